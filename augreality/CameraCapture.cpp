@@ -0,0 +1,266 @@
+/*
+ *   One thread per camera, grabbing frames while the render loop draws the
+ *   last one, and where the radar detections fall in its image.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CameraCapture.h"
+#include "../can/CaptureLog.h"
+#include "../can/Telemetry.h"
+#include "../can/Trace.h"
+#include "FrameRecorder.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+// nearer than this, a point is behind the lens or too close to draw
+static constexpr double MIN_DEPTH = 0.5; // m
+// when a video file doesn't say
+static constexpr double DEFAULT_FPS = 30;
+
+// :::: struct CameraConfig
+
+using augreality::CameraConfig;
+
+CameraConfig CameraConfig::parse(const std::string& spec)
+{
+    auto fail = [&spec]() {
+        throw std::runtime_error(
+            "Invalid camera \"" + spec +
+            "\", expected <source>:<sensor>[,<sensor>...][@<x>,<y>,<yaw>"
+            "[,<height>,<pitch>,<hfov>]].");
+    };
+
+    // the source may be a path with colons of its own
+    const auto at = spec.find('@');
+    const auto colon = spec.rfind(':', at);
+    if (colon == std::string::npos || colon == 0) {
+        fail();
+    }
+
+    CameraConfig config;
+    config.source = spec.substr(0, colon);
+
+    std::istringstream sensors(spec.substr(colon + 1, at - colon - 1));
+    char sep = 0;
+    do {
+        unsigned sensorIdx;
+        if (!(sensors >> sensorIdx) ||
+            sensorIdx >= can::backsense::MAX_N_SENSORS) {
+            fail();
+        }
+        config.sensors.push_back(sensorIdx);
+    } while (sensors >> sep && sep == ',');
+    if (!sensors.eof()) {
+        fail();
+    }
+
+    if (at != std::string::npos) {
+        std::istringstream placement(spec.substr(at + 1));
+        double values[6];
+        unsigned n = 0;
+        do {
+            if (n == 6 || !(placement >> values[n++])) {
+                fail();
+            }
+        } while (placement >> sep && sep == ',');
+        if (!placement.eof() || (n != 3 && n != 6)) {
+            fail();
+        }
+        config.mount.x = values[0];
+        config.mount.y = values[1];
+        config.mount.yawDeg = values[2];
+        if (n == 6) {
+            config.height = values[3];
+            config.pitchDeg = values[4];
+            config.hfovDeg = values[5];
+        }
+    }
+    return config;
+}
+
+bool CameraConfig::project(double x, double y, const cv::Size& size,
+                           cv::Point& pixel, double& scale) const
+{
+    // into the frame of the camera: ahead, to the right, and down to the
+    // ground
+    const double yaw = mount.yawDeg * M_PI / 180;
+    const double dx = x - mount.x;
+    const double dy = y - mount.y;
+    const double ahead = std::cos(yaw) * dx + std::sin(yaw) * dy;
+    const double right = -std::sin(yaw) * dx + std::cos(yaw) * dy;
+
+    // ... then tilted with the optical axis
+    const double pitch = pitchDeg * M_PI / 180;
+    const double depth = ahead * std::cos(pitch) + height * std::sin(pitch);
+    const double down = height * std::cos(pitch) - ahead * std::sin(pitch);
+    if (depth < MIN_DEPTH) {
+        return false;
+    }
+
+    const double focal = size.width / 2.0 / std::tan(hfovDeg * M_PI / 360);
+    pixel = cv::Point(size.width / 2.0 + focal * right / depth,
+                      size.height / 2.0 + focal * down / depth);
+    scale = focal / depth;
+    return pixel.x >= 0 && pixel.x < size.width && pixel.y >= 0 &&
+           pixel.y < size.height;
+}
+
+// :::: class CameraCapture
+
+using augreality::CameraCapture;
+
+CameraCapture::CameraCapture(const CameraConfig& config,
+                             FrameRecorder* recorder)
+    : m_config(config),
+      m_isFile(config.source.empty() || !std::isdigit(config.source[0])),
+      m_recorder(recorder)
+{
+    open();
+}
+
+CameraCapture::CameraCapture(const CameraConfig& config, CameraReplay replay)
+    : m_config(config), m_isFile(true), m_replay(std::move(replay))
+{
+    open();
+}
+
+CameraCapture::~CameraCapture()
+{
+    m_running = false;
+    m_stopSignal.set_value();
+    m_thread.join();
+}
+
+void CameraCapture::open()
+{
+    const bool opened = m_isFile ? m_capture.open(m_config.source)
+                                 : m_capture.open(std::stoi(m_config.source));
+    if (!opened) {
+        throw std::runtime_error("Can't open camera \"" + m_config.source +
+                                 "\".");
+    }
+    m_stopped = m_stopSignal.get_future().share();
+    m_thread = std::thread(
+        m_replay.clock ? &CameraCapture::replay : &CameraCapture::run, this);
+}
+
+bool CameraCapture::hasNewFrame()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fresh;
+}
+
+const cv::Mat& CameraCapture::latest()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fresh) {
+        std::swap(m_front, m_ready);
+        m_fresh = false;
+    }
+    return m_slots[m_front];
+}
+
+void CameraCapture::run()
+{
+    telemetry::registerThread("camera_capture");
+
+    double fps = m_isFile ? m_capture.get(cv::CAP_PROP_FPS) : 0;
+    if (m_isFile && !(fps > 0)) {
+        fps = DEFAULT_FPS;
+    }
+    const auto period = std::chrono::duration_cast<
+        std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(m_isFile ? 1 / fps : 0));
+    auto next = std::chrono::steady_clock::now();
+
+    while (m_running) {
+        // a buffer of the same size is decoded into in place
+        if (!readFrame()) {
+            // the end of a file, or a camera gone: its last frame stays on
+            end();
+            break;
+        }
+        if (m_recorder) {
+            m_recorder->submit(m_slots[m_back],
+                               can::CaptureLogWriter::hostTimeNs());
+        }
+        publish();
+        if (m_isFile) {
+            next += period;
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
+
+void CameraCapture::replay()
+{
+    telemetry::registerThread("camera_replay");
+
+    // the checkpoint is a little early: on to the first frame due
+    const auto& timestamps = m_replay.timestamps;
+    auto frameIdx = std::min<size_t>(m_replay.firstFrame, timestamps.size());
+    while (frameIdx < timestamps.size() &&
+           timestamps[frameIdx] < m_replay.clock->fromNs()) {
+        ++frameIdx;
+    }
+    if (frameIdx) {
+        m_capture.set(cv::CAP_PROP_POS_FRAMES, frameIdx);
+    }
+
+    for (; frameIdx < timestamps.size(); ++frameIdx) {
+        // decoded ahead, shown when due
+        if (!readFrame()) {
+            break;
+        }
+        if (!m_replay.clock->waitUntil(timestamps[frameIdx], m_stopped)) {
+            // stopping
+            return;
+        }
+        publish();
+    }
+    end();
+}
+
+bool CameraCapture::readFrame()
+{
+    TRACE_SCOPE(CAMERA_CAPTURE);
+    return m_capture.read(m_slots[m_back]);
+}
+
+void CameraCapture::end()
+{
+    if (m_running) {
+        std::cerr << "#WARNING: No more frames from camera \""
+                  << m_config.source << "\"." << std::endl;
+    }
+    m_ended = true;
+}
+
+void CameraCapture::publish()
+{
+    telemetry::add(telemetry::Counter::CAMERA_FRAMES);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::swap(m_back, m_ready);
+    m_fresh = true;
+}
@@ -0,0 +1,142 @@
+/*
+ *   One thread per camera, grabbing frames while the render loop draws the
+ *   last one, and where the radar detections fall in its image.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _CAMERA_CAPTURE_H_
+#define _CAMERA_CAPTURE_H_
+
+#include "../can/OccupancyGrid.h" // SensorMount
+#include "../can/Timeline.h"
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace augreality {
+
+// A camera, the radars whose area it covers, and how it sees the ground.
+// The camera is placed in the vehicle frame as a sensor is (its yaw is the
+// direction it looks at), 'height' metres above the ground and tilted
+// 'pitchDeg' down.
+struct CameraConfig
+{
+    std::string source; // a device index ("0") or a video file
+    std::vector<unsigned> sensors;
+    can::backsense::SensorMount mount;
+    double height = 2.5;  // m
+    double pitchDeg = 15; // down from the horizon
+    double hfovDeg = 90;  // horizontal field of view
+
+    // "<source>:<sensor>[,<sensor>...][@<x>,<y>,<yaw>[,<height>,<pitch>,
+    // <hfov>]]", e.g. "rear.mp4:0,1@-7.5,0,180,3,20,100"
+    static CameraConfig parse(const std::string& spec);
+
+    // Pinhole projection of a point of the ground, in the vehicle frame,
+    // into an image of 'size' pixels (the camera's, or its tile); 'scale'
+    // is then the size in pixels of a metre at that distance. False when
+    // the point isn't in sight.
+    bool project(double x, double y, const cv::Size& size, cv::Point& pixel,
+                 double& scale) const;
+};
+
+class FrameRecorder;
+
+// A camera of a recorded session: its file is played from the frame of the
+// clock's start on, each frame when the clock says, instead of at its rate.
+struct CameraReplay
+{
+    const can::ReplayClock* clock = nullptr;
+    std::vector<__u64> timestamps; // of each frame of the file
+    __u64 firstFrame = 0;          // as the timeline checkpoint tells
+};
+
+// The capture thread decodes into one of three buffers while the render
+// loop draws another; the third holds the newest complete frame, and the
+// two sides swap buffers with it under a short lock. Neither ever waits for
+// the other to finish a frame, and no frame is copied: a slow camera only
+// makes its own picture older.
+class CameraCapture
+{
+  public:
+    CameraCapture(const CameraCapture&) = delete;
+    CameraCapture& operator=(const CameraCapture&) = delete;
+
+    // Opens the source and starts grabbing; throws if it can't be opened.
+    // Every frame grabbed goes to 'recorder' too, stamped as it was read.
+    explicit CameraCapture(const CameraConfig& config,
+                           FrameRecorder* recorder = nullptr);
+    // plays back a recorded camera
+    CameraCapture(const CameraConfig& config, CameraReplay replay);
+    ~CameraCapture();
+
+    const CameraConfig& config() const { return m_config; }
+
+    // whether a frame came since the last call to latest()
+    bool hasNewFrame();
+
+    // The newest frame grabbed (empty before the first one). Render thread
+    // only: the frame stays untouched until the next call.
+    const cv::Mat& latest();
+
+    // the capture thread gave up (a read failed, or the file or the session
+    // is over): the last frame is all there will be
+    bool hasEnded() const { return m_ended.load(); }
+
+  private:
+    void open();
+    void run();
+    void replay();
+    // the next frame, decoded into the back slot
+    bool readFrame();
+    void publish();
+    // from the capture thread, as it gives up
+    void end();
+
+    const CameraConfig m_config;
+    cv::VideoCapture m_capture;
+    // video files are played at their own rate, devices at the camera's
+    bool m_isFile;
+    FrameRecorder* m_recorder = nullptr;
+    const CameraReplay m_replay;
+
+    cv::Mat m_slots[3];
+    unsigned m_back = 0;  // capture thread only
+    unsigned m_front = 1; // render thread only
+    std::mutex m_mutex;   // guards m_ready and m_fresh
+    unsigned m_ready = 2;
+    bool m_fresh = false;
+
+    std::atomic<bool> m_running{true};
+    std::atomic<bool> m_ended{false};
+    // also interrupts the wait of a replayed frame
+    std::promise<void> m_stopSignal;
+    std::shared_future<void> m_stopped;
+    std::thread m_thread;
+};
+
+} // namespace augreality
+
+#endif // _CAMERA_CAPTURE_H_
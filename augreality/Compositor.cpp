@@ -0,0 +1,99 @@
+/*
+ *   Lays out the pictures of several cameras in one window.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Compositor.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+using augreality::Compositor;
+
+Compositor::Layout Compositor::parseLayout(const std::string& name)
+{
+    if (name == "split") {
+        return Layout::SPLIT;
+    }
+    if (name == "switch") {
+        return Layout::SWITCH;
+    }
+    throw std::runtime_error("Invalid camera layout \"" + name +
+                             "\", expected split or switch.");
+}
+
+Compositor::Compositor(unsigned nCameras, Layout layout,
+                       const cv::Size& outputSize)
+    : m_layout(layout),
+      m_output(outputSize.height, outputSize.width, CV_8UC3,
+               cv::Scalar(0, 0, 0))
+{
+    if (!nCameras) {
+        throw std::runtime_error("No camera to compose.");
+    }
+
+    // e.g. 3 cameras: 2x2 tiles, the last one left black
+    const unsigned nCols =
+        layout == Layout::SPLIT ? std::ceil(std::sqrt(nCameras)) : 1;
+    const unsigned nRows =
+        layout == Layout::SPLIT ? (nCameras + nCols - 1) / nCols : 1;
+    const int width = outputSize.width / nCols;
+    const int height = outputSize.height / nRows;
+
+    for (unsigned i = 0; i < nCameras; ++i) {
+        const unsigned cell = layout == Layout::SPLIT ? i : 0;
+        m_tiles.push_back(m_output(cv::Rect(cell % nCols * width,
+                                            cell / nCols * height, width,
+                                            height)));
+    }
+}
+
+bool Compositor::isShown(unsigned cameraIdx) const
+{
+    return m_layout == Layout::SPLIT || cameraIdx == m_selected;
+}
+
+void Compositor::select(unsigned cameraIdx)
+{
+    if (cameraIdx < m_tiles.size()) {
+        m_selected = cameraIdx;
+    }
+}
+
+void Compositor::place(unsigned cameraIdx, const cv::Mat& frame)
+{
+    assert(cameraIdx < m_tiles.size());
+    if (!isShown(cameraIdx)) {
+        return;
+    }
+    auto& tile = m_tiles[cameraIdx];
+    if (frame.empty()) {
+        // no picture yet: nothing of an earlier overlay is kept either
+        tile.setTo(cv::Scalar(0, 0, 0));
+        return;
+    }
+    // the tile is the right size and type already: written in place
+    if (frame.size() == tile.size()) {
+        frame.copyTo(tile);
+    } else {
+        cv::resize(frame, tile, tile.size(), 0, 0, cv::INTER_LINEAR);
+    }
+}
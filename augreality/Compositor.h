@@ -0,0 +1,70 @@
+/*
+ *   Lays out the pictures of several cameras in one window.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _COMPOSITOR_H_
+#define _COMPOSITOR_H_
+
+#include <opencv2/core.hpp>
+
+#include <string>
+#include <vector>
+
+namespace augreality {
+
+// The output buffer is allocated once, with one ROI view of it per camera.
+// A camera frame is written straight into its tile (scaled on the way if
+// the sizes differ), and its overlay is then drawn on the tile itself:
+// nothing is composed in a second pass.
+class Compositor
+{
+  public:
+    enum class Layout
+    {
+        SPLIT, // every camera at once, in a grid of equal tiles
+        SWITCH // one camera, full size, picked with select()
+    };
+
+    // "split" or "switch"
+    static Layout parseLayout(const std::string& name);
+
+    Compositor(unsigned nCameras, Layout layout, const cv::Size& outputSize);
+
+    unsigned getNumberOfCameras() const { return m_tiles.size(); }
+    bool isShown(unsigned cameraIdx) const;
+    void select(unsigned cameraIdx);
+
+    // the frame (BGR, as the cameras give) goes into the tile of its
+    // camera, if it's shown (a frame not yet grabbed blanks it)
+    void place(unsigned cameraIdx, const cv::Mat& frame);
+    // to draw over the picture of a camera
+    cv::Mat& tile(unsigned cameraIdx) { return m_tiles[cameraIdx]; }
+
+    const cv::Mat& output() const { return m_output; }
+
+  private:
+    const Layout m_layout;
+    unsigned m_selected = 0;
+    cv::Mat m_output;
+    std::vector<cv::Mat> m_tiles;
+};
+
+} // namespace augreality
+
+#endif // _COMPOSITOR_H_
@@ -0,0 +1,265 @@
+/*
+ *   Records the frames of an AR window to video files, from a thread of
+ *   its own.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "FrameRecorder.h"
+#include "../can/CaptureLog.h"
+#include "../can/Telemetry.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+// cheap to encode: the encoder keeps up on one core
+static const int FOURCC = cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
+
+static __u64 elapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// :::: class FrameRecorder::IndexQueue
+
+using augreality::FrameRecorder;
+
+void FrameRecorder::IndexQueue::push(unsigned idx)
+{
+    assert(m_size < m_slots.size());
+    m_slots[(m_head + m_size++) % m_slots.size()] = idx;
+}
+
+unsigned FrameRecorder::IndexQueue::pop()
+{
+    assert(m_size);
+    const unsigned idx = m_slots[m_head];
+    m_head = (m_head + 1) % m_slots.size();
+    --m_size;
+    return idx;
+}
+
+// :::: class FrameRecorder
+
+constexpr unsigned FrameRecorder::DEFAULT_POOL_SIZE;
+
+FrameRecorder::FrameRecorder(const std::string& prefix, double fps,
+                             unsigned segmentSeconds, unsigned poolSize)
+    : m_prefix(prefix), m_fps(fps),
+      m_framesPerSegment(static_cast<__u64>(fps * segmentSeconds)),
+      m_pool(poolSize), m_stamps(poolSize), m_free(poolSize),
+      m_pending(poolSize)
+{
+    if (!(fps > 0) || (segmentSeconds && !m_framesPerSegment) || !poolSize) {
+        throw std::runtime_error("Invalid recording parameters.");
+    }
+    for (unsigned i = 0; i < poolSize; ++i) {
+        m_free.push(i);
+    }
+    m_encoder = std::thread(&FrameRecorder::run, this);
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_queued.notify_one();
+    m_encoder.join();
+}
+
+void FrameRecorder::submit(const cv::Mat& frame)
+{
+    submit(frame, can::CaptureLogWriter::hostTimeNs());
+}
+
+void FrameRecorder::submit(const cv::Mat& frame, __u64 hostTimeNs)
+{
+    const auto start = std::chrono::steady_clock::now();
+    m_submitted.fetch_add(1, std::memory_order_relaxed);
+    enqueue(frame, hostTimeNs);
+
+    // the submitting thread is the only writer of these
+    const auto ns = elapsedNs(start);
+    m_submitNs.store(m_submitNs.load(std::memory_order_relaxed) + ns,
+                     std::memory_order_relaxed);
+    if (ns > m_maxSubmitNs.load(std::memory_order_relaxed)) {
+        m_maxSubmitNs.store(ns, std::memory_order_relaxed);
+    }
+}
+
+void FrameRecorder::enqueue(const cv::Mat& frame, __u64 hostTimeNs)
+{
+    unsigned idx;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free.size()) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            telemetry::add(telemetry::Counter::RECORDER_DROPS);
+            return;
+        }
+        idx = m_free.pop();
+    }
+
+    // the buffer only belongs to this thread now; once it has held a frame
+    // of this size, the copy doesn't allocate
+    frame.copyTo(m_pool[idx]);
+    m_stamps[idx] = hostTimeNs;
+
+    unsigned depth;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push(idx);
+        depth = m_pending.size();
+    }
+    m_queued.notify_one();
+
+    if (depth > m_maxQueueDepth.load(std::memory_order_relaxed)) {
+        m_maxQueueDepth.store(depth, std::memory_order_relaxed);
+    }
+}
+
+augreality::RecorderStats FrameRecorder::stats() const
+{
+    RecorderStats stats;
+    stats.submitted = m_submitted.load(std::memory_order_relaxed);
+    stats.encoded = m_encoded.load(std::memory_order_relaxed);
+    stats.dropped = m_dropped.load(std::memory_order_relaxed);
+    stats.segments = m_segments.load(std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        stats.queueDepth = m_pending.size();
+    }
+    stats.maxQueueDepth = m_maxQueueDepth.load(std::memory_order_relaxed);
+
+    stats.meanSubmitUs =
+        stats.submitted ? m_submitNs.load(std::memory_order_relaxed) / 1e3 /
+                              stats.submitted
+                        : 0;
+    stats.maxSubmitUs = m_maxSubmitNs.load(std::memory_order_relaxed) / 1e3;
+    stats.meanEncodeMs =
+        stats.encoded
+            ? m_encodeNs.load(std::memory_order_relaxed) / 1e6 / stats.encoded
+            : 0;
+    return stats;
+}
+
+void FrameRecorder::run()
+{
+    telemetry::registerThread("ar_recorder");
+
+    while (true) {
+        unsigned idx;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_queued.wait(lock,
+                          [this] { return m_pending.size() || m_stopping; });
+            if (!m_pending.size()) {
+                // stopping, with everything written
+                break;
+            }
+            idx = m_pending.pop();
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        write(m_pool[idx], m_stamps[idx]);
+        m_encodeNs.fetch_add(elapsedNs(start), std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push(idx);
+    }
+    closeSegment();
+}
+
+void FrameRecorder::closeSegment()
+{
+    m_writer.release();
+    if (m_stampFile) {
+        std::fclose(m_stampFile);
+        m_stampFile = nullptr;
+    }
+}
+
+void FrameRecorder::write(const cv::Mat& frame, __u64 hostTimeNs)
+{
+    // Kept in one file, a frame of another size is scaled to that of the
+    // file: a session (Timeline.h) only knows of "_0000".
+    if (!m_framesPerSegment && m_writer.isOpened() &&
+        frame.size() != m_size) {
+        cv::resize(frame, m_scaled, m_size);
+        write(m_scaled, hostTimeNs);
+        return;
+    }
+
+    // a new file every segment, and whenever the window changes size
+    if (!m_writer.isOpened() ||
+        (m_framesPerSegment && m_segmentFrames == m_framesPerSegment) ||
+        frame.size() != m_size) {
+        char name[32];
+        const unsigned segment = m_segments.load(std::memory_order_relaxed);
+        std::snprintf(name, sizeof(name), "_%04u", segment);
+        const auto path = m_prefix + name;
+        closeSegment();
+        if (!m_writer.open(path + ".avi", FOURCC, m_fps, frame.size()) ||
+            !(m_stampFile = std::fopen((path + ".ts").c_str(), "wb"))) {
+            if (!m_openFailed) {
+                std::cerr << "#ERROR: Can't record to " << path
+                          << ".avi, dropping the frames." << std::endl;
+                m_openFailed = true;
+            }
+            m_writer.release();
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_openFailed = false;
+        m_size = frame.size();
+        m_segmentFrames = 0;
+        m_segments.store(segment + 1, std::memory_order_relaxed);
+    }
+
+    m_writer.write(frame);
+    std::fwrite(&hostTimeNs, sizeof(hostTimeNs), 1, m_stampFile);
+    ++m_segmentFrames;
+    m_encoded.fetch_add(1, std::memory_order_relaxed);
+    telemetry::add(telemetry::Counter::RECORDED_FRAMES);
+}
+
+std::ostream& augreality::operator<<(std::ostream& os,
+                                     const RecorderStats& stats)
+{
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+    os << stats.encoded << " frames recorded in " << stats.segments
+       << " files, " << stats.dropped << " dropped, queue " << stats.queueDepth
+       << " (max " << stats.maxQueueDepth << "), " << std::fixed
+       << std::setprecision(1) << stats.meanSubmitUs << " us per submit (max "
+       << stats.maxSubmitUs << "), " << std::setprecision(2)
+       << stats.meanEncodeMs << " ms per encode";
+    os.flags(flags);
+    os.precision(precision);
+    return os;
+}
@@ -0,0 +1,151 @@
+/*
+ *   Records the frames of an AR window to video files, from a thread of
+ *   its own.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FRAME_RECORDER_H_
+#define _FRAME_RECORDER_H_
+
+#include <linux/types.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace augreality {
+
+struct RecorderStats
+{
+    __u64 submitted;   // frames given to submit()
+    __u64 encoded;     // written to a file
+    __u64 dropped;     // no free buffer when they came
+    unsigned segments; // files opened
+    unsigned queueDepth;
+    unsigned maxQueueDepth;
+    double meanSubmitUs; // the time the render loop spends in submit()
+    double maxSubmitUs;
+    double meanEncodeMs; // per frame: 1000 / this is the encoder throughput
+};
+
+std::ostream& operator<<(std::ostream& os, const RecorderStats& stats);
+
+// The render loop copies each frame into a free buffer of a fixed pool and
+// queues it; the encoder thread writes the queued buffers in order and
+// gives them back. Nothing is allocated once the pool is warm, and the
+// render loop never waits for the encoder: when every buffer is queued
+// (the encoder can't keep up), the new frame is dropped and counted, and
+// the frames already queued are still written. The files are
+// "<prefix>_0000.avi", "<prefix>_0001.avi"... of 'segmentSeconds' each (at
+// 'fps'), so a long run can be reviewed, or deleted, piece by piece, and a
+// new one starts whenever the frames change size; 0 keeps it all in one file,
+// scaling the frames to the size of the first. Next to each,
+// "<prefix>_0000.ts"... holds the host time (CaptureLogWriter::hostTimeNs())
+// of each of its frames, a raw array of __u64, to play it back in step with
+// the CAN traffic (Timeline.h).
+class FrameRecorder
+{
+  public:
+    FrameRecorder(const FrameRecorder&) = delete;
+    FrameRecorder& operator=(const FrameRecorder&) = delete;
+
+    static constexpr unsigned DEFAULT_POOL_SIZE = 8;
+
+    explicit FrameRecorder(const std::string& prefix, double fps = 30,
+                           unsigned segmentSeconds = 60,
+                           unsigned poolSize = DEFAULT_POOL_SIZE);
+    // writes what is queued, and closes the last file
+    ~FrameRecorder();
+
+    // one thread only: the render loop, or a camera's capture thread;
+    // stamped now, or when the frame was grabbed
+    void submit(const cv::Mat& frame);
+    void submit(const cv::Mat& frame, __u64 hostTimeNs);
+
+    RecorderStats stats() const;
+    // frames written so far; from any thread
+    __u64 encodedCount() const
+    {
+        return m_encoded.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // the indexes of a set of buffers, in the order they were put in: never
+    // more than the pool, so never reallocated
+    class IndexQueue
+    {
+      public:
+        explicit IndexQueue(unsigned capacity) : m_slots(capacity) {}
+        unsigned size() const { return m_size; }
+        void push(unsigned idx);
+        unsigned pop();
+
+      private:
+        std::vector<unsigned> m_slots;
+        unsigned m_head = 0;
+        unsigned m_size = 0;
+    };
+
+    void enqueue(const cv::Mat& frame, __u64 hostTimeNs);
+    void run();
+    void write(const cv::Mat& frame, __u64 hostTimeNs);
+    void closeSegment();
+
+    const std::string m_prefix;
+    const double m_fps;
+    const __u64 m_framesPerSegment;
+
+    std::vector<cv::Mat> m_pool;
+    std::vector<__u64> m_stamps; // of the frame in each buffer
+    mutable std::mutex m_mutex; // guards the queues and m_stopping
+    std::condition_variable m_queued;
+    IndexQueue m_free;
+    IndexQueue m_pending;
+    bool m_stopping = false;
+
+    // encoder thread only
+    cv::VideoWriter m_writer;
+    std::FILE* m_stampFile = nullptr;
+    cv::Size m_size;
+    cv::Mat m_scaled; // a frame of another size, in a single file
+    __u64 m_segmentFrames = 0;
+    bool m_openFailed = false; // reported once
+
+    std::atomic<__u64> m_submitted{0};
+    std::atomic<__u64> m_encoded{0};
+    std::atomic<__u64> m_dropped{0};
+    std::atomic<unsigned> m_segments{0};
+    std::atomic<unsigned> m_maxQueueDepth{0};
+    std::atomic<__u64> m_submitNs{0};
+    std::atomic<__u64> m_maxSubmitNs{0};
+    std::atomic<__u64> m_encodeNs{0};
+
+    std::thread m_encoder;
+};
+
+} // namespace augreality
+
+#endif // _FRAME_RECORDER_H_
@@ -19,31 +19,253 @@
  */
 
 #include "../can/BSFrameHandler.h"
-#include "../can/CANUtils.h"
-#include "../can/CANproChannel.h"
+#include "../can/CaptureLog.h"
+#include "../can/ChannelSupervisor.h"
+#include "../can/FlightRecorder.h"
+#include "../can/ObjectTracker.h"
+#include "../can/OccupancyGrid.h"
+#include "../can/RadarStateBus.h"
+#include "../can/Telemetry.h"
+#include "../can/Timeline.h"
+#include "../can/Trace.h"
+#include "../can/TrackHistory.h"
+#include "CameraCapture.h"
+#include "Compositor.h"
+#include "FrameRecorder.h"
+#include "SensorSimulator.h"
+#include "SurroundView.h"
 
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/videoio.hpp>
 
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <future>
 #include <iomanip>
+#include <memory>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
-static void launchARWindowLoop(const can::backsense::RadarStateDB& stateDB)
+static void printUsage(const char* prg)
 {
-    cv::Mat frame;
-    cv::VideoCapture cap;
-    // access built-in camera at index 0
-    if (!cap.open(0)) {
-        throw std::runtime_error("Can't open camera.");
+    std::cerr << "Usage: " << prg
+              << " [--attach] [--record <prefix>] [--surround side|pip]"
+                 " [-M <sensor>:<x>,<y>,<yaw>]...\n"
+                 "    [--layout split|switch] [--camera <source>:<sensor>"
+                 "[,<sensor>...][@<x>,<y>,<yaw>[,<height>,<pitch>,<hfov>]]]..."
+                 "\n    [--timeline <dir> | --replay <dir> [--speed <x>]"
+                 " [--from <s>]] [--flight <file>] [--simulate <seed>]"
+              << std::endl;
+}
+
+// the DB keeps the last known state while the CAN channel is down: the
+// driver must not take it for live data
+static void drawStaleBanner(cv::Mat& frame)
+{
+    static const cv::Scalar bannerColor(0, 0, 255);
+    cv::putText(frame, "NO RADAR DATA", cv::Point(20, 40),
+                cv::FONT_HERSHEY_SIMPLEX, 1, bannerColor, 2);
+}
+
+// the last frame of a camera that gave up stays on: it must not be taken for
+// a live picture either
+static void drawCameraBanner(cv::Mat& frame)
+{
+    static const cv::Scalar bannerColor(0, 0, 255);
+    cv::putText(frame, "NO CAMERA", cv::Point(20, 120),
+                cv::FONT_HERSHEY_SIMPLEX, 1, bannerColor, 2);
+}
+
+// The overlay of a camera is drawn again over each new frame, and over the
+// last one when the radar goes stale or comes back, when the camera gives
+// up, and at least every MAX_AGE in between: it never freezes with the
+// camera.
+struct OverlayState
+{
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds MAX_AGE{100};
+
+    bool stale = false;
+    bool cameraEnded = false;
+    Clock::time_point drawnAt;
+
+    // if so, the overlay is then taken as drawn
+    bool isDue(bool newFrame, bool nowStale, bool nowEnded,
+               Clock::time_point now)
+    {
+        if (!newFrame && nowStale == stale && nowEnded == cameraEnded &&
+            now - drawnAt < MAX_AGE) {
+            return false;
+        }
+        stale = nowStale;
+        cameraEnded = nowEnded;
+        drawnAt = now;
+        return true;
+    }
+};
+
+constexpr std::chrono::milliseconds OverlayState::MAX_AGE;
+
+// where the obstacle has been, and how fast it is closing in
+static void drawTrail(cv::Mat& frame, const can::backsense::Trail& trail,
+                      const std::vector<cv::Point>& points,
+                      const cv::Scalar& color)
+{
+    if (points.size() < 2) {
+        return;
+    }
+    cv::polylines(frame, points, false /* open */, color, 1 /* thickness */,
+                  cv::LINE_AA);
+
+    const auto velocity = can::backsense::estimateVelocity(trail);
+    if (velocity && velocity->closingSpeed > 0) {
+        char label[16];
+        std::snprintf(label, sizeof(label), "%.1f m/s",
+                      velocity->closingSpeed);
+        cv::putText(frame, label, points.back() + cv::Point(12, 4),
+                    cv::FONT_HERSHEY_SIMPLEX, 0.5, color, 1);
+    }
+}
+
+// what the tracker expects now or, attached to radar_daemon or with the
+// channel down, the last received positions; (x, y) of each in the frame of
+// the sensor
+template <typename Function>
+static void forEachObstacle(const can::backsense::RadarStateDB& stateDB,
+                            const can::backsense::ObjectTracker* tracker,
+                            bool stale, unsigned sensorIdx, __u64 hostTimeNs,
+                            Function&& function)
+{
+    if (tracker && !stale) {
+        can::backsense::TrackedObject predicted[can::backsense::MAX_N_OBJS];
+        const auto nObjects =
+            tracker->predictAt(sensorIdx, hostTimeNs, predicted);
+        for (unsigned i = 0; i < nObjects; ++i) {
+            function(predicted[i].x, predicted[i].y);
+        }
+    } else {
+        for (const auto& obstacle : stateDB.getSensorData(sensorIdx)) {
+            if (obstacle) {
+                function(obstacle->getX().toDouble(),
+                         obstacle->getY().toDouble());
+            }
+        }
+    }
+}
+
+// every sensor around the truck: the fused grid, and the obstacles on top
+// of it, next to or over 'image'
+static void drawSurround(augreality::SurroundView& surround,
+                         const cv::Mat& image,
+                         const can::backsense::RadarStateDB& stateDB,
+                         const can::backsense::ObjectTracker* tracker,
+                         const can::backsense::OccupancyGrid* grid,
+                         can::backsense::OccupancyCells& cells,
+                         const cv::Scalar& color, cv::Mat& composed)
+{
+    surround.beginFrame(image.size());
+    if (grid) {
+        grid->read(cells);
+        surround.drawCells(cells);
+    }
+    const bool stale = stateDB.isStale();
+    const auto now = can::CaptureLogWriter::hostTimeNs();
+    for (unsigned sensorIdx = 0; sensorIdx < stateDB.getNumberOfSensors();
+         ++sensorIdx) {
+        forEachObstacle(stateDB, tracker, stale, sensorIdx, now,
+                        [&](double x, double y) {
+                            surround.drawObstacle(sensorIdx, x, y, color);
+                        });
+    }
+    surround.compose(image, composed);
+}
+
+// what is kept of the frames shown: the video of --record, and the render
+// cycles and a thumbnail a second of --flight (either may be null)
+struct WindowRecorders
+{
+    static constexpr __u64 THUMBNAIL_PERIOD_NS = 1000000000;
+
+    augreality::FrameRecorder* video = nullptr;
+    can::FlightRecorder* flight = nullptr;
+    __u64 nFrames = 0;
+    __u64 nextThumbnailNs = 0;
+    cv::Mat small; // reused: no allocation once the first one is made
+    cv::Mat grey;
+};
+
+// the key pressed, if any: the window is only redrawn in here
+static int waitKey()
+{
+    TRACE_SCOPE(WAIT_KEY);
+    return cv::waitKey(5);
+}
+
+// what the operator sees, and what is recorded of it
+static void showFrame(const cv::Mat& frame, WindowRecorders& recorders)
+{
+    {
+        TRACE_SCOPE(IMSHOW);
+        cv::imshow("Augmented Reality App", frame);
+    }
+    if (recorders.video) {
+        recorders.video->submit(frame);
+    }
+    if (recorders.flight) {
+        recorders.flight->recordCycle(can::FlightCycle::RENDER,
+                                      recorders.nFrames++);
+        const auto now = can::CaptureLogWriter::hostTimeNs();
+        if (now >= recorders.nextThumbnailNs) {
+            cv::resize(frame, recorders.small,
+                       cv::Size(can::THUMBNAIL_WIDTH, can::THUMBNAIL_HEIGHT),
+                       0, 0, cv::INTER_AREA);
+            cv::cvtColor(recorders.small, recorders.grey,
+                         cv::COLOR_BGR2GRAY);
+            recorders.flight->recordThumbnail(recorders.grey.data);
+            recorders.nextThumbnailNs =
+                now + WindowRecorders::THUMBNAIL_PERIOD_NS;
+        }
     }
+}
+
+static constexpr std::chrono::milliseconds FIRST_FRAME_POLL{5};
+static constexpr std::chrono::milliseconds FIRST_FRAME_TIMEOUT{5000};
 
-    cap >> frame;
+// 'tracks', 'tracker' and 'grid' are null when attached to radar_daemon:
+// the last received positions are drawn then, with no trails; 'surround' is
+// null without --surround
+static void
+launchARWindowLoop(const can::backsense::RadarStateDB& stateDB,
+                   const can::backsense::TrackHistory* tracks,
+                   const can::backsense::ObjectTracker* tracker,
+                   const can::backsense::OccupancyGrid* grid,
+                   augreality::SurroundView* surround,
+                   augreality::CameraCapture& camera,
+                   WindowRecorders& recorders)
+{
+    // the overlay is drawn on a copy: the camera's frame may be shown again
+    cv::Mat frame;
+    // the geometry of the overlay is that of the first frame
+    for (unsigned wait = 0; !camera.hasNewFrame(); ++wait) {
+        if (wait == FIRST_FRAME_TIMEOUT / FIRST_FRAME_POLL) {
+            throw std::runtime_error("No frame from camera \"" +
+                                     camera.config().source + "\".");
+        }
+        std::this_thread::sleep_for(FIRST_FRAME_POLL);
+    }
+    camera.latest().copyTo(frame);
 
     //
     // 30m ^  +--------------+
@@ -88,57 +310,576 @@ static void launchARWindowLoop(const can::backsense::RadarStateDB& stateDB)
 
     constexpr unsigned obstRadius = 10;
     const cv::Scalar obstColor(0, 255, 255);
+    const cv::Scalar staleObstColor(128, 128, 128);
+    const cv::Scalar trailColor(0, 160, 255);
 
-    auto toDisplayCoords = [&](const auto& y, const auto& x) {
-        const unsigned dispY = (y * pxStepY) + sensorY;
-        const unsigned dispX = sensorX - (x * pxStepX);
+    // integer maths on the fixed point coordinates, down to the pixel
+    auto toDisplayCoords = [&](can::backsense::Distance y,
+                               can::backsense::Distance x) {
+        const int dispY = y.scaled(pxStepY) + sensorY;
+        const int dispX = sensorX - x.scaled(pxStepX);
+        return cv::Point(dispY, dispX);
+    };
+    // ... and on the estimates of the tracker, in metres
+    auto toDisplayCoordsM = [&](double y, double x) {
+        const int dispY = y * pxStepY + sensorY;
+        const int dispX = sensorX - x * pxStepX;
         return cv::Point(dispY, dispX);
     };
 
-    while (cv::waitKey(5) != 27) { // Esc key
-        cap >> frame;
-        assert(!frame.empty());
-        // get data from 1 sensor only, at index 0
-        for (const auto obstacle : stateDB.getSensorData(0)) {
-            if (obstacle) {
-                auto y = obstacle->getY();
-                auto x = obstacle->getX();
-                auto obstP = toDisplayCoords(y, x);
+    telemetry::registerThread("ar_render");
 
-                // draw obstacle
-                cv::circle(frame, obstP, obstRadius, obstColor,
-                           -1 /* filled circle */, cv::LINE_AA /* line type */);
-                cv::line(frame, sensorP, obstP, obstColor, 1 /* thickness */,
-                         cv::LINE_8 /* line type */);
+    can::backsense::Trail trail;
+    std::vector<cv::Point> trailPoints;
+    trailPoints.reserve(can::backsense::TRACK_LEN);
+    can::backsense::TrackedObject predicted[can::backsense::MAX_N_OBJS];
+    cv::Mat composed;
+    auto cells = std::make_unique<can::backsense::OccupancyCells>();
+
+    auto drawObstacle = [&](const cv::Point& obstP, const cv::Scalar& color) {
+        cv::circle(frame, obstP, obstRadius, color, -1 /* filled circle */,
+                   cv::LINE_AA /* line type */);
+        cv::line(frame, sensorP, obstP, color, 1 /* thickness */,
+                 cv::LINE_8 /* line type */);
+    };
+    auto drawSlotTrail = [&](unsigned objIdx) {
+        tracks->readTrail(0, objIdx, trail);
+        trailPoints.clear();
+        for (const auto& sample : trail) {
+            trailPoints.push_back(toDisplayCoords(sample.y, sample.x));
+        }
+        drawTrail(frame, trail, trailPoints, trailColor);
+    };
+
+    OverlayState overlay;
+    while (waitKey() != 27) { // Esc key
+        const bool stale = stateDB.isStale();
+        const bool cameraEnded = camera.hasEnded();
+        if (!overlay.isDue(camera.hasNewFrame(), stale, cameraEnded,
+                           OverlayState::Clock::now())) {
+            continue;
+        }
+        telemetry::add(telemetry::Counter::RENDERED_FRAMES);
+        // the new frame, or the last one again
+        camera.latest().copyTo(frame);
+        const cv::Mat* shown = &frame;
+        {
+            TRACE_SCOPE(OVERLAY);
+            const auto& color = stale ? staleObstColor : obstColor;
+            // get data from 1 sensor only, at index 0
+            if (tracker && !stale) {
+                // where the obstacles are as the frame is shown, not where the
+                // radar last saw them
+                const auto nObjects = tracker->predictAt(
+                    0, can::CaptureLogWriter::hostTimeNs(), predicted);
+                for (unsigned i = 0; i < nObjects; ++i) {
+                    const auto& object = predicted[i];
+                    drawObstacle(toDisplayCoordsM(object.y, object.x), color);
+                    drawSlotTrail(object.objIdx);
+                }
+            } else {
+                const auto& obstacles = stateDB.getSensorData(0);
+                for (unsigned objIdx = 0; objIdx < obstacles.size(); ++objIdx) {
+                    const auto& obstacle = obstacles[objIdx];
+                    if (obstacle) {
+                        drawObstacle(toDisplayCoords(obstacle->getY(),
+                                                     obstacle->getX()),
+                                     color);
+                    }
+                }
+            }
+            cv::rectangle(frame, rectP1, rectP2, rectColor);
+            if (stale) {
+                drawStaleBanner(frame);
+            }
+            if (cameraEnded) {
+                drawCameraBanner(frame);
+            }
+
+            if (surround) {
+                drawSurround(*surround, frame, stateDB, tracker, grid, *cells,
+                             color, composed);
+                shown = &composed;
             }
         }
-        cv::rectangle(frame, rectP1, rectP2, rectColor);
-        cv::imshow("Augmented Reality App", frame);
+        showFrame(*shown, recorders);
+    }
+}
+
+// One tile per camera, with the obstacles of its sensors drawn where they
+// stand on the ground. The cameras are grabbed by threads of their own: the
+// loop draws the newest frame of each, whatever the number of cameras.
+static void launchMultiCameraLoop(
+    const can::backsense::RadarStateDB& stateDB,
+    const can::backsense::ObjectTracker* tracker,
+    const can::backsense::OccupancyGrid* grid,
+    augreality::SurroundView* surround,
+    const std::array<can::backsense::SensorMount,
+                     can::backsense::MAX_N_SENSORS>& mounts,
+    std::vector<std::unique_ptr<augreality::CameraCapture>>& cameras,
+    augreality::Compositor& compositor, WindowRecorders& recorders)
+{
+    const cv::Scalar obstColor(0, 255, 255);
+    const cv::Scalar staleObstColor(128, 128, 128);
+    const cv::Scalar labelColor(255, 255, 255);
+    // the obstacles are drawn a metre wide, within limits
+    constexpr double MIN_OBST_RADIUS = 4;
+    constexpr double MAX_OBST_RADIUS = 60;
+
+    telemetry::registerThread("ar_render");
+
+    cv::Mat composed;
+    auto cells = std::make_unique<can::backsense::OccupancyCells>();
+    // A tile is drawn again when its overlay is due, always over the frame
+    // of its camera (the overlay would pile up on the last one otherwise),
+    // and after a switch (the tiles share the window).
+    std::vector<OverlayState> overlays(cameras.size());
+    std::vector<bool> redraw(cameras.size(), true);
+
+    // Esc quits; with the switch layout, 1 to 9 pick a camera and Tab
+    // cycles through them
+    unsigned selected = 0;
+    for (int key = 0; key != 27; key = waitKey()) {
+        if (key >= '1' && key <= '9') {
+            selected = key - '1';
+        } else if (key == '\t') {
+            selected = (selected + 1) % cameras.size();
+        }
+        if ((key >= '1' && key <= '9') || key == '\t') {
+            std::fill(redraw.begin(), redraw.end(), true);
+        }
+        compositor.select(selected);
+
+        const cv::Mat* shown = &compositor.output();
+        {
+            TRACE_SCOPE(OVERLAY);
+            const bool stale = stateDB.isStale();
+            const auto& color = stale ? staleObstColor : obstColor;
+            const auto now = can::CaptureLogWriter::hostTimeNs();
+            const auto drawnAt = OverlayState::Clock::now();
+
+            bool drawn = false;
+            for (unsigned cameraIdx = 0; cameraIdx < cameras.size();
+                 ++cameraIdx) {
+                if (!compositor.isShown(cameraIdx)) {
+                    continue;
+                }
+                auto& camera = *cameras[cameraIdx];
+                const bool cameraEnded = camera.hasEnded();
+                if (!overlays[cameraIdx].isDue(camera.hasNewFrame(), stale,
+                                               cameraEnded, drawnAt) &&
+                    !redraw[cameraIdx]) {
+                    continue;
+                }
+                redraw[cameraIdx] = false;
+                drawn = true;
+                compositor.place(cameraIdx, camera.latest());
+
+                auto& tile = compositor.tile(cameraIdx);
+                for (const auto sensorIdx : camera.config().sensors) {
+                    forEachObstacle(
+                        stateDB, tracker, stale, sensorIdx, now,
+                        [&](double x, double y) {
+                            double vehicleX, vehicleY, scale;
+                            cv::Point pixel;
+                            mounts[sensorIdx].toVehicle(x, y, vehicleX,
+                                                        vehicleY);
+                            if (camera.config().project(vehicleX, vehicleY,
+                                                        tile.size(), pixel,
+                                                        scale)) {
+                                const int radius = std::min(
+                                    std::max(scale / 2, MIN_OBST_RADIUS),
+                                    MAX_OBST_RADIUS);
+                                cv::circle(tile, pixel, radius, color, 2);
+                            }
+                        });
+                }
+                cv::putText(tile, camera.config().source, cv::Point(20, 80),
+                            cv::FONT_HERSHEY_SIMPLEX, 0.6, labelColor, 1);
+                if (stale) {
+                    drawStaleBanner(tile);
+                }
+                if (cameraEnded) {
+                    drawCameraBanner(tile);
+                }
+            }
+            // As the single camera loop: nothing new to show, nothing to
+            // render or record (the recorders write at a fixed rate).
+            if (!drawn) {
+                continue;
+            }
+
+            if (surround) {
+                drawSurround(*surround, compositor.output(), stateDB, tracker,
+                             grid, *cells, color, composed);
+                shown = &composed;
+            }
+        }
+        telemetry::add(telemetry::Counter::RENDERED_FRAMES);
+        showFrame(*shown, recorders);
     }
 }
 
+// the window of the cameras, whatever their number and resolution
+static const cv::Size MULTI_CAMERA_SIZE(1280, 720);
+
 int main(int argc, char** argv)
 {
+    // --attach: read the state published by radar_daemon instead of opening
+    // the CAN channel
+    bool attach = false;
+    // --surround: a top-down view of the sensors placed with -M
+    std::unique_ptr<augreality::SurroundView> surround;
+    std::string layout;
+    std::vector<can::backsense::SensorMount> mounts;
+    // --camera: one tile per camera, with the detections of its sensors
+    std::vector<augreality::CameraConfig> cameraConfigs;
+    std::string cameraLayout = "split";
+    // --record: the frames shown, to video files
+    std::string recordPrefix;
+    // --timeline: the CAN traffic and the frames of every camera, on one
+    // clock, to a session directory; --replay: such a session played back
+    // through the same windows, with the --camera and -M it was recorded
+    // with
+    std::string timelineDir;
+    std::string replayDir;
+    double replaySpeed = 1;
+    double replayFromS = 0; // from the start of the session
+    // --flight: the black box of the radar and of the window (see
+    // FlightRecorder.h)
+    std::string flightPath;
+    // --simulate: synthetic traffic from the given seed, in place of the
+    // CAN channel
+    bool simulate = false;
+    can::backsense::TrafficConfig trafficConfig;
+
     try {
-        static constexpr unsigned N_SENSORS = 1;
+        for (int i = 1; i < argc; ++i) {
+            if (!std::strcmp(argv[i], "--attach")) {
+                attach = true;
+            } else if (!std::strcmp(argv[i], "--surround") && i + 1 < argc) {
+                layout = argv[++i];
+            } else if (!std::strcmp(argv[i], "-M") && i + 1 < argc) {
+                mounts.push_back(can::backsense::SensorMount::parse(argv[++i]));
+            } else if (!std::strcmp(argv[i], "--camera") && i + 1 < argc) {
+                cameraConfigs.push_back(
+                    augreality::CameraConfig::parse(argv[++i]));
+            } else if (!std::strcmp(argv[i], "--layout") && i + 1 < argc) {
+                cameraLayout = argv[++i];
+            } else if (!std::strcmp(argv[i], "--record") && i + 1 < argc) {
+                recordPrefix = argv[++i];
+            } else if (!std::strcmp(argv[i], "--timeline") && i + 1 < argc) {
+                timelineDir = argv[++i];
+            } else if (!std::strcmp(argv[i], "--replay") && i + 1 < argc) {
+                replayDir = argv[++i];
+            } else if (!std::strcmp(argv[i], "--speed") && i + 1 < argc) {
+                replaySpeed = std::stod(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--from") && i + 1 < argc) {
+                replayFromS = std::stod(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--flight") && i + 1 < argc) {
+                flightPath = argv[++i];
+            } else if (!std::strcmp(argv[i], "--simulate") && i + 1 < argc) {
+                simulate = true;
+                trafficConfig.seed = std::stoul(argv[++i]);
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        if (mounts.empty()) {
+            // the sensor of the camera, alone
+            mounts.emplace_back();
+        }
+        const bool replay = !replayDir.empty();
+        if ((attach || replay) && !timelineDir.empty()) {
+            throw std::runtime_error(
+                "--timeline records the CAN channel: it can't be used with "
+                "--attach or --replay.");
+        }
+        if (attach && replay) {
+            throw std::runtime_error("--replay can't be used with --attach.");
+        }
+        if (simulate && (attach || replay || !timelineDir.empty())) {
+            throw std::runtime_error(
+                "--simulate stands for the CAN channel: it can't be used with "
+                "--attach, --replay or --timeline.");
+        }
+
+        // the camera's sensor is sensor 0; the surround view and the
+        // other cameras show the others too
+        unsigned nSensors = 1;
+        if (!layout.empty()) {
+            surround = std::make_unique<augreality::SurroundView>(
+                mounts, augreality::SurroundView::parseLayout(layout));
+            for (const auto& mount : mounts) {
+                nSensors = std::max(nSensors, mount.sensorIdx + 1);
+            }
+        }
+        std::array<can::backsense::SensorMount, can::backsense::MAX_N_SENSORS>
+            mountOf;
+        for (const auto& mount : mounts) {
+            mountOf[mount.sensorIdx] = mount;
+        }
+        for (const auto& config : cameraConfigs) {
+            for (const auto sensorIdx : config.sensors) {
+                nSensors = std::max(nSensors, sensorIdx + 1);
+            }
+        }
+
+        // without --camera, the built-in camera shows sensor 0
+        const bool singleCamera = cameraConfigs.empty();
+        if (singleCamera) {
+            augreality::CameraConfig config;
+            config.source = "0";
+            config.sensors.push_back(0);
+            cameraConfigs.push_back(config);
+        }
+
+        // --timeline: the streams of the session, and its index (stream 0
+        // is the CAN log, stream i + 1 camera i)
+        std::unique_ptr<can::CaptureLogWriter> canCapture;
+        std::vector<std::unique_ptr<augreality::FrameRecorder>>
+            cameraRecorders;
+        std::unique_ptr<can::TimelineIndexWriter> timeline;
+        if (!timelineDir.empty()) {
+            if (mkdir(timelineDir.c_str(), 0755) && errno != EEXIST) {
+                throw std::runtime_error("Can't create \"" + timelineDir +
+                                         "\": " + std::strerror(errno));
+            }
+            canCapture = std::make_unique<can::CaptureLogWriter>(
+                can::timelineCanLogPath(timelineDir));
+            std::vector<std::function<__u64()>> positions{
+                [capture = canCapture.get()] {
+                    return capture->recordCount();
+                }};
+            for (unsigned i = 0; i < cameraConfigs.size(); ++i) {
+                // one file per camera, whatever the length of the session
+                cameraRecorders.push_back(
+                    std::make_unique<augreality::FrameRecorder>(
+                        can::timelineCameraPrefix(timelineDir, i), 30, 0));
+                positions.push_back(
+                    [recorder = cameraRecorders.back().get()] {
+                        return recorder->encodedCount();
+                    });
+            }
+            timeline = std::make_unique<can::TimelineIndexWriter>(
+                timelineDir, std::move(positions));
+        }
 
-        can::CANproChannel channel;
-        can::backsense::RadarStateDB stateDB(N_SENSORS);
+        // --replay: played from the checkpoint before --from
+        std::unique_ptr<can::TimelineIndexReader> session;
+        std::unique_ptr<can::CaptureLogReader> canLog;
+        std::unique_ptr<can::ReplayClock> replayClock;
+        const can::TimelineCheckpoint* replayStart = nullptr;
+        if (replay) {
+            session = std::make_unique<can::TimelineIndexReader>(replayDir);
+            if (session->getNumberOfStreams() != 1 + cameraConfigs.size()) {
+                throw std::runtime_error(
+                    "The session has " +
+                    std::to_string(session->getNumberOfStreams() - 1) +
+                    " cameras: replay it with the --camera it was recorded "
+                    "with.");
+            }
+            canLog = std::make_unique<can::CaptureLogReader>(
+                can::timelineCanLogPath(replayDir));
+            const auto fromNs = session->startNs() +
+                                static_cast<__u64>(replayFromS * 1e9);
+            replayStart = &session->seek(fromNs);
+            replayClock =
+                std::make_unique<can::ReplayClock>(fromNs, replaySpeed);
+        }
+
+        // grabbing from now on, before the radar threads start
+        std::vector<std::unique_ptr<augreality::CameraCapture>> cameras;
+        std::unique_ptr<augreality::Compositor> compositor;
+        for (unsigned i = 0; i < cameraConfigs.size(); ++i) {
+            if (replay) {
+                auto config = cameraConfigs[i];
+                config.source = can::timelineCameraPath(replayDir, i);
+                augreality::CameraReplay cameraReplay;
+                cameraReplay.clock = replayClock.get();
+                cameraReplay.timestamps = can::readTimestamps(
+                    can::timelineTimestampsPath(replayDir, i));
+                cameraReplay.firstFrame = replayStart->positions[1 + i];
+                cameras.push_back(std::make_unique<augreality::CameraCapture>(
+                    config, std::move(cameraReplay)));
+            } else {
+                cameras.push_back(std::make_unique<augreality::CameraCapture>(
+                    cameraConfigs[i],
+                    cameraRecorders.empty() ? nullptr
+                                            : cameraRecorders[i].get()));
+            }
+        }
+        if (!singleCamera) {
+            compositor = std::make_unique<augreality::Compositor>(
+                cameras.size(),
+                augreality::Compositor::parseLayout(cameraLayout),
+                MULTI_CAMERA_SIZE);
+        }
+
+        std::unique_ptr<augreality::FrameRecorder> recorder;
+        if (!recordPrefix.empty()) {
+            recorder =
+                std::make_unique<augreality::FrameRecorder>(recordPrefix);
+        }
+        std::unique_ptr<can::FlightRecorder> flight;
+        if (!flightPath.empty()) {
+            flight = std::make_unique<can::FlightRecorder>(flightPath);
+        }
+        WindowRecorders windowRecorders;
+        windowRecorders.video = recorder.get();
+        windowRecorders.flight = flight.get();
+
+        can::backsense::RadarStateDB stateDB(nSensors);
+        auto telemetryExporter = telemetry::TelemetryExporter::fromEnvironment();
+        auto traceFlusher = tracing::TraceFlusher::fromEnvironment();
+
+        std::unique_ptr<can::ChannelSupervisor> supervisor;
+        std::unique_ptr<can::backsense::RadarStateBusReader> bus;
+        std::unique_ptr<can::backsense::TrackHistory> tracks;
+        std::unique_ptr<can::backsense::ObjectTracker> tracker;
+        std::unique_ptr<can::backsense::OccupancyGrid> grid;
+        std::unique_ptr<augreality::SensorSimulator> simulator;
 
         // start a task to handle the CAN bus and DB updates
         std::promise<void> exitSignal;
         std::future<void> futureSignal = exitSignal.get_future();
-        std::thread canHandler(can::CANUtils::readMsgs, channel.getHandle(),
-                               std::ref(stateDB), std::move(futureSignal));
+        std::thread canHandler;
+        std::thread fusion;
+        std::thread indexer;
+        size_t nReplayed = 0;
 
-        // blocking call: loop until the user quits
-        launchARWindowLoop(stateDB);
+        if (attach) {
+            bus = std::make_unique<can::backsense::RadarStateBusReader>();
+            canHandler =
+                std::thread(can::backsense::RadarStateBusReader::followBus,
+                            std::ref(*bus), std::ref(stateDB),
+                            std::move(futureSignal));
+        } else {
+            // fed by the reader thread, on every DB update
+            tracks = std::make_unique<can::backsense::TrackHistory>();
+            tracker = std::make_unique<can::backsense::ObjectTracker>();
+            stateDB.addUpdateListener(
+                [&tracks, &tracker](const can::backsense::RadarStateDB& db,
+                                    const can::backsense::DetectionData& state) {
+                    tracks->onUpdate(db, state);
+                    tracker->onUpdate(db, state);
+                });
+            if (flight) {
+                stateDB.addUpdateListener(
+                    [&flight](const can::backsense::RadarStateDB& db,
+                              const can::backsense::DetectionData& state) {
+                        flight->onUpdate(db, state);
+                    });
+            }
+            auto sharedSignal = futureSignal.share();
+            if (surround) {
+                grid = std::make_unique<can::backsense::OccupancyGrid>();
+                for (const auto& mount : mounts) {
+                    grid->setMount(mount);
+                }
+                stateDB.addUpdateListener(
+                    [&grid](const can::backsense::RadarStateDB& db,
+                            const can::backsense::DetectionData& state) {
+                        grid->onUpdate(db, state);
+                    });
+                // a cycle of the sensors
+                using namespace std::chrono_literals;
+                fusion = std::thread(can::backsense::OccupancyGrid::runFusion,
+                                     std::ref(*grid), 50ms, sharedSignal);
+            }
+            if (replay) {
+                // the CAN log stands for the channel, on the cameras' clock
+                canHandler = std::thread([&, sharedSignal] {
+                    telemetry::registerThread("can_replay");
+                    can::FrameIngest ingest(stateDB, nullptr, 0);
+                    nReplayed = can::replayCaptureLog(
+                        *canLog, replayStart->positions[0], *replayClock,
+                        ingest, sharedSignal);
+                });
+            } else if (simulate) {
+                trafficConfig.nSensors = nSensors;
+                simulator = std::make_unique<augreality::SensorSimulator>(
+                    stateDB, trafficConfig);
+            } else {
+                supervisor = std::make_unique<can::ChannelSupervisor>(
+                    can::ChannelConfig::singleChannel(nSensors), stateDB,
+                    canCapture.get());
+                if (flight) {
+                    supervisor->addStateListener([&flight](bool online) {
+                        flight->recordChannel(0, online);
+                    });
+                }
+                canHandler = std::thread(&can::ChannelSupervisor::run,
+                                         supervisor.get(), sharedSignal);
+            }
+            if (timeline) {
+                indexer = std::thread(can::TimelineIndexWriter::run,
+                                      std::ref(*timeline), sharedSignal);
+            }
+        }
 
-        // notify interruption thread
-        exitSignal.set_value();
+        // Once the loop returns, or throws (e.g. a camera that never gives a
+        // frame), the threads are told to stop and joined: a thread still
+        // joinable when it goes out of scope would terminate the app instead
+        // of the error being reported.
+        class ThreadsStopper
+        {
+          public:
+            explicit ThreadsStopper(std::function<void()> stop)
+                : m_stop(std::move(stop))
+            {
+            }
+            ~ThreadsStopper() { stop(); }
 
-        can::CANUtils::resetChip(channel.getHandle());
-        canHandler.join();
+            void stop()
+            {
+                if (m_stop) {
+                    m_stop();
+                    m_stop = nullptr;
+                }
+            }
+
+          private:
+            std::function<void()> m_stop;
+        } threadsStopper([&] {
+            // notify interruption thread
+            exitSignal.set_value();
+
+            if (supervisor) {
+                supervisor->interrupt();
+            }
+            if (canHandler.joinable()) {
+                canHandler.join();
+            }
+            simulator.reset();
+            if (fusion.joinable()) {
+                fusion.join();
+            }
+            if (indexer.joinable()) {
+                indexer.join();
+            }
+        });
+
+        // blocking call: loop until the user quits
+        if (singleCamera) {
+            launchARWindowLoop(stateDB, tracks.get(), tracker.get(),
+                               grid.get(), surround.get(), *cameras[0],
+                               windowRecorders);
+        } else {
+            launchMultiCameraLoop(stateDB, tracker.get(), grid.get(),
+                                  surround.get(), mountOf, cameras,
+                                  *compositor, windowRecorders);
+        }
+        threadsStopper.stop();
+
+        if (replay) {
+            std::cout << "#INFO: " << nReplayed << " CAN records replayed."
+                      << std::endl;
+        }
+        if (recorder) {
+            std::cout << "#INFO: " << recorder->stats() << std::endl;
+        }
 
     } catch (std::runtime_error& ex) {
         std::cerr << "#ERROR: " << ex.what() << std::endl;
@@ -19,10 +19,16 @@
  */
 
 #include "BarGraph.h"
+#include "FrameRecorder.h"
+#include "SensorSimulator.h"
 
 #include "../can/BSFrameHandler.h"
-#include "../can/CANUtils.h"
-#include "../can/CANproChannel.h"
+#include "../can/CaptureLog.h"
+#include "../can/ChannelSupervisor.h"
+#include "../can/ObjectTracker.h"
+#include "../can/RadarStateBus.h"
+#include "../can/Telemetry.h"
+#include "../can/Trace.h"
 
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
@@ -30,10 +36,14 @@
 #include <opencv2/videoio.hpp>
 
 #include <chrono>
+#include <cmath>
+#include <cstring>
 #include <future>
 #include <iomanip>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -45,7 +55,28 @@ template <typename T> static std::string buildDisplayTextValue(const T value)
     return builder.str();
 }
 
-static void launchARWindowLoop(const can::backsense::RadarStateDB& stateDB)
+// the DB keeps the last known state while the CAN channel is down: the
+// driver must not take it for live data
+static void drawStaleBanner(cv::Mat& frame)
+{
+    static const cv::Scalar bannerColor(0, 0, 255);
+    cv::putText(frame, "NO RADAR DATA", cv::Point(20, 40),
+                cv::FONT_HERSHEY_SIMPLEX, 1, bannerColor, 2);
+}
+
+// the key pressed, if any: the window is only redrawn in here
+static int waitKey()
+{
+    TRACE_SCOPE(WAIT_KEY);
+    return cv::waitKey(5);
+}
+
+// 'tracker' is null when attached to radar_daemon: the last received
+// position is drawn then; 'recorder' is null without --record
+static void
+launchARWindowLoop(const can::backsense::RadarStateDB& stateDB,
+                   const can::backsense::ObjectTracker* tracker,
+                   augreality::FrameRecorder* recorder)
 {
     cv::Mat frame;
     cv::VideoCapture cap;
@@ -71,76 +102,189 @@ static void launchARWindowLoop(const can::backsense::RadarStateDB& stateDB)
     const auto sensorY = frame.cols / 2;
     const cv::Point sensorP(sensorY, sensorX);
 
-    while (cv::waitKey(5) != 27) { // Esc key
-        cap >> frame;
+    telemetry::registerThread("ar_render");
+
+    static const double pi = std::atan(1.0) * 4.0;
+    can::backsense::TrackedObject predicted[can::backsense::MAX_N_OBJS];
+
+    while (waitKey() != 27) { // Esc key
+        telemetry::add(telemetry::Counter::RENDERED_FRAMES);
+        {
+            TRACE_SCOPE(CAMERA_CAPTURE);
+            cap >> frame;
+        }
         assert(!frame.empty());
-        std::experimental::optional<can::backsense::DetectionData>
-            detectionData;
         {
-            // take the closest object's data, for the sensor at index 0
-            std::lock_guard<std::mutex> lock(stateDB.mutex_db);
-            auto s0Data = stateDB.getSensorData(0);
-            if (!s0Data.empty())
-            {
-                detectionData = s0Data[0];
+            TRACE_SCOPE(OVERLAY);
+            // distance and bearing of the closest object, for the sensor at
+            // index 0
+            bool found = false;
+            double radius = 0;
+            double angleRad = 0;
+            if (tracker && !stateDB.isStale()) {
+                // where it is as the frame is shown, not where the radar last
+                // saw it
+                const auto nObjects = tracker->predictAt(
+                    0, can::CaptureLogWriter::hostTimeNs(), predicted);
+                for (unsigned i = 0; i < nObjects; ++i) {
+                    const auto& object = predicted[i];
+                    const double r = std::hypot(object.x, object.y);
+                    if (!found || r < radius) {
+                        found = true;
+                        radius = r;
+                        angleRad = std::atan2(object.y, object.x);
+                    }
+                }
+            } else {
+                std::experimental::optional<can::backsense::DetectionData>
+                    detectionData;
+                const auto nearest = stateDB.obstacleSummary(0);
+                if (nearest.hasObstacle()) {
+                    std::lock_guard<std::mutex> lock(stateDB.shardMutex(0));
+                    detectionData =
+                        stateDB.getSensorData(0)[nearest.nearestObj];
+                }
+                if (detectionData) {
+                    found = true;
+                    radius = detectionData->getPolarRadius().toDouble();
+                    angleRad = (pi / 180.0) * detectionData->getPolarAngle();
+                }
+            }
+
+            auto frac = 0.0;
+            if (found) {
+
+                // draw numerical distance
+                bGraph.drawTxt(frame, buildDisplayTextValue(radius));
+
+                // calculate fraction to fill bar graph
+                static constexpr double MAX_RADIUS = 5.0;
+                frac = radius / MAX_RADIUS;
+
+                // draw an arrow to indicate the angle
+                static constexpr double ARROW_LENGTH = 50.0;
+                static const cv::Scalar arrowColor(0, 255, 255);
+                const auto arrowY = (angleRad > 0 ? 1 : -1) * ARROW_LENGTH *
+                                        std::sin(std::abs(angleRad)) +
+                                    sensorY;
+                const auto arrowX =
+                    -ARROW_LENGTH * std::cos(std::abs(angleRad)) + sensorX;
+                cv::arrowedLine(frame, sensorP, cv::Point(arrowY, arrowX),
+                                arrowColor, 1 /* thickness */,
+                                cv::LINE_8 /* line type */, 0,
+                                0.3 /* tip length*/);
+                cv::circle(frame, sensorP, 6 /* radius */, arrowColor, 1,
+                           cv::LINE_AA);
             }
+            bGraph.draw(frame, frac);
+            if (stateDB.isStale()) {
+                drawStaleBanner(frame);
+            }
+        }
+        {
+            TRACE_SCOPE(IMSHOW);
+            cv::imshow("Live", frame);
         }
-        auto frac = 0.0;
-        if (detectionData) {
-
-            // draw numerical distance
-            auto polarRadius = detectionData->getPolarRadius();
-            bGraph.drawTxt(frame, buildDisplayTextValue(polarRadius));
-
-            // calculate fraction to fill bar graph
-            static constexpr double MAX_RADIUS = 5.0;
-            frac = polarRadius / MAX_RADIUS;
-
-            // draw an arrow to indicate the angle
-            auto angleDeg = detectionData->getPolarAngle();
-            static const double pi = std::atan(1.0) * 4.0;
-            auto angleRad = (pi / 180.0) * angleDeg;
-
-            static constexpr double ARROW_LENGTH = 50.0;
-            static const cv::Scalar arrowColor(0, 255, 255);
-            const auto arrowY = (angleRad > 0 ? 1 : -1) * ARROW_LENGTH *
-                                    std::sin(std::abs(angleRad)) +
-                                sensorY;
-            const auto arrowX =
-                -ARROW_LENGTH * std::cos(std::abs(angleRad)) + sensorX;
-            cv::arrowedLine(frame, sensorP, cv::Point(arrowY, arrowX),
-                            arrowColor, 1 /* thickness */,
-                            cv::LINE_8 /* line type */, 0, 0.3 /* tip length*/);
-            cv::circle(frame, sensorP, 6 /* radius */, arrowColor, 1,
-                       cv::LINE_AA);
+        if (recorder) {
+            recorder->submit(frame);
         }
-        bGraph.draw(frame, frac);
-        cv::imshow("Live", frame);
     }
 }
 
 int main(int argc, char** argv)
 {
+    // --attach: read the state published by radar_daemon instead of opening
+    // the CAN channel
+    bool attach = false;
+    // --record: the frames shown, to video files
+    std::unique_ptr<augreality::FrameRecorder> recorder;
+    // --simulate: synthetic traffic from the given seed, in place of the
+    // CAN channel
+    bool simulate = false;
+    can::backsense::TrafficConfig trafficConfig;
+
     try {
+        for (int i = 1; i < argc; ++i) {
+            if (!std::strcmp(argv[i], "--attach")) {
+                attach = true;
+            } else if (!std::strcmp(argv[i], "--record") && i + 1 < argc) {
+                recorder =
+                    std::make_unique<augreality::FrameRecorder>(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--simulate") && i + 1 < argc) {
+                simulate = true;
+                trafficConfig.seed = std::stoul(argv[++i]);
+            } else {
+                std::cerr << "Usage: " << argv[0]
+                          << " [--attach | --simulate <seed>]"
+                             " [--record <prefix>]"
+                          << std::endl;
+                return 1;
+            }
+        }
+        if (attach && simulate) {
+            throw std::runtime_error(
+                "--simulate can't be used with --attach.");
+        }
+
         static constexpr unsigned N_SENSORS = 1;
 
-        can::CANproChannel channel;
         can::backsense::RadarStateDB stateDB(N_SENSORS);
+        auto telemetryExporter = telemetry::TelemetryExporter::fromEnvironment();
+        auto traceFlusher = tracing::TraceFlusher::fromEnvironment();
+
+        std::unique_ptr<can::ChannelSupervisor> supervisor;
+        std::unique_ptr<can::backsense::RadarStateBusReader> bus;
+        std::unique_ptr<can::backsense::ObjectTracker> tracker;
+        std::unique_ptr<augreality::SensorSimulator> simulator;
 
         // start a task to handle the CAN bus and DB updates
         std::promise<void> exitSignal;
         std::future<void> futureSignal = exitSignal.get_future();
-        std::thread canHandler(can::CANUtils::readMsgs, channel.getHandle(),
-                               std::ref(stateDB), std::move(futureSignal));
+        std::thread canHandler;
+
+        if (attach) {
+            bus = std::make_unique<can::backsense::RadarStateBusReader>();
+            canHandler =
+                std::thread(can::backsense::RadarStateBusReader::followBus,
+                            std::ref(*bus), std::ref(stateDB),
+                            std::move(futureSignal));
+        } else {
+            // fed by the reader thread, on every DB update
+            tracker = std::make_unique<can::backsense::ObjectTracker>();
+            stateDB.addUpdateListener(
+                [&tracker](const can::backsense::RadarStateDB& db,
+                           const can::backsense::DetectionData& state) {
+                    tracker->onUpdate(db, state);
+                });
+            if (simulate) {
+                trafficConfig.nSensors = N_SENSORS;
+                simulator = std::make_unique<augreality::SensorSimulator>(
+                    stateDB, trafficConfig);
+            } else {
+                supervisor = std::make_unique<can::ChannelSupervisor>(
+                    can::ChannelConfig::singleChannel(N_SENSORS), stateDB);
+                canHandler = std::thread(&can::ChannelSupervisor::run,
+                                         supervisor.get(),
+                                         futureSignal.share());
+            }
+        }
 
         // blocking call: loop until the user quits
-        launchARWindowLoop(stateDB);
+        launchARWindowLoop(stateDB, tracker.get(), recorder.get());
 
         // notify interruption thread
         exitSignal.set_value();
 
-        can::CANUtils::resetChip(channel.getHandle());
-        canHandler.join();
+        if (supervisor) {
+            supervisor->interrupt();
+        }
+        if (canHandler.joinable()) {
+            canHandler.join();
+        }
+        simulator.reset();
+        if (recorder) {
+            std::cout << "#INFO: " << recorder->stats() << std::endl;
+        }
 
     } catch (std::runtime_error& ex) {
         std::cerr << "#ERROR: " << ex.what() << std::endl;
@@ -0,0 +1,140 @@
+/*
+ *   Measures the time the render loop spends handing frames to the
+ *   FrameRecorder, at 720p and 1080p.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "FrameRecorder.h"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using augreality::FrameRecorder;
+
+// what the render loop may spend in submit(), per frame
+static constexpr double MAX_MEAN_SUBMIT_US = 1000;
+// the frames submitted in turn: different pixels, as a rendered scene
+static constexpr unsigned N_SOURCE_FRAMES = 4;
+
+struct Resolution
+{
+    const char* name;
+    cv::Size size;
+};
+
+static const Resolution RESOLUTIONS[] = {{"720p", cv::Size(1280, 720)},
+                                         {"1080p", cv::Size(1920, 1080)}};
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg << " [-n frames] [-f fps] [-o prefix]"
+              << std::endl;
+}
+
+// Submits 'nFrames' frames of 'resolution' at 'fps', as the render loop
+// does, and returns the mean of the times spent in submit(), in us.
+static double run(const Resolution& resolution, unsigned nFrames, double fps,
+                  const std::string& prefix)
+{
+    std::vector<cv::Mat> frames;
+    for (unsigned i = 0; i < N_SOURCE_FRAMES; ++i) {
+        frames.emplace_back(resolution.size, CV_8UC3);
+        cv::randu(frames.back(), 0, 256);
+    }
+
+    double totalUs = 0;
+    double maxUs = 0;
+    augreality::RecorderStats stats;
+    {
+        FrameRecorder recorder(prefix + "_" + resolution.name, fps);
+
+        using Clock = std::chrono::steady_clock;
+        const auto period = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(1 / fps));
+        auto due = Clock::now();
+        for (unsigned i = 0; i < nFrames; ++i) {
+            std::this_thread::sleep_until(due);
+            due += period;
+
+            const auto start = Clock::now();
+            recorder.submit(frames[i % N_SOURCE_FRAMES]);
+            const std::chrono::duration<double, std::micro> elapsed =
+                Clock::now() - start;
+            totalUs += elapsed.count();
+            maxUs = std::max(maxUs, elapsed.count());
+        }
+        stats = recorder.stats();
+    } // the recorder writes what is still queued
+
+    const double meanUs = totalUs / nFrames;
+    std::cout << resolution.name << ": " << meanUs << " us per submit (max "
+              << maxUs << ")\n  recorder: " << stats << std::endl;
+    return meanUs;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned nFrames = 300;
+    double fps = 30;
+    std::string prefix = "recorder_bench";
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+            nFrames = std::stoul(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-f") && i + 1 < argc) {
+            fps = std::stod(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+            prefix = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!nFrames || fps <= 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try {
+        bool allGood = true;
+        for (const auto& resolution : RESOLUTIONS) {
+            allGood = run(resolution, nFrames, fps, prefix) <
+                          MAX_MEAN_SUBMIT_US &&
+                      allGood;
+        }
+        if (!allGood) {
+            std::cerr << "#ERROR: the render loop spends more than "
+                      << MAX_MEAN_SUBMIT_US << " us per frame in submit()."
+                      << std::endl;
+            return 1;
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,5 +1,6 @@
 /*
- *   A sensor simulator to generate random data values as a separate task.
+ *   A sensor simulator: synthetic BS-9000 traffic fed to the radar state
+ *   as a separate task, in place of the CAN channel.
  *
  *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
  *
@@ -19,36 +20,40 @@
  */
 
 #include "SensorSimulator.h"
+#include "../can/CANUtils.h"
+#include "../can/Telemetry.h"
 
-#include <random>
-
-static double generateRandom(double min, double max)
-{
-    std::random_device rdev;
-    std::mt19937 rgen(rdev());
-    std::uniform_real_distribution<> iDist(min, max);
-    return iDist(rgen);
-}
+#include <chrono>
 
 using augreality::SensorSimulator;
 
-SensorSimulator::SensorSimulator(std::chrono::milliseconds interval)
-    : m_thread(&SensorSimulator::updateFraction, this)
-    , m_msInterval(interval)
+SensorSimulator::SensorSimulator(can::backsense::RadarStateDB& stateDB,
+                                 const can::backsense::TrafficConfig& config)
+    : m_stateDB(stateDB), m_generator(config),
+      m_thread(&SensorSimulator::feed, this)
 {
-    m_fraction.store(0.0);
 }
 
 SensorSimulator::~SensorSimulator()
 {
-    m_leaving.store(true);
+    m_exitSignal.set_value();
     m_thread.join();
 }
 
-void SensorSimulator::updateFraction()
+void SensorSimulator::feed()
 {
-    while (!m_leaving.load()) {
-        std::this_thread::sleep_for(m_msInterval);
-        m_fraction.store(generateRandom(0.0, 1.0));
+    telemetry::registerThread("sensor_sim");
+
+    auto futureSignal = m_exitSignal.get_future();
+    can::FrameIngest ingest(m_stateDB, nullptr, 0);
+    const auto start = std::chrono::steady_clock::now();
+    for (;;) {
+        const auto& frame = m_generator.next();
+        if (futureSignal.wait_until(
+                start + std::chrono::nanoseconds(frame.offsetNs)) ==
+            std::future_status::ready) {
+            break;
+        }
+        ingest.process(CANL2_RA_DATAFRAME, frame.param);
     }
 }
@@ -1,5 +1,6 @@
 /*
- *   A sensor simulator to generate random data values as a separate task.
+ *   A sensor simulator: synthetic BS-9000 traffic fed to the radar state
+ *   as a separate task, in place of the CAN channel.
  *
  *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
  *
@@ -21,31 +22,35 @@
 #ifndef _SENSOR_SIMULATOR_H_
 #define _SENSOR_SIMULATOR_H_
 
-#include <atomic>
-#include <chrono>
+#include "../can/TrafficGenerator.h"
+
+#include <future>
 #include <thread>
 
 namespace augreality {
 
+// The frames of a TrafficGenerator go through the same ingest path as those
+// read from the bus (see can::FrameIngest), each when it is due: the AR
+// apps run, and are drawn the same, without a radar.
 class SensorSimulator
 {
   public:
     SensorSimulator(const SensorSimulator& other) = delete;
     SensorSimulator& operator=(const SensorSimulator&) = delete;
 
-    SensorSimulator(std::chrono::milliseconds interval);
+    SensorSimulator(can::backsense::RadarStateDB& stateDB,
+                    const can::backsense::TrafficConfig& config);
     ~SensorSimulator();
 
-    double getFraction() { return m_fraction.load(); }
-
   private:
-    void updateFraction();
+    void feed();
 
   private:
+    can::backsense::RadarStateDB& m_stateDB;
+    can::backsense::TrafficGenerator m_generator;
+    std::promise<void> m_exitSignal;
+    // last: started once the rest is set up
     std::thread m_thread;
-    std::chrono::milliseconds m_msInterval;
-    std::atomic<double> m_fraction;
-    std::atomic<bool> m_leaving{false};
 };
 
 } // namespace augreality
@@ -0,0 +1,197 @@
+/*
+ *   A top-down view of the truck and of what all its sensors see, next to
+ *   or over the camera image.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SurroundView.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+// BGR
+static const cv::Scalar backgroundColor(40, 40, 40);
+static const cv::Scalar gridColor(60, 60, 60);
+static const cv::Scalar ringColor(110, 110, 110);
+static const cv::Scalar truckColor(150, 150, 150);
+static const cv::Scalar sensorColor(255, 200, 0);
+
+static constexpr double GRID_SPACING = 5;  // m
+static constexpr double RING_SPACING = 10; // m
+// the smallest truck drawn, with a single sensor mounted
+static constexpr double MIN_HALF_LENGTH = 2;
+static constexpr double MIN_HALF_WIDTH = 1;
+static constexpr double OBSTACLE_RADIUS = 0.6; // m
+static constexpr int PIP_MARGIN = 10;          // px
+
+using augreality::SurroundView;
+
+SurroundView::Layout SurroundView::parseLayout(const std::string& name)
+{
+    if (name == "side") {
+        return Layout::SIDE_BY_SIDE;
+    }
+    if (name == "pip") {
+        return Layout::PICTURE_IN_PICTURE;
+    }
+    throw std::runtime_error("Invalid surround view layout \"" + name +
+                             "\", expected side or pip.");
+}
+
+SurroundView::SurroundView(
+    const std::vector<can::backsense::SensorMount>& mounts, Layout layout,
+    double range)
+    : m_layout(layout), m_range(range)
+{
+    for (const auto& mount : mounts) {
+        assert(mount.sensorIdx < can::backsense::MAX_N_SENSORS);
+        m_mounts[mount.sensorIdx] = mount;
+    }
+}
+
+cv::Point SurroundView::toPixel(double x, double y) const
+{
+    // X forward is up, Y to the right is right
+    const double centre = m_side / 2.0;
+    return cv::Point(centre + y * m_pxPerMetre, centre - x * m_pxPerMetre);
+}
+
+void SurroundView::renderBackground(int side)
+{
+    m_side = side;
+    m_pxPerMetre = side / (2 * m_range);
+    m_background.create(side, side, CV_8UC3);
+    m_background.setTo(backgroundColor);
+
+    for (double d = GRID_SPACING; d < m_range; d += GRID_SPACING) {
+        for (double sign : {-1.0, 1.0}) {
+            cv::line(m_background, toPixel(sign * d, -m_range),
+                     toPixel(sign * d, m_range), gridColor);
+            cv::line(m_background, toPixel(-m_range, sign * d),
+                     toPixel(m_range, sign * d), gridColor);
+        }
+    }
+
+    const cv::Point centre = toPixel(0, 0);
+    for (double r = RING_SPACING; r < m_range * M_SQRT2; r += RING_SPACING) {
+        const int radius = r * m_pxPerMetre;
+        cv::circle(m_background, centre, radius, ringColor, 1, cv::LINE_AA);
+        cv::putText(m_background, std::to_string(static_cast<int>(r)) + " m",
+                    centre + cv::Point(4, 12 - radius),
+                    cv::FONT_HERSHEY_PLAIN, 0.8, ringColor, 1, cv::LINE_AA);
+    }
+
+    // the box of the sensors, which sit on the body of the truck
+    double front = MIN_HALF_LENGTH, rear = -MIN_HALF_LENGTH;
+    double right = MIN_HALF_WIDTH, left = -MIN_HALF_WIDTH;
+    for (const auto& mount : m_mounts) {
+        if (mount) {
+            front = std::max(front, mount->x);
+            rear = std::min(rear, mount->x);
+            right = std::max(right, mount->y);
+            left = std::min(left, mount->y);
+        }
+    }
+    cv::rectangle(m_background, toPixel(front, left), toPixel(rear, right),
+                  truckColor, cv::FILLED);
+    cv::arrowedLine(m_background, centre,
+                    toPixel(front - MIN_HALF_LENGTH / 2, 0),
+                    backgroundColor, 2, cv::LINE_AA);
+
+    // each sensor, with a tick along its X axis
+    for (const auto& mount : m_mounts) {
+        if (mount) {
+            double tipX, tipY;
+            mount->toVehicle(2, 0, tipX, tipY);
+            const cv::Point at = toPixel(mount->x, mount->y);
+            cv::line(m_background, at, toPixel(tipX, tipY), sensorColor, 2,
+                     cv::LINE_AA);
+            cv::circle(m_background, at, 3, sensorColor, cv::FILLED,
+                       cv::LINE_AA);
+        }
+    }
+}
+
+void SurroundView::beginFrame(const cv::Size& cameraSize)
+{
+    const int side = m_layout == Layout::SIDE_BY_SIDE ? cameraSize.height
+                                                      : cameraSize.height / 3;
+    if (side != m_side) {
+        renderBackground(side);
+    }
+    // same size: no allocation
+    m_background.copyTo(m_view);
+}
+
+void SurroundView::drawCells(const can::backsense::OccupancyCells& grid)
+{
+    using can::backsense::GRID_CELLS;
+    using can::backsense::OccupancyCells;
+
+    constexpr double half = 0.5 / can::backsense::GRID_CELLS_PER_METRE;
+    for (unsigned row = 0; row < GRID_CELLS; ++row) {
+        const double x = OccupancyCells::rowToX(row);
+        for (unsigned col = 0; col < GRID_CELLS; ++col) {
+            const int value = grid.cells[row][col];
+            if (!value) {
+                continue;
+            }
+            // from dark red, about to be forgotten, to bright red, just hit
+            const cv::Scalar color(0, 0, 64 + value * 191 / 255);
+            const double y = OccupancyCells::colToY(col);
+            cv::rectangle(m_view, toPixel(x + half, y - half),
+                          toPixel(x - half, y + half), color, cv::FILLED);
+        }
+    }
+}
+
+void SurroundView::drawObstacle(unsigned sensorIdx, double x, double y,
+                                const cv::Scalar& color)
+{
+    assert(sensorIdx < can::backsense::MAX_N_SENSORS);
+    const auto& mount = m_mounts[sensorIdx];
+    if (!mount) {
+        return;
+    }
+    double vehicleX, vehicleY;
+    mount->toVehicle(x, y, vehicleX, vehicleY);
+    const int radius = std::max(3.0, OBSTACLE_RADIUS * m_pxPerMetre);
+    cv::circle(m_view, toPixel(vehicleX, vehicleY), radius, color,
+               cv::FILLED);
+}
+
+void SurroundView::compose(const cv::Mat& camera, cv::Mat& out) const
+{
+    // the ROIs share the memory of 'out'
+    if (m_layout == Layout::SIDE_BY_SIDE) {
+        out.create(camera.rows, camera.cols + m_side, camera.type());
+        cv::Mat cameraRoi = out(cv::Rect(0, 0, camera.cols, camera.rows));
+        camera.copyTo(cameraRoi);
+        cv::Mat viewRoi = out(cv::Rect(camera.cols, 0, m_side, m_side));
+        m_view.copyTo(viewRoi);
+    } else {
+        camera.copyTo(out);
+        cv::Mat viewRoi =
+            out(cv::Rect(camera.cols - m_side - PIP_MARGIN,
+                         camera.rows - m_side - PIP_MARGIN, m_side, m_side));
+        m_view.copyTo(viewRoi);
+    }
+}
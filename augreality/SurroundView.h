@@ -0,0 +1,86 @@
+/*
+ *   A top-down view of the truck and of what all its sensors see, next to
+ *   or over the camera image.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SURROUND_VIEW_H_
+#define _SURROUND_VIEW_H_
+
+#include "../can/BSFrameHandler.h"
+#include "../can/OccupancyGrid.h"
+
+#include <opencv2/core.hpp>
+
+#include <array>
+#include <experimental/optional>
+#include <string>
+#include <vector>
+
+namespace augreality {
+
+// The truck, the grid and the range rings don't change from one frame to
+// the next: they are drawn once per size into a background, and every
+// frame starts from a copy of it, into the same buffer. Only the occupied
+// cells and the obstacles are drawn per frame, without anti-aliasing.
+class SurroundView
+{
+  public:
+    enum class Layout
+    {
+        SIDE_BY_SIDE,      // as high as the camera image, on its right
+        PICTURE_IN_PICTURE // a third of its height, in its lower right corner
+    };
+
+    // "side" or "pip"
+    static Layout parseLayout(const std::string& name);
+
+    // The truck is drawn as the box of its sensors; 'range' metres are
+    // shown ahead, behind and to each side of its centre.
+    SurroundView(const std::vector<can::backsense::SensorMount>& mounts,
+                 Layout layout, double range = 32);
+
+    // per frame, in this order
+    void beginFrame(const cv::Size& cameraSize);
+    void drawCells(const can::backsense::OccupancyCells& grid);
+    // (x, y) in the frame of the sensor
+    void drawObstacle(unsigned sensorIdx, double x, double y,
+                      const cv::Scalar& color);
+    // the camera image with the view next to it or over it; 'out' is
+    // reallocated only when the camera size changes
+    void compose(const cv::Mat& camera, cv::Mat& out) const;
+
+  private:
+    void renderBackground(int side);
+    cv::Point toPixel(double x, double y) const;
+
+    std::array<std::experimental::optional<can::backsense::SensorMount>,
+               can::backsense::MAX_N_SENSORS>
+        m_mounts;
+    const Layout m_layout;
+    const double m_range;
+
+    int m_side = 0;
+    double m_pxPerMetre = 0;
+    cv::Mat m_background;
+    cv::Mat m_view;
+};
+
+} // namespace augreality
+
+#endif // _SURROUND_VIEW_H_
@@ -0,0 +1,87 @@
+/*
+ *   Allocation checks: marks the code that must not touch the heap.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "AllocCheck.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdlib>
+
+// Called from inside malloc(): nothing here may allocate, hence a plain
+// thread local (no dynamic initialization) and write(2) for the report.
+static thread_local unsigned t_scopeDepth = 0;
+static std::atomic<__u64> s_violations{0};
+static std::atomic<bool> s_fatal{true};
+
+using alloccheck::NoAllocScope;
+
+NoAllocScope::NoAllocScope(bool active) : m_active(active)
+{
+    if (m_active) {
+        ++t_scopeDepth;
+    }
+}
+
+NoAllocScope::~NoAllocScope()
+{
+    if (m_active) {
+        --t_scopeDepth;
+    }
+}
+
+bool alloccheck::inNoAllocScope() { return t_scopeDepth > 0; }
+
+// AllocHooks.cpp has the strong definition
+__attribute__((weak)) bool alloccheck::hooksInstalled() { return false; }
+
+static void writeError(size_t size)
+{
+    char msg[96] = "#ERROR: heap allocation of ";
+    size_t len = 27;
+    char digits[24];
+    int nDigits = 0;
+    do {
+        digits[nDigits++] = '0' + size % 10;
+        size /= 10;
+    } while (size);
+    while (nDigits) {
+        msg[len++] = digits[--nDigits];
+    }
+    const char suffix[] = " bytes in a no-alloc scope.\n";
+    for (char c : suffix) {
+        msg[len++] = c;
+    }
+    // the trailing '\0' of the suffix is not written
+    (void)!write(STDERR_FILENO, msg, len - 1);
+}
+
+void alloccheck::reportAllocation(size_t size)
+{
+    s_violations.fetch_add(1, std::memory_order_relaxed);
+    if (s_fatal.load(std::memory_order_relaxed)) {
+        writeError(size);
+        std::abort();
+    }
+}
+
+void alloccheck::setFatal(bool fatal) { s_fatal.store(fatal); }
+
+__u64 alloccheck::violations() { return s_violations.load(); }
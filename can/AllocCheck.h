@@ -0,0 +1,64 @@
+/*
+ *   Allocation checks: marks the code that must not touch the heap.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ALLOC_CHECK_H_
+#define _ALLOC_CHECK_H_
+
+#include <linux/types.h>
+
+#include <cstddef>
+
+namespace alloccheck {
+
+// While a scope is open, the thread must not allocate: e.g. the CAN reader,
+// from CANL2_read_ac() to the DB update, once warmed up. A scope only costs
+// a thread local increment. The allocations are caught when AllocHooks.o,
+// which replaces malloc() and friends, is linked in (ingest_test, or any
+// program built with "make ALLOC_CHECK=1").
+class NoAllocScope
+{
+  public:
+    NoAllocScope(const NoAllocScope&) = delete;
+    NoAllocScope& operator=(const NoAllocScope&) = delete;
+
+    // an inactive scope does nothing (e.g. during the warm-up)
+    explicit NoAllocScope(bool active = true);
+    ~NoAllocScope();
+
+  private:
+    bool m_active;
+};
+
+// whether the calling thread is in a scope
+bool inNoAllocScope();
+
+// whether AllocHooks.o is linked in: without it nothing is checked
+bool hooksInstalled();
+
+// called by the hooks for every allocation made in a scope: it is counted
+// and, unless fatal mode is off, the program aborts right there (a core
+// dump or a debugger then points at the culprit)
+void reportAllocation(size_t size);
+void setFatal(bool fatal);
+__u64 violations();
+
+} // namespace alloccheck
+
+#endif // _ALLOC_CHECK_H_
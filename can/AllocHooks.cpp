@@ -0,0 +1,97 @@
+/*
+ *   Replaces the allocator entry points, to catch allocations made in a
+ *   NoAllocScope. Only linked into the checking builds.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "AllocCheck.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <malloc.h>
+
+// The glibc allocator, under the names it exports for this purpose.
+// operator new (and so every container) ends up in malloc(), which makes
+// it enough to replace the C functions.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+bool alloccheck::hooksInstalled() { return true; }
+
+static inline void check(size_t size)
+{
+    if (alloccheck::inNoAllocScope()) {
+        alloccheck::reportAllocation(size);
+    }
+}
+
+extern "C" {
+
+void* malloc(size_t size) noexcept
+{
+    check(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+    check(n * size);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+    check(size);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    check(size);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    check(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept
+{
+    check(size);
+    if (alignment % sizeof(void*) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void* mem = __libc_memalign(alignment, size);
+    if (!mem) {
+        return ENOMEM;
+    }
+    *ptr = mem;
+    return 0;
+}
+
+// freeing is not checked, but it must reach the same allocator
+void free(void* ptr) noexcept { __libc_free(ptr); }
+
+} // extern "C"
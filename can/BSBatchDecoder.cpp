@@ -0,0 +1,358 @@
+/*
+ *   Decodes many BS-9000 detection frames at once, into columns of
+ *   physical values, with SIMD kernels chosen at runtime.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "BSBatchDecoder.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BS_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using can::backsense::BatchDecoder;
+using can::backsense::DetectionColumns;
+using can::backsense::N_BYTES;
+
+// Every signal is a byte (or a few bits) plus an offset, in steps of its
+// resolution (see BSDataConverter.h). The signed ones, angle, y and speed,
+// all have the same: -128 degrees, -32 m and -64 km/h.
+static constexpr int SIGNED_OFFSET = -128;
+
+static_assert(sizeof(can::backsense::Distance) == sizeof(__s16) &&
+                  sizeof(can::backsense::Speed) == sizeof(__s16),
+              "the kernels store fixed point values as 16 bit integers");
+
+static void decodeScalar(const __u8* payloads, size_t n, DetectionColumns& out,
+                         size_t first)
+{
+    using can::backsense::Distance;
+    using can::backsense::Speed;
+
+    for (size_t i = 0; i < n; ++i) {
+        const __u8* p = payloads + i * N_BYTES;
+        const size_t row = first + i;
+        out.radius[row] = Distance::fromSteps(p[0]);
+        out.angle[row] = p[1] + SIGNED_OFFSET;
+        out.x[row] = Distance::fromSteps(p[2]);
+        out.y[row] = Distance::fromSteps(p[3] + SIGNED_OFFSET);
+        out.speed[row] = Speed::fromSteps(p[4] + SIGNED_OFFSET);
+        out.power[row] = p[5];
+        out.objectId[row] = p[6] >> 5;
+        out.appearance[row] = (p[6] >> 4) & 0x1;
+        out.trigger[row] = (p[6] >> 1) & 0x3;
+        out.detection[row] = p[7] & 0x1;
+    }
+}
+
+#ifdef BS_BATCH_X86
+
+//
+// Both kernels work the same way: they load frames two per 128 bit lane,
+// interleave the bytes of the two frames (pshufb), and transpose the 8x8
+// matrix of 16 bit pairs that the lanes form (3 rounds of unpacks). Each
+// lane then holds one byte of 16 consecutive frames, so that the bit
+// fields are extracted and the values widened to 16 bit steps for 16 (SSE)
+// or 32 (AVX2) frames per instruction. There is no floating point at all.
+//
+
+__attribute__((target("sse4.1"))) static inline void
+transpose(const __m128i r[8], __m128i bytes[8])
+{
+    const __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    const __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    const __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    const __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    const __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    const __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    const __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    const __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+    bytes[0] = _mm_unpacklo_epi64(b0, b4);
+    bytes[1] = _mm_unpackhi_epi64(b0, b4);
+    bytes[2] = _mm_unpacklo_epi64(b1, b5);
+    bytes[3] = _mm_unpackhi_epi64(b1, b5);
+    bytes[4] = _mm_unpacklo_epi64(b2, b6);
+    bytes[5] = _mm_unpackhi_epi64(b2, b6);
+    bytes[6] = _mm_unpacklo_epi64(b3, b7);
+    bytes[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// 16 bytes --> 16 shorts (or fixed point steps), byte + offset
+__attribute__((target("sse4.1"))) static inline void
+storeSteps(void* out, __m128i bytes, __m128i offset)
+{
+    const __m128i lo = _mm_cvtepu8_epi16(bytes);
+    const __m128i hi = _mm_cvtepu8_epi16(_mm_srli_si128(bytes, 8));
+    auto vectors = reinterpret_cast<__m128i*>(out);
+    _mm_storeu_si128(vectors, _mm_add_epi16(lo, offset));
+    _mm_storeu_si128(vectors + 1, _mm_add_epi16(hi, offset));
+}
+
+__attribute__((target("sse4.1"))) static inline void storeBytes(__u8* out,
+                                                                __m128i bytes)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), bytes);
+}
+
+__attribute__((target("sse4.1"))) static void
+decodeSse41(const __u8* payloads, size_t n, DetectionColumns& out,
+            size_t first)
+{
+    const __m128i interleave =
+        _mm_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+    const __m128i signedOffset = _mm_set1_epi16(SIGNED_OFFSET);
+    const __m128i noOffset = _mm_setzero_si128();
+    const __m128i mask1 = _mm_set1_epi8(0x1);
+    const __m128i mask2 = _mm_set1_epi8(0x3);
+    const __m128i mask3 = _mm_set1_epi8(0x7);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i r[8], bytes[8];
+        for (int k = 0; k < 8; ++k) {
+            const __u8* pair = payloads + (i + 2 * k) * N_BYTES;
+            r[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pair));
+            r[k] = _mm_shuffle_epi8(r[k], interleave);
+        }
+        transpose(r, bytes);
+
+        const size_t row = first + i;
+        storeSteps(&out.radius[row], bytes[0], noOffset);
+        storeSteps(&out.angle[row], bytes[1], signedOffset);
+        storeSteps(&out.x[row], bytes[2], noOffset);
+        storeSteps(&out.y[row], bytes[3], signedOffset);
+        storeSteps(&out.speed[row], bytes[4], signedOffset);
+        storeSteps(&out.power[row], bytes[5], noOffset);
+
+        // no 8 bit shifts: the bits coming from the next byte are masked
+        const __m128i flags = bytes[6];
+        storeBytes(&out.objectId[row],
+                   _mm_and_si128(_mm_srli_epi16(flags, 5), mask3));
+        storeBytes(&out.appearance[row],
+                   _mm_and_si128(_mm_srli_epi16(flags, 4), mask1));
+        storeBytes(&out.trigger[row],
+                   _mm_and_si128(_mm_srli_epi16(flags, 1), mask2));
+        storeBytes(&out.detection[row], _mm_and_si128(bytes[7], mask1));
+    }
+    decodeScalar(payloads + i * N_BYTES, n - i, out, first + i);
+}
+
+// the same, on both lanes at once
+__attribute__((target("avx2"))) static inline void
+transpose(const __m256i r[8], __m256i bytes[8])
+{
+    const __m256i a0 = _mm256_unpacklo_epi16(r[0], r[1]);
+    const __m256i a1 = _mm256_unpackhi_epi16(r[0], r[1]);
+    const __m256i a2 = _mm256_unpacklo_epi16(r[2], r[3]);
+    const __m256i a3 = _mm256_unpackhi_epi16(r[2], r[3]);
+    const __m256i a4 = _mm256_unpacklo_epi16(r[4], r[5]);
+    const __m256i a5 = _mm256_unpackhi_epi16(r[4], r[5]);
+    const __m256i a6 = _mm256_unpacklo_epi16(r[6], r[7]);
+    const __m256i a7 = _mm256_unpackhi_epi16(r[6], r[7]);
+    const __m256i b0 = _mm256_unpacklo_epi32(a0, a2);
+    const __m256i b1 = _mm256_unpackhi_epi32(a0, a2);
+    const __m256i b2 = _mm256_unpacklo_epi32(a1, a3);
+    const __m256i b3 = _mm256_unpackhi_epi32(a1, a3);
+    const __m256i b4 = _mm256_unpacklo_epi32(a4, a6);
+    const __m256i b5 = _mm256_unpackhi_epi32(a4, a6);
+    const __m256i b6 = _mm256_unpacklo_epi32(a5, a7);
+    const __m256i b7 = _mm256_unpackhi_epi32(a5, a7);
+    bytes[0] = _mm256_unpacklo_epi64(b0, b4);
+    bytes[1] = _mm256_unpackhi_epi64(b0, b4);
+    bytes[2] = _mm256_unpacklo_epi64(b1, b5);
+    bytes[3] = _mm256_unpackhi_epi64(b1, b5);
+    bytes[4] = _mm256_unpacklo_epi64(b2, b6);
+    bytes[5] = _mm256_unpackhi_epi64(b2, b6);
+    bytes[6] = _mm256_unpacklo_epi64(b3, b7);
+    bytes[7] = _mm256_unpackhi_epi64(b3, b7);
+}
+
+// 32 bytes --> 32 shorts (or fixed point steps), byte + offset
+__attribute__((target("avx2"))) static inline void
+storeSteps(void* out, __m256i bytes, __m256i offset)
+{
+    const __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes));
+    const __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
+    auto vectors = reinterpret_cast<__m256i*>(out);
+    _mm256_storeu_si256(vectors, _mm256_add_epi16(lo, offset));
+    _mm256_storeu_si256(vectors + 1, _mm256_add_epi16(hi, offset));
+}
+
+__attribute__((target("avx2"))) static inline void storeBytes(__u8* out,
+                                                              __m256i bytes)
+{
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), bytes);
+}
+
+__attribute__((target("avx2"))) static void
+decodeAvx2(const __u8* payloads, size_t n, DetectionColumns& out,
+           size_t first)
+{
+    const __m256i interleave = _mm256_setr_epi8(
+        0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+        0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+    const __m256i signedOffset = _mm256_set1_epi16(SIGNED_OFFSET);
+    const __m256i noOffset = _mm256_setzero_si256();
+    const __m256i mask1 = _mm256_set1_epi8(0x1);
+    const __m256i mask2 = _mm256_set1_epi8(0x3);
+    const __m256i mask3 = _mm256_set1_epi8(0x7);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        // the low lanes take frames 0-15 and the high lanes 16-31, so that
+        // the transposition leaves them in order
+        __m256i r[8], bytes[8];
+        for (int k = 0; k < 8; ++k) {
+            const __u8* lo = payloads + (i + 2 * k) * N_BYTES;
+            const __u8* hi = lo + 16 * N_BYTES;
+            const __m256i pairs = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi)), 1);
+            r[k] = _mm256_shuffle_epi8(pairs, interleave);
+        }
+        transpose(r, bytes);
+
+        const size_t row = first + i;
+        storeSteps(&out.radius[row], bytes[0], noOffset);
+        storeSteps(&out.angle[row], bytes[1], signedOffset);
+        storeSteps(&out.x[row], bytes[2], noOffset);
+        storeSteps(&out.y[row], bytes[3], signedOffset);
+        storeSteps(&out.speed[row], bytes[4], signedOffset);
+        storeSteps(&out.power[row], bytes[5], noOffset);
+
+        const __m256i flags = bytes[6];
+        storeBytes(&out.objectId[row],
+                   _mm256_and_si256(_mm256_srli_epi16(flags, 5), mask3));
+        storeBytes(&out.appearance[row],
+                   _mm256_and_si256(_mm256_srli_epi16(flags, 4), mask1));
+        storeBytes(&out.trigger[row],
+                   _mm256_and_si256(_mm256_srli_epi16(flags, 1), mask2));
+        storeBytes(&out.detection[row], _mm256_and_si256(bytes[7], mask1));
+    }
+    decodeSse41(payloads + i * N_BYTES, n - i, out, first + i);
+}
+
+#endif // BS_BATCH_X86
+
+// :::: struct DetectionColumns
+
+void DetectionColumns::resize(size_t n)
+{
+    radius.resize(n);
+    angle.resize(n);
+    x.resize(n);
+    y.resize(n);
+    speed.resize(n);
+    power.resize(n);
+    objectId.resize(n);
+    appearance.resize(n);
+    trigger.resize(n);
+    detection.resize(n);
+}
+
+// :::: class BatchDecoder
+
+BatchDecoder::BatchDecoder()
+    : BatchDecoder(isSupported(Isa::AVX2)
+                       ? Isa::AVX2
+                       : isSupported(Isa::SSE41) ? Isa::SSE41 : Isa::SCALAR)
+{
+}
+
+BatchDecoder::BatchDecoder(Isa isa) : m_isa(isa), m_kernel(decodeScalar)
+{
+    if (!isSupported(isa)) {
+        throw std::runtime_error(std::string("The CPU doesn't support the ") +
+                                 isaName(isa) + " batch decoder.");
+    }
+#ifdef BS_BATCH_X86
+    if (isa == Isa::AVX2) {
+        m_kernel = decodeAvx2;
+    } else if (isa == Isa::SSE41) {
+        m_kernel = decodeSse41;
+    }
+#endif
+}
+
+const char* BatchDecoder::isaName(Isa isa)
+{
+    switch (isa) {
+    case Isa::SSE41:
+        return "SSE4.1";
+    case Isa::AVX2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}
+
+bool BatchDecoder::isSupported(Isa isa)
+{
+#ifdef BS_BATCH_X86
+    switch (isa) {
+    case Isa::SSE41:
+        return __builtin_cpu_supports("sse4.1");
+    case Isa::AVX2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        return true;
+    }
+#else
+    return isa == Isa::SCALAR;
+#endif
+}
+
+void BatchDecoder::decode(const __u8* payloads, size_t stride, size_t n,
+                          DetectionColumns& out, size_t first) const
+{
+    if (first + n > out.size()) {
+        throw std::runtime_error("Batch decode past the end of the columns.");
+    }
+
+    if (stride == N_BYTES) {
+        m_kernel(payloads, n, out, first);
+        return;
+    }
+
+    // the kernels want packed payloads: gather them a block at a time
+    static constexpr size_t BLOCK = 256;
+    __u8 packed[BLOCK * N_BYTES];
+    for (size_t done = 0; done < n; done += BLOCK) {
+        const size_t count = std::min(BLOCK, n - done);
+        for (size_t i = 0; i < count; ++i) {
+            std::memcpy(packed + i * N_BYTES, payloads + (done + i) * stride,
+                        N_BYTES);
+        }
+        m_kernel(packed, count, out, first + done);
+    }
+}
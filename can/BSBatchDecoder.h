@@ -0,0 +1,87 @@
+/*
+ *   Decodes many BS-9000 detection frames at once, into columns of
+ *   physical values, with SIMD kernels chosen at runtime.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BACKSENSE_BATCH_DECODER_H_
+#define _BACKSENSE_BATCH_DECODER_H_
+
+#include "BSDataConverter.h" // N_BYTES, Distance, Speed
+
+#include <linux/types.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace can {
+
+namespace backsense {
+
+// the values of the DetectionData getters, one column per signal: 16 bytes
+// per frame, all integers
+struct DetectionColumns
+{
+    std::vector<Distance> radius;
+    std::vector<__s16> angle;
+    std::vector<Distance> x;
+    std::vector<Distance> y;
+    std::vector<Speed> speed;
+    std::vector<__s16> power;
+    std::vector<__u8> objectId;
+    std::vector<__u8> appearance;
+    std::vector<__u8> trigger;
+    std::vector<__u8> detection;
+
+    size_t size() const { return radius.size(); }
+    void resize(size_t n);
+};
+
+class BatchDecoder
+{
+  public:
+    enum class Isa { SCALAR, SSE41, AVX2 };
+
+    // the best kernel for the CPU we run on
+    BatchDecoder();
+    // a given kernel (benchmarks); throws if the CPU doesn't support it
+    explicit BatchDecoder(Isa isa);
+
+    Isa isa() const { return m_isa; }
+    static const char* isaName(Isa isa);
+    static bool isSupported(Isa isa);
+
+    // Decodes 'n' payloads of N_BYTES bytes, 'stride' bytes apart (N_BYTES
+    // when packed, sizeof(CaptureRecord) straight from a capture log), into
+    // the rows [first, first + n) of 'out', which must already be there.
+    void decode(const __u8* payloads, size_t stride, size_t n,
+                DetectionColumns& out, size_t first = 0) const;
+
+  private:
+    using Kernel = void (*)(const __u8* payloads, size_t n,
+                            DetectionColumns& out, size_t first);
+
+    Isa m_isa;
+    Kernel m_kernel;
+};
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _BACKSENSE_BATCH_DECODER_H_
@@ -22,6 +22,8 @@
 #ifndef _BACKSENSE_DATA_CONVERTER_H_
 #define _BACKSENSE_DATA_CONVERTER_H_
 
+#include "FixedPoint.h"
+
 #include <linux/types.h>
 
 #include <array>
@@ -34,8 +36,21 @@ namespace backsense {
 static constexpr unsigned N_BYTES = 8;
 static constexpr unsigned N_BITS = 8;
 
+// the resolutions of the sensor, as fixed point types
+using Distance = Fixed<4>; // quarter metres
+using Speed = Fixed<2>;    // half km/h
+
 namespace converter {
 
+// physical value from a count of steps of its resolution
+template <typename PhyT> constexpr PhyT fromSteps(int steps)
+{
+    return PhyT::fromSteps(steps);
+}
+template <> constexpr int fromSteps<int>(int steps) { return steps; }
+
+// The resolution is the step of PhyT (1 for int), so that the conversion is
+// integer only.
 template <typename PhyT> class DetectionDataConverter
 {
   public:
@@ -54,13 +69,13 @@ template <typename PhyT> class DetectionDataConverter
             byte >>= (N_BITS - dataLength());
         }
 
-        PhyT value = byte * resolution() + offset();
+        return fromSteps<PhyT>(byte + offset());
     }
 
   protected:
     virtual unsigned byteNumber() const = 0;
-    virtual PhyT resolution() const = 0;
 
+    // in steps of PhyT
     virtual int offset() const { return 0; }
     virtual unsigned dataLength() const { return N_BITS; }
     virtual unsigned startBit() const { return 0; }
@@ -68,14 +83,13 @@ template <typename PhyT> class DetectionDataConverter
     virtual __u8 maxRawValue() const { return 0xFF; }
 };
 
-class PolarRadius : public DetectionDataConverter<double>
+class PolarRadius : public DetectionDataConverter<Distance>
 {
   public:
     PolarRadius() = default;
 
   private:
     unsigned byteNumber() const override { return 0; }
-    double resolution() const override { return 0.25; }
     __u8 minRawValue() const override { return 0x0; }
     __u8 maxRawValue() const override { return 0x79; }
 };
@@ -88,45 +102,41 @@ class PolarAngle : public DetectionDataConverter<int>
   private:
     unsigned byteNumber() const override { return 1; }
     int offset() const override { return -128; }
-    int resolution() const override { return 1; }
     __u8 minRawValue() const override { return 0x44; }
     __u8 maxRawValue() const override { return 0xBC; }
 };
 
-class X : public DetectionDataConverter<double>
+class X : public DetectionDataConverter<Distance>
 {
   public:
     X() = default;
 
   private:
     unsigned byteNumber() const override { return 2; }
-    double resolution() const override { return 0.25; }
     __u8 minRawValue() const override { return 0x0; }
     __u8 maxRawValue() const override { return 0x78; }
 };
 
-class Y : public DetectionDataConverter<double>
+class Y : public DetectionDataConverter<Distance>
 {
   public:
     Y() = default;
 
   private:
     unsigned byteNumber() const override { return 3; }
-    double resolution() const override { return 0.25; }
-    int offset() const override { return -32; }
+    int offset() const override { return -128; } // -32 m
     __u8 minRawValue() const override { return 0x6C; }
     __u8 maxRawValue() const override { return 0x94; }
 };
 
-class RelativeSpeed : public DetectionDataConverter<double>
+class RelativeSpeed : public DetectionDataConverter<Speed>
 {
   public:
     RelativeSpeed() = default;
 
   private:
     unsigned byteNumber() const override { return 4; }
-    double resolution() const override { return 0.5; }
-    int offset() const override { return -64; }
+    int offset() const override { return -128; } // -64 km/h
     __u8 minRawValue() const override { return 0x0; }
     __u8 maxRawValue() const override { return 0xFF; }
 };
@@ -138,7 +148,6 @@ class SignalPower : public DetectionDataConverter<int>
 
   private:
     unsigned byteNumber() const override { return 5; }
-    int resolution() const override { return 1; }
     __u8 minRawValue() const override { return 0x0; }
     __u8 maxRawValue() const override { return 0x7F; }
 };
@@ -152,7 +161,6 @@ class ObjectId : public DetectionDataConverter<int>
     unsigned byteNumber() const override { return 6; }
     unsigned startBit() const override { return 5; }
     unsigned dataLength() const override { return 3; }
-    int resolution() const override { return 1; }
 };
 
 class ObjectAppearanceStatus : public DetectionDataConverter<int>
@@ -164,7 +172,6 @@ class ObjectAppearanceStatus : public DetectionDataConverter<int>
     unsigned byteNumber() const override { return 6; }
     unsigned startBit() const override { return 4; }
     unsigned dataLength() const override { return 1; }
-    int resolution() const override { return 1; }
 };
 
 class TriggerEvent : public DetectionDataConverter<int>
@@ -176,7 +183,6 @@ class TriggerEvent : public DetectionDataConverter<int>
     unsigned byteNumber() const override { return 6; }
     unsigned startBit() const override { return 1; }
     unsigned dataLength() const override { return 2; }
-    int resolution() const override { return 1; }
 };
 
 class DetectionFlag : public DetectionDataConverter<int>
@@ -187,7 +193,6 @@ class DetectionFlag : public DetectionDataConverter<int>
   private:
     unsigned byteNumber() const override { return 7; }
     unsigned dataLength() const override { return 1; }
-    int resolution() const override { return 1; }
     __u8 minRawValue() const override { return 0x0; }
     __u8 maxRawValue() const override { return 0x1; }
 };
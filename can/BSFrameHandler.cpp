@@ -21,16 +21,21 @@
 
 #include "BSFrameHandler.h"
 
-#include <sstream>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
 #include <utility>
 
 // :::: class FrameHandler
 
 using can::backsense::DetectionData;
+using can::backsense::Distance;
 using can::backsense::FrameHandler;
+using can::backsense::Speed;
 
-std::unordered_map<__u32, std::pair<unsigned, unsigned>>
-    FrameHandler::s_detectionIdsToIndexes;
+std::bitset<can::backsense::N_STD_IDS> FrameHandler::s_detectionIds;
+std::array<std::pair<__u8, __u8>, can::backsense::N_STD_IDS>
+    FrameHandler::s_idsToIndexes;
 
 std::experimental::optional<DetectionData>
 FrameHandler::processRcvFrame(const PARAM_STRUCT& frame)
@@ -47,38 +52,92 @@ FrameHandler::processRcvFrame(const PARAM_STRUCT& frame)
 
 std::pair<unsigned, unsigned> FrameHandler::getIndexPairFromId(const __u32 id)
 {
-    auto retPair = s_detectionIdsToIndexes.find(id);
-    assert(retPair != s_detectionIdsToIndexes.end());
-    return retPair->second;
+    assert(id < N_STD_IDS && s_detectionIds.test(id));
+    return s_idsToIndexes[id];
 }
 
-bool FrameHandler::isDetectionObjectId(const __u32 id) const
+can::AcceptanceFilter FrameHandler::acceptanceFilter(unsigned nSensors)
 {
-    return s_detectionIdsToIndexes.find(id) != s_detectionIdsToIndexes.end();
+    assert(nSensors > 0 && nSensors <= MAX_N_SENSORS);
+    std::vector<unsigned> sensors(nSensors);
+    for (unsigned i = 0; i < nSensors; ++i) {
+        sensors[i] = i;
+    }
+    return acceptanceFilter(sensors);
+}
+
+can::AcceptanceFilter
+FrameHandler::acceptanceFilter(const std::vector<unsigned>& sensors)
+{
+    assert(!sensors.empty());
+
+    // bits that are the same in every id must match, the others are
+    // "don't care"
+    __u32 allOnes = N_STD_IDS - 1;
+    __u32 anyOnes = 0;
+    for (auto i : sensors) {
+        assert(i < MAX_N_SENSORS);
+        for (unsigned j = 0; j < MAX_N_OBJS; ++j) {
+            const __u32 id = BASE_DETECTION_ID + i * SENSOR_ID_STRIDE + j;
+            allOnes &= id;
+            anyOnes |= id;
+        }
+    }
+
+    AcceptanceFilter filter;
+    filter.mask = ~(allOnes ^ anyOnes) & (N_STD_IDS - 1);
+    filter.code = allOnes & filter.mask;
+    filter.rejectExtended = true;
+    return filter;
 }
 
 void FrameHandler::initializeDetectionIds()
 {
-    __u32 baseId = 0x310;
-    for (auto i = 0; i < MAX_N_SENSORS; ++i) {
+    __u32 baseId = BASE_DETECTION_ID;
+    for (unsigned i = 0; i < MAX_N_SENSORS; ++i) {
         __u32 objId = baseId;
-        for (auto j = 0; j < MAX_N_OBJS; ++j) {
-            s_detectionIdsToIndexes.emplace(objId++, std::make_pair(i, j));
+        for (unsigned j = 0; j < MAX_N_OBJS; ++j) {
+            s_detectionIds.set(objId);
+            s_idsToIndexes[objId++] = std::make_pair(i, j);
         }
-        baseId += 0x10;
+        baseId += SENSOR_ID_STRIDE;
     }
 }
 
+// :::: class CycleTracker
+
+using can::backsense::CycleTracker;
+
+constexpr __u8 CycleTracker::ALL_SLOTS;
+
+CycleTracker::Boundary CycleTracker::onObject(unsigned objIdx)
+{
+    assert(objIdx < MAX_N_OBJS);
+    Boundary boundary;
+    if (static_cast<int>(objIdx) <= m_lastObjIdx) {
+        boundary.restarted = true;
+        boundary.previousSlots = ALL_SLOTS & ~(1u << objIdx);
+    }
+    if (objIdx == MAX_N_OBJS - 1) {
+        boundary.completed = true;
+        m_lastObjIdx = -1;
+    } else {
+        m_lastObjIdx = objIdx;
+    }
+    return boundary;
+}
+
 // :::: class DetectionData
 
 std::string DetectionData::getStrHexId() const
 {
-    std::stringstream ss;
-    ss << std::hex << "0x" << m_detectionId;
-    return ss.str();
+    // short enough for the small string buffer: no allocation
+    char text[16];
+    std::snprintf(text, sizeof(text), "0x%x", m_detectionId);
+    return text;
 }
 
-double DetectionData::getPolarRadius() const
+Distance DetectionData::getPolarRadius() const
 {
     return converter::PolarRadius().convert(m_frame);
 }
@@ -88,11 +147,17 @@ int DetectionData::getPolarAngle() const
     return converter::PolarAngle().convert(m_frame);
 }
 
-double DetectionData::getX() const { return converter::X().convert(m_frame); }
+Distance DetectionData::getX() const
+{
+    return converter::X().convert(m_frame);
+}
 
-double DetectionData::getY() const { return converter::Y().convert(m_frame); }
+Distance DetectionData::getY() const
+{
+    return converter::Y().convert(m_frame);
+}
 
-double DetectionData::getRelativeSpeed() const
+Speed DetectionData::getRelativeSpeed() const
 {
     return converter::RelativeSpeed().convert(m_frame);
 }
@@ -142,19 +207,203 @@ void DetectionData::dump(std::ostream& out) const
 
 // :::: class RadarStateDB
 
+using can::backsense::ObstacleSummary;
 using can::backsense::RadarStateDB;
 
+constexpr unsigned ObstacleSummary::NONE;
+
+// The summary of one sensor in 64 bits, so that it is read in one go:
+// radius steps (16) | nearest obj (4) | ttc obj (4) | unused (8) | ttc (32)
+static __u64 packObstacles(unsigned nearestObj, Distance nearestRadius,
+                           unsigned ttcObj, __u32 ttcMs)
+{
+    return static_cast<__u16>(nearestRadius.steps()) |
+           static_cast<__u64>(nearestObj) << 16 |
+           static_cast<__u64>(ttcObj) << 20 | static_cast<__u64>(ttcMs) << 32;
+}
+
+static ObstacleSummary unpackObstacles(unsigned sensorIdx, __u64 packed)
+{
+    ObstacleSummary summary;
+    summary.nearestSensor = sensorIdx;
+    summary.nearestObj = (packed >> 16) & 0xF;
+    summary.nearestRadius = Distance::fromSteps(packed & 0xFFFF);
+    summary.ttcSensor = sensorIdx;
+    summary.ttcObj = (packed >> 20) & 0xF;
+    summary.ttcMs = packed >> 32;
+    return summary;
+}
+
+static const __u64 NO_OBSTACLES = packObstacles(
+    ObstacleSummary::NONE, Distance(), ObstacleSummary::NONE, 0);
+
+RadarStateDB::RadarStateDB(unsigned nSensors)
+    : RadarStateDB(nSensors, {})
+{
+}
+
+RadarStateDB::RadarStateDB(unsigned nSensors,
+                           const std::vector<std::vector<unsigned>>& shards)
+{
+    assert(nSensors <= MAX_N_SENSORS);
+    m_db.assign(nSensors, DetectionDataVec(MAX_N_OBJS, nullopt));
+    for (auto& obstacles : m_obstacles) {
+        obstacles.value.store(NO_OBSTACLES);
+    }
+
+    std::vector<bool> assigned(nSensors, false);
+    for (const auto& sensors : shards) {
+        m_shards.push_back(std::make_unique<Shard>());
+        for (auto sensorIdx : sensors) {
+            if (sensorIdx >= nSensors || assigned[sensorIdx]) {
+                throw std::runtime_error(
+                    "Sensor " + std::to_string(sensorIdx) +
+                    " is out of range or in more than one shard.");
+            }
+            assigned[sensorIdx] = true;
+            m_sensorShard[sensorIdx] = m_shards.size() - 1;
+            m_shards.back()->sensors.push_back(sensorIdx);
+        }
+    }
+
+    if (std::find(assigned.begin(), assigned.end(), false) != assigned.end()) {
+        m_shards.push_back(std::make_unique<Shard>());
+        for (unsigned i = 0; i < nSensors; ++i) {
+            if (!assigned[i]) {
+                m_sensorShard[i] = m_shards.size() - 1;
+                m_shards.back()->sensors.push_back(i);
+            }
+        }
+    }
+}
+
+RadarStateDB::FullLock::FullLock(const RadarStateDB& stateDB)
+{
+    // shards are always taken in index order: no deadlock between two full
+    // locks
+    for (const auto& shard : stateDB.m_shards) {
+        m_locks.emplace_back(shard->mutex);
+    }
+}
+
 void RadarStateDB::updateState(const DetectionData&& newState)
 {
-    autoClear();
+    auto id = newState.getId();
+    auto idxPair = FrameHandler::getIndexPairFromId(id);
+
+    auto& shard = *m_shards[m_sensorShard[idxPair.first]];
+    const bool cleared = autoClear(shard);
 
     if (!newState.getDetectionFlag()) {
-        auto id = newState.getId();
-        auto idxPair = FrameHandler::getIndexPairFromId(id);
         m_db[idxPair.first][idxPair.second] = OptDetectionData(newState);
     } else {
         // no object detection
     }
+
+    if (cleared) {
+        for (auto sensorIdx : shard.sensors) {
+            refreshObstacles(sensorIdx);
+        }
+    } else {
+        refreshObstacles(idxPair.first);
+    }
+
+    for (const auto& listener : m_listeners) {
+        listener(*this, newState);
+    }
+}
+
+void RadarStateDB::addUpdateListener(UpdateListener listener)
+{
+    m_listeners.push_back(std::move(listener));
+}
+
+void RadarStateDB::addObstacleAlert(Distance radius, __u32 ttcMs,
+                                    AlertListener listener)
+{
+    m_alerts.push_back({radius, ttcMs, std::move(listener), {}});
+}
+
+ObstacleSummary RadarStateDB::obstacleSummary(unsigned sensorIdx) const
+{
+    assert(sensorIdx < m_db.size());
+    return unpackObstacles(
+        sensorIdx,
+        m_obstacles[sensorIdx].value.load(std::memory_order_acquire));
+}
+
+ObstacleSummary RadarStateDB::obstacleSummary() const
+{
+    ObstacleSummary all;
+    for (unsigned i = 0; i < m_db.size(); ++i) {
+        const auto sensor = obstacleSummary(i);
+        if (sensor.hasObstacle() &&
+            (!all.hasObstacle() || sensor.nearestRadius < all.nearestRadius)) {
+            all.nearestSensor = i;
+            all.nearestObj = sensor.nearestObj;
+            all.nearestRadius = sensor.nearestRadius;
+        }
+        if (sensor.hasCollision() &&
+            (!all.hasCollision() || sensor.ttcMs < all.ttcMs)) {
+            all.ttcSensor = i;
+            all.ttcObj = sensor.ttcObj;
+            all.ttcMs = sensor.ttcMs;
+        }
+    }
+    return all;
+}
+
+void RadarStateDB::refreshObstacles(unsigned sensorIdx)
+{
+    // radius steps over speed steps, to milliseconds: m / (km/h) is 3.6 s
+    static constexpr __u32 TTC_MS_FACTOR =
+        3600 * Speed::STEPS_PER_UNIT / Distance::STEPS_PER_UNIT;
+
+    unsigned nearestObj = ObstacleSummary::NONE;
+    Distance nearestRadius;
+    unsigned ttcObj = ObstacleSummary::NONE;
+    __u32 ttcMs = 0;
+
+    const auto& rows = m_db[sensorIdx];
+    for (unsigned j = 0; j < MAX_N_OBJS; ++j) {
+        if (!rows[j]) {
+            continue;
+        }
+        const auto radius = rows[j]->getPolarRadius();
+        if (nearestObj == ObstacleSummary::NONE || radius < nearestRadius) {
+            nearestObj = j;
+            nearestRadius = radius;
+        }
+        // a negative relative speed (km/h): the object comes closer
+        const int speed = rows[j]->getRelativeSpeed().steps();
+        if (speed < 0) {
+            const __u32 ms = radius.steps() * TTC_MS_FACTOR / -speed;
+            if (ttcObj == ObstacleSummary::NONE || ms < ttcMs) {
+                ttcObj = j;
+                ttcMs = ms;
+            }
+        }
+    }
+
+    const auto packed =
+        packObstacles(nearestObj, nearestRadius, ttcObj, ttcMs);
+    m_obstacles[sensorIdx].value.store(packed, std::memory_order_release);
+
+    // edge triggered: the listener only hears of the changes
+    if (m_alerts.empty()) {
+        return;
+    }
+    const auto summary = unpackObstacles(sensorIdx, packed);
+    for (auto& alert : m_alerts) {
+        const bool raise = (summary.hasObstacle() &&
+                            summary.nearestRadius < alert.radius) ||
+                           (summary.hasCollision() &&
+                            summary.ttcMs < alert.ttcMs);
+        if (raise != alert.raised[sensorIdx]) {
+            alert.raised[sensorIdx] = raise;
+            alert.listener(sensorIdx, summary, raise);
+        }
+    }
 }
 
 const std::vector<std::experimental::optional<DetectionData>>&
@@ -164,14 +413,68 @@ RadarStateDB::getSensorData(unsigned sensorIdx) const
     return m_db[sensorIdx];
 }
 
-void RadarStateDB::autoClear()
+void RadarStateDB::setSensorStale(unsigned sensorIdx, bool stale)
+{
+    assert(sensorIdx < m_db.size());
+    if (stale) {
+        m_staleMask.fetch_or(1u << sensorIdx);
+    } else {
+        m_staleMask.fetch_and(~(1u << sensorIdx));
+    }
+}
+
+void RadarStateDB::exportSnapshot(RadarSnapshot& snapshot) const
+{
+    snapshot.nSensors = m_db.size();
+    snapshot.stale = staleMask();
+    for (unsigned i = 0; i < m_db.size(); ++i) {
+        exportSensor(snapshot.sensors[i], i);
+    }
+}
+
+void RadarStateDB::exportSensor(SensorSnapshot& rows, unsigned sensorIdx) const
+{
+    assert(sensorIdx < m_db.size());
+    for (unsigned j = 0; j < MAX_N_OBJS; ++j) {
+        const auto& slot = m_db[sensorIdx][j];
+        rows.valid[j] = static_cast<bool>(slot);
+        if (slot) {
+            rows.ids[j] = slot->m_detectionId;
+            std::copy(slot->m_frame.begin(), slot->m_frame.end(),
+                      rows.frames[j]);
+        }
+    }
+}
+
+void RadarStateDB::importSnapshot(const RadarSnapshot& snapshot)
+{
+    const auto nSensors = std::min<unsigned>(snapshot.nSensors, m_db.size());
+    m_staleMask.store(snapshot.stale);
+    for (unsigned i = 0; i < nSensors; ++i) {
+        const auto& rows = snapshot.sensors[i];
+        for (unsigned j = 0; j < MAX_N_OBJS; ++j) {
+            if (rows.valid[j]) {
+                m_db[i][j] = DetectionData(rows.frames[j], rows.ids[j]);
+            } else {
+                m_db[i][j] = nullopt;
+            }
+        }
+        refreshObstacles(i);
+    }
+}
+
+bool RadarStateDB::autoClear(Shard& shard)
 {
     // best effort to keep the DB state up-to-date
-    if (m_callCount >= MAX_N_OBJS * MAX_N_SENSORS) {
+    if (shard.callCount >= MAX_N_OBJS * shard.sensors.size()) {
         // TODO: source of glitches (relevant?)
-        m_db.assign(m_db.size(), DetectionDataVec(MAX_N_OBJS, nullopt));
-        m_callCount = 0;
-    } else {
-        m_callCount++;
+        for (auto sensorIdx : shard.sensors) {
+            std::fill(m_db[sensorIdx].begin(), m_db[sensorIdx].end(),
+                      nullopt);
+        }
+        shard.callCount = 0;
+        return true;
     }
+    shard.callCount++;
+    return false;
 }
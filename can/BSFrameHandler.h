@@ -24,16 +24,20 @@
 
 #include "BSDataConverter.h"
 #include "CANL2.h" // PARAM_STRUCT
+#include "CANproChannel.h" // AcceptanceFilter
 
 #include <cassert>
 #include <linux/types.h>
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <experimental/optional>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
-#include <unordered_map>
 #include <vector>
 
 namespace can {
@@ -41,11 +45,15 @@ namespace can {
 namespace backsense {
 
 static constexpr unsigned MAX_N_OBJS = 8;
-//static constexpr unsigned MAX_N_SENSORS = 8;
-// hacking to 1 since we aint using more than 1
-static constexpr unsigned MAX_N_SENSORS = 1;
+static constexpr unsigned MAX_N_SENSORS = 8;
+
+// sensor i sends its objects with ids BASE_ID + i * SENSOR_STRIDE + [0, 7]
+static constexpr __u32 BASE_DETECTION_ID = 0x310;
+static constexpr __u32 SENSOR_ID_STRIDE = 0x10;
+static constexpr unsigned N_STD_IDS = 2048;
 
 class FrameHandler;
+class RadarStateDB;
 
 class DetectionData
 {
@@ -55,12 +63,13 @@ class DetectionData
 
     __u32 getId() const { return m_detectionId; }
     std::string getStrHexId() const;
+    const std::array<__u8, N_BYTES>& getRawData() const { return m_frame; }
 
-    double getPolarRadius() const;
+    Distance getPolarRadius() const;
     int getPolarAngle() const;
-    double getX() const;
-    double getY() const;
-    double getRelativeSpeed() const;
+    Distance getX() const;
+    Distance getY() const;
+    Speed getRelativeSpeed() const;
     int getSignalPower() const;
     int getObjectId() const;
     int getObjectAppearanceStatus() const;
@@ -77,7 +86,9 @@ class DetectionData
     }
 
     // only the frame handler should build frames directly
+    // (the DB rebuilds them when importing a snapshot)
     friend FrameHandler;
+    friend RadarStateDB;
 
   private:
     std::array<__u8, N_BYTES> m_frame;
@@ -98,42 +109,216 @@ class FrameHandler
 
     static std::pair<unsigned, unsigned> getIndexPairFromId(const __u32 id);
 
-  private:
-    bool isDetectionObjectId(const __u32 id) const;
+    // the tightest code/mask pair that lets through the detection frames of
+    // the first 'nSensors' sensors
+    static AcceptanceFilter acceptanceFilter(unsigned nSensors);
+    // ... or of the given sensors (e.g. the ones wired to one CAN channel)
+    static AcceptanceFilter
+    acceptanceFilter(const std::vector<unsigned>& sensors);
+
+    bool isDetectionObjectId(const __u32 id) const
+    {
+        return id < N_STD_IDS && s_detectionIds.test(id);
+    }
 
+  private:
     void initializeDetectionIds();
 
   private:
-    // key: frame id --> value: pair of <sensor idx, obj idx>
-    static std::unordered_map<__u32, std::pair<unsigned, unsigned>>
-        s_detectionIdsToIndexes;
+    // The hardware mask can only express a superset of the id ranges, so
+    // the exact filtering is done here: one bit per standard id.
+    static std::bitset<N_STD_IDS> s_detectionIds;
+    // frame id --> pair of <sensor idx, obj idx>
+    static std::array<std::pair<__u8, __u8>, N_STD_IDS> s_idsToIndexes;
+};
+
+// Where the cycles of one sensor end, from the objects it sends, once the DB
+// holds them. The sensor sends its objects in id order, once per cycle: a
+// cycle ends with its last object, or, when that frame was lost, at the
+// first object of the next cycle (the sequence restarts), which has then
+// already replaced the one of its slot. Fed by the thread that updates the
+// sensor.
+class CycleTracker
+{
+  public:
+    static constexpr __u8 ALL_SLOTS = (1u << MAX_N_OBJS) - 1;
+
+    struct Boundary
+    {
+        // the previous cycle ended before this object: only the slots in
+        // 'previousSlots' still hold it
+        bool restarted = false;
+        __u8 previousSlots = 0;
+        // this object is the last of its cycle, which every slot holds
+        bool completed = false;
+
+        unsigned cycles() const { return restarted + completed; }
+    };
+
+    Boundary onObject(unsigned objIdx);
+
+  private:
+    int m_lastObjIdx = -1;
 };
 
 using DetectionDataVec = std::vector<OptDetectionData>;
 using std::experimental::nullopt;
 
+// plain copy of the DB, with a fixed layout that can be shared between
+// processes; the rows of each sensor are kept together, since different
+// sensors may be written by different threads
+struct SensorSnapshot
+{
+    __u8 valid[MAX_N_OBJS];
+    __u32 ids[MAX_N_OBJS];
+    __u8 frames[MAX_N_OBJS][N_BYTES];
+};
+
+struct RadarSnapshot
+{
+    __u32 nSensors;
+    __u8 stale; // bit i set: the state of sensor i is stale
+    SensorSnapshot sensors[MAX_N_SENSORS];
+};
+
+// the closest obstacle and the soonest collision, of one sensor or of the
+// whole DB
+struct ObstacleSummary
+{
+    static constexpr unsigned NONE = MAX_N_OBJS;
+
+    // the obstacle with the smallest polar radius (nearestObj is NONE when
+    // there is none)
+    unsigned nearestSensor = 0;
+    unsigned nearestObj = NONE;
+    Distance nearestRadius;
+    // of the obstacles coming closer, the one that would be reached first,
+    // at their current speed (ttcObj is NONE when none is coming closer)
+    unsigned ttcSensor = 0;
+    unsigned ttcObj = NONE;
+    __u32 ttcMs = 0;
+
+    bool hasObstacle() const { return nearestObj != NONE; }
+    bool hasCollision() const { return ttcObj != NONE; }
+};
+
+// The DB is split in shards, one per CAN channel: each shard holds the
+// sensors wired to that channel and has its own lock, so that the reader
+// threads of different channels never wait for each other.
 class RadarStateDB
 {
-  public:
-    RadarStateDB(unsigned nSensors)
+    struct alignas(64) Shard
     {
-        assert(nSensors <= MAX_N_SENSORS);
-        m_db.assign(nSensors, DetectionDataVec(MAX_N_OBJS, nullopt));
-    }
+        std::mutex mutex;
+        std::vector<unsigned> sensors;
+        unsigned callCount = 0;
+    };
 
+  public:
+    RadarStateDB(const RadarStateDB&) = delete;
+    RadarStateDB& operator=(const RadarStateDB&) = delete;
+
+    // a single shard, with every sensor
+    explicit RadarStateDB(unsigned nSensors);
+    // one shard per list of sensors; unlisted sensors share an extra shard
+    RadarStateDB(unsigned nSensors,
+                 const std::vector<std::vector<unsigned>>& shards);
+
+    // called after every update, with the shard of the updated sensor still
+    // locked
+    using UpdateListener =
+        std::function<void(const RadarStateDB&, const DetectionData&)>;
+
+    // the shard of the sensor that sent 'newState' must be locked by the
+    // caller
     void updateState(const DetectionData&& newState);
+    void addUpdateListener(UpdateListener listener);
 
     const DetectionDataVec& getSensorData(unsigned sensorIdx) const;
+    unsigned getNumberOfSensors() const { return m_db.size(); }
+
+    // Kept up to date by every update, so that they cost a single atomic
+    // load per sensor: no lock, no scan of the rows.
+    ObstacleSummary obstacleSummary(unsigned sensorIdx) const;
+    ObstacleSummary obstacleSummary() const;
+
+    // Called by the thread that updates the sensor (the CAN reader), right
+    // after the update that brings an obstacle closer than 'radius' or a
+    // collision sooner than 'ttcMs' ('raised'), and after the one that ends
+    // it. It runs with the shard of the sensor locked: it must be quick.
+    // Like the update listeners, alerts are set up before the updates start.
+    using AlertListener = std::function<void(
+        unsigned sensorIdx, const ObstacleSummary& summary, bool raised)>;
+    void addObstacleAlert(Distance radius, __u32 ttcMs,
+                          AlertListener listener);
+
+    // guards the sensors of one shard
+    std::mutex& shardMutex(unsigned sensorIdx) const
+    {
+        assert(sensorIdx < m_db.size());
+        return m_shards[m_sensorShard[sensorIdx]]->mutex;
+    }
+
+    // locks every shard (always in the same order), for the accesses that
+    // span the whole DB
+    class FullLock
+    {
+      public:
+        explicit FullLock(const RadarStateDB& stateDB);
+
+      private:
+        std::vector<std::unique_lock<std::mutex>> m_locks;
+    };
+
+    // the whole DB must be locked by the caller
+    void exportSnapshot(RadarSnapshot& snapshot) const;
+    void importSnapshot(const RadarSnapshot& snapshot);
+    // only the rows of one sensor, whose shard must be locked
+    void exportSensor(SensorSnapshot& rows, unsigned sensorIdx) const;
+
+    // set while the DB can't be refreshed (e.g. the CAN channel is down):
+    // the last known state is kept, but should be displayed as such
+    void setStale(bool stale) { m_staleMask.store(stale ? ~0u : 0u); }
+    void setSensorStale(unsigned sensorIdx, bool stale);
+    bool isStale() const { return staleMask() != 0; }
+    bool isSensorStale(unsigned sensorIdx) const
+    {
+        return staleMask() & (1u << sensorIdx);
+    }
+    __u32 staleMask() const
+    {
+        return m_staleMask.load() & ((1u << m_db.size()) - 1);
+    }
 
   private:
-    void autoClear();
+    struct ObstacleAlert
+    {
+        Distance radius;
+        __u32 ttcMs;
+        AlertListener listener;
+        // per sensor, only touched by the thread that updates it
+        std::array<bool, MAX_N_SENSORS> raised;
+    };
+
+    // each one written by its own reader thread: a line each
+    struct alignas(64) PackedSummary
+    {
+        std::atomic<__u64> value;
+    };
 
-  public:
-    mutable std::mutex mutex_db;
+    // returns true if the rows of the shard were cleared
+    bool autoClear(Shard& shard);
+    // rescans the rows of a sensor (its shard is locked)
+    void refreshObstacles(unsigned sensorIdx);
 
   private:
     std::vector<DetectionDataVec> m_db;
-    unsigned m_callCount = 0;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::array<__u8, MAX_N_SENSORS> m_sensorShard;
+    std::vector<UpdateListener> m_listeners;
+    std::vector<ObstacleAlert> m_alerts;
+    std::atomic<__u32> m_staleMask{0};
+    PackedSummary m_obstacles[MAX_N_SENSORS];
 };
 
 } // namespace backsense
@@ -20,39 +20,95 @@
  */
 
 #include "BSFrameHandler.h"
-#include "CANUtils.h"
-#include "CANproChannel.h"
+#include "CaptureLog.h"
+#include "ChannelSupervisor.h"
 #include "DetectionGUI.h"
+#include "RadarEventLoop.h"
+#include "RadarStateBus.h"
+#include "Telemetry.h"
 
-#include <functional> // std::ref
+#include <chrono>
+#include <functional>
 #include <future>
+#include <memory>
 #include <stdexcept>
+#include <string>
 #include <thread>
-#include <utility> // std::move
 
 int main(int argc, char** argv)
 {
     static constexpr unsigned N_SENSORS = 1;
 
+    // --attach: read the state published by radar_daemon instead of opening
+    // the CAN channel
+    const bool attach = argc > 1 && std::string(argv[1]) == "--attach";
+
     try {
-        can::CANproChannel channel;
         can::backsense::RadarStateDB stateDB(N_SENSORS);
+        auto telemetryExporter = telemetry::TelemetryExporter::fromEnvironment();
+
+        std::unique_ptr<can::ChannelSupervisor> supervisor;
+        std::unique_ptr<can::backsense::RadarStateBusReader> bus;
+        std::unique_ptr<can::CaptureLogWriter> capture;
+
+        // the GUI refresh (and the bus follower, with --attach) run on the
+        // loop thread, waiting for the radar cycles
+        can::backsense::RadarEventLoop events(stateDB);
 
         std::promise<void> exitSignal;
         std::future<void> futureSignal = exitSignal.get_future();
-        std::thread readingHandler(can::CANUtils::readMsgs,
-                                   channel.getHandle(), std::ref(stateDB),
-                                   std::move(futureSignal));
+        std::thread readingHandler;
+        std::function<void()> followBus;
+
+        if (attach) {
+            bus = std::make_unique<can::backsense::RadarStateBusReader>();
+            // as RadarStateBusReader::followBus(), a snapshot is a cycle
+            followBus = [&]() {
+                using namespace std::chrono_literals;
+                if (bus->refresh(stateDB)) {
+                    events.onSnapshot();
+                }
+                events.after(5ms, followBus);
+            };
+            events.post(followBus);
+        } else {
+            // optionally record the raw traffic, e.g. for can_export
+            if (argc > 1) {
+                capture = std::make_unique<can::CaptureLogWriter>(argv[1]);
+            }
 
-        gui::DetectionGUI interface(stateDB);
+            stateDB.addUpdateListener(
+                [&events](const can::backsense::RadarStateDB&,
+                          const can::backsense::DetectionData& state) {
+                    events.onUpdate(state);
+                });
+            supervisor = std::make_unique<can::ChannelSupervisor>(
+                can::ChannelConfig::singleChannel(N_SENSORS),
+                stateDB, capture.get());
+            readingHandler = std::thread(&can::ChannelSupervisor::run,
+                                         supervisor.get(),
+                                         futureSignal.share());
+        }
+
+        std::thread eventHandler([&events]() {
+            telemetry::registerThread("gui_events");
+            events.run();
+        });
+
+        gui::DetectionGUI interface(stateDB, events);
         // blocking call
         interface.launchGUI();
 
+        events.stop();
+        eventHandler.join();
+
         // notify interruption thread
         exitSignal.set_value();
 
-        can::CANUtils::resetChip(channel.getHandle());
-        readingHandler.join();
+        if (supervisor) {
+            supervisor->interrupt();
+            readingHandler.join();
+        }
 
     } catch (std::runtime_error& ex) {
         std::cerr << "#ERROR: " << ex.what() << std::endl;
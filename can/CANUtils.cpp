@@ -19,37 +19,41 @@
  */
 
 #include "CANUtils.h"
+#include "AllocCheck.h"
 #include "BSFrameHandler.h"
 #include "CANproChannel.h"
+#include "CaptureLog.h"
+#include "IngestPipeline.h"
+#include "Telemetry.h"
+#include "Trace.h"
 
 #include <cassert>
 #include <cerrno>
 #include <cstring>
 #include <sys/poll.h>
 
+#include <algorithm>
 #include <chrono>
 #include <experimental/optional>
 #include <iomanip>
 #include <iostream>
-#include <sstream>
-
-#define DEBUG_READMSGS(MSG)                                                \
-    if (false)                                                                 \
-    std::cout << "#DEBUG: ReadMsgs Thread :::: " << MSG << std::endl
 
 #define DEBUG_RECV_DATA false
 
 using can::CANUtils;
 
 constexpr std::array<char, 16> CANUtils::m_hexMap;
+constexpr unsigned long CANUtils::WARM_UP_EVENTS;
 
 int CANUtils::readBusEvent(CAN_HANDLE can, PARAM_STRUCT& retParam)
 {
+    TRACE_SCOPE(CAN_READ);
     retParam.DataLength = 3;
     return CANL2_read_ac(can, &retParam);
 }
 
-std::string CANUtils::formatHexStr(const __u8* data, const __s32 len)
+void CANUtils::formatHexStr(const __u8* data, const __s32 len,
+                            char (&out)[HEX_STR_LEN + 1])
 {
     // input: an array of bytes, like: |100|045|099|000|253|022|009|150|
     // each byte is a __u8 type, which corresponds to a char
@@ -62,30 +66,30 @@ std::string CANUtils::formatHexStr(const __u8* data, const __s32 len)
 
     // each byte will take 3 positions in the string, like:
     // "64 2D 63 00 FD 16 09 96"
-    std::string hexData(3 * MAXLEN, ' ');
+    std::fill(out, out + HEX_STR_LEN, ' ');
+    out[HEX_STR_LEN] = '\0';
     for (unsigned i = 0; i < len; ++i) {
-        hexData[3 * i] = m_hexMap[(data[i] & 0xF0) >> 4];
-        hexData[3 * i + 1] = m_hexMap[data[i] & 0x0F];
+        out[3 * i] = m_hexMap[(data[i] & 0xF0) >> 4];
+        out[3 * i + 1] = m_hexMap[data[i] & 0x0F];
     }
-    return hexData;
 }
 
 void CANUtils::printReceivedData(int frc, const PARAM_STRUCT& param)
 {
     // for now, we are only interested in this type of frame
     if (frc == CANL2_RA_DATAFRAME) {
+        char hexData[HEX_STR_LEN + 1];
+        formatHexStr(param.RCV_data, param.DataLength, hexData);
         std::cout << "RCV STD CAN1 :::: "
                   << "ID " << std::hex << std::setfill(' ') << std::setw(5)
                   << param.Ident << " :: LEN " << param.DataLength
-                  << " :: DATA "
-                  << formatHexStr(param.RCV_data, param.DataLength)
-                  << std::endl;
+                  << " :: DATA " << hexData << std::dec << std::endl;
     } else {
         assert(false);
     }
 }
 
-static bool shouldTerminate(const std::future<void>& signal)
+static bool shouldTerminate(const std::shared_future<void>& signal)
 {
     return signal.wait_for(std::chrono::system_clock::duration::zero()) ==
            std::future_status::ready;
@@ -93,68 +97,193 @@ static bool shouldTerminate(const std::future<void>& signal)
 
 static void printDetectionData(const can::backsense::DetectionData& state)
 {
-    std::ostringstream ss;
-    state.dump(ss);
-    std::cout << ss.str();
+    // straight to the stream: no intermediate string
+    state.dump(std::cout);
+}
+
+static void setBusState(telemetry::BusGauges& gauges, const __s32 busState)
+{
+    if (gauges.busState.exchange(busState) != busState) {
+        telemetry::add(telemetry::Counter::BUS_STATE_CHANGES);
+        std::cerr << "#WARNING: CAN bus state changed to " << busState
+                  << std::endl;
+    }
+}
+
+static void updateBusHealth(telemetry::BusGauges& gauges, int frc,
+                            const PARAM_STRUCT& param)
+{
+    // the driver reports FIFO losses alongside any received event
+    if (param.RecOverrun_flag) {
+        telemetry::add(telemetry::Counter::RECEIVE_OVERRUNS);
+    }
+    if (param.RCV_fifo_lost_msg > 0) {
+        telemetry::add(telemetry::Counter::FIFO_LOST_MSGS,
+                       param.RCV_fifo_lost_msg);
+    }
+    if (frc == CANL2_RA_CHG_BUS_STATE) {
+        gauges.errorState.store(param.Error_state);
+        setBusState(gauges, param.Bus_state);
+    }
+}
+
+static bool isBusOff(const telemetry::BusGauges& gauges)
+{
+    return gauges.busState.load() == CANL2_GBS_ERROR_BUS_OFF;
 }
 
-void CANUtils::readMsgs(CAN_HANDLE channel,
-                            backsense::RadarStateDB& stateDB,
-                            std::future<void> futureSignal)
+CANUtils::ReadExit CANUtils::readMsgs(CAN_HANDLE channel,
+                                      IngestPipeline& pipeline,
+                                      std::shared_future<void> futureSignal)
 {
-    DEBUG_READMSGS("Thread start");
+    telemetry::registerThread("can_reader");
+
+    // the bus state is sampled whenever the bus is quiet for this long
+    static constexpr int BUS_STATE_POLL_MS = 100;
 
     struct pollfd can_poll;
     can_poll.fd = CANL2_handle_to_descriptor(channel);
     can_poll.events = POLLIN | POLLHUP;
 
-    backsense::FrameHandler frameHandler;
+    ReadExit exitReason = ReadExit::TERMINATED;
+    auto& gauges = telemetry::busGauges(pipeline.channelIdx());
+    unsigned long nEvents = 0;
+
+    // start from the actual state (the channel may have been reinitialized)
+    setBusState(gauges, CANL2_get_bus_state(channel));
 
     while (!shouldTerminate(futureSignal)) {
 
         int ret = 0;
 
-        DEBUG_READMSGS("Poll section");
         // wait for event on file descriptor
         while (ret <= 0) {
-            ret = poll(&can_poll, 1 /*nfds*/, -1 /*timeout*/);
+            {
+                TRACE_SCOPE(POLL_WAIT);
+                ret = poll(&can_poll, 1 /*nfds*/, BUS_STATE_POLL_MS);
+            }
 
             if (can_poll.revents & POLLHUP) {
+                // the device is gone (e.g. the USB stick was unplugged)
+                exitReason = ReadExit::HANGUP;
                 goto endthread;
             }
+            if (ret == 0) {
+                setBusState(gauges, CANL2_get_bus_state(channel));
+                if (isBusOff(gauges)) {
+                    exitReason = ReadExit::BUS_OFF;
+                    goto endthread;
+                }
+                if (shouldTerminate(futureSignal)) {
+                    goto endthread;
+                }
+            }
             if ((ret == -1) && (errno != EINTR)) {
                 std::cerr << "#Error: poll() [" << std::strerror(errno) << "]";
             }
         }
 
-        DEBUG_READMSGS("Read section");
-        // descriptor is ready to be read
+        // descriptor is ready to be read: from here to the DB update, the
+        // heap is off limits once warmed up (see AllocCheck.h)
+        alloccheck::NoAllocScope noAlloc(nEvents >= WARM_UP_EVENTS);
         PARAM_STRUCT outParam;
         while ((ret = CANUtils::readBusEvent(channel, outParam))) {
-            if (ret < 0 || shouldTerminate(futureSignal)) {
+            if (ret < 0) {
+                telemetry::add(telemetry::Counter::READ_ERRORS);
+                exitReason = ReadExit::READ_ERROR;
                 goto endthread;
             }
-
-            if (DEBUG_RECV_DATA) {
-                CANUtils::printReceivedData(ret, outParam);
+            if (shouldTerminate(futureSignal)) {
+                goto endthread;
             }
 
-            auto state = frameHandler.processRcvFrame(outParam);
-            if (state) {
-                if (DEBUG_RECV_DATA) {
-                    printDetectionData(*state);
-                }
-
-                // This is probably the most important step in this loop:
-                // we've read the raw data from the CAN bus, converted into
-                // a DetectionData object, and now we are able to update the DB,
-                // overwriting the state for the corresponding object id.
-                std::lock_guard<std::mutex> lock(stateDB.mutex_db);
-                stateDB.updateState(std::move(*state));
+            ++nEvents;
+            if (!pipeline.push(ret, outParam)) {
+                // the controller stays off the bus until it is reset
+                exitReason = ReadExit::BUS_OFF;
+                goto endthread;
             }
         }
     }
 
 endthread:
-    DEBUG_READMSGS("Thread end");
+    return exitReason;
+}
+
+// :::: class FrameIngest
+
+using can::FrameIngest;
+
+FrameIngest::FrameIngest(backsense::RadarStateDB& stateDB,
+                         CaptureLogWriter* capture, unsigned channelIdx)
+    : m_stateDB(stateDB), m_capture(capture),
+      m_gauges(telemetry::busGauges(channelIdx))
+{
+}
+
+bool FrameIngest::process(int frc, const PARAM_STRUCT& param)
+{
+    // the event that took the controller off the bus is still captured
+    const bool busOn = accept(frc, param);
+    if (auto state = decode(frc, param)) {
+        update(*state);
+    }
+    return busOn;
+}
+
+bool FrameIngest::accept(int frc, const PARAM_STRUCT& param)
+{
+    telemetry::add(telemetry::Counter::FRAMES_READ);
+    updateBusHealth(m_gauges, frc, param);
+
+    // bus state changes, error frames, etc. carry no detection
+    return frc == CANL2_RA_DATAFRAME || !isBusOff(m_gauges);
+}
+
+can::backsense::OptDetectionData
+FrameIngest::decode(int frc, const PARAM_STRUCT& param)
+{
+    if (DEBUG_RECV_DATA && frc == CANL2_RA_DATAFRAME) {
+        CANUtils::printReceivedData(frc, param);
+    }
+
+    if (m_capture) {
+        m_capture->append(frc, param);
+    }
+
+    if (frc != CANL2_RA_DATAFRAME) {
+        return {};
+    }
+    telemetry::countFrameId(param.Ident);
+
+    backsense::OptDetectionData state;
+    {
+        TRACE_SCOPE(DECODE);
+        state = m_frameHandler.processRcvFrame(param);
+    }
+    if (!state) {
+        telemetry::add(telemetry::Counter::DECODE_REJECTS);
+        return state;
+    }
+
+    if (DEBUG_RECV_DATA) {
+        printDetectionData(*state);
+    }
+    return state;
+}
+
+void FrameIngest::update(const backsense::DetectionData& state)
+{
+    // This is probably the most important step in this loop:
+    // we've read the raw data from the CAN bus, converted into
+    // a DetectionData object, and now we are able to update the DB,
+    // overwriting the state for the corresponding object id.
+    // Only the shard of this sensor is locked: the readers of
+    // the other channels carry on.
+    TRACE_SCOPE(DB_UPDATE);
+    const auto sensorIdx =
+        backsense::FrameHandler::getIndexPairFromId(state.getId()).first;
+    std::lock_guard<std::mutex> lock(m_stateDB.shardMutex(sensorIdx));
+    m_stateDB.updateState(backsense::DetectionData(state));
+    telemetry::add(telemetry::Counter::DB_UPDATES);
 }
@@ -21,6 +21,7 @@
 #ifndef __CAN_UTILS_CHANNEL_H_
 #define __CAN_UTILS_CHANNEL_H_
 
+#include "BSFrameHandler.h"
 #include "CANL2.h"
 #include "CANproChannel.h"
 
@@ -28,13 +29,16 @@
 #include <future>
 #include <string>
 
-namespace can {
+namespace telemetry {
+
+struct BusGauges;
 
-namespace backsense {
+} // namespace telemetry
 
-class RadarStateDB;
+namespace can {
 
-} // namespace backsense
+class CaptureLogWriter;
+class IngestPipeline;
 
 class CANUtils
 {
@@ -44,15 +48,25 @@ class CANUtils
 
     CANUtils() = default;
 
+    // events read before the ingest path must be allocation free (the
+    // first calls may still set up lazily initialized state)
+    static constexpr unsigned long WARM_UP_EVENTS = 1024;
+
+    // why readMsgs() returned
+    enum class ReadExit { TERMINATED, HANGUP, READ_ERROR, BUS_OFF };
+
     static int readBusEvent(CAN_HANDLE can, PARAM_STRUCT& retParam);
     static void resetChip(CAN_HANDLE can) { CANL2_reset_chip(can); }
     static void printReceivedData(int frc, const PARAM_STRUCT& param);
-    static void readMsgs(CAN_HANDLE channel,
-                           backsense::RadarStateDB& stateDB,
-                             std::future<void> futureSignal);
+    // every event read is pushed into 'pipeline' (which knows the channel
+    // and its capture log)
+    static ReadExit readMsgs(CAN_HANDLE channel, IngestPipeline& pipeline,
+                             std::shared_future<void> futureSignal);
 
-  private:
-    static std::string formatHexStr(const __u8* data, const __s32 len);
+    // "64 2d 63 00 fd 16 09 96", written into 'out' (no allocation)
+    static constexpr unsigned HEX_STR_LEN = 3 * 8;
+    static void formatHexStr(const __u8* data, const __s32 len,
+                             char (&out)[HEX_STR_LEN + 1]);
 
   private:
     static constexpr std::array<char, 16> m_hexMap{'0', '1', '2', '3', '4', '5',
@@ -60,6 +74,40 @@ class CANUtils
                                                    'c', 'd', 'e', 'f'};
 };
 
+// What happens to every event read from the bus: telemetry, capture,
+// decoding and the DB update. It is apart from readMsgs() so that the very
+// same path can be driven without a CAN channel (ingest_test). Nothing in
+// here allocates once the capture log and the telemetry of the thread are
+// set up.
+class FrameIngest
+{
+  public:
+    FrameIngest(const FrameIngest&) = delete;
+    FrameIngest& operator=(const FrameIngest&) = delete;
+
+    FrameIngest(backsense::RadarStateDB& stateDB, CaptureLogWriter* capture,
+                unsigned channelIdx);
+
+    // 'frc' and 'param' as returned by CANL2_read_ac(); returns false if
+    // the controller went bus-off
+    bool process(int frc, const PARAM_STRUCT& param);
+
+    // The steps of process(), for the stages of an IngestPipeline: each one
+    // only touches its own members, so they may run on three threads (one
+    // each). accept() takes the bus health, and returns false on a bus-off;
+    // decode() writes the capture log; update() locks the shard of the
+    // sensor.
+    bool accept(int frc, const PARAM_STRUCT& param);
+    backsense::OptDetectionData decode(int frc, const PARAM_STRUCT& param);
+    void update(const backsense::DetectionData& state);
+
+  private:
+    backsense::FrameHandler m_frameHandler;
+    backsense::RadarStateDB& m_stateDB;
+    CaptureLogWriter* m_capture;
+    telemetry::BusGauges& m_gauges;
+};
+
 } // namespace can
 
 #endif // __CAN_UTILS_CHANNEL_H_
@@ -22,6 +22,7 @@
 
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 
 static std::string getDriverErrorMsg(const int code)
@@ -31,7 +32,10 @@ static std::string getDriverErrorMsg(const int code)
 
 using can::CANproChannel;
 
-CANproChannel::CANproChannel()
+CANproChannel::CANproChannel(const AcceptanceFilter& filter,
+                             unsigned channelIdx)
+    : m_filter(filter)
+    , m_channelIdx(channelIdx)
 {
     try {
         queryChannel();
@@ -53,7 +57,7 @@ CANproChannel::~CANproChannel()
     delete m_pChannel;
 }
 
-void CANproChannel::queryChannel()
+std::vector<CHDSNAPSHOT> CANproChannel::enumerateChannels()
 {
     __u32 neededBufferSize, nChannels;
 
@@ -61,31 +65,39 @@ void CANproChannel::queryChannel()
     // buffer size
     int retCode =
         CANL2_get_all_CAN_channels(0, &neededBufferSize, &nChannels, nullptr);
-
-    std::string errorMsg;
     if (retCode) {
-        errorMsg = getDriverErrorMsg(retCode);
-    } else if (!nChannels) {
-        errorMsg = "No Softing CAN interface card is plugged in.";
-    } else if (nChannels > 1) {
-        errorMsg = "More than 1 channel found.";
+        throw std::runtime_error(getDriverErrorMsg(retCode));
     }
-
-    if (!errorMsg.empty()) {
-        throw std::runtime_error(errorMsg);
+    if (!nChannels) {
+        return {};
     }
 
-    assert(nChannels == 1);
-    assert(neededBufferSize == sizeof(*m_pChannel));
-
+    assert(neededBufferSize == nChannels * sizeof(CHDSNAPSHOT));
+    std::vector<CHDSNAPSHOT> channels(nChannels);
     const auto providedBufferSize = neededBufferSize;
 
-    // now call the function with a valid buffer size and pointer to channel
+    // now call the function with a valid buffer size and pointer to channels
     retCode = CANL2_get_all_CAN_channels(providedBufferSize, &neededBufferSize,
-                                         &nChannels, m_pChannel);
+                                         &nChannels, channels.data());
     if (retCode) {
-        errorMsg = getDriverErrorMsg(retCode);
-    } else if (m_pChannel->bIsOpen) {
+        throw std::runtime_error(getDriverErrorMsg(retCode));
+    }
+    channels.resize(nChannels);
+    return channels;
+}
+
+void CANproChannel::queryChannel()
+{
+    const auto channels = enumerateChannels();
+
+    std::string errorMsg;
+    if (channels.empty()) {
+        errorMsg = "No Softing CAN interface card is plugged in.";
+    } else if (m_channelIdx >= channels.size()) {
+        errorMsg = "CAN channel " + std::to_string(m_channelIdx) +
+                   " not found, only " + std::to_string(channels.size()) +
+                   " channel(s) available.";
+    } else if (channels[m_channelIdx].bIsOpen) {
         errorMsg = "CAN channel used by other applications.";
     }
 
@@ -93,8 +105,11 @@ void CANproChannel::queryChannel()
         throw std::runtime_error(errorMsg);
     }
 
+    *m_pChannel = channels[m_channelIdx];
     assert(m_pChannel->u32DeviceType == CANPROUSB);
-    std::cout << "\n#INFO: 1 channel was found." << std::endl;
+    std::cout << "\n#INFO: " << channels.size()
+              << " channel(s) found, using channel " << m_channelIdx << "."
+              << std::endl;
 }
 
 void CANproChannel::initializeChannel()
@@ -118,6 +133,16 @@ void CANproChannel::initializeChannel()
     m_handle = channel.ulChannelHandle;
 }
 
+void CANproChannel::reinitializeChip()
+{
+    int retCode = CANL2_reset_chip(m_handle);
+    if (retCode) {
+        throw std::runtime_error("#ERROR " + std::to_string(retCode) +
+                                 " in CANL2_reset_chip()");
+    }
+    setFifoMode();
+}
+
 void CANproChannel::setFifoMode()
 {
     setLayer2Configuration();
@@ -140,10 +165,17 @@ void CANproChannel::setLayer2Configuration()
                                        // the program is not able to read any
                                        // data from the CAN bus.
     m_l2Config.s32Sam = 0;
-    m_l2Config.s32AccCodeStd = 0;
-    m_l2Config.s32AccCodeXtd = 0;
-    m_l2Config.s32AccMaskStd = 0;
-    m_l2Config.s32AccMaskXtd = 0;
+    // only the standard frames we are interested in should reach the host
+    m_l2Config.s32AccCodeStd = m_filter.code;
+    m_l2Config.s32AccMaskStd = m_filter.mask;
+    if (m_filter.rejectExtended) {
+        // all bits relevant, matching an id nobody sends
+        m_l2Config.s32AccCodeXtd = 0x1FFFFFFF;
+        m_l2Config.s32AccMaskXtd = 0x1FFFFFFF;
+    } else {
+        m_l2Config.s32AccCodeXtd = 0;
+        m_l2Config.s32AccMaskXtd = 0;
+    }
     m_l2Config.s32OutputCtrl = 0xFA;
     m_l2Config.bEnableAck = 1;
     m_l2Config.bEnableErrorframe = 0;
@@ -157,5 +189,7 @@ void CANproChannel::printChannelInfo() const
     std::cout << "---- Serial Number: " << m_pChannel->u32Serial << "\n";
     std::cout << "---- Channel Number: " << m_pChannel->u32PhysCh << "\n";
     std::cout << "---- Open: " << m_pChannel->bIsOpen << "\n";
+    std::cout << "---- Acceptance Code/Mask: " << std::hex << "0x"
+              << m_filter.code << "/0x" << m_filter.mask << std::dec << "\n";
     std::cout << "---------------------------------------------\n";
 }
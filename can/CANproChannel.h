@@ -23,20 +23,47 @@
 
 #include "CANL2.h"
 
+#include <linux/types.h>
+
+#include <vector>
+
 namespace can {
 
+// Hardware filter for standard (11 bit) identifiers: a frame is passed to
+// the host only if its id matches 'code' in every bit set in 'mask'.
+// The default (mask 0) accepts every frame on the bus.
+struct AcceptanceFilter
+{
+    __s32 code = 0;
+    __s32 mask = 0;
+    // extended (29 bit) frames, e.g. J1939 traffic from the engine ECUs
+    bool rejectExtended = false;
+
+    bool accepts(__u32 id) const { return ((id ^ code) & mask) == 0; }
+};
+
 class CANproChannel
 {
   public:
     CANproChannel& operator=(const CANproChannel) = delete;
     CANproChannel(const CANproChannel&) = delete;
 
-    CANproChannel();
+    // opens the channel at 'channelIdx' in the list of enumerateChannels()
+    explicit CANproChannel(const AcceptanceFilter& filter = AcceptanceFilter(),
+                           unsigned channelIdx = 0);
     ~CANproChannel();
 
+    // every CAN channel of the Softing cards plugged in (e.g. the two
+    // channels of a dual channel CANpro USB)
+    static std::vector<CHDSNAPSHOT> enumerateChannels();
+
     void printChannelInfo() const;
     CAN_HANDLE getHandle() const { return m_handle; }
 
+    // resets the CAN controller and restores the FIFO mode configuration:
+    // a controller in bus-off only rejoins the bus after a reset
+    void reinitializeChip();
+
   private:
     void initializeChannel();
     void queryChannel();
@@ -46,6 +73,8 @@ class CANproChannel
   private:
     CAN_HANDLE m_handle;
     L2CONFIG m_l2Config;
+    AcceptanceFilter m_filter;
+    unsigned m_channelIdx;
     CHDSNAPSHOT* m_pChannel{new CHDSNAPSHOT};
 };
 
@@ -0,0 +1,152 @@
+/*
+ *   Raw capture log of the frames read from the CAN bus.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CaptureLog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr char CAPTURE_MAGIC[8] = {'B', 'S', 'C', 'A', 'P', 'T', 'R', 0};
+static constexpr __u32 CAPTURE_VERSION = 1;
+
+// records are written in blocks of 2048 (64 KiB)
+static constexpr size_t WRITE_BLOCK = 2048;
+
+using can::CaptureLogReader;
+using can::CaptureLogWriter;
+
+void can::toParam(const CaptureRecord& record, PARAM_STRUCT& param)
+{
+    param.Ident = record.ident;
+    param.Time = record.canTime;
+    param.DataLength = record.dataLength;
+    std::memcpy(param.RCV_data, record.data, sizeof(record.data));
+}
+
+// :::: class CaptureLogWriter
+
+CaptureLogWriter::CaptureLogWriter(const std::string& path)
+{
+    m_file = std::fopen(path.c_str(), "wb");
+    if (!m_file) {
+        throw std::runtime_error("Can't create capture log \"" + path + "\".");
+    }
+
+    CaptureFileHeader header{};
+    std::memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.recordSize = sizeof(CaptureRecord);
+    std::fwrite(&header, sizeof(header), 1, m_file);
+
+    m_buffer.reserve(WRITE_BLOCK);
+}
+
+CaptureLogWriter::~CaptureLogWriter()
+{
+    flush();
+    std::fclose(m_file);
+}
+
+__u64 CaptureLogWriter::hostTimeNs()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void CaptureLogWriter::append(int frameType, const PARAM_STRUCT& param)
+{
+    CaptureRecord record{};
+    record.hostTimeNs = hostTimeNs();
+    record.canTime = param.Time;
+    record.ident = param.Ident;
+    record.frameType = frameType;
+    record.dataLength = std::min<__s32>(std::max<__s32>(param.DataLength, 0),
+                                        sizeof(record.data));
+    std::memcpy(record.data, param.RCV_data, sizeof(record.data));
+    append(record);
+}
+
+void CaptureLogWriter::append(const CaptureRecord& record)
+{
+    m_buffer.push_back(record);
+    m_nRecords.store(m_nRecords.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    if (m_buffer.size() == WRITE_BLOCK) {
+        flush();
+    }
+}
+
+void CaptureLogWriter::flush()
+{
+    if (!m_buffer.empty()) {
+        std::fwrite(m_buffer.data(), sizeof(CaptureRecord), m_buffer.size(),
+                    m_file);
+        m_buffer.clear();
+    }
+    std::fflush(m_file);
+}
+
+// :::: class CaptureLogReader
+
+CaptureLogReader::CaptureLogReader(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open capture log \"" + path + "\".");
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    m_mapSize = st.st_size;
+
+    if (m_mapSize < sizeof(CaptureFileHeader)) {
+        close(fd);
+        throw std::runtime_error("Capture log \"" + path + "\" is truncated.");
+    }
+
+    m_map = mmap(nullptr, m_mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED) {
+        throw std::runtime_error("Can't map capture log \"" + path + "\".");
+    }
+    // the log is always read front to back
+    madvise(m_map, m_mapSize, MADV_SEQUENTIAL);
+
+    auto header = static_cast<const CaptureFileHeader*>(m_map);
+    if (std::memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) ||
+        header->version != CAPTURE_VERSION ||
+        header->recordSize != sizeof(CaptureRecord)) {
+        munmap(m_map, m_mapSize);
+        throw std::runtime_error("\"" + path + "\" is not a capture log.");
+    }
+
+    m_records = reinterpret_cast<const CaptureRecord*>(header + 1);
+    m_nRecords = (m_mapSize - sizeof(CaptureFileHeader)) / sizeof(CaptureRecord);
+}
+
+CaptureLogReader::~CaptureLogReader() { munmap(m_map, m_mapSize); }
@@ -0,0 +1,114 @@
+/*
+ *   Raw capture log of the frames read from the CAN bus.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _CAPTURE_LOG_H_
+#define _CAPTURE_LOG_H_
+
+#include "CANL2.h" // PARAM_STRUCT
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace can {
+
+#pragma pack(1)
+
+// one record per frame read from the bus, exactly as returned by the driver
+struct CaptureRecord
+{
+    __u64 hostTimeNs; // steady clock of the host, in nanoseconds
+    __u32 canTime;    // PARAM_STRUCT::Time, as stamped by the adapter
+    __u32 ident;
+    __s32 frameType; // return code of CANL2_read_ac()
+    __u8 dataLength;
+    __u8 reserved[3];
+    __u8 data[8];
+};
+
+struct CaptureFileHeader
+{
+    char magic[8];
+    __u32 version;
+    __u32 recordSize;
+};
+
+#pragma pack()
+
+static_assert(sizeof(CaptureRecord) == 32, "unexpected record layout");
+
+// the record back into what the driver returned (e.g. to replay it)
+void toParam(const CaptureRecord& record, PARAM_STRUCT& param);
+
+class CaptureLogWriter
+{
+  public:
+    CaptureLogWriter(const CaptureLogWriter&) = delete;
+    CaptureLogWriter& operator=(const CaptureLogWriter&) = delete;
+
+    explicit CaptureLogWriter(const std::string& path);
+    ~CaptureLogWriter();
+
+    void append(int frameType, const PARAM_STRUCT& param);
+    void append(const CaptureRecord& record);
+    void flush();
+
+    // records appended so far; from any thread
+    __u64 recordCount() const
+    {
+        return m_nRecords.load(std::memory_order_relaxed);
+    }
+
+    static __u64 hostTimeNs();
+
+  private:
+    std::FILE* m_file = nullptr;
+    std::vector<CaptureRecord> m_buffer;
+    std::atomic<__u64> m_nRecords{0}; // one writer: a plain load and store
+};
+
+// maps the whole log read-only: records are accessed in place
+class CaptureLogReader
+{
+  public:
+    CaptureLogReader(const CaptureLogReader&) = delete;
+    CaptureLogReader& operator=(const CaptureLogReader&) = delete;
+
+    explicit CaptureLogReader(const std::string& path);
+    ~CaptureLogReader();
+
+    size_t size() const { return m_nRecords; }
+    const CaptureRecord* begin() const { return m_records; }
+    const CaptureRecord* end() const { return m_records + m_nRecords; }
+    const CaptureRecord& operator[](size_t i) const { return m_records[i]; }
+
+  private:
+    void* m_map = nullptr;
+    size_t m_mapSize = 0;
+    const CaptureRecord* m_records = nullptr;
+    size_t m_nRecords = 0;
+};
+
+} // namespace can
+
+#endif // _CAPTURE_LOG_H_
@@ -0,0 +1,301 @@
+/*
+ *   Keeps the CAN channel alive: recovers from bus-off, driver errors and
+ *   USB hangups, feeding the same state DB all along.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ChannelSupervisor.h"
+#include "BSFrameHandler.h"
+#include "Telemetry.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+static bool shouldTerminate(const std::shared_future<void>& signal)
+{
+    return signal.wait_for(std::chrono::seconds::zero()) ==
+           std::future_status::ready;
+}
+
+static const char* describe(can::CANUtils::ReadExit reason)
+{
+    using ReadExit = can::CANUtils::ReadExit;
+    switch (reason) {
+    case ReadExit::HANGUP:
+        return "device hangup";
+    case ReadExit::READ_ERROR:
+        return "driver read error";
+    case ReadExit::BUS_OFF:
+        return "bus-off";
+    default:
+        return "terminated";
+    }
+}
+
+using can::ChannelConfig;
+using can::ChannelSupervisor;
+
+// :::: struct ChannelConfig
+
+ChannelConfig ChannelConfig::singleChannel(unsigned nSensors)
+{
+    ChannelConfig config;
+    for (unsigned i = 0; i < nSensors; ++i) {
+        config.sensors.push_back(i);
+    }
+    return config;
+}
+
+ChannelConfig ChannelConfig::parse(const std::string& spec)
+{
+    ChannelConfig config;
+    std::istringstream in(spec);
+    char sep = 0;
+
+    auto fail = [&spec]() {
+        throw std::runtime_error("Invalid channel configuration \"" + spec +
+                                 "\", expected "
+                                 "<channel>:<sensor>[,<sensor>...][@<cpu>].");
+    };
+
+    if (!(in >> config.channelIdx) || !(in >> sep) || sep != ':') {
+        fail();
+    }
+    do {
+        unsigned sensorIdx;
+        if (!(in >> sensorIdx) || sensorIdx >= backsense::MAX_N_SENSORS) {
+            fail();
+        }
+        config.sensors.push_back(sensorIdx);
+    } while (in >> sep && sep == ',');
+
+    if (in && sep == '@') {
+        if (!(in >> config.cpu) || config.cpu < 0) {
+            fail();
+        }
+    } else if (in) {
+        fail();
+    }
+    return config;
+}
+
+constexpr std::chrono::milliseconds ChannelSupervisor::MIN_BACKOFF;
+constexpr std::chrono::milliseconds ChannelSupervisor::MAX_BACKOFF;
+
+// :::: class ChannelSupervisor
+
+ChannelSupervisor::ChannelSupervisor(const ChannelConfig& config,
+                                     backsense::RadarStateDB& stateDB,
+                                     CaptureLogWriter* capture)
+    : m_config(config)
+    , m_filter(backsense::FrameHandler::acceptanceFilter(config.sensors))
+    , m_stateDB(stateDB)
+    , m_pipeline(stateDB, capture, config.channelIdx, config.layout)
+{
+    // nothing is known until the channel is up
+    for (auto sensorIdx : m_config.sensors) {
+        m_stateDB.setSensorStale(sensorIdx, true);
+    }
+    auto& gauges = telemetry::busGauges(m_config.channelIdx);
+    gauges.inUse.store(true);
+    gauges.channelOnline.store(0);
+}
+
+ChannelSupervisor::~ChannelSupervisor() = default;
+
+void ChannelSupervisor::addStateListener(StateListener listener)
+{
+    m_listeners.push_back(std::move(listener));
+}
+
+void ChannelSupervisor::run(std::shared_future<void> futureSignal)
+{
+    using Clock = std::chrono::steady_clock;
+
+    const auto threadName = "can_reader" + std::to_string(m_config.channelIdx);
+    telemetry::registerThread(threadName.c_str());
+    pinThread();
+
+    auto backoff = MIN_BACKOFF;
+
+    while (!shouldTerminate(futureSignal)) {
+        if (!m_channel) {
+            if (!openChannel()) {
+                // the card is not there (yet): retry, backing off up to
+                // MAX_BACKOFF, but leave as soon as the signal is set
+                futureSignal.wait_for(backoff);
+                backoff = std::min(backoff * 2, MAX_BACKOFF);
+                continue;
+            }
+        }
+
+        // still stale: what the DB holds is from before the fault, until
+        // the first frame read
+        m_pipeline.onNextDataFrame([this]() { onDataFlowing(); });
+
+        const auto framesBefore = m_pipeline.dataFrames();
+        const auto reason = CANUtils::readMsgs(m_channel->getHandle(),
+                                               m_pipeline, futureSignal);
+        if (reason == CANUtils::ReadExit::TERMINATED ||
+            shouldTerminate(futureSignal)) {
+            break;
+        }
+
+        // a blackout lasts from the first fault on, until frames flow again
+        if (!m_recovering) {
+            m_faultTime = Clock::now();
+            m_recovering = true;
+        }
+        setOnline(false);
+        std::cerr << "#WARNING: CAN channel " << m_config.channelIdx
+                  << " lost (" << describe(reason)
+                  << "), recovering." << std::endl;
+
+        // Only a channel that received frames since the last fault starts
+        // over from MIN_BACKOFF (and is recovered right away): a persistent
+        // fault (e.g. bus-off after bus-off, with bad wiring or termination)
+        // is retried less and less often.
+        auto delay = std::chrono::milliseconds::zero();
+        if (m_pipeline.dataFrames() != framesBefore) {
+            backoff = MIN_BACKOFF;
+        } else {
+            delay = backoff;
+            backoff = std::min(backoff * 2, MAX_BACKOFF);
+        }
+        if (!recover(reason, delay, futureSignal)) {
+            std::lock_guard<std::mutex> lock(m_channelMutex);
+            m_channel.reset();
+        }
+    }
+}
+
+bool ChannelSupervisor::recover(CANUtils::ReadExit reason,
+                                std::chrono::milliseconds delay,
+                                const std::shared_future<void>& futureSignal)
+{
+    if (delay.count()) {
+        futureSignal.wait_for(delay);
+    }
+
+    // A bus-off is a fault of the controller only: resetting it is enough,
+    // and much faster than reopening the channel. Anything else means the
+    // device itself is in trouble.
+    if (reason != CANUtils::ReadExit::BUS_OFF ||
+        shouldTerminate(futureSignal)) {
+        return false;
+    }
+
+    try {
+        std::lock_guard<std::mutex> lock(m_channelMutex);
+        m_channel->reinitializeChip();
+        return true;
+    } catch (std::runtime_error& ex) {
+        std::cerr << "#WARNING: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+bool ChannelSupervisor::openChannel()
+{
+    try {
+        auto channel =
+            std::make_unique<CANproChannel>(m_filter, m_config.channelIdx);
+        std::lock_guard<std::mutex> lock(m_channelMutex);
+        m_channel = std::move(channel);
+        m_lastOpenError.clear();
+        return true;
+    } catch (std::runtime_error& ex) {
+        // only the first failure in a row is reported: the card may take a
+        // while to come back
+        if (m_lastOpenError != ex.what()) {
+            m_lastOpenError = ex.what();
+            std::cerr << "#WARNING: Can't open CAN channel "
+                      << m_config.channelIdx << ": "
+                      << m_lastOpenError << " Retrying." << std::endl;
+        }
+        return false;
+    }
+}
+
+void ChannelSupervisor::onDataFlowing()
+{
+    setOnline(true);
+    if (!m_recovering) {
+        return;
+    }
+    m_recovering = false;
+
+    const auto blackout =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - m_faultTime);
+    telemetry::busGauges(m_config.channelIdx)
+        .lastBlackoutUs.store(blackout.count());
+    telemetry::add(telemetry::Counter::CHANNEL_RECOVERIES);
+    std::cout << "#INFO: CAN channel " << m_config.channelIdx
+              << " recovered after " << blackout.count() / 1000.0 << " ms."
+              << std::endl;
+}
+
+void ChannelSupervisor::setOnline(bool online)
+{
+    if (online == m_online) {
+        return;
+    }
+    m_online = online;
+    for (auto sensorIdx : m_config.sensors) {
+        m_stateDB.setSensorStale(sensorIdx, !online);
+    }
+    telemetry::busGauges(m_config.channelIdx).channelOnline.store(online);
+
+    for (auto& listener : m_listeners) {
+        listener(online);
+    }
+}
+
+void ChannelSupervisor::interrupt()
+{
+    std::lock_guard<std::mutex> lock(m_channelMutex);
+    if (m_channel) {
+        CANUtils::resetChip(m_channel->getHandle());
+    }
+}
+
+void ChannelSupervisor::pinThread()
+{
+    if (m_config.cpu < 0) {
+        return;
+    }
+
+    // the reader of each channel keeps its core (and its caches) for itself
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(m_config.cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err) {
+        std::cerr << "#WARNING: Can't pin the reader of CAN channel "
+                  << m_config.channelIdx << " to core " << m_config.cpu
+                  << ": " << std::strerror(err) << std::endl;
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ *   Keeps the CAN channel alive: recovers from bus-off, driver errors and
+ *   USB hangups, feeding the same state DB all along.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _CHANNEL_SUPERVISOR_H_
+#define _CHANNEL_SUPERVISOR_H_
+
+#include "CANUtils.h"
+#include "CANproChannel.h"
+#include "IngestPipeline.h"
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace can {
+
+// which sensors are wired to one CAN channel, and where its reader runs
+struct ChannelConfig
+{
+    unsigned channelIdx = 0; // in CANproChannel::enumerateChannels()
+    std::vector<unsigned> sensors;
+    int cpu = -1; // core the reader thread is pinned to, -1 for any
+    PipelineLayout layout; // the threads of the stages after the reader
+
+    // channel 0, with the first 'nSensors' sensors
+    static ChannelConfig singleChannel(unsigned nSensors);
+
+    // "<channel>:<sensor>[,<sensor>...][@<cpu>]", e.g. "1:4,5,6,7@3"
+    static ChannelConfig parse(const std::string& spec);
+};
+
+class CaptureLogWriter;
+
+namespace backsense {
+
+class RadarStateDB;
+
+} // namespace backsense
+
+class ChannelSupervisor
+{
+  public:
+    ChannelSupervisor(const ChannelSupervisor&) = delete;
+    ChannelSupervisor& operator=(const ChannelSupervisor&) = delete;
+
+    ChannelSupervisor(const ChannelConfig& config,
+                      backsense::RadarStateDB& stateDB,
+                      CaptureLogWriter* capture = nullptr);
+    ~ChannelSupervisor();
+
+    // called from the supervisor thread whenever the channel goes up/down
+    using StateListener = std::function<void(bool online)>;
+    void addStateListener(StateListener listener);
+
+    // Blocking: reads the bus until the signal is set. On a fault the DB is
+    // marked stale and the channel is brought back, retrying with an
+    // exponential backoff until frames are received again. The channel is
+    // only online (and its sensors no longer stale) once its frames flow:
+    // an open channel on a silent bus is no fresher than a closed one.
+    void run(std::shared_future<void> futureSignal);
+
+    // wakes up a blocked read, to speed up the termination
+    void interrupt();
+
+    // where the frames read go, e.g. to add sinks before run()
+    IngestPipeline& pipeline() { return m_pipeline; }
+
+  private:
+    // after 'delay', resets the controller; returns false if the channel
+    // must be reopened instead
+    bool recover(CANUtils::ReadExit reason, std::chrono::milliseconds delay,
+                 const std::shared_future<void>& futureSignal);
+    bool openChannel();
+    // the first data frame since the channel was (re)opened
+    void onDataFlowing();
+    void setOnline(bool online);
+    void pinThread();
+
+  private:
+    static constexpr std::chrono::milliseconds MIN_BACKOFF{10};
+    static constexpr std::chrono::milliseconds MAX_BACKOFF{2000};
+
+    ChannelConfig m_config;
+    AcceptanceFilter m_filter;
+    backsense::RadarStateDB& m_stateDB;
+    IngestPipeline m_pipeline;
+
+    std::mutex m_channelMutex;
+    std::unique_ptr<CANproChannel> m_channel;
+    std::vector<StateListener> m_listeners;
+    bool m_online = false;
+    std::string m_lastOpenError;
+
+    // reader thread only: from the first fault to the next data frame
+    bool m_recovering = false;
+    std::chrono::steady_clock::time_point m_faultTime;
+};
+
+} // namespace can
+
+#endif // _CHANNEL_SUPERVISOR_H_
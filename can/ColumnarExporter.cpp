@@ -0,0 +1,536 @@
+/*
+ *   Exports decoded detections into a self-describing columnar file.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ColumnarExporter.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+static constexpr char COLUMNAR_MAGIC[8] = {'B', 'S', 'C', 'O', 'L', 'M', 'N', 0};
+static constexpr __u32 COLUMNAR_VERSION = 1;
+
+template <typename T> static const __u8* getRaw(const __u8* in, T& value)
+{
+    std::memcpy(&value, in, sizeof(T));
+    return in + sizeof(T);
+}
+
+// as getRaw(), for the footer: throws rather than read past 'end'
+template <typename T>
+static const __u8* getChecked(const __u8* in, const __u8* end, T& value)
+{
+    if (static_cast<size_t>(end - in) < sizeof(T)) {
+        throw std::runtime_error("truncated footer");
+    }
+    return getRaw(in, value);
+}
+
+// :::: class ColumnarWriter
+
+using can::columnar::ColumnarWriter;
+
+ColumnarWriter::ColumnarWriter(const std::string& path,
+                               std::vector<ColumnBufferBase*> columns,
+                               const ExportOptions& opts)
+    : m_path(path)
+    , m_columns(std::move(columns))
+    , m_opts(opts)
+{
+    m_file = std::fopen(path.c_str(), "wb");
+    if (!m_file) {
+        throw std::runtime_error("Can't create columnar file \"" + path +
+                                 "\".");
+    }
+    // large stdio buffer: chunks are written in a few big sequential writes
+    std::setvbuf(m_file, nullptr, _IOFBF, 1 << 20);
+
+    m_scratch.reserve(m_opts.chunkRows * sizeof(__u64));
+
+    write(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+    write(&COLUMNAR_VERSION, sizeof(COLUMNAR_VERSION));
+    m_offset = sizeof(COLUMNAR_MAGIC) + sizeof(COLUMNAR_VERSION);
+}
+
+ColumnarWriter::~ColumnarWriter()
+{
+    try {
+        finish();
+    } catch (std::runtime_error& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+    }
+    std::fclose(m_file);
+}
+
+void ColumnarWriter::write(const void* data, size_t size)
+{
+    if (size && std::fwrite(data, 1, size, m_file) != size) {
+        // the file is unusable: don't write a footer to it
+        m_finished = true;
+        throw std::runtime_error("Can't write columnar file \"" + m_path +
+                                 "\".");
+    }
+}
+
+void ColumnarWriter::flushChunk()
+{
+    assert(!m_finished);
+    const size_t nRows = m_columns.front()->size();
+    if (!nRows) {
+        return;
+    }
+
+    for (auto column : m_columns) {
+        assert(column->size() == nRows);
+
+        m_scratch.clear();
+        auto encoding = column->encode(m_scratch, m_opts);
+        write(m_scratch.data(), m_scratch.size());
+
+        m_chunkInfo.push_back({m_offset, static_cast<__u32>(m_scratch.size()),
+                               encoding, column->stats()});
+        m_offset += m_scratch.size();
+        column->clear();
+    }
+    m_chunkRows.push_back(nRows);
+}
+
+void ColumnarWriter::finish()
+{
+    if (m_finished) {
+        return;
+    }
+    flushChunk();
+    m_finished = true;
+
+    using detail::putRaw;
+    std::vector<__u8> footer;
+
+    putRaw(footer, static_cast<__u32>(m_columns.size()));
+    for (auto column : m_columns) {
+        putRaw(footer, column->type());
+        putRaw(footer, static_cast<__u8>(column->name().size()));
+        footer.insert(footer.end(), column->name().begin(),
+                      column->name().end());
+    }
+
+    putRaw(footer, static_cast<__u32>(m_chunkRows.size()));
+    auto info = m_chunkInfo.begin();
+    for (auto nRows : m_chunkRows) {
+        putRaw(footer, nRows);
+        for (size_t i = 0; i < m_columns.size(); ++i, ++info) {
+            putRaw(footer, info->offset);
+            putRaw(footer, info->size);
+            putRaw(footer, info->encoding);
+            putRaw(footer, info->stats.min);
+            putRaw(footer, info->stats.max);
+        }
+    }
+
+    putRaw(footer, m_offset);
+    footer.insert(footer.end(), COLUMNAR_MAGIC,
+                  COLUMNAR_MAGIC + sizeof(COLUMNAR_MAGIC));
+    write(footer.data(), footer.size());
+    if (std::fflush(m_file) != 0) {
+        throw std::runtime_error("Can't write columnar file \"" + m_path +
+                                 "\".");
+    }
+}
+
+// :::: class ColumnarReader
+
+using can::columnar::ColumnarReader;
+
+ColumnarReader::ColumnarReader(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open columnar file \"" + path + "\".");
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    m_mapSize = st.st_size;
+
+    constexpr size_t minSize = 2 * sizeof(COLUMNAR_MAGIC) + sizeof(__u64);
+    if (m_mapSize < minSize) {
+        close(fd);
+        throw std::runtime_error("\"" + path + "\" is not a columnar file.");
+    }
+
+    void* map = mmap(nullptr, m_mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("Can't map columnar file \"" + path + "\".");
+    }
+    m_map = static_cast<const __u8*>(map);
+
+    const __u8* trailer = m_map + m_mapSize - sizeof(COLUMNAR_MAGIC);
+    if (std::memcmp(m_map, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) ||
+        std::memcmp(trailer, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC))) {
+        munmap(map, m_mapSize);
+        throw std::runtime_error("\"" + path + "\" is not a columnar file.");
+    }
+
+    try {
+        readFooter(trailer - sizeof(__u64));
+    } catch (std::runtime_error&) {
+        // a truncated or corrupt file: nothing in it can be trusted
+        munmap(map, m_mapSize);
+        throw std::runtime_error("\"" + path +
+                                 "\" is a corrupt columnar file.");
+    }
+}
+
+void ColumnarReader::readFooter(const __u8* end)
+{
+    // the chunks lie between the header and the footer
+    const __u64 dataStart = sizeof(COLUMNAR_MAGIC) + sizeof(COLUMNAR_VERSION);
+    __u64 footerOffset;
+    getRaw(end, footerOffset);
+    if (footerOffset < dataStart ||
+        footerOffset > static_cast<__u64>(end - m_map)) {
+        throw std::runtime_error("bad footer offset");
+    }
+    const __u8* in = m_map + footerOffset;
+
+    __u32 nColumns;
+    in = getChecked(in, end, nColumns);
+    for (__u32 i = 0; i < nColumns; ++i) {
+        ColumnInfo column;
+        __u8 nameLen;
+        in = getChecked(in, end, column.type);
+        in = getChecked(in, end, nameLen);
+        if (end - in < nameLen) {
+            throw std::runtime_error("truncated footer");
+        }
+        column.name.assign(reinterpret_cast<const char*>(in), nameLen);
+        in += nameLen;
+        m_columns.push_back(std::move(column));
+    }
+
+    __u32 nChunks;
+    in = getChecked(in, end, nChunks);
+    const size_t chunkSize =
+        sizeof(__u32) + nColumns * (sizeof(ChunkColumnInfo::offset) +
+                                    sizeof(ChunkColumnInfo::size) +
+                                    sizeof(ChunkColumnInfo::encoding) +
+                                    sizeof(ColumnStats));
+    if (nChunks > static_cast<size_t>(end - in) / chunkSize) {
+        throw std::runtime_error("truncated footer");
+    }
+    m_chunkRows.reserve(nChunks);
+    m_chunkInfo.reserve(nChunks * nColumns);
+    for (__u32 i = 0; i < nChunks; ++i) {
+        __u32 nRows;
+        in = getChecked(in, end, nRows);
+        m_chunkRows.push_back(nRows);
+        for (__u32 j = 0; j < nColumns; ++j) {
+            ChunkColumnInfo ci;
+            in = getChecked(in, end, ci.offset);
+            in = getChecked(in, end, ci.size);
+            in = getChecked(in, end, ci.encoding);
+            in = getChecked(in, end, ci.stats.min);
+            in = getChecked(in, end, ci.stats.max);
+            if (ci.offset < dataStart || ci.offset > footerOffset ||
+                ci.size > footerOffset - ci.offset) {
+                throw std::runtime_error("chunk out of the file");
+            }
+            m_chunkInfo.push_back(ci);
+        }
+    }
+}
+
+ColumnarReader::~ColumnarReader()
+{
+    munmap(const_cast<__u8*>(m_map), m_mapSize);
+}
+
+int ColumnarReader::columnIndex(const std::string& name) const
+{
+    for (size_t i = 0; i < m_columns.size(); ++i) {
+        if (m_columns[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+can::columnar::ColumnStats ColumnarReader::stats(size_t chunk,
+                                                 size_t column) const
+{
+    return info(chunk, column).stats;
+}
+
+can::columnar::Encoding ColumnarReader::encoding(size_t chunk,
+                                                 size_t column) const
+{
+    return info(chunk, column).encoding;
+}
+
+// :::: class DetectionExporter
+
+using can::DetectionExporter;
+
+DetectionExporter::DetectionExporter(const std::string& path,
+                                     const columnar::ExportOptions& opts)
+    : m_opts(opts)
+    , m_timestamp("timestamp_ns", opts.chunkRows)
+    , m_sensor("sensor", opts.chunkRows)
+    , m_object("object", opts.chunkRows)
+    , m_radius("radius_m", opts.chunkRows)
+    , m_angle("angle_deg", opts.chunkRows)
+    , m_x("x_m", opts.chunkRows)
+    , m_y("y_m", opts.chunkRows)
+    , m_speed("speed_kmh", opts.chunkRows)
+    , m_power("power_db", opts.chunkRows)
+    , m_flags("flags", opts.chunkRows)
+    , m_writer(path, schema(), opts)
+{
+    m_decoded.resize(BATCH_ROWS);
+}
+
+std::vector<can::columnar::ColumnBufferBase*> DetectionExporter::schema()
+{
+    return {&m_timestamp, &m_sensor, &m_object, &m_radius, &m_angle,
+            &m_x,         &m_y,      &m_speed,  &m_power,  &m_flags};
+}
+
+bool DetectionExporter::append(const CaptureRecord& record)
+{
+    if (record.frameType != CANL2_RA_DATAFRAME ||
+        record.dataLength != backsense::N_BYTES ||
+        !m_frameHandler.isDetectionObjectId(record.ident)) {
+        return false;
+    }
+
+    // the signals are decoded later, by batches; what only depends on the
+    // id is appended right away
+    auto idxPair = backsense::FrameHandler::getIndexPairFromId(record.ident);
+    m_timestamp.append(record.hostTimeNs);
+    m_sensor.append(idxPair.first);
+    m_object.append(idxPair.second);
+    std::memcpy(&m_payloads[m_pending * backsense::N_BYTES], record.data,
+                backsense::N_BYTES);
+
+    // a batch never crosses a chunk boundary
+    if (++m_pending == BATCH_ROWS ||
+        (m_rows + m_pending) % m_opts.chunkRows == 0) {
+        flushPending();
+    }
+    return true;
+}
+
+void DetectionExporter::flushPending()
+{
+    if (!m_pending) {
+        return;
+    }
+
+    m_decoder.decode(m_payloads.data(), backsense::N_BYTES, m_pending,
+                     m_decoded);
+    m_angle.append(m_decoded.angle.data(), m_pending);
+    m_power.append(m_decoded.power.data(), m_pending);
+    for (size_t i = 0; i < m_pending; ++i) {
+        // the file keeps floats: this is where the fixed point values leave
+        m_radius.append(m_decoded.radius[i].toFloat());
+        m_x.append(m_decoded.x[i].toFloat());
+        m_y.append(m_decoded.y[i].toFloat());
+        m_speed.append(m_decoded.speed[i].toFloat());
+        m_flags.append((m_decoded.objectId[i] << 5) |
+                       (m_decoded.appearance[i] << 4) |
+                       (m_decoded.trigger[i] << 1) | m_decoded.detection[i]);
+    }
+
+    m_rows += m_pending;
+    m_pending = 0;
+    if (m_rows % m_opts.chunkRows == 0) {
+        m_writer.flushChunk();
+    }
+}
+
+void DetectionExporter::finish()
+{
+    flushPending();
+    m_writer.finish();
+}
+
+// :::: class SignalExporter
+
+using can::SignalExporter;
+
+SignalExporter::SignalExporter(const std::string& path,
+                               const dbc::SignalDatabase& db,
+                               const columnar::ExportOptions& opts)
+    : m_db(db)
+    , m_opts(opts)
+    , m_timestamp("timestamp_ns", opts.chunkRows)
+    , m_frameId("frame_id", opts.chunkRows)
+    , m_writer(path, schema(), opts)
+{
+}
+
+static bool sameOps(const can::dbc::MessageLayout& a,
+                    const can::dbc::MessageLayout& b)
+{
+    return std::equal(a.ops().begin(), a.ops().end(), b.ops().begin(),
+                      b.ops().end(), [](const auto& x, const auto& y) {
+                          return x.mask == y.mask && x.signBit == y.signBit &&
+                                 x.scale == y.scale && x.offset == y.offset &&
+                                 x.shift == y.shift &&
+                                 x.bigEndian == y.bigEndian;
+                      });
+}
+
+std::vector<can::columnar::ColumnBufferBase*> SignalExporter::schema()
+{
+    std::vector<columnar::ColumnBufferBase*> columns = {&m_timestamp,
+                                                        &m_frameId};
+    std::unordered_map<std::string, size_t> byName;
+    size_t maxSignals = 0;
+
+    for (const auto& msg : m_db.messages()) {
+        std::vector<size_t> columnOf;
+        for (const auto& signal : msg.signals()) {
+            auto it = byName.find(signal.name);
+            if (it == byName.end()) {
+                it = byName.emplace(signal.name, m_signals.size()).first;
+                m_signals.push_back(
+                    std::make_unique<columnar::ColumnBuffer<float>>(
+                        signal.name, m_opts.chunkRows));
+                columns.push_back(m_signals.back().get());
+            }
+            columnOf.push_back(it->second);
+        }
+        maxSignals = std::max(maxSignals, msg.signalCount());
+
+        size_t group = 0;
+        while (group < m_layoutOf.size() &&
+               !(m_columnOf[group] == columnOf &&
+                 sameOps(*m_layoutOf[group], msg))) {
+            ++group;
+        }
+        if (group == m_layoutOf.size()) {
+            m_layoutOf.push_back(&msg);
+            m_columnOf.push_back(std::move(columnOf));
+        }
+        m_groupOf.push_back(group);
+    }
+
+    const size_t chunkRows = m_opts.chunkRows;
+    m_payloads.resize(chunkRows * dbc::MAX_PAYLOAD);
+    m_rowGroup.resize(chunkRows);
+    m_rowsOf.resize(m_layoutOf.size());
+    m_gathered.resize(chunkRows * dbc::MAX_PAYLOAD);
+    m_values.resize(maxSignals * chunkRows);
+    m_staged.resize(m_signals.size());
+    return columns;
+}
+
+bool SignalExporter::append(const CaptureRecord& record)
+{
+    if (record.frameType != CANL2_RA_DATAFRAME) {
+        return false;
+    }
+    const auto msg = m_db.find(record.ident);
+    if (!msg || record.dataLength < msg->dlc()) {
+        return false;
+    }
+
+    // the signals are decoded when the chunk is full; what only depends on
+    // the record is appended right away
+    m_timestamp.append(record.hostTimeNs);
+    m_frameId.append(record.ident);
+    std::memcpy(&m_payloads[m_pending * dbc::MAX_PAYLOAD], record.data,
+                dbc::MAX_PAYLOAD);
+    m_rowGroup[m_pending] = m_groupOf[msg - m_db.messages().data()];
+
+    if (++m_pending == m_opts.chunkRows) {
+        flushPending();
+    }
+    return true;
+}
+
+void SignalExporter::flushPending()
+{
+    if (!m_pending) {
+        return;
+    }
+
+    for (auto& rows : m_rowsOf) {
+        rows.clear();
+    }
+    for (size_t i = 0; i < m_pending; ++i) {
+        m_rowsOf[m_rowGroup[i]].push_back(i);
+    }
+    // a signal a message doesn't have is NaN in its rows
+    for (auto& column : m_staged) {
+        column.assign(m_pending, NAN);
+    }
+
+    for (size_t g = 0; g < m_layoutOf.size(); ++g) {
+        const auto& rows = m_rowsOf[g];
+        if (rows.empty()) {
+            continue;
+        }
+        const size_t n = rows.size();
+        for (size_t i = 0; i < n; ++i) {
+            std::memcpy(&m_gathered[i * dbc::MAX_PAYLOAD],
+                        &m_payloads[rows[i] * dbc::MAX_PAYLOAD],
+                        dbc::MAX_PAYLOAD);
+        }
+        m_layoutOf[g]->decodeBatch(m_gathered.data(), dbc::MAX_PAYLOAD, n,
+                                   m_values.data());
+
+        const auto& columnOf = m_columnOf[g];
+        for (size_t s = 0; s < columnOf.size(); ++s) {
+            const double* values = &m_values[s * n];
+            auto& column = m_staged[columnOf[s]];
+            if (n == m_pending) {
+                // the whole chunk is one group: no scatter
+                std::copy(values, values + n, column.begin());
+                continue;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                column[rows[i]] = values[i];
+            }
+        }
+    }
+
+    for (size_t c = 0; c < m_signals.size(); ++c) {
+        m_signals[c]->append(m_staged[c].data(), m_pending);
+    }
+
+    m_rows += m_pending;
+    m_pending = 0;
+    m_writer.flushChunk();
+}
+
+void SignalExporter::finish()
+{
+    flushPending();
+    m_writer.finish();
+}
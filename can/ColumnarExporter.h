@@ -0,0 +1,529 @@
+/*
+ *   Exports decoded detections into a self-describing columnar file.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _COLUMNAR_EXPORTER_H_
+#define _COLUMNAR_EXPORTER_H_
+
+#include "BSBatchDecoder.h"
+#include "BSFrameHandler.h"
+#include "CaptureLog.h"
+#include "SignalDatabase.h"
+
+#include <linux/types.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace can {
+
+namespace columnar {
+
+//
+// File layout (all integers little endian):
+//
+//   "BSCOLMN\0" u32 version
+//   chunk 0: column 0 blob | column 1 blob | ...
+//   chunk 1: ...
+//   footer:  u32 nColumns, { u8 type, u8 nameLen, name }
+//            u32 nChunks,  { u32 nRows,
+//                            { u64 offset, u32 size, u8 encoding,
+//                              f64 min, f64 max } per column }
+//   trailer: u64 footerOffset, "BSCOLMN\0"
+//
+// The min/max statistics let a query skip whole chunks by reading only the
+// footer.
+//
+
+enum class ColumnType : __u8 { U8, I16, F32, U64 };
+
+enum class Encoding : __u8 {
+    PLAIN,     // raw values
+    DELTA,     // first value + zigzag varint differences (integers only)
+    DICTIONARY // u16 count, distinct values, u8 index per row
+};
+
+struct ColumnStats
+{
+    double min;
+    double max;
+};
+
+struct ExportOptions
+{
+    unsigned chunkRows = 64 * 1024;
+    bool deltaEncoding = true;
+    bool dictionaryEncoding = true;
+};
+
+template <typename T> constexpr ColumnType columnTypeOf();
+template <> constexpr ColumnType columnTypeOf<__u8>() { return ColumnType::U8; }
+template <> constexpr ColumnType columnTypeOf<__s16>() { return ColumnType::I16; }
+template <> constexpr ColumnType columnTypeOf<float>() { return ColumnType::F32; }
+template <> constexpr ColumnType columnTypeOf<__u64>() { return ColumnType::U64; }
+
+namespace detail {
+
+inline void putVarint(std::vector<__u8>& out, __u64 value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<__u8>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<__u8>(value));
+}
+
+// throws if the varint doesn't end before 'end'
+inline __u64 getVarint(const __u8*& in, const __u8* end)
+{
+    __u64 value = 0;
+    unsigned shift = 0;
+    while (in < end && (*in & 0x80) && shift < 64) {
+        value |= static_cast<__u64>(*in++ & 0x7F) << shift;
+        shift += 7;
+    }
+    if (in == end || shift >= 64) {
+        throw std::runtime_error("Corrupt varint in a columnar chunk.");
+    }
+    return value | (static_cast<__u64>(*in++) << shift);
+}
+
+inline __u64 zigzag(__s64 v) { return (static_cast<__u64>(v) << 1) ^ (v >> 63); }
+inline __s64 unzigzag(__u64 v) { return (v >> 1) ^ -static_cast<__s64>(v & 1); }
+
+template <typename T> void putRaw(std::vector<__u8>& out, const T& value)
+{
+    auto bytes = reinterpret_cast<const __u8*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+} // namespace detail
+
+class ColumnBufferBase
+{
+  public:
+    ColumnBufferBase(std::string name) : m_name(std::move(name)) {}
+    virtual ~ColumnBufferBase() = default;
+
+    const std::string& name() const { return m_name; }
+
+    virtual ColumnType type() const = 0;
+    virtual size_t size() const = 0;
+    virtual ColumnStats stats() const = 0;
+    virtual void clear() = 0;
+
+    // serializes the buffered values with the smallest allowed encoding
+    virtual Encoding encode(std::vector<__u8>& out,
+                            const ExportOptions& opts) const = 0;
+
+  private:
+    std::string m_name;
+};
+
+template <typename T> class ColumnBuffer : public ColumnBufferBase
+{
+  public:
+    ColumnBuffer(std::string name, size_t capacity)
+        : ColumnBufferBase(std::move(name))
+    {
+        m_values.reserve(capacity);
+    }
+
+    void append(const T value)
+    {
+        m_values.push_back(value);
+        m_min = std::min(m_min, value);
+        m_max = std::max(m_max, value);
+    }
+
+    void append(const T* values, size_t n)
+    {
+        m_values.insert(m_values.end(), values, values + n);
+        for (size_t i = 0; i < n; ++i) {
+            m_min = std::min(m_min, values[i]);
+            m_max = std::max(m_max, values[i]);
+        }
+    }
+
+    ColumnType type() const override { return columnTypeOf<T>(); }
+    size_t size() const override { return m_values.size(); }
+
+    ColumnStats stats() const override
+    {
+        return {static_cast<double>(m_min), static_cast<double>(m_max)};
+    }
+
+    void clear() override
+    {
+        m_values.clear();
+        m_min = std::numeric_limits<T>::max();
+        m_max = std::numeric_limits<T>::lowest();
+    }
+
+    Encoding encode(std::vector<__u8>& out,
+                    const ExportOptions& opts) const override
+    {
+        const size_t plainSize = m_values.size() * sizeof(T);
+
+        std::vector<__u8> candidate;
+        Encoding best = Encoding::PLAIN;
+
+        if (std::is_integral<T>::value && opts.dictionaryEncoding &&
+            sizeof(T) > 1 && encodeDictionary(candidate) &&
+            candidate.size() < plainSize) {
+            best = Encoding::DICTIONARY;
+            out.swap(candidate);
+        }
+
+        candidate.clear();
+        if (std::is_integral<T>::value && opts.deltaEncoding &&
+            encodeDelta(candidate) &&
+            candidate.size() < (best == Encoding::PLAIN ? plainSize
+                                                        : out.size())) {
+            best = Encoding::DELTA;
+            out.swap(candidate);
+        }
+
+        if (best == Encoding::PLAIN) {
+            auto bytes = reinterpret_cast<const __u8*>(m_values.data());
+            out.assign(bytes, bytes + plainSize);
+        }
+        return best;
+    }
+
+  private:
+    bool encodeDelta(std::vector<__u8>& out) const
+    {
+        if (m_values.empty()) {
+            return false;
+        }
+        out.reserve(m_values.size() * 2);
+        detail::putRaw(out, static_cast<__s64>(m_values[0]));
+        for (size_t i = 1; i < m_values.size(); ++i) {
+            detail::putVarint(out, detail::zigzag(static_cast<__s64>(
+                                       m_values[i] - m_values[i - 1])));
+        }
+        return true;
+    }
+
+    bool encodeDictionary(std::vector<__u8>& out) const
+    {
+        std::unordered_map<T, __u8> indexes;
+        std::vector<T> dict;
+        for (const auto v : m_values) {
+            if (indexes.find(v) == indexes.end()) {
+                if (dict.size() == 256) {
+                    return false;
+                }
+                indexes.emplace(v, dict.size());
+                dict.push_back(v);
+            }
+        }
+        detail::putRaw(out, static_cast<__u16>(dict.size()));
+        for (const auto v : dict) {
+            detail::putRaw(out, v);
+        }
+        for (const auto v : m_values) {
+            out.push_back(indexes[v]);
+        }
+        return true;
+    }
+
+  private:
+    std::vector<T> m_values;
+    T m_min = std::numeric_limits<T>::max();
+    T m_max = std::numeric_limits<T>::lowest();
+};
+
+// generic chunked writer: the schema is the list of column buffers
+class ColumnarWriter
+{
+  public:
+    ColumnarWriter(const ColumnarWriter&) = delete;
+    ColumnarWriter& operator=(const ColumnarWriter&) = delete;
+
+    ColumnarWriter(const std::string& path,
+                   std::vector<ColumnBufferBase*> columns,
+                   const ExportOptions& opts);
+    ~ColumnarWriter();
+
+    // encodes and writes the rows buffered so far as one chunk
+    void flushChunk();
+    // writes the footer; no more chunks can be added afterwards
+    void finish();
+
+  private:
+    // throws if the file can't be written (e.g. the disk is full)
+    void write(const void* data, size_t size);
+
+    struct ChunkColumnInfo
+    {
+        __u64 offset;
+        __u32 size;
+        Encoding encoding;
+        ColumnStats stats;
+    };
+
+    std::string m_path;
+    std::FILE* m_file = nullptr;
+    std::vector<ColumnBufferBase*> m_columns;
+    ExportOptions m_opts;
+    __u64 m_offset = 0;
+    std::vector<__u32> m_chunkRows;
+    std::vector<ChunkColumnInfo> m_chunkInfo;
+    std::vector<__u8> m_scratch;
+    bool m_finished = false;
+};
+
+// reads the footer of a columnar file and decodes single column chunks
+class ColumnarReader
+{
+  public:
+    ColumnarReader(const ColumnarReader&) = delete;
+    ColumnarReader& operator=(const ColumnarReader&) = delete;
+
+    explicit ColumnarReader(const std::string& path);
+    ~ColumnarReader();
+
+    struct ColumnInfo
+    {
+        std::string name;
+        ColumnType type;
+    };
+
+    const std::vector<ColumnInfo>& columns() const { return m_columns; }
+    int columnIndex(const std::string& name) const;
+
+    size_t chunkCount() const { return m_chunkRows.size(); }
+    __u32 chunkRows(size_t chunk) const { return m_chunkRows[chunk]; }
+    ColumnStats stats(size_t chunk, size_t column) const;
+    Encoding encoding(size_t chunk, size_t column) const;
+
+    template <typename T>
+    void read(size_t chunk, size_t column, std::vector<T>& out) const;
+
+  private:
+    struct ChunkColumnInfo
+    {
+        __u64 offset;
+        __u32 size;
+        Encoding encoding;
+        ColumnStats stats;
+    };
+
+    // parses the footer, which ends at 'end', and checks that every chunk
+    // is within the file
+    void readFooter(const __u8* end);
+
+    const ChunkColumnInfo& info(size_t chunk, size_t column) const
+    {
+        return m_chunkInfo[chunk * m_columns.size() + column];
+    }
+
+  private:
+    const __u8* m_map = nullptr;
+    size_t m_mapSize = 0;
+    std::vector<ColumnInfo> m_columns;
+    std::vector<__u32> m_chunkRows;
+    std::vector<ChunkColumnInfo> m_chunkInfo;
+};
+
+template <typename T>
+void ColumnarReader::read(size_t chunk, size_t column,
+                          std::vector<T>& out) const
+{
+    if (m_columns[column].type != columnTypeOf<T>()) {
+        throw std::runtime_error("Type mismatch reading column \"" +
+                                 m_columns[column].name + "\".");
+    }
+
+    // the chunk is within the file (see the constructor), but its content
+    // may not match the number of rows
+    const auto& ci = info(chunk, column);
+    const __u8* in = m_map + ci.offset;
+    const __u8* end = in + ci.size;
+    const size_t nRows = m_chunkRows[chunk];
+    const auto corrupt = [&]() {
+        return std::runtime_error("Corrupt chunk " + std::to_string(chunk) +
+                                  " of column \"" + m_columns[column].name +
+                                  "\".");
+    };
+
+    switch (ci.encoding) {
+    case Encoding::PLAIN:
+        if (ci.size < nRows * sizeof(T)) {
+            throw corrupt();
+        }
+        out.resize(nRows);
+        std::memcpy(out.data(), in, nRows * sizeof(T));
+        break;
+    case Encoding::DELTA: {
+        // a varint per row after the first
+        if (nRows && (ci.size < sizeof(__s64) ||
+                      ci.size - sizeof(__s64) < nRows - 1)) {
+            throw corrupt();
+        }
+        out.resize(nRows);
+        __s64 value;
+        std::memcpy(&value, in, sizeof(value));
+        in += sizeof(value);
+        for (size_t i = 0; i < nRows; ++i) {
+            if (i) {
+                value += detail::unzigzag(detail::getVarint(in, end));
+            }
+            out[i] = static_cast<T>(value);
+        }
+        break;
+    }
+    case Encoding::DICTIONARY: {
+        __u16 dictSize = 0;
+        if (ci.size >= sizeof(dictSize)) {
+            std::memcpy(&dictSize, in, sizeof(dictSize));
+        }
+        const __u8* dict = in + sizeof(dictSize);
+        const __u8* idx = dict + dictSize * sizeof(T);
+        if (ci.size < sizeof(dictSize) || idx > end ||
+            static_cast<size_t>(end - idx) < nRows) {
+            throw corrupt();
+        }
+        out.resize(nRows);
+        for (size_t i = 0; i < nRows; ++i) {
+            if (idx[i] >= dictSize) {
+                throw corrupt();
+            }
+            std::memcpy(&out[i], dict + idx[i] * sizeof(T), sizeof(T));
+        }
+        break;
+    }
+    }
+}
+
+} // namespace columnar
+
+// decodes BS-9000 detection frames from a capture log into columns
+class DetectionExporter
+{
+  public:
+    DetectionExporter(const DetectionExporter&) = delete;
+    DetectionExporter& operator=(const DetectionExporter&) = delete;
+
+    DetectionExporter(const std::string& path,
+                      const columnar::ExportOptions& opts);
+
+    // returns false if the record is not a detection frame
+    bool append(const CaptureRecord& record);
+    void finish();
+
+    size_t exportedRows() const { return m_rows + m_pending; }
+
+  private:
+    std::vector<columnar::ColumnBufferBase*> schema();
+    // decodes the pending frames in one batch and appends them
+    void flushPending();
+
+  private:
+    // frames are decoded this many at a time
+    static constexpr size_t BATCH_ROWS = 1024;
+
+    columnar::ExportOptions m_opts;
+    backsense::FrameHandler m_frameHandler;
+    backsense::BatchDecoder m_decoder;
+    backsense::DetectionColumns m_decoded;
+    std::array<__u8, BATCH_ROWS * backsense::N_BYTES> m_payloads;
+    size_t m_pending = 0;
+
+    columnar::ColumnBuffer<__u64> m_timestamp;
+    columnar::ColumnBuffer<__u8> m_sensor;
+    columnar::ColumnBuffer<__u8> m_object;
+    columnar::ColumnBuffer<float> m_radius;
+    columnar::ColumnBuffer<__s16> m_angle;
+    columnar::ColumnBuffer<float> m_x;
+    columnar::ColumnBuffer<float> m_y;
+    columnar::ColumnBuffer<float> m_speed;
+    columnar::ColumnBuffer<__s16> m_power;
+    // bits 7-5: object id, 4: appearance, 2-1: trigger event, 0: detection
+    columnar::ColumnBuffer<__u8> m_flags;
+
+    columnar::ColumnarWriter m_writer;
+    size_t m_rows = 0;
+};
+
+// decodes every frame described by a DBC file into columns: one per signal
+// name, NaN in the rows of messages that don't carry it
+class SignalExporter
+{
+  public:
+    SignalExporter(const SignalExporter&) = delete;
+    SignalExporter& operator=(const SignalExporter&) = delete;
+
+    SignalExporter(const std::string& path, const dbc::SignalDatabase& db,
+                   const columnar::ExportOptions& opts);
+
+    // returns false if the record is not described by the database
+    bool append(const CaptureRecord& record);
+    void finish();
+
+    size_t exportedRows() const { return m_rows + m_pending; }
+
+  private:
+    std::vector<columnar::ColumnBufferBase*> schema();
+    // decodes the pending frames, one batch per message, and appends them
+    void flushPending();
+
+  private:
+    const dbc::SignalDatabase& m_db;
+    columnar::ExportOptions m_opts;
+
+    columnar::ColumnBuffer<__u64> m_timestamp;
+    columnar::ColumnBuffer<__u64> m_frameId;
+    std::vector<std::unique_ptr<columnar::ColumnBuffer<float>>> m_signals;
+    // Messages with the same signal ops going to the same columns (e.g.
+    // the objects of every sensor) are decoded together: per group, its
+    // first message and the column of each of its signals
+    std::vector<const dbc::MessageLayout*> m_layoutOf;
+    std::vector<std::vector<size_t>> m_columnOf;
+    // per message of the database, its group
+    std::vector<__u32> m_groupOf;
+
+    // the frames of the current chunk: payload and group of each row
+    std::vector<__u8> m_payloads;
+    std::vector<__u32> m_rowGroup;
+    size_t m_pending = 0;
+    // per group, its rows in the chunk and their gathered payloads
+    std::vector<std::vector<__u32>> m_rowsOf;
+    std::vector<__u8> m_gathered;
+    // the output of decodeBatch(), then the signal columns of the chunk
+    std::vector<double> m_values;
+    std::vector<std::vector<float>> m_staged;
+
+    columnar::ColumnarWriter m_writer;
+    size_t m_rows = 0;
+};
+
+} // namespace can
+
+#endif // _COLUMNAR_EXPORTER_H_
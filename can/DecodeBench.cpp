@@ -0,0 +1,298 @@
+/*
+ *   Measures the batch decoders against the per-frame getters, and the DBC
+ *   decoders against both.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "BSBatchDecoder.h"
+#include "BSFrameHandler.h"
+#include "CaptureLog.h"
+#include "SignalDatabase.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace can::backsense;
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg << " [-n frames] [-d file.dbc]"
+              << std::endl;
+}
+
+// the DBC decoders write doubles: they run over this many frames at a time
+static constexpr size_t DBC_CHUNK = 64 * 1024;
+
+// calls run(first, count) over [0, n), DBC_CHUNK frames at a time
+template <typename F> static void byChunks(size_t n, F&& run)
+{
+    for (size_t first = 0; first < n; first += DBC_CHUNK) {
+        run(first, std::min(DBC_CHUNK, n - first));
+    }
+}
+
+template <typename F> static double nsPerFrame(size_t nFrames, F&& run)
+{
+    const auto start = std::chrono::steady_clock::now();
+    run();
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / nFrames;
+}
+
+static bool sameColumns(const DetectionColumns& a, const DetectionColumns& b)
+{
+    return a.radius == b.radius && a.angle == b.angle && a.x == b.x &&
+           a.y == b.y && a.speed == b.speed && a.power == b.power &&
+           a.objectId == b.objectId && a.appearance == b.appearance &&
+           a.trigger == b.trigger && a.detection == b.detection;
+}
+
+// the getters' values of frames [first, first + count), one column per
+// signal of 'layout', as decodeBatch() writes them
+static void referenceColumns(const DetectionColumns& c, size_t first,
+                             size_t count,
+                             const can::dbc::MessageLayout& layout,
+                             std::vector<double>& out)
+{
+    out.assign(layout.signalCount() * count, NAN);
+    auto column = [&](const char* name) {
+        const int s = layout.signalIndex(name);
+        if (s < 0) {
+            throw std::runtime_error(std::string("No signal \"") + name +
+                                     "\" in " + layout.name() + ".");
+        }
+        return &out[s * count];
+    };
+    auto radius = column("PolarRadius");
+    auto angle = column("PolarAngle");
+    auto x = column("X");
+    auto y = column("Y");
+    auto speed = column("RelativeSpeed");
+    auto power = column("SignalPower");
+    auto objectId = column("ObjectId");
+    auto appearance = column("ObjectAppearanceStatus");
+    auto trigger = column("TriggerEvent");
+    auto detection = column("DetectionFlag");
+
+    for (size_t i = 0; i < count; ++i) {
+        radius[i] = c.radius[first + i].toDouble();
+        angle[i] = c.angle[first + i];
+        x[i] = c.x[first + i].toDouble();
+        y[i] = c.y[first + i].toDouble();
+        speed[i] = c.speed[first + i].toDouble();
+        power[i] = c.power[first + i];
+        objectId[i] = c.objectId[first + i];
+        appearance[i] = c.appearance[first + i];
+        trigger[i] = c.trigger[first + i];
+        detection[i] = c.detection[first + i];
+    }
+}
+
+// frames of 'payloads' (one every 'stride' bytes) whose signals, through
+// decode() or decodeBatch(), differ from the getters' values
+static size_t dbcMismatches(const can::dbc::MessageLayout& layout,
+                            const __u8* payloads, size_t stride,
+                            const DetectionColumns& expected)
+{
+    const size_t nSignals = layout.signalCount();
+    std::vector<double> reference, batch(nSignals * DBC_CHUNK);
+    std::vector<double> frame(nSignals);
+    size_t mismatches = 0;
+
+    byChunks(expected.size(), [&](size_t first, size_t count) {
+        referenceColumns(expected, first, count, layout, reference);
+        layout.decodeBatch(payloads + first * stride, stride, count,
+                           batch.data());
+        for (size_t i = 0; i < count; ++i) {
+            layout.decode(payloads + (first + i) * stride, frame.data());
+            for (size_t s = 0; s < nSignals; ++s) {
+                const double value = reference[s * count + i];
+                if (frame[s] != value || batch[s * count + i] != value) {
+                    ++mismatches;
+                    break;
+                }
+            }
+        }
+    });
+    return mismatches;
+}
+
+int main(int argc, char** argv)
+{
+    size_t nFrames = 10000000;
+    std::string dbcPath = "dbc/bs9000.dbc";
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+            nFrames = std::stoul(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-d") && i + 1 < argc) {
+            dbcPath = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    try {
+        // every byte value, in random frames
+        std::mt19937 rng(9000);
+        std::vector<__u8> payloads(nFrames * N_BYTES);
+        for (auto& byte : payloads) {
+            byte = rng();
+        }
+        // the same frames, as they are found in a capture log
+        std::vector<can::CaptureRecord> records(nFrames);
+        for (size_t i = 0; i < nFrames; ++i) {
+            std::memcpy(records[i].data, &payloads[i * N_BYTES], N_BYTES);
+        }
+
+        // reference: one DetectionData and its getters per frame
+        DetectionColumns expected;
+        expected.resize(nFrames);
+        const double getterNs = nsPerFrame(nFrames, [&]() {
+            FrameHandler frameHandler;
+            PARAM_STRUCT param{};
+            param.Ident = BASE_DETECTION_ID;
+            param.DataLength = N_BYTES;
+            for (size_t i = 0; i < nFrames; ++i) {
+                std::memcpy(param.RCV_data, &payloads[i * N_BYTES], N_BYTES);
+                const auto state = frameHandler.processRcvFrame(param);
+                expected.radius[i] = state->getPolarRadius();
+                expected.angle[i] = state->getPolarAngle();
+                expected.x[i] = state->getX();
+                expected.y[i] = state->getY();
+                expected.speed[i] = state->getRelativeSpeed();
+                expected.power[i] = state->getSignalPower();
+                expected.objectId[i] = state->getObjectId();
+                expected.appearance[i] = state->getObjectAppearanceStatus();
+                expected.trigger[i] = state->getTriggerEvent();
+                expected.detection[i] = state->getDetectionFlag();
+            }
+        });
+        std::cout << nFrames << " frames\n"
+                  << "getters: " << getterNs << " ns/frame\n";
+
+        bool allGood = true;
+        DetectionColumns columns;
+        columns.resize(nFrames);
+        for (auto isa : {BatchDecoder::Isa::SCALAR, BatchDecoder::Isa::SSE41,
+                         BatchDecoder::Isa::AVX2}) {
+            if (!BatchDecoder::isSupported(isa)) {
+                std::cout << BatchDecoder::isaName(isa)
+                          << ": not supported by this CPU\n";
+                continue;
+            }
+            const BatchDecoder decoder(isa);
+
+            const double packedNs = nsPerFrame(nFrames, [&]() {
+                decoder.decode(payloads.data(), N_BYTES, nFrames, columns);
+            });
+            const bool packedGood = sameColumns(columns, expected);
+
+            const double recordNs = nsPerFrame(nFrames, [&]() {
+                decoder.decode(records[0].data, sizeof(can::CaptureRecord),
+                               nFrames, columns);
+            });
+            const bool recordGood = sameColumns(columns, expected);
+            allGood = allGood && packedGood && recordGood;
+
+            std::cout << BatchDecoder::isaName(isa) << ": " << packedNs
+                      << " ns/frame packed (x" << getterNs / packedNs << "), "
+                      << recordNs << " ns/frame from capture records (x"
+                      << getterNs / recordNs << ")"
+                      << (packedGood && recordGood ? "" : " MISMATCH")
+                      << "\n";
+        }
+        std::cout << "Default kernel: "
+                  << BatchDecoder::isaName(BatchDecoder().isa()) << std::endl;
+
+        // the same frames through the layout of a DBC file
+        const auto db = can::dbc::SignalDatabase::load(dbcPath);
+        const auto layout = db.find(BASE_DETECTION_ID);
+        if (!layout) {
+            throw std::runtime_error("No message " +
+                                     std::to_string(BASE_DETECTION_ID) +
+                                     " in \"" + dbcPath + "\".");
+        }
+        const size_t nSignals = layout->signalCount();
+        std::vector<double> values(nSignals * DBC_CHUNK);
+
+        const double frameNs = nsPerFrame(nFrames, [&]() {
+            byChunks(nFrames, [&](size_t first, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    layout->decode(&payloads[(first + i) * N_BYTES],
+                                   &values[i * nSignals]);
+                }
+            });
+        });
+        const double batchNs = nsPerFrame(nFrames, [&]() {
+            byChunks(nFrames, [&](size_t first, size_t count) {
+                layout->decodeBatch(&payloads[first * N_BYTES], N_BYTES,
+                                    count, values.data());
+            });
+        });
+        const double batchRecordNs = nsPerFrame(nFrames, [&]() {
+            byChunks(nFrames, [&](size_t first, size_t count) {
+                layout->decodeBatch(records[first].data,
+                                    sizeof(can::CaptureRecord), count,
+                                    values.data());
+            });
+        });
+        const size_t dbcBad =
+            dbcMismatches(*layout, payloads.data(), N_BYTES, expected) +
+            dbcMismatches(*layout, records[0].data, sizeof(can::CaptureRecord),
+                          expected);
+
+        std::cout << "DBC " << layout->name() << ", " << nSignals
+                  << " signals: decode() " << frameNs << " ns/frame (x"
+                  << getterNs / frameNs << "), decodeBatch() " << batchNs
+                  << " ns/frame packed (x" << getterNs / batchNs << "), "
+                  << batchRecordNs << " ns/frame from capture records (x"
+                  << getterNs / batchRecordNs << ")";
+        if (dbcBad) {
+            std::cout << " MISMATCH (" << dbcBad << " frames)";
+        }
+        std::cout << std::endl;
+
+        if (!allGood) {
+            std::cerr << "#ERROR: the batch decoders disagree with the "
+                         "getters."
+                      << std::endl;
+            return 1;
+        }
+        if (dbcBad) {
+            std::cerr << "#ERROR: the DBC decoders disagree with the "
+                         "getters."
+                      << std::endl;
+            return 1;
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -20,9 +20,10 @@
 
 #include "DetectionGUI.h"
 #include "BSFrameHandler.h"
+#include "RadarEventLoop.h"
+#include "Telemetry.h"
 
 #include <chrono>
-#include <thread>
 
 static void adjustColumns(nana::listbox& lsbox)
 {
@@ -34,7 +35,9 @@ static void adjustColumns(nana::listbox& lsbox)
 
 using gui::DetectionGUI;
 
-DetectionGUI::DetectionGUI(const can::backsense::RadarStateDB& stateDB)
+DetectionGUI::DetectionGUI(const can::backsense::RadarStateDB& stateDB,
+                           can::backsense::RadarEventLoop& events)
+    : m_stateDB(stateDB), m_events(events)
 {
     m_button.caption("Quit");
     m_button.events().click([this] { m_form.close(); });
@@ -63,16 +66,40 @@ DetectionGUI::DetectionGUI(const can::backsense::RadarStateDB& stateDB)
 
 void DetectionGUI::launchGUI()
 {
-    std::thread updater([this]() {
-        using namespace std::chrono_literals;
-        while (true) {
-            std::this_thread::sleep_for(250ms);
+    // the waits are only set up from the loop thread
+    m_events.post([this]() {
+        refreshOnCycle();
+        checkStale();
+    });
+    nana::exec();
+}
+
+void DetectionGUI::refreshOnCycle()
+{
+    m_events.nextCycle(0, [this](unsigned, __u64) {
+        nana::API::refresh_window(m_lsbox);
+        telemetry::add(telemetry::Counter::RENDERED_FRAMES);
+        refreshOnCycle();
+    });
+}
+
+void DetectionGUI::checkStale()
+{
+    // no update tells that the radar went quiet: this one is polled
+    using namespace std::chrono_literals;
+    m_events.after(250ms, [this]() {
+        if (m_stateDB.isStale() != m_stale) {
+            // the table keeps the last known state: make it obvious
+            m_stale = !m_stale;
+            nana::API::window_caption(
+                m_form, m_stale ? "Detection Table - NO RADAR DATA"
+                                : "Detection Table");
+            nana::API::bgcolor(m_form, m_stale ? nana::colors::light_grey
+                                               : nana::colors::light_green);
             nana::API::refresh_window(m_lsbox);
         }
+        checkStale();
     });
-
-    updater.detach();
-    nana::exec();
 }
 
 std::vector<nana::listbox::cell> DetectionGUI::cellTranslator(
@@ -83,11 +110,11 @@ std::vector<nana::listbox::cell> DetectionGUI::cellTranslator(
 
     if (data) {
         cells.emplace_back(data->getStrHexId());
-        cells.emplace_back(std::to_string(data->getPolarRadius()));
+        cells.emplace_back(data->getPolarRadius().toString());
         cells.emplace_back(std::to_string(data->getPolarAngle()));
-        cells.emplace_back(std::to_string(data->getX()));
-        cells.emplace_back(std::to_string(data->getY()));
-        cells.emplace_back(std::to_string(data->getRelativeSpeed()));
+        cells.emplace_back(data->getX().toString());
+        cells.emplace_back(data->getY().toString());
+        cells.emplace_back(data->getRelativeSpeed().toString());
         cells.emplace_back(std::to_string(data->getSignalPower()));
         cells.emplace_back(std::to_string(data->getObjectId()));
         cells.emplace_back(std::to_string(data->getObjectAppearanceStatus()));
@@ -36,6 +36,7 @@ namespace can {
 namespace backsense {
 
 class DetectionData;
+class RadarEventLoop;
 class RadarStateDB;
 
 } // namespace backsense
@@ -50,16 +51,27 @@ class DetectionGUI
     DetectionGUI(const DetectionGUI& other) = delete;
     DetectionGUI& operator=(const DetectionGUI&) = delete;
 
-    DetectionGUI(const can::backsense::RadarStateDB& stateDB);
+    // the table is refreshed from the thread running 'events'
+    DetectionGUI(const can::backsense::RadarStateDB& stateDB,
+                 can::backsense::RadarEventLoop& events);
     void launchGUI();
 
   private:
+    // on the loop thread: the table after each cycle of the sensor, the
+    // caption whenever the DB goes stale or fresh again
+    void refreshOnCycle();
+    void checkStale();
+
     // translate data from our DB into text that can be
     // displayed in the "listbox" cells
     static std::vector<nana::listbox::cell> cellTranslator(
         const std::experimental::optional<can::backsense::DetectionData>& data);
 
   private:
+    const can::backsense::RadarStateDB& m_stateDB;
+    can::backsense::RadarEventLoop& m_events;
+    bool m_stale = false;
+
     // TODO: there are probably better ways to define the sizes
     nana::form m_form{nana::rectangle{100, 100, 800, 400}};
     nana::button m_button{m_form, nana::rectangle{370, 350, 60, 30}};
@@ -0,0 +1,142 @@
+/*
+ *   Converts a raw capture log into a columnar file of decoded detections,
+ *   or prints the chunk statistics of an existing columnar file.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CaptureLog.h"
+#include "ColumnarExporter.h"
+#include "SignalDatabase.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg
+              << " [-n chunk_rows] [--plain] [--dbc <file.dbc>]"
+                 " <capture.log> <out.bscol>\n"
+              << "       " << prg << " -i <file.bscol>" << std::endl;
+}
+
+static const char* encodingName(can::columnar::Encoding encoding)
+{
+    switch (encoding) {
+    case can::columnar::Encoding::PLAIN:
+        return "plain";
+    case can::columnar::Encoding::DELTA:
+        return "delta";
+    case can::columnar::Encoding::DICTIONARY:
+        return "dict";
+    }
+    return "?";
+}
+
+static void inspect(const std::string& path)
+{
+    can::columnar::ColumnarReader reader(path);
+    const auto& columns = reader.columns();
+
+    for (size_t chunk = 0; chunk < reader.chunkCount(); ++chunk) {
+        std::cout << "Chunk " << chunk << " :::: " << reader.chunkRows(chunk)
+                  << " rows\n";
+        for (size_t col = 0; col < columns.size(); ++col) {
+            auto stats = reader.stats(chunk, col);
+            std::cout << "    " << columns[col].name << " ["
+                      << encodingName(reader.encoding(chunk, col))
+                      << "] min " << stats.min << " max " << stats.max
+                      << "\n";
+        }
+    }
+}
+
+template <typename Exporter>
+static void exportLog(const std::string& in, Exporter& exporter)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    can::CaptureLogReader log(in);
+    for (const auto& record : log) {
+        exporter.append(record);
+    }
+    exporter.finish();
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "#INFO: " << exporter.exportedRows() << " rows out of "
+              << log.size() << " frames exported in " << elapsed.count()
+              << " s." << std::endl;
+}
+
+static void convert(const std::string& in, const std::string& out,
+                    const std::string& dbcPath,
+                    const can::columnar::ExportOptions& opts)
+{
+    if (dbcPath.empty()) {
+        can::DetectionExporter exporter(out, opts);
+        exportLog(in, exporter);
+    } else {
+        // generic path: whatever the DBC file describes
+        const auto db = can::dbc::SignalDatabase::load(dbcPath);
+        can::SignalExporter exporter(out, db, opts);
+        exportLog(in, exporter);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    can::columnar::ExportOptions opts;
+    std::string inspectPath;
+    std::string dbcPath;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+            opts.chunkRows = std::stoul(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--plain")) {
+            opts.deltaEncoding = false;
+            opts.dictionaryEncoding = false;
+        } else if (!std::strcmp(argv[i], "--dbc") && i + 1 < argc) {
+            dbcPath = argv[++i];
+        } else if (!std::strcmp(argv[i], "-i") && i + 1 < argc) {
+            inspectPath = argv[++i];
+        } else {
+            paths.emplace_back(argv[i]);
+        }
+    }
+
+    try {
+        if (!inspectPath.empty()) {
+            inspect(inspectPath);
+        } else if (paths.size() == 2 && opts.chunkRows) {
+            convert(paths[0], paths[1], dbcPath, opts);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
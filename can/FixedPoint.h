@@ -0,0 +1,157 @@
+/*
+ *   Fixed point physical values: an integer count of steps of the unit.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FIXED_POINT_H_
+#define _FIXED_POINT_H_
+
+#include <linux/types.h>
+
+#include <ostream>
+#include <string>
+
+namespace can {
+
+// A value of 1/StepsPerUnit resolution, kept as a 16 bit count of steps:
+// e.g. Fixed<4> holds metres in quarter metre steps. The sensor values are
+// exact multiples of their resolution, so nothing is lost; floating point
+// is only for the edges (drawing, export), through toDouble()/toFloat().
+template <int StepsPerUnit> class Fixed
+{
+  public:
+    using Steps = __s16;
+    static constexpr int STEPS_PER_UNIT = StepsPerUnit;
+
+    constexpr Fixed() = default;
+
+    static constexpr Fixed fromSteps(int steps)
+    {
+        return Fixed(static_cast<Steps>(steps));
+    }
+    static constexpr Fixed fromUnits(int units)
+    {
+        return fromSteps(units * StepsPerUnit);
+    }
+
+    constexpr Steps steps() const { return m_steps; }
+
+    constexpr double toDouble() const
+    {
+        return static_cast<double>(m_steps) / StepsPerUnit;
+    }
+    constexpr float toFloat() const
+    {
+        return static_cast<float>(m_steps) / StepsPerUnit;
+    }
+
+    // the value times 'factor', in whole units (truncated), e.g. pixels
+    // from metres and a pixels per metre scale
+    constexpr int scaled(int factor) const
+    {
+        return m_steps * factor / StepsPerUnit;
+    }
+
+    // longest text of format(): sign, 5 digits, point, 6 decimals
+    static constexpr unsigned MAX_TEXT_LEN = 13;
+
+    // shortest exact decimal form: "12", "-3.25", "0.5", written into 'out'
+    // (with its '\0'); returns the length
+    unsigned format(char (&out)[MAX_TEXT_LEN + 1]) const
+    {
+        const int steps = m_steps;
+        unsigned magnitude = steps < 0 ? -steps : steps;
+        unsigned rest = magnitude % StepsPerUnit;
+        magnitude /= StepsPerUnit;
+
+        unsigned len = 0;
+        if (steps < 0) {
+            out[len++] = '-';
+        }
+        char digits[5];
+        unsigned nDigits = 0;
+        do {
+            digits[nDigits++] = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        while (nDigits) {
+            out[len++] = digits[--nDigits];
+        }
+
+        if (rest) {
+            out[len++] = '.';
+            // exact for any StepsPerUnit dividing a power of 10
+            for (int decimals = 0; rest && decimals < 6; ++decimals) {
+                rest *= 10;
+                out[len++] = static_cast<char>('0' + rest / StepsPerUnit);
+                rest %= StepsPerUnit;
+            }
+        }
+        out[len] = '\0';
+        return len;
+    }
+
+    std::string toString() const
+    {
+        char text[MAX_TEXT_LEN + 1];
+        const auto len = format(text);
+        return std::string(text, len);
+    }
+
+    constexpr Fixed operator-() const { return fromSteps(-m_steps); }
+    constexpr Fixed operator+(Fixed other) const
+    {
+        return fromSteps(m_steps + other.m_steps);
+    }
+    constexpr Fixed operator-(Fixed other) const
+    {
+        return fromSteps(m_steps - other.m_steps);
+    }
+
+    constexpr bool operator==(Fixed other) const
+    {
+        return m_steps == other.m_steps;
+    }
+    constexpr bool operator!=(Fixed other) const { return !(*this == other); }
+    constexpr bool operator<(Fixed other) const
+    {
+        return m_steps < other.m_steps;
+    }
+    constexpr bool operator>(Fixed other) const { return other < *this; }
+    constexpr bool operator<=(Fixed other) const { return !(other < *this); }
+    constexpr bool operator>=(Fixed other) const { return !(*this < other); }
+
+  private:
+    constexpr explicit Fixed(Steps steps) : m_steps(steps) {}
+
+  private:
+    Steps m_steps = 0;
+};
+
+template <int StepsPerUnit>
+std::ostream& operator<<(std::ostream& out, Fixed<StepsPerUnit> value)
+{
+    // no temporary string: printing never allocates
+    char text[Fixed<StepsPerUnit>::MAX_TEXT_LEN + 1];
+    value.format(text);
+    return out << text;
+}
+
+} // namespace can
+
+#endif // _FIXED_POINT_H_
@@ -0,0 +1,196 @@
+/*
+ *   Extracts a time window of a flight recorder: its records as text, and
+ *   its thumbnails as PGM pictures.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "BSDataConverter.h"
+#include "FlightRecorder.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg
+              << " [-l <seconds> | -f <unix time> -t <unix time>]"
+                 " [-o <thumbnail dir>] <flight file>"
+              << std::endl;
+}
+
+// "2018-06-01 14:03:27.125", local time
+static std::string formatWallTime(__u64 wallTimeNs)
+{
+    if (!wallTimeNs) {
+        return "(unknown time)";
+    }
+    const std::time_t seconds = wallTimeNs / 1000000000;
+    std::tm local;
+    localtime_r(&seconds, &local);
+    char text[32];
+    const auto len = std::strftime(text, sizeof(text), "%F %T", &local);
+    std::snprintf(text + len, sizeof(text) - len, ".%03u",
+                  static_cast<unsigned>(wallTimeNs / 1000000 % 1000));
+    return text;
+}
+
+static void printRecord(const can::FlightRecord& record)
+{
+    using can::FlightRecordType;
+    using namespace can::backsense;
+
+    switch (record.type) {
+    case FlightRecordType::SESSION:
+        std::cout << "SESSION " << record.session;
+        break;
+    case FlightRecordType::DETECTION:
+        std::cout << "DETECTION sensor " << unsigned(record.sensorIdx)
+                  << " obj " << unsigned(record.index) << " id 0x" << std::hex
+                  << record.ident << std::dec << " x "
+                  << Distance::fromSteps(record.values[0]).toString() << " y "
+                  << Distance::fromSteps(record.values[1]).toString()
+                  << " speed "
+                  << Speed::fromSteps(record.values[2]).toString();
+        break;
+    case FlightRecordType::CYCLE:
+        if (record.index == unsigned(can::FlightCycle::RENDER)) {
+            std::cout << "CYCLE render " << record.value;
+        } else {
+            std::cout << "CYCLE " << unsigned(record.index) << " "
+                      << record.value;
+        }
+        break;
+    case FlightRecordType::ALERT:
+        std::cout << "ALERT sensor " << unsigned(record.sensorIdx)
+                  << (record.flag ? " raised" : " ended") << " nearest "
+                  << Distance::fromSteps(record.values[0]).toString()
+                  << " ttc " << record.values[1] << " ms";
+        break;
+    case FlightRecordType::CHANNEL:
+        std::cout << "CHANNEL " << unsigned(record.index)
+                  << (record.flag ? " up" : " down");
+        break;
+    default:
+        std::cout << "? type " << unsigned(record.type);
+    }
+}
+
+static void writeThumbnail(const std::string& path,
+                           const can::FlightThumbnail& thumbnail)
+{
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Can't write \"" + path + "\".");
+    }
+    std::fprintf(file, "P5\n%u %u\n255\n", can::THUMBNAIL_WIDTH,
+                 can::THUMBNAIL_HEIGHT);
+    std::fwrite(thumbnail.pixels, 1, sizeof(thumbnail.pixels), file);
+    std::fclose(file);
+}
+
+int main(int argc, char** argv)
+{
+    double lastS = 0;
+    double fromS = 0;
+    double toS = std::numeric_limits<double>::max();
+    std::string thumbnailDir;
+    std::string path;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-l") && i + 1 < argc) {
+            lastS = std::stod(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-f") && i + 1 < argc) {
+            fromS = std::stod(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-t") && i + 1 < argc) {
+            toS = std::stod(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+            thumbnailDir = argv[++i];
+        } else if (argv[i][0] != '-' && path.empty()) {
+            path = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (path.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try {
+        const auto log = can::readFlightLog(path);
+
+        // -l: up to the last thing recorded, e.g. before a crash
+        __u64 fromNs = fromS * 1e9;
+        __u64 toNs = toS >= std::numeric_limits<__u64>::max() / 1e9
+                         ? std::numeric_limits<__u64>::max()
+                         : static_cast<__u64>(toS * 1e9);
+        if (lastS > 0 && !log.records.empty()) {
+            const auto& last = log.records.back();
+            toNs = log.wallTimeNs(last.hostTimeNs, last.session);
+            fromNs = toNs - static_cast<__u64>(lastS * 1e9);
+        }
+        auto inWindow = [&](__u64 wallTimeNs) {
+            return wallTimeNs >= fromNs && wallTimeNs <= toNs;
+        };
+
+        size_t nRecords = 0;
+        for (const auto& record : log.records) {
+            const auto wallTimeNs =
+                log.wallTimeNs(record.hostTimeNs, record.session);
+            if (!inWindow(wallTimeNs)) {
+                continue;
+            }
+            std::cout << formatWallTime(wallTimeNs) << " ";
+            printRecord(record);
+            std::cout << "\n";
+            ++nRecords;
+        }
+
+        size_t nThumbnails = 0;
+        for (const auto& thumbnail : log.thumbnails) {
+            const auto wallTimeNs =
+                log.wallTimeNs(thumbnail.hostTimeNs, thumbnail.session);
+            if (thumbnailDir.empty() || !inWindow(wallTimeNs)) {
+                continue;
+            }
+            // by the millisecond, and in order within one
+            writeThumbnail(thumbnailDir + "/thumb_" +
+                               std::to_string(wallTimeNs / 1000000) + "_" +
+                               std::to_string(thumbnail.seq) + ".pgm",
+                           thumbnail);
+            ++nThumbnails;
+        }
+
+        std::cout.flush();
+        std::cerr << "#INFO: " << nRecords << " of " << log.records.size()
+                  << " records, " << nThumbnails << " of "
+                  << log.thumbnails.size() << " thumbnails, "
+                  << log.nSessions << " sessions." << std::endl;
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ *   An always-on black box: the last minutes of radar and render state, in
+ *   a memory-mapped ring file that outlives a crash of the process.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "FlightRecorder.h"
+#include "BSFrameHandler.h"
+#include "CaptureLog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr char FLIGHT_MAGIC[8] = {'B', 'S', 'F', 'L',
+                                         'I', 'G', 'H', 'T'};
+static constexpr __u32 FLIGHT_VERSION = 1;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "the ring positions are shared through the file");
+
+// the header fields that must match to carry a file on
+static bool sameGeometry(const can::FlightFileHeader& header,
+                         const can::FlightRecorderConfig& config)
+{
+    return !std::memcmp(header.magic, FLIGHT_MAGIC, sizeof(FLIGHT_MAGIC)) &&
+           header.version == FLIGHT_VERSION &&
+           header.recordSize == sizeof(can::FlightRecord) &&
+           header.thumbnailSize == sizeof(can::FlightThumbnail) &&
+           header.nRecords == config.nRecords() &&
+           header.nThumbnails == config.nThumbnails();
+}
+
+// Whatever was in the slot, it's invalid from now on; the stores that
+// follow can't be seen before this one.
+template <typename Slot> static void beginWrite(Slot& slot)
+{
+    __atomic_store_n(&slot.seq, 0, __ATOMIC_RELAXED);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+template <typename Slot> static void endWrite(Slot& slot, __u64 position)
+{
+    __atomic_store_n(&slot.seq, position + 1, __ATOMIC_RELEASE);
+}
+
+// a copy of the slot at 'idx' of a ring of 'n', if complete
+template <typename Slot>
+static bool readSlot(const Slot& slot, size_t idx, size_t n, Slot& copy)
+{
+    const auto seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+    if (!seq || (seq - 1) % n != idx) {
+        return false;
+    }
+    std::memcpy(&copy, &slot, sizeof(Slot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return __atomic_load_n(&slot.seq, __ATOMIC_RELAXED) == seq;
+}
+
+size_t can::FlightRecorderConfig::fileSize() const
+{
+    return sizeof(FlightFileHeader) + nRecords() * sizeof(FlightRecord) +
+           static_cast<size_t>(nThumbnails()) * sizeof(FlightThumbnail);
+}
+
+// :::: class FlightRecorder
+
+using can::FlightRecorder;
+
+FlightRecorder::FlightRecorder(const std::string& path,
+                               const FlightRecorderConfig& config)
+{
+    if (!config.nRecords()) {
+        throw std::runtime_error("The flight recorder can't be empty.");
+    }
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open flight recorder \"" + path +
+                                 "\".");
+    }
+
+    m_mapSize = config.fileSize();
+    struct stat st;
+    FlightFileHeader old;
+    const bool carryOn =
+        !fstat(fd, &st) && static_cast<size_t>(st.st_size) == m_mapSize &&
+        pread(fd, &old, sizeof(old), 0) == sizeof(old) &&
+        sameGeometry(old, config);
+    if (!carryOn) {
+        // every block now: the ring never makes the file grow, nor fails
+        // on a full disk half way through
+        if (ftruncate(fd, 0) || posix_fallocate(fd, 0, m_mapSize)) {
+            close(fd);
+            throw std::runtime_error("Can't allocate " +
+                                     std::to_string(m_mapSize) +
+                                     " bytes for flight recorder \"" + path +
+                                     "\".");
+        }
+    }
+
+    // populated: no page fault on the paths that record
+    m_map = mmap(nullptr, m_mapSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED) {
+        throw std::runtime_error("Can't map flight recorder \"" + path +
+                                 "\".");
+    }
+
+    m_header = static_cast<FlightFileHeader*>(m_map);
+    m_records = reinterpret_cast<FlightRecord*>(m_header + 1);
+    m_thumbnails =
+        reinterpret_cast<FlightThumbnail*>(m_records + config.nRecords());
+
+    if (!carryOn) {
+        // the file reads as zeros
+        std::memcpy(m_header->magic, FLIGHT_MAGIC, sizeof(FLIGHT_MAGIC));
+        m_header->version = FLIGHT_VERSION;
+        m_header->recordSize = sizeof(FlightRecord);
+        m_header->thumbnailSize = sizeof(FlightThumbnail);
+        m_header->nRecords = config.nRecords();
+        m_header->nThumbnails = config.nThumbnails();
+    }
+
+    using namespace std::chrono;
+    m_session = m_header->nSessions.fetch_add(1, std::memory_order_relaxed);
+    m_header->wallOffsetsNs[m_session % FLIGHT_SESSIONS] =
+        duration_cast<nanoseconds>(system_clock::now().time_since_epoch())
+            .count() -
+        CaptureLogWriter::hostTimeNs();
+    append(FlightRecordType::SESSION, [](FlightRecord&) {});
+}
+
+FlightRecorder::~FlightRecorder() { munmap(m_map, m_mapSize); }
+
+template <typename Fill>
+void FlightRecorder::append(FlightRecordType type, Fill&& fill)
+{
+    const auto position =
+        m_header->nextRecord.fetch_add(1, std::memory_order_relaxed);
+    auto& record = m_records[position % m_header->nRecords];
+
+    beginWrite(record);
+    // the fields of the record it replaces are cleared with the rest
+    std::memset(&record.hostTimeNs, 0,
+                sizeof(FlightRecord) - offsetof(FlightRecord, hostTimeNs));
+    record.hostTimeNs = CaptureLogWriter::hostTimeNs();
+    record.session = m_session;
+    record.type = type;
+    fill(record);
+    endWrite(record, position);
+}
+
+void FlightRecorder::onUpdate(const backsense::RadarStateDB&,
+                              const backsense::DetectionData& state)
+{
+    append(FlightRecordType::DETECTION, [&state](FlightRecord& record) {
+        const auto indexes =
+            backsense::FrameHandler::getIndexPairFromId(state.getId());
+        record.sensorIdx = indexes.first;
+        record.index = indexes.second;
+        record.ident = state.getId();
+        std::copy(state.getRawData().begin(), state.getRawData().end(),
+                  record.frame);
+        record.values[0] = state.getX().steps();
+        record.values[1] = state.getY().steps();
+        record.values[2] = state.getRelativeSpeed().steps();
+    });
+}
+
+void FlightRecorder::onAlert(unsigned sensorIdx,
+                             const backsense::ObstacleSummary& summary,
+                             bool raised)
+{
+    append(FlightRecordType::ALERT, [&](FlightRecord& record) {
+        record.sensorIdx = sensorIdx;
+        record.index = summary.nearestObj;
+        record.flag = raised;
+        record.values[0] = summary.nearestRadius.steps();
+        record.values[1] = summary.ttcMs;
+        record.values[2] = summary.ttcObj;
+    });
+}
+
+void FlightRecorder::recordChannel(unsigned channelIdx, bool online)
+{
+    append(FlightRecordType::CHANNEL, [=](FlightRecord& record) {
+        record.index = channelIdx;
+        record.flag = online;
+    });
+}
+
+void FlightRecorder::recordCycle(FlightCycle cycle, __u64 count)
+{
+    append(FlightRecordType::CYCLE, [=](FlightRecord& record) {
+        record.index = static_cast<__u8>(cycle);
+        record.value = count;
+    });
+}
+
+void FlightRecorder::recordThumbnail(const __u8* pixels)
+{
+    if (!m_header->nThumbnails) {
+        return;
+    }
+    const auto position =
+        m_header->nextThumbnail.fetch_add(1, std::memory_order_relaxed);
+    auto& thumbnail = m_thumbnails[position % m_header->nThumbnails];
+
+    beginWrite(thumbnail);
+    thumbnail.hostTimeNs = CaptureLogWriter::hostTimeNs();
+    thumbnail.session = m_session;
+    std::memcpy(thumbnail.pixels, pixels, sizeof(thumbnail.pixels));
+    endWrite(thumbnail, position);
+}
+
+// :::: struct FlightLog
+
+__u64 can::FlightLog::wallTimeNs(__u64 hostTimeNs, __u32 session) const
+{
+    if (session >= nSessions || nSessions - session > FLIGHT_SESSIONS) {
+        return 0;
+    }
+    return hostTimeNs + wallOffsetsNs[session % FLIGHT_SESSIONS];
+}
+
+can::FlightLog can::readFlightLog(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open flight recorder \"" + path +
+                                 "\".");
+    }
+    struct stat st;
+    fstat(fd, &st);
+    const size_t mapSize = st.st_size;
+    if (mapSize < sizeof(FlightFileHeader)) {
+        close(fd);
+        throw std::runtime_error("\"" + path + "\" is not a flight recorder.");
+    }
+
+    // shared: a recorder still running is seen as it writes
+    void* map = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("Can't map flight recorder \"" + path +
+                                 "\".");
+    }
+
+    const auto& header = *static_cast<const FlightFileHeader*>(map);
+    const size_t expectedSize =
+        sizeof(FlightFileHeader) + header.nRecords * sizeof(FlightRecord) +
+        static_cast<size_t>(header.nThumbnails) * sizeof(FlightThumbnail);
+    if (std::memcmp(header.magic, FLIGHT_MAGIC, sizeof(FLIGHT_MAGIC)) ||
+        header.version != FLIGHT_VERSION ||
+        header.recordSize != sizeof(FlightRecord) ||
+        header.thumbnailSize != sizeof(FlightThumbnail) ||
+        mapSize != expectedSize) {
+        munmap(map, mapSize);
+        throw std::runtime_error("\"" + path + "\" is not a flight recorder.");
+    }
+
+    FlightLog log;
+    log.nSessions = header.nSessions.load(std::memory_order_relaxed);
+    std::copy(std::begin(header.wallOffsetsNs), std::end(header.wallOffsetsNs),
+              log.wallOffsetsNs);
+
+    const auto* records = reinterpret_cast<const FlightRecord*>(&header + 1);
+    log.records.reserve(header.nRecords);
+    FlightRecord record;
+    for (size_t i = 0; i < header.nRecords; ++i) {
+        if (readSlot(records[i], i, header.nRecords, record)) {
+            log.records.push_back(record);
+        }
+    }
+
+    const auto* thumbnails =
+        reinterpret_cast<const FlightThumbnail*>(records + header.nRecords);
+    FlightThumbnail thumbnail;
+    for (size_t i = 0; i < header.nThumbnails; ++i) {
+        if (readSlot(thumbnails[i], i, header.nThumbnails, thumbnail)) {
+            log.thumbnails.push_back(thumbnail);
+        }
+    }
+    munmap(map, mapSize);
+
+    // from the oldest, wherever the ring had got to
+    auto bySeq = [](const auto& a, const auto& b) { return a.seq < b.seq; };
+    std::sort(log.records.begin(), log.records.end(), bySeq);
+    std::sort(log.thumbnails.begin(), log.thumbnails.end(), bySeq);
+    return log;
+}
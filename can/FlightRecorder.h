@@ -0,0 +1,192 @@
+/*
+ *   An always-on black box: the last minutes of radar and render state, in
+ *   a memory-mapped ring file that outlives a crash of the process.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _FLIGHT_RECORDER_H_
+#define _FLIGHT_RECORDER_H_
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace can {
+
+namespace backsense {
+
+class DetectionData;
+class RadarStateDB;
+struct ObstacleSummary;
+
+} // namespace backsense
+
+enum class FlightRecordType : __u16
+{
+    SESSION = 1, // the recorder was opened
+    DETECTION,   // a DB update: 'ident', 'frame' and the decoded values
+    CYCLE,       // a cycle of the app: 'index' is the FlightCycle
+    ALERT,       // an obstacle alert raised or ended
+    CHANNEL      // a CAN channel went up or down
+};
+
+enum class FlightCycle : __u8
+{
+    RENDER // a frame shown by an AR window
+};
+
+// 64 bytes: a cache line, and never split across pages
+struct FlightRecord
+{
+    // 1 + the position of the record in the ring, 0 while it's written
+    // (only accessed atomically)
+    __u64 seq;
+    __u64 hostTimeNs; // CaptureLogWriter::hostTimeNs()
+    __u32 session;    // of the recorder that wrote it
+    FlightRecordType type;
+    __u8 sensorIdx; // DETECTION, ALERT
+    // DETECTION: object; CYCLE: FlightCycle; CHANNEL: channel
+    __u8 index;
+    __u8 flag; // ALERT: raised; CHANNEL: online
+    __u8 reserved[3];
+    __u32 ident;   // DETECTION: CAN id
+    __u8 frame[8]; // DETECTION: the raw frame
+    // DETECTION: x, y (Distance) and speed (Speed), as raw fixed point;
+    // ALERT: nearest radius (Distance), ttc (ms) and ttc object
+    __s32 values[3];
+    __u64 value; // CYCLE: count
+};
+
+static_assert(sizeof(FlightRecord) == 64, "unexpected record layout");
+
+// a grey picture of the AR window, THUMBNAIL_WIDTH x THUMBNAIL_HEIGHT
+static constexpr unsigned THUMBNAIL_WIDTH = 160;
+static constexpr unsigned THUMBNAIL_HEIGHT = 90;
+
+struct FlightThumbnail
+{
+    __u64 seq; // as FlightRecord's
+    __u64 hostTimeNs;
+    __u32 session;
+    __u8 reserved[44];
+    __u8 pixels[THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT];
+};
+
+static_assert(sizeof(FlightThumbnail) % 64 == 0,
+              "unexpected thumbnail layout");
+
+// the wall clock of the sessions whose records may still be in the file
+static constexpr unsigned FLIGHT_SESSIONS = 16;
+
+// the file: this header, the records, then the thumbnails
+struct alignas(64) FlightFileHeader
+{
+    char magic[8];
+    __u32 version;
+    __u32 recordSize;
+    __u32 thumbnailSize;
+    __u32 nRecords;
+    __u32 nThumbnails;
+    // claimed by every recorder that opens the file, as the positions below
+    std::atomic<__u32> nSessions;
+    // the next position of each ring, claimed by every writer
+    std::atomic<__u64> nextRecord;
+    std::atomic<__u64> nextThumbnail;
+    // the wall clock minus the host clock (which restarts with the
+    // machine), of session i at i % FLIGHT_SESSIONS
+    __s64 wallOffsetsNs[FLIGHT_SESSIONS];
+};
+
+struct FlightRecorderConfig
+{
+    unsigned minutes = 5;
+    // a full BS-9000 setup (8 sensors, 8 objects, 20 Hz) is 1280
+    // detections a second, with room for the cycles and the alerts
+    unsigned recordsPerSecond = 2048;
+    unsigned thumbnailsPerSecond = 1;
+
+    __u32 nRecords() const { return minutes * 60 * recordsPerSecond; }
+    __u32 nThumbnails() const { return minutes * 60 * thumbnailsPerSecond; }
+    // the size of the file, which never grows
+    size_t fileSize() const;
+};
+
+// Every writer claims the next slot of a ring with one atomic increment of
+// the header, fills it and then stamps it with its position: no lock, and
+// any thread may record (the reader threads of every channel, the render
+// loop). The file is mapped shared and its blocks allocated up front, so
+// that a write is a store to memory; what was stored is in the page cache
+// and reaches the disk even if the process dies right after. A slot being
+// written when it does keeps the stamp 0, and is left out by the reader.
+//
+// An existing file of the same geometry is carried on, after a SESSION
+// record, so a restart doesn't wipe the evidence of the crash before it.
+class FlightRecorder
+{
+  public:
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+    FlightRecorder(const std::string& path,
+                   const FlightRecorderConfig& config = {});
+    ~FlightRecorder();
+
+    // an update listener of the DB
+    void onUpdate(const backsense::RadarStateDB& stateDB,
+                  const backsense::DetectionData& state);
+    // an alert listener of the DB
+    void onAlert(unsigned sensorIdx, const backsense::ObstacleSummary& summary,
+                 bool raised);
+    // a state listener of a ChannelSupervisor
+    void recordChannel(unsigned channelIdx, bool online);
+    void recordCycle(FlightCycle cycle, __u64 count);
+    // THUMBNAIL_WIDTH x THUMBNAIL_HEIGHT grey pixels, row by row
+    void recordThumbnail(const __u8* pixels);
+
+  private:
+    // claims a record, has 'fill' set its fields, and publishes it
+    template <typename Fill> void append(FlightRecordType type, Fill&& fill);
+
+    void* m_map = nullptr;
+    size_t m_mapSize = 0;
+    FlightFileHeader* m_header = nullptr;
+    FlightRecord* m_records = nullptr;
+    FlightThumbnail* m_thumbnails = nullptr;
+    __u32 m_session = 0;
+};
+
+// what was in a file, e.g. after a crash
+struct FlightLog
+{
+    std::vector<FlightRecord> records;       // in the order they were claimed
+    std::vector<FlightThumbnail> thumbnails; // idem
+    __u32 nSessions;
+    __s64 wallOffsetsNs[FLIGHT_SESSIONS];
+
+    // since the epoch; 0 if the session is too old to tell
+    __u64 wallTimeNs(__u64 hostTimeNs, __u32 session) const;
+};
+
+// copies the complete slots out, so it may be read while recording
+FlightLog readFlightLog(const std::string& path);
+
+} // namespace can
+
+#endif // _FLIGHT_RECORDER_H_
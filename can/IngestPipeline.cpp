@@ -0,0 +1,247 @@
+/*
+ *   The ingest path as a pipeline of stages (read, decode, DB update, sinks),
+ *   each one fused into the one before it or on a thread of its own.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "IngestPipeline.h"
+#include "AllocCheck.h"
+
+#include <stdexcept>
+
+static __u64 nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// :::: struct PipelineLayout
+
+using can::PipelineLayout;
+
+PipelineLayout PipelineLayout::parse(const std::string& spec)
+{
+    static const char* STAGES[] = {"read", "decode", "update", "sinks"};
+
+    PipelineLayout layout;
+    bool* split[] = {nullptr, &layout.splitDecode, &layout.splitUpdate,
+                     &layout.splitSinks};
+
+    size_t pos = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+        const auto end = spec.find_first_of("|+", pos);
+        if (spec.compare(pos, end - pos, STAGES[i]) != 0 ||
+            (i < 3) == (end == std::string::npos)) {
+            throw std::runtime_error(
+                "Bad pipeline layout \"" + spec +
+                "\", expected e.g. \"read|decode+update|sinks\".");
+        }
+        if (i > 0) {
+            *split[i] = spec[pos - 1] == '|';
+        }
+        pos = end + 1;
+    }
+    return layout;
+}
+
+std::string PipelineLayout::toString() const
+{
+    return std::string("read") + (splitDecode ? "|" : "+") + "decode" +
+           (splitUpdate ? "|" : "+") + "update" + (splitSinks ? "|" : "+") +
+           "sinks";
+}
+
+// :::: class IngestPipeline
+
+using can::IngestPipeline;
+
+constexpr unsigned IngestPipeline::FRAME_QUEUE_LEN;
+constexpr unsigned IngestPipeline::DETECTION_QUEUE_LEN;
+constexpr unsigned IngestPipeline::SINK_QUEUE_LEN;
+
+IngestPipeline::IngestPipeline(backsense::RadarStateDB& stateDB,
+                               CaptureLogWriter* capture, unsigned channelIdx,
+                               const PipelineLayout& layout)
+    : m_ingest(stateDB, capture, channelIdx), m_channelIdx(channelIdx),
+      m_layout(layout),
+      m_readGauges(telemetry::stageGauges(stageName("read").c_str(), 0))
+{
+    if (layout.splitDecode) {
+        m_frames = std::make_unique<FrameQueue>(stageName("decode"));
+        m_decodeGauges = &m_frames->gauges();
+    } else {
+        m_decodeGauges =
+            &telemetry::stageGauges(stageName("decode").c_str(), 0);
+    }
+    if (layout.splitUpdate) {
+        m_detections = std::make_unique<DetectionQueue>(stageName("update"));
+        m_updateGauges = &m_detections->gauges();
+    } else {
+        m_updateGauges =
+            &telemetry::stageGauges(stageName("update").c_str(), 0);
+    }
+
+    if (m_frames) {
+        m_decodeThread = std::thread(&IngestPipeline::runDecode, this);
+    }
+    if (m_detections) {
+        m_updateThread = std::thread(&IngestPipeline::runUpdate, this);
+    }
+}
+
+IngestPipeline::~IngestPipeline() { stop(); }
+
+std::string IngestPipeline::stageName(const std::string& stage) const
+{
+    return "ch" + std::to_string(m_channelIdx) + "." + stage;
+}
+
+void IngestPipeline::addSink(const std::string& name, Sink sink)
+{
+    auto stage = std::make_unique<SinkStage>();
+    stage->sink = std::move(sink);
+    const auto fullName = stageName("sink." + name);
+    if (m_layout.splitSinks) {
+        stage->queue = std::make_unique<SinkQueue>(fullName);
+        stage->gauges = &stage->queue->gauges();
+        stage->thread = std::thread(&IngestPipeline::runSink, std::ref(*stage));
+    } else {
+        stage->gauges = &telemetry::stageGauges(fullName.c_str(), 0);
+    }
+    m_sinks.push_back(std::move(stage));
+}
+
+bool IngestPipeline::push(int frc, const PARAM_STRUCT& param)
+{
+    const auto readNs = nowNs();
+    const bool busOn = m_ingest.accept(frc, param);
+    telemetry::recordLatency(m_readGauges, nowNs() - readNs);
+    if (frc == CANL2_RA_DATAFRAME) {
+        ++m_dataFrames;
+        if (m_nextFrameListener) {
+            // once: the listener may well set the next one
+            auto listener = std::move(m_nextFrameListener);
+            m_nextFrameListener = nullptr;
+            listener();
+        }
+    }
+
+    if (m_frames) {
+        m_frames->push({readNs, frc, param});
+    } else {
+        decodeStage({readNs, frc, param});
+    }
+    return busOn;
+}
+
+void IngestPipeline::decodeStage(const FrameRecord& record)
+{
+    auto state = m_ingest.decode(record.frc, record.param);
+    telemetry::recordLatency(*m_decodeGauges, nowNs() - record.readNs);
+    if (!state) {
+        return;
+    }
+
+    if (m_detections) {
+        m_detections->push({record.readNs, state});
+    } else {
+        updateStage({record.readNs, state});
+    }
+}
+
+void IngestPipeline::updateStage(const DetectionRecord& record)
+{
+    m_ingest.update(*record.state);
+    telemetry::recordLatency(*m_updateGauges, nowNs() - record.readNs);
+
+    for (auto& stage : m_sinks) {
+        if (stage->queue) {
+            stage->queue->push(record);
+        } else {
+            stage->sink(*record.state);
+            telemetry::recordLatency(*stage->gauges, nowNs() - record.readNs);
+        }
+    }
+}
+
+void IngestPipeline::runDecode()
+{
+    telemetry::registerThread("can_decode");
+    unsigned long nRecords = 0;
+    while (auto* record = m_frames->front()) {
+        {
+            // as the reader: no allocation once warmed up
+            alloccheck::NoAllocScope noAlloc(nRecords++ >=
+                                             CANUtils::WARM_UP_EVENTS);
+            decodeStage(*record);
+        }
+        m_frames->pop();
+    }
+}
+
+void IngestPipeline::runUpdate()
+{
+    telemetry::registerThread("can_update");
+    unsigned long nRecords = 0;
+    while (auto* record = m_detections->front()) {
+        {
+            alloccheck::NoAllocScope noAlloc(nRecords++ >=
+                                             CANUtils::WARM_UP_EVENTS);
+            updateStage(*record);
+        }
+        m_detections->pop();
+    }
+}
+
+void IngestPipeline::runSink(SinkStage& stage)
+{
+    // the sinks with a thread of their own may take their time, and
+    // allocate: nothing waits for them
+    telemetry::registerThread("can_sink");
+    while (auto* record = stage.queue->front()) {
+        stage.sink(*record->state);
+        telemetry::recordLatency(*stage.gauges, nowNs() - record->readNs);
+        stage.queue->pop();
+    }
+}
+
+void IngestPipeline::stop()
+{
+    if (m_stopped) {
+        return;
+    }
+    m_stopped = true;
+
+    // in order: a stage has drained its queue, and pushed everything to
+    // the next one, before that one is closed
+    if (m_frames) {
+        m_frames->close();
+        m_decodeThread.join();
+    }
+    if (m_detections) {
+        m_detections->close();
+        m_updateThread.join();
+    }
+    for (auto& stage : m_sinks) {
+        if (stage->queue) {
+            stage->queue->close();
+            stage->thread.join();
+        }
+    }
+}
@@ -0,0 +1,263 @@
+/*
+ *   The ingest path as a pipeline of stages (read, decode, DB update, sinks),
+ *   each one fused into the one before it or on a thread of its own.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INGEST_PIPELINE_H_
+#define _INGEST_PIPELINE_H_
+
+#include "BSFrameHandler.h"
+#include "CANL2.h"
+#include "CANUtils.h" // FrameIngest
+#include "SpscRing.h"
+#include "Telemetry.h"
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace can {
+
+class CaptureLogWriter;
+
+// which stages run on a thread of their own; the others run on the thread
+// of the stage before them
+struct PipelineLayout
+{
+    bool splitDecode = false;
+    bool splitUpdate = false;
+    bool splitSinks = false; // a thread per sink
+
+    // the stages in order, "|" starting a new thread and "+" fusing the
+    // next stage into the current one: e.g. "read|decode+update|sinks".
+    // "read+decode+update+sinks", the default, is all in the reader thread.
+    static PipelineLayout parse(const std::string& spec);
+    std::string toString() const;
+};
+
+// The queue in front of a stage with a thread of its own. Its producer never
+// waits: a full queue drops the record (counted), and the consumer is only
+// woken up if it went to sleep on an empty queue.
+template <typename Record, unsigned N> class StageQueue
+{
+  public:
+    StageQueue(const StageQueue&) = delete;
+    StageQueue& operator=(const StageQueue&) = delete;
+
+    explicit StageQueue(const std::string& name)
+        : m_gauges(telemetry::stageGauges(name.c_str(), N))
+    {
+    }
+
+    // the gauges of the stage that consumes the queue
+    telemetry::StageGauges& gauges() { return m_gauges; }
+
+    // producer only; returns false if the queue is full
+    bool push(const Record& record)
+    {
+        if (!m_ring.tryPush(record)) {
+            telemetry::bump(m_gauges.dropped);
+            return false;
+        }
+        telemetry::bump(m_gauges.enqueued);
+        const auto depth = m_ring.size();
+        if (depth > m_gauges.highWater.load(std::memory_order_relaxed)) {
+            m_gauges.highWater.store(depth, std::memory_order_relaxed);
+        }
+        // the push, then the look at 'm_asleep' (the consumer does the
+        // opposite): at least one of the two sees the other; cleared here,
+        // so that only the first push after it went to sleep wakes it up
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_asleep.load(std::memory_order_relaxed) &&
+            m_asleep.exchange(false, std::memory_order_relaxed)) {
+            wakeUp();
+        }
+        return true;
+    }
+
+    // producer only: nothing more will be pushed
+    void close()
+    {
+        m_closed.store(true);
+        wakeUp();
+    }
+
+    // consumer only: the oldest record, waiting for one if need be; null
+    // once the queue is closed and empty
+    Record* front()
+    {
+        while (true) {
+            if (auto* record = m_ring.front()) {
+                return record;
+            }
+            if (m_closed.load()) {
+                // what was pushed before close() is in the ring by now
+                return m_ring.front();
+            }
+            m_asleep.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeUp.wait(lock, [this] {
+                    return m_ring.front() || m_closed.load();
+                });
+            }
+            m_asleep.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void pop() { m_ring.pop(); }
+
+  private:
+    // The consumer looks at the queue again with the mutex held, before it
+    // waits: taking it here means the notification comes either before that
+    // look (which sees the record) or once it waits, never in between.
+    void wakeUp()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+        m_wakeUp.notify_one();
+    }
+
+    SpscRing<Record, N> m_ring;
+    telemetry::StageGauges& m_gauges;
+    std::atomic<bool> m_closed{false};
+    std::atomic<bool> m_asleep{false};
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+};
+
+// The path of the events read from one channel, through FrameIngest: read
+// (bus health), decode (capture log, decoding), update (the DB, its
+// listeners and alerts) and then the sinks. With the default layout it is
+// FrameIngest::process(), plus the sinks; a split stage gets its own thread,
+// fed through a StageQueue, so that a slow stage only ever delays (or drops)
+// the frames after it: the reader thread goes back to the driver's FIFO as
+// soon as each event is queued.
+class IngestPipeline
+{
+  public:
+    IngestPipeline(const IngestPipeline&) = delete;
+    IngestPipeline& operator=(const IngestPipeline&) = delete;
+
+    // about 0.2 s of a saturated bus (a frame every 222 us at 500 kbit/s)
+    static constexpr unsigned FRAME_QUEUE_LEN = 1024;
+    static constexpr unsigned DETECTION_QUEUE_LEN = 1024;
+    static constexpr unsigned SINK_QUEUE_LEN = 256;
+
+    IngestPipeline(backsense::RadarStateDB& stateDB, CaptureLogWriter* capture,
+                   unsigned channelIdx,
+                   const PipelineLayout& layout = PipelineLayout());
+    ~IngestPipeline();
+
+    // Called after each DB update, with no lock held. A sink fused into the
+    // update stage runs on its thread, and must not allocate; a split one
+    // has a thread of its own, and only drops its own updates if it falls
+    // behind. The sinks are all added before the first frame.
+    using Sink = std::function<void(const backsense::DetectionData&)>;
+    void addSink(const std::string& name, Sink sink);
+
+    // the read stage, from the reader thread: 'frc' and 'param' as returned
+    // by CANL2_read_ac(); returns false if the controller went bus-off
+    bool push(int frc, const PARAM_STRUCT& param);
+
+    // Called once, from the reader thread, as the next data frame is read
+    // (before it is decoded), e.g. the first one after the channel came
+    // back. Past the warm-up of the reader, it must not allocate.
+    using FrameListener = std::function<void()>;
+    void onNextDataFrame(FrameListener listener)
+    {
+        m_nextFrameListener = std::move(listener);
+    }
+
+    // processes whatever is still queued, and stops the stage threads:
+    // nothing may be pushed afterwards
+    void stop();
+
+    unsigned channelIdx() const { return m_channelIdx; }
+    const PipelineLayout& layout() const { return m_layout; }
+    // data frames pushed so far, from the reader thread
+    unsigned long dataFrames() const { return m_dataFrames; }
+
+  private:
+    struct FrameRecord
+    {
+        __u64 readNs; // when it was read: the start of every latency
+        int frc;
+        PARAM_STRUCT param;
+    };
+
+    struct DetectionRecord
+    {
+        __u64 readNs;
+        backsense::OptDetectionData state;
+    };
+
+    using FrameQueue = StageQueue<FrameRecord, FRAME_QUEUE_LEN>;
+    using DetectionQueue = StageQueue<DetectionRecord, DETECTION_QUEUE_LEN>;
+    using SinkQueue = StageQueue<DetectionRecord, SINK_QUEUE_LEN>;
+
+    struct SinkStage
+    {
+        Sink sink;
+        std::unique_ptr<SinkQueue> queue; // null if fused
+        telemetry::StageGauges* gauges;
+        std::thread thread;
+    };
+
+    std::string stageName(const std::string& stage) const;
+
+    void decodeStage(const FrameRecord& record);
+    void updateStage(const DetectionRecord& record);
+
+    void runDecode();
+    void runUpdate();
+    static void runSink(SinkStage& stage);
+
+  private:
+    FrameIngest m_ingest;
+    const unsigned m_channelIdx;
+    const PipelineLayout m_layout;
+
+    // a split stage counts on the gauges of its queue
+    telemetry::StageGauges& m_readGauges;
+    std::unique_ptr<FrameQueue> m_frames;
+    telemetry::StageGauges* m_decodeGauges;
+    std::unique_ptr<DetectionQueue> m_detections;
+    telemetry::StageGauges* m_updateGauges;
+    std::vector<std::unique_ptr<SinkStage>> m_sinks;
+    unsigned long m_dataFrames = 0;
+    FrameListener m_nextFrameListener;
+
+    std::thread m_decodeThread;
+    std::thread m_updateThread;
+    bool m_stopped = false;
+};
+
+} // namespace can
+
+#endif // _INGEST_PIPELINE_H_
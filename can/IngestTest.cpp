@@ -0,0 +1,299 @@
+/*
+ *   Drives the CAN ingest path without a CAN channel, and fails if it
+ *   touches the heap once warmed up. Also measures its latency.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "AllocCheck.h"
+#include "BSFrameHandler.h"
+#include "CANUtils.h"
+#include "CaptureLog.h"
+#include "FlightRecorder.h"
+#include "IngestPipeline.h"
+#include "ObjectTracker.h"
+#include "OccupancyGrid.h"
+#include "RadarStateBus.h"
+#include "RadarStream.h"
+#include "Telemetry.h"
+#include "TrackHistory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace can::backsense;
+
+static constexpr const char* BUS_NAME = "/bs9000_ingest_test";
+static constexpr const char* STREAM_ENDPOINT =
+    "unix:/tmp/bs9000_ingest_test.sock";
+static constexpr const char* CAPTURE_PATH = "/tmp/bs9000_ingest_test.log";
+static constexpr const char* FLIGHT_PATH = "/tmp/bs9000_ingest_test.flight";
+
+// the sensors around a haul truck of 15 m x 8 m: two per side
+static constexpr const char* TRUCK_MOUNTS[MAX_N_SENSORS] = {
+    "0:7.5,-2,0",    "1:7.5,2,0",    "2:3.5,4,90", "3:-3.5,4,90",
+    "4:-7.5,2,180", "5:-7.5,-2,180", "6:-3.5,-4,270", "7:3.5,-4,270"};
+
+static __u32 percentile(std::vector<__u32> samples, unsigned pct)
+{
+    std::sort(samples.begin(), samples.end());
+    return samples[(samples.size() - 1) * pct / 100];
+}
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg
+              << " [-n frames] [-r capture.log] [-S read|decode|update|sinks]"
+              << std::endl;
+}
+
+struct Event
+{
+    int frc;
+    PARAM_STRUCT param;
+};
+
+// the detection cycles of every sensor, with a few frames of other ids and
+// two bus state changes in between
+static std::vector<Event> syntheticEvents(size_t nFrames)
+{
+    std::mt19937 rng(9000);
+    std::vector<Event> events(nFrames);
+    for (size_t i = 0; i < nFrames; ++i) {
+        auto& event = events[i];
+        event.frc = CANL2_RA_DATAFRAME;
+        event.param.Ident = BASE_DETECTION_ID +
+                            (i / MAX_N_OBJS) % MAX_N_SENSORS *
+                                SENSOR_ID_STRIDE +
+                            i % MAX_N_OBJS;
+        event.param.DataLength = N_BYTES;
+        for (auto& byte : event.param.RCV_data) {
+            byte = rng();
+        }
+        if (i % 1000 == 999) {
+            event.param.Ident = 0x100; // not a detection
+        }
+    }
+    events[nFrames / 3].frc = CANL2_RA_CHG_BUS_STATE;
+    events[nFrames / 3].param.Bus_state = CANL2_GBS_ERROR_PASSIVE;
+    events[2 * nFrames / 3].frc = CANL2_RA_CHG_BUS_STATE;
+    events[2 * nFrames / 3].param.Bus_state = CANL2_GBS_ERROR_ACTIVE;
+    return events;
+}
+
+static std::vector<Event> capturedEvents(const std::string& path)
+{
+    const can::CaptureLogReader log(path);
+    std::vector<Event> events(log.size());
+    for (size_t i = 0; i < log.size(); ++i) {
+        const auto& record = log[i];
+        auto& event = events[i];
+        event.frc = record.frameType;
+        can::toParam(record, event.param);
+    }
+    return events;
+}
+
+int main(int argc, char** argv)
+{
+    size_t nFrames = 1000000;
+    std::string capturePath;
+    can::PipelineLayout layout;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+            nFrames = std::stoul(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-r") && i + 1 < argc) {
+            capturePath = argv[++i];
+        } else if (!std::strcmp(argv[i], "-S") && i + 1 < argc) {
+            layout = can::PipelineLayout::parse(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!alloccheck::hooksInstalled()) {
+        std::cerr << "#ERROR: built without AllocHooks.o, nothing would be "
+                     "checked."
+                  << std::endl;
+        return 1;
+    }
+    // every allocation is counted and reported at the end
+    alloccheck::setFatal(false);
+
+    try {
+        const auto events = capturePath.empty() ? syntheticEvents(nFrames)
+                                                : capturedEvents(capturePath);
+        if (events.size() <= can::CANUtils::WARM_UP_EVENTS) {
+            throw std::runtime_error("Not enough frames past the warm-up.");
+        }
+
+        // the listeners of radar_daemon, under names of their own
+        RadarStateDB stateDB(MAX_N_SENSORS);
+        RadarStateBusPublisher publisher(BUS_NAME);
+        stateDB.addUpdateListener(
+            [&publisher](const RadarStateDB& db, const DetectionData& state) {
+                publisher.publishSensor(
+                    db, FrameHandler::getIndexPairFromId(state.getId()).first);
+            });
+        StreamPublisher streamer({STREAM_ENDPOINT});
+        stateDB.addUpdateListener(
+            [&streamer](const RadarStateDB& db, const DetectionData& state) {
+                streamer.onUpdate(db, state);
+            });
+        // ... and the ones of the AR windows
+        auto tracks = std::make_unique<TrackHistory>();
+        auto tracker = std::make_unique<ObjectTracker>();
+        auto grid = std::make_unique<OccupancyGrid>();
+        for (const auto* spec : TRUCK_MOUNTS) {
+            grid->setMount(SensorMount::parse(spec));
+        }
+        stateDB.addUpdateListener(
+            [&tracks, &tracker, &grid](const RadarStateDB& db,
+                                       const DetectionData& state) {
+                tracks->onUpdate(db, state);
+                tracker->onUpdate(db, state);
+                grid->onUpdate(db, state);
+            });
+        auto capture = std::make_unique<can::CaptureLogWriter>(CAPTURE_PATH);
+
+        // does the check work at all?
+        const auto before = alloccheck::violations();
+        {
+            // through a volatile pointer: the compiler can't drop the call
+            void* (*volatile allocate)(size_t) = std::malloc;
+            alloccheck::NoAllocScope noAlloc;
+            std::free(allocate(64));
+        }
+        if (alloccheck::violations() == before) {
+            throw std::runtime_error("The allocation hooks caught nothing.");
+        }
+        const auto baseline = alloccheck::violations();
+
+        // the fusion cycles run alongside, as fast as they can, so that
+        // they race the reader thread as much as possible
+        std::atomic<bool> ingesting{true};
+        std::vector<__u32> fuseNs;
+        fuseNs.reserve(10000000);
+        std::thread fusion([&]() {
+            while (ingesting.load(std::memory_order_relaxed) &&
+                   fuseNs.size() < fuseNs.capacity()) {
+                alloccheck::NoAllocScope noAlloc;
+                const auto start = std::chrono::steady_clock::now();
+                grid->fuse(can::CaptureLogWriter::hostTimeNs());
+                fuseNs.push_back(std::chrono::duration_cast<
+                                     std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now() - start)
+                                     .count());
+            }
+        });
+
+        // as radar_daemon: the stages after the reader may run on threads
+        // of their own (then, with the events as fast as they come, their
+        // queues may well overflow)
+        auto pipeline = std::make_unique<can::IngestPipeline>(
+            stateDB, capture.get(), 0, layout);
+        // radar_daemon -F, timed on its own: its share of the latency
+        std::remove(FLIGHT_PATH);
+        auto flight = std::make_unique<can::FlightRecorder>(FLIGHT_PATH);
+        std::vector<__u32> flightNs;
+        flightNs.reserve(events.size());
+        pipeline->addSink("flight", [&](const DetectionData& state) {
+            const auto start = std::chrono::steady_clock::now();
+            flight->onUpdate(stateDB, state);
+            flightNs.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count());
+        });
+        std::vector<__u32> latencyNs(events.size());
+        std::thread reader([&]() {
+            // as CANUtils::readMsgs(), minus the driver
+            telemetry::registerThread("can_reader");
+            for (size_t i = 0; i < events.size(); ++i) {
+                alloccheck::NoAllocScope noAlloc(
+                    i >= can::CANUtils::WARM_UP_EVENTS);
+                const auto start = std::chrono::steady_clock::now();
+                pipeline->push(events[i].frc, events[i].param);
+                latencyNs[i] = std::chrono::duration_cast<
+                                   std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count();
+            }
+        });
+        reader.join();
+        pipeline.reset();
+        ingesting = false;
+        fusion.join();
+        capture.reset();
+        std::remove(CAPTURE_PATH);
+        flight.reset();
+        std::remove(FLIGHT_PATH);
+
+        const auto nAllocs = alloccheck::violations() - baseline;
+        std::vector<__u32> steady(
+            latencyNs.begin() + can::CANUtils::WARM_UP_EVENTS,
+            latencyNs.end());
+        std::cout << events.size() << " events, "
+                  << can::CANUtils::WARM_UP_EVENTS << " of warm-up, stages "
+                  << layout.toString() << "\n"
+                  << "latency: " << percentile(steady, 50) << " ns median, "
+                  << percentile(steady, 99) << " ns p99, "
+                  << percentile(steady, 100) << " ns max\n"
+                  << "fusion: " << fuseNs.size() << " cycles, "
+                  << percentile(fuseNs, 50) << " ns median, "
+                  << percentile(fuseNs, 99) << " ns p99, "
+                  << grid->droppedHits() << " hits dropped\n"
+                  << "flight recorder: " << flightNs.size() << " updates, "
+                  << percentile(flightNs, 50) << " ns median, "
+                  << percentile(flightNs, 99) << " ns p99\n"
+                  << "allocations after the warm-up: " << nAllocs
+                  << std::endl;
+        // the queues and latencies of the stages, as exported
+        std::istringstream metrics(telemetry::renderPrometheusText());
+        std::string line;
+        while (std::getline(metrics, line)) {
+            if (line.compare(0, 13, "bs9000_stage_") == 0 &&
+                line.find("_bucket") == std::string::npos) {
+                std::cout << line << "\n";
+            }
+        }
+
+        if (nAllocs) {
+            std::cerr << "#ERROR: the ingest path allocated." << std::endl;
+            return 1;
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,591 @@
+/*
+ *   Microbenchmarks of the CAN decode and state update path, with results
+ *   that can be compared between builds.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "AllocCheck.h"
+#include "BSFrameHandler.h"
+#include "CANUtils.h"
+#include "CaptureLog.h"
+#include "TrafficGenerator.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace can::backsense;
+
+// every case is run this many times; its median is reported
+static constexpr unsigned N_RUNS = 5;
+// the synthetic frames: a hundred cycles of every sensor
+static constexpr size_t N_SYNTHETIC_FRAMES = 100 * MAX_N_SENSORS * MAX_N_OBJS;
+static const unsigned SENSOR_COUNTS[] = {1, 4, 8};
+// the mixed traffic: this many frames of other ECUs per radar frame, a
+// quarter of them extended (J1939)
+static constexpr unsigned N_OTHERS_PER_RADAR = 9;
+
+// what the results of the operations are folded into, so that none is
+// optimized away
+static volatile __u64 s_sink;
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg
+              << " [-n ops] [-r capture.log] [-o results.csv]"
+                 " [-b baseline.csv [-t tolerance %]]"
+              << std::endl;
+}
+
+// The core cycles of the calling thread, from the PMU; where the kernel
+// doesn't give access to it (perf_event_paranoid, a VM), the time stamp
+// counter instead, which counts at a fixed rate.
+class CycleCounter
+{
+  public:
+    CycleCounter(const CycleCounter&) = delete;
+    CycleCounter& operator=(const CycleCounter&) = delete;
+
+    CycleCounter()
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = syscall(__NR_perf_event_open, &attr, 0 /* this thread */,
+                       -1 /* any cpu */, -1 /* no group */, 0);
+    }
+
+    ~CycleCounter()
+    {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    __u64 read() const
+    {
+        __u64 count = 0;
+        if (m_fd >= 0) {
+            if (::read(m_fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+            return count;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        count = __rdtsc();
+#endif
+        return count;
+    }
+
+    const char* source() const
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return m_fd >= 0 ? "cpu" : "tsc";
+#else
+        return m_fd >= 0 ? "cpu" : "none";
+#endif
+    }
+
+  private:
+    int m_fd = -1;
+};
+
+struct Result
+{
+    std::string name;
+    unsigned nSensors;
+    std::string frames; // synthetic or recorded
+    size_t nOps;
+    double nsPerOp;
+    double opsPerS;
+    double cyclesPerOp;
+    double allocsPerOp; // negative: not counted
+};
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+// Runs 'op(i)' for i in [0, nOps), N_RUNS times, after a warm-up pass.
+// The allocations are counted with the hooks of AllocHooks.o, the runs being
+// no-alloc scopes.
+template <typename Op>
+static Result measure(const CycleCounter& counter, const std::string& name,
+                      unsigned nSensors, const std::string& frames,
+                      size_t nOps, Op&& op)
+{
+    for (size_t i = 0; i < nOps; ++i) {
+        op(i);
+    }
+
+    std::vector<double> nsPerOp;
+    std::vector<double> cyclesPerOp;
+    __u64 nAllocs = 0;
+    for (unsigned run = 0; run < N_RUNS; ++run) {
+        const auto allocsBefore = alloccheck::violations();
+        const auto cyclesBefore = counter.read();
+        const auto start = std::chrono::steady_clock::now();
+        {
+            alloccheck::NoAllocScope noAlloc;
+            for (size_t i = 0; i < nOps; ++i) {
+                op(i);
+            }
+        }
+        const std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        const auto cycles = counter.read() - cyclesBefore;
+        nAllocs += alloccheck::violations() - allocsBefore;
+        nsPerOp.push_back(elapsed.count() / nOps);
+        cyclesPerOp.push_back(static_cast<double>(cycles) / nOps);
+    }
+
+    Result result;
+    result.name = name;
+    result.nSensors = nSensors;
+    result.frames = frames;
+    result.nOps = nOps;
+    result.nsPerOp = median(nsPerOp);
+    result.opsPerS = 1e9 / result.nsPerOp;
+    result.cyclesPerOp = median(cyclesPerOp);
+    result.allocsPerOp = alloccheck::hooksInstalled()
+                             ? static_cast<double>(nAllocs) / N_RUNS / nOps
+                             : -1;
+    return result;
+}
+
+// random payloads, the objects of each sensor in turn
+static std::vector<PARAM_STRUCT> syntheticFrames()
+{
+    std::mt19937 rng(9000);
+    std::vector<PARAM_STRUCT> frames(N_SYNTHETIC_FRAMES);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        auto& frame = frames[i];
+        std::memset(&frame, 0, sizeof(frame));
+        frame.Ident = BASE_DETECTION_ID +
+                      (i / MAX_N_OBJS) % MAX_N_SENSORS * SENSOR_ID_STRIDE +
+                      i % MAX_N_OBJS;
+        frame.DataLength = N_BYTES;
+        for (auto& byte : frame.RCV_data) {
+            byte = rng();
+        }
+    }
+    return frames;
+}
+
+// the detection frames of a capture log
+static std::vector<PARAM_STRUCT> recordedFrames(const std::string& path)
+{
+    const can::CaptureLogReader log(path);
+    const FrameHandler frameHandler;
+    std::vector<PARAM_STRUCT> frames;
+    for (size_t i = 0; i < log.size(); ++i) {
+        PARAM_STRUCT frame;
+        can::toParam(log[i], frame);
+        if (log[i].frameType == CANL2_RA_DATAFRAME &&
+            frameHandler.isDetectionObjectId(frame.Ident)) {
+            frames.push_back(frame);
+        }
+    }
+    if (frames.empty()) {
+        throw std::runtime_error("No detection frames in \"" + path + "\".");
+    }
+    return frames;
+}
+
+// the same frames, as sent by the first 'nSensors' sensors only
+static std::vector<PARAM_STRUCT>
+spreadOver(std::vector<PARAM_STRUCT> frames, unsigned nSensors)
+{
+    for (auto& frame : frames) {
+        const auto offset = frame.Ident - BASE_DETECTION_ID;
+        frame.Ident = BASE_DETECTION_ID +
+                      offset / SENSOR_ID_STRIDE % nSensors * SENSOR_ID_STRIDE +
+                      offset % SENSOR_ID_STRIDE;
+    }
+    return frames;
+}
+
+// a frame on the bus, and how the adapter would return it
+struct BusFrame
+{
+    int frc; // CANL2_RA_DATAFRAME or CANL2_RA_XTD_DATAFRAME
+    PARAM_STRUCT param;
+};
+
+// The frames of 'nSensors' sensors, as the TrafficGenerator sends them,
+// each followed by N_OTHERS_PER_RADAR frames of the rest of the truck bus:
+// standard ids that are no detection id, and extended ones.
+static std::vector<BusFrame> mixedFrames(unsigned nSensors)
+{
+    TrafficConfig config;
+    config.nSensors = nSensors;
+    TrafficGenerator generator(config);
+    const FrameHandler frameHandler;
+    std::mt19937 rng(9000);
+
+    std::vector<BusFrame> frames;
+    frames.reserve(N_SYNTHETIC_FRAMES * (1 + N_OTHERS_PER_RADAR));
+    for (size_t i = 0; i < N_SYNTHETIC_FRAMES; ++i) {
+        frames.push_back({CANL2_RA_DATAFRAME, generator.next().param});
+        for (unsigned j = 0; j < N_OTHERS_PER_RADAR; ++j) {
+            BusFrame other = frames.back();
+            if (rng() % 4 == 0) {
+                other.frc = CANL2_RA_XTD_DATAFRAME;
+                other.param.Ident = rng() & 0x1FFFFFFF;
+            } else {
+                other.frc = CANL2_RA_DATAFRAME;
+                do {
+                    other.param.Ident = rng() % N_STD_IDS;
+                } while (frameHandler.isDetectionObjectId(other.param.Ident));
+            }
+            for (auto& byte : other.param.RCV_data) {
+                byte = rng();
+            }
+            frames.push_back(other);
+        }
+    }
+    return frames;
+}
+
+// The mixed traffic through the host alone (every frame reaches it), and
+// through the acceptance filter of the adapter first. The filter runs in
+// the adapter: its own cost is in the second case, but what it saves the
+// host is the share of the frames it passes, reported in 'notes'.
+static void runFilterCases(const CycleCounter& counter, size_t nOps,
+                           std::vector<Result>& results,
+                           std::vector<std::string>& notes)
+{
+    for (const auto nSensors : SENSOR_COUNTS) {
+        const auto frames = mixedFrames(nSensors);
+        const auto nFrames = frames.size();
+        const auto filter = FrameHandler::acceptanceFilter(nSensors);
+        const auto passes = [&filter](const BusFrame& frame) {
+            return frame.frc == CANL2_RA_XTD_DATAFRAME
+                       ? !filter.rejectExtended
+                       : filter.accepts(frame.param.Ident);
+        };
+
+        FrameHandler frameHandler;
+        __u64 sink = 0;
+        // what the reader does with a frame: the exact check of the id
+        // (the bitmap), then the decoding of the detection frames
+        const auto host = [&](const BusFrame& frame) {
+            if (frame.frc != CANL2_RA_DATAFRAME) {
+                return;
+            }
+            const auto state = frameHandler.processRcvFrame(frame.param);
+            if (state) {
+                sink += state->getId();
+            }
+        };
+
+        results.push_back(measure(counter, "hostFilter", nSensors, "mixed",
+                                  nOps, [&](size_t i) {
+                                      host(frames[i % nFrames]);
+                                  }));
+        results.push_back(measure(counter, "adapterFilter", nSensors,
+                                  "mixed", nOps, [&](size_t i) {
+                                      const auto& frame = frames[i % nFrames];
+                                      if (passes(frame)) {
+                                          host(frame);
+                                      }
+                                  }));
+        s_sink = sink;
+
+        size_t nPassed = 0;
+        size_t nRadar = 0;
+        for (const auto& frame : frames) {
+            nPassed += passes(frame);
+            nRadar += frame.frc == CANL2_RA_DATAFRAME &&
+                      frameHandler.isDetectionObjectId(frame.param.Ident);
+        }
+        std::ostringstream note;
+        note << std::fixed << std::setprecision(1) << "mixed traffic, "
+             << nSensors << " sensors: " << 100.0 * nRadar / nFrames
+             << "% radar frames; the adapter passes "
+             << 100.0 * nPassed / nFrames << "% of the frames to the host.";
+        notes.push_back(note.str());
+    }
+}
+
+static void runCases(const CycleCounter& counter,
+                     const std::vector<PARAM_STRUCT>& baseFrames,
+                     const std::string& framesName, size_t nOps,
+                     std::vector<Result>& results)
+{
+    for (const auto nSensors : SENSOR_COUNTS) {
+        const auto frames = spreadOver(baseFrames, nSensors);
+        const auto nFrames = frames.size();
+
+        FrameHandler frameHandler;
+        std::vector<DetectionData> states;
+        states.reserve(nFrames);
+        for (const auto& frame : frames) {
+            states.push_back(*frameHandler.processRcvFrame(frame));
+        }
+
+        __u64 sink = 0;
+        results.push_back(measure(
+            counter, "processRcvFrame", nSensors, framesName, nOps,
+            [&](size_t i) {
+                const auto state =
+                    frameHandler.processRcvFrame(frames[i % nFrames]);
+                sink += state->getId();
+            }));
+
+        results.push_back(measure(
+            counter, "getters", nSensors, framesName, nOps, [&](size_t i) {
+                const auto& state = states[i % nFrames];
+                sink += state.getPolarRadius().steps() +
+                        state.getPolarAngle() + state.getX().steps() +
+                        state.getY().steps() +
+                        state.getRelativeSpeed().steps() +
+                        state.getSignalPower() + state.getObjectId() +
+                        state.getObjectAppearanceStatus() +
+                        state.getTriggerEvent() + state.getDetectionFlag();
+            }));
+
+        // as the reader does it: under the lock of the shard; autoClear()
+        // wipes the shard once per cycle of its sensors
+        RadarStateDB stateDB(nSensors);
+        results.push_back(measure(
+            counter, "updateState", nSensors, framesName, nOps,
+            [&](size_t i) {
+                const auto& state = states[i % nFrames];
+                const auto sensorIdx =
+                    FrameHandler::getIndexPairFromId(state.getId()).first;
+                std::lock_guard<std::mutex> lock(
+                    stateDB.shardMutex(sensorIdx));
+                stateDB.updateState(DetectionData(state));
+            }));
+        sink += stateDB.obstacleSummary().nearestObj;
+
+        char hex[can::CANUtils::HEX_STR_LEN + 1];
+        results.push_back(measure(
+            counter, "formatHexStr", nSensors, framesName, nOps,
+            [&](size_t i) {
+                const auto& frame = frames[i % nFrames];
+                can::CANUtils::formatHexStr(frame.RCV_data, frame.DataLength,
+                                            hex);
+                sink += hex[3];
+            }));
+
+        s_sink = sink;
+    }
+}
+
+static const char* const CSV_HEADER =
+    "benchmark,sensors,frames,ops,ns_per_op,ops_per_s,cycles_per_op,"
+    "allocs_per_op";
+
+static void writeResults(const std::string& path,
+                         const std::vector<Result>& results,
+                         const char* cycleSource)
+{
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Can't write \"" + path + "\".");
+    }
+    out << "# cycles: " << cycleSource << "\n" << CSV_HEADER << "\n";
+    for (const auto& result : results) {
+        out << result.name << "," << result.nSensors << "," << result.frames
+            << "," << result.nOps << "," << result.nsPerOp << ","
+            << result.opsPerS << "," << result.cyclesPerOp << ","
+            << result.allocsPerOp << "\n";
+    }
+    if (!out) {
+        throw std::runtime_error("Can't write \"" + path + "\".");
+    }
+}
+
+using ResultKey = std::tuple<std::string, unsigned, std::string>;
+
+static std::map<ResultKey, Result> readResults(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Can't read \"" + path + "\".");
+    }
+    std::map<ResultKey, Result> results;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#' || line == CSV_HEADER) {
+            continue;
+        }
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream fields(line);
+        Result result;
+        if (!(fields >> result.name >> result.nSensors >> result.frames >>
+              result.nOps >> result.nsPerOp >> result.opsPerS >>
+              result.cyclesPerOp >> result.allocsPerOp)) {
+            throw std::runtime_error("Bad line in \"" + path + "\": " + line);
+        }
+        results[ResultKey(result.name, result.nSensors, result.frames)] =
+            result;
+    }
+    return results;
+}
+
+// a case is a regression if it got slower by more than 'tolerancePct', or
+// if it allocates more than it did
+static unsigned countRegressions(const std::vector<Result>& results,
+                                 const std::map<ResultKey, Result>& baseline,
+                                 double tolerancePct)
+{
+    unsigned nRegressions = 0;
+    for (const auto& result : results) {
+        const auto it = baseline.find(
+            ResultKey(result.name, result.nSensors, result.frames));
+        if (it == baseline.end()) {
+            continue;
+        }
+        const auto& base = it->second;
+        const bool slower =
+            result.nsPerOp > base.nsPerOp * (1 + tolerancePct / 100);
+        const bool allocates = base.allocsPerOp >= 0 &&
+                               result.allocsPerOp > base.allocsPerOp;
+        if (slower || allocates) {
+            std::cerr << "#ERROR: " << result.name << ", " << result.nSensors
+                      << " sensors, " << result.frames << " frames: "
+                      << result.nsPerOp << " ns/op, "
+                      << result.allocsPerOp << " allocs/op (baseline "
+                      << base.nsPerOp << " ns/op, " << base.allocsPerOp
+                      << " allocs/op)." << std::endl;
+            ++nRegressions;
+        }
+    }
+    return nRegressions;
+}
+
+int main(int argc, char** argv)
+{
+    size_t nOps = 200000;
+    std::string capturePath;
+    std::string outPath;
+    std::string baselinePath;
+    double tolerancePct = 10;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+            nOps = std::stoul(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-r") && i + 1 < argc) {
+            capturePath = argv[++i];
+        } else if (!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+            outPath = argv[++i];
+        } else if (!std::strcmp(argv[i], "-b") && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (!std::strcmp(argv[i], "-t") && i + 1 < argc) {
+            tolerancePct = std::stod(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!nOps) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try {
+        if (!alloccheck::hooksInstalled()) {
+            std::cerr << "#WARNING: built without AllocHooks.o, the "
+                         "allocations are not counted."
+                      << std::endl;
+        }
+        // counted, not fatal
+        alloccheck::setFatal(false);
+
+        const CycleCounter counter;
+        std::vector<Result> results;
+        std::vector<std::string> notes;
+        runCases(counter, syntheticFrames(), "synthetic", nOps, results);
+        if (!capturePath.empty()) {
+            runCases(counter, recordedFrames(capturePath), "recorded", nOps,
+                     results);
+        }
+        runFilterCases(counter, nOps, results, notes);
+
+        std::cout << std::left << std::setw(16) << "benchmark"
+                  << std::setw(9) << "sensors" << std::setw(11) << "frames"
+                  << std::right << std::setw(10) << "ns/op" << std::setw(14)
+                  << "ops/s" << std::setw(16)
+                  << (std::string("cycles/op (") + counter.source() + ")")
+                  << std::setw(11) << "allocs/op" << "\n";
+        for (const auto& result : results) {
+            std::cout << std::left << std::setw(16) << result.name
+                      << std::setw(9) << result.nSensors << std::setw(11)
+                      << result.frames << std::right << std::fixed
+                      << std::setprecision(1) << std::setw(10)
+                      << result.nsPerOp << std::setprecision(0)
+                      << std::setw(14) << result.opsPerS
+                      << std::setprecision(1) << std::setw(16)
+                      << result.cyclesPerOp << std::setprecision(2)
+                      << std::setw(11) << result.allocsPerOp << "\n";
+        }
+        for (const auto& note : notes) {
+            std::cout << "#INFO: " << note << "\n";
+        }
+        std::cout.flush();
+
+        if (!outPath.empty()) {
+            writeResults(outPath, results, counter.source());
+        }
+        if (!baselinePath.empty()) {
+            const auto nRegressions = countRegressions(
+                results, readResults(baselinePath), tolerancePct);
+            if (nRegressions) {
+                std::cerr << "#ERROR: " << nRegressions
+                          << " regressions against \"" << baselinePath
+                          << "\"." << std::endl;
+                return 2;
+            }
+            std::cerr << "#INFO: no regression against \"" << baselinePath
+                      << "\" (tolerance " << tolerancePct << "%)."
+                      << std::endl;
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ *   Tracks the objects of every sensor across cycles with a Kalman filter,
+ *   and extrapolates them to the time they are drawn at.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ObjectTracker.h"
+#include "CaptureLog.h" // hostTimeNs()
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+// the positions come in quarter metre steps, on top of the sensor's own
+// error: 0.25 m of standard deviation
+static constexpr double MEAS_VAR = 0.25 * 0.25;
+// what a vehicle or a person around the truck may do: 3 m/s^2
+static constexpr double ACCEL_VAR = 3.0 * 3.0;
+// nothing is known of the speed of a new object: 5 m/s
+static constexpr double INIT_VEL_VAR = 5.0 * 5.0;
+// a detection further than this from its track is another object
+static constexpr double GATE_DISTANCE = 3.0;
+
+// the object id of the sensor has 3 bits
+static_assert(can::backsense::MAX_N_OBJS == 8, "one track per object id");
+
+// :::: struct AxisFilter
+
+using can::backsense::AxisFilter;
+
+void AxisFilter::init(double z, double measVar, double velVar)
+{
+    pos = z;
+    vel = 0;
+    p00 = measVar;
+    p01 = 0;
+    p11 = velVar;
+}
+
+void AxisFilter::predict(double dt, double accelVar)
+{
+    // F = [1 dt; 0 1], Q = accelVar * [dt^4/4 dt^3/2; dt^3/2 dt^2]
+    const double dt2 = dt * dt;
+    pos += vel * dt;
+    p00 += 2 * dt * p01 + dt2 * p11 + accelVar * dt2 * dt2 / 4;
+    p01 += dt * p11 + accelVar * dt2 * dt / 2;
+    p11 += accelVar * dt2;
+}
+
+void AxisFilter::update(double z, double measVar)
+{
+    // H = [1 0]
+    const double s = p00 + measVar;
+    const double k0 = p00 / s;
+    const double k1 = p01 / s;
+    const double innovation = z - pos;
+    pos += k0 * innovation;
+    vel += k1 * innovation;
+    p11 -= k1 * p01;
+    p01 *= 1 - k0;
+    p00 *= 1 - k0;
+}
+
+// :::: class ObjectTracker
+
+using can::backsense::ObjectTracker;
+
+constexpr __u64 ObjectTracker::TRACK_EXPIRY_NS;
+constexpr __u64 ObjectTracker::MAX_PREDICTION_NS;
+
+void ObjectTracker::onUpdate(const RadarStateDB& /*stateDB*/,
+                             const DetectionData& newState)
+{
+    addDetection(newState, CaptureLogWriter::hostTimeNs());
+}
+
+void ObjectTracker::addDetection(const DetectionData& state,
+                                 __u64 hostTimeNs)
+{
+    if (state.getDetectionFlag()) {
+        // an empty slot: which object left is unknown, its track expires
+        return;
+    }
+
+    const auto idxPair = FrameHandler::getIndexPairFromId(state.getId());
+    auto& track = m_tracks[idxPair.first][state.getObjectId()];
+    const double x = state.getX().toDouble();
+    const double y = state.getY().toDouble();
+
+    auto seq = track.sequence.load(std::memory_order_relaxed);
+    track.sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // the appearance status may stay up for a few cycles: only its rising
+    // edge is a new object
+    const bool appearing = state.getObjectAppearanceStatus();
+    bool restart = !track.active || (appearing && !track.appearing) ||
+                   hostTimeNs - track.lastNs > TRACK_EXPIRY_NS;
+    if (!restart) {
+        const double dt = (hostTimeNs - track.lastNs) * 1e-9;
+        track.x.predict(dt, ACCEL_VAR);
+        track.y.predict(dt, ACCEL_VAR);
+        const double dx = x - track.x.pos;
+        const double dy = y - track.y.pos;
+        restart = dx * dx + dy * dy > GATE_DISTANCE * GATE_DISTANCE;
+    }
+
+    if (restart) {
+        track.x.init(x, MEAS_VAR, INIT_VEL_VAR);
+        track.y.init(y, MEAS_VAR, INIT_VEL_VAR);
+        track.active = true;
+    } else {
+        track.x.update(x, MEAS_VAR);
+        track.y.update(y, MEAS_VAR);
+    }
+    track.appearing = appearing;
+    track.objIdx = idxPair.second;
+    track.lastNs = hostTimeNs;
+
+    track.sequence.store(seq + 2, std::memory_order_release);
+}
+
+unsigned ObjectTracker::predictAt(unsigned sensorIdx, __u64 hostTimeNs,
+                                  TrackedObject (&objects)[MAX_N_OBJS]) const
+{
+    assert(sensorIdx < MAX_N_SENSORS);
+
+    unsigned nObjects = 0;
+    for (int objectId = 0; objectId < static_cast<int>(MAX_N_OBJS);
+         ++objectId) {
+        const auto& track = m_tracks[sensorIdx][objectId];
+
+        bool active;
+        unsigned objIdx;
+        __u64 lastNs;
+        AxisFilter x, y;
+        while (true) {
+            auto before = track.sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                // writer in progress
+                continue;
+            }
+
+            active = track.active;
+            objIdx = track.objIdx;
+            lastNs = track.lastNs;
+            std::memcpy(&x, &track.x, sizeof(x));
+            std::memcpy(&y, &track.y, sizeof(y));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto after = track.sequence.load(std::memory_order_relaxed);
+            if (before == after) {
+                break;
+            }
+        }
+
+        // a frame drawn a little before the last detection arrived does
+        // not go backwards
+        const __u64 ageNs = hostTimeNs > lastNs ? hostTimeNs - lastNs : 0;
+        if (!active || ageNs > TRACK_EXPIRY_NS) {
+            continue;
+        }
+
+        const double dt = std::min(ageNs, MAX_PREDICTION_NS) * 1e-9;
+        auto& object = objects[nObjects++];
+        object.objectId = objectId;
+        object.objIdx = objIdx;
+        object.x = x.pos + x.vel * dt;
+        object.y = y.pos + y.vel * dt;
+        object.vx = x.vel;
+        object.vy = y.vel;
+        object.ageNs = ageNs;
+    }
+    return nObjects;
+}
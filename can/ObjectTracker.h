@@ -0,0 +1,114 @@
+/*
+ *   Tracks the objects of every sensor across cycles with a Kalman filter,
+ *   and extrapolates them to the time they are drawn at.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BACKSENSE_OBJECT_TRACKER_H_
+#define _BACKSENSE_OBJECT_TRACKER_H_
+
+#include "BSFrameHandler.h"
+
+#include <linux/types.h>
+
+#include <atomic>
+
+namespace can {
+
+namespace backsense {
+
+// Constant velocity model along one axis: state (position, velocity) and
+// its 2x2 covariance. With no coupling between the axes in the model or in
+// the measurement noise, the 4 state filter of a track splits exactly in
+// one of these for x and one for y.
+struct AxisFilter
+{
+    double pos; // m
+    double vel; // m/s
+    double p00, p01, p11;
+
+    void init(double z, double measVar, double velVar);
+    // forward by 'dt' seconds, with white acceleration noise of variance
+    // 'accelVar'
+    void predict(double dt, double accelVar);
+    void update(double z, double measVar);
+};
+
+// a track, as estimated for a given time
+struct TrackedObject
+{
+    int objectId;    // the sensor's id for the object
+    unsigned objIdx; // the DB slot of its last detection
+    double x;        // m
+    double y;        // m
+    double vx;       // m/s
+    double vy;       // m/s
+    __u64 ageNs;     // since the last detection
+};
+
+// Detections are associated to tracks through the object id of the sensor.
+// A track starts anew when the appearance status starts flagging a new
+// object, or when a detection lands too far from where the track was
+// expected. A track nobody detects for TRACK_EXPIRY_NS is dropped.
+class ObjectTracker
+{
+  public:
+    ObjectTracker(const ObjectTracker&) = delete;
+    ObjectTracker& operator=(const ObjectTracker&) = delete;
+
+    ObjectTracker() = default;
+
+    static constexpr __u64 TRACK_EXPIRY_NS = 500000000;
+    // a track is never extrapolated further than this past its last
+    // detection (it only coasts for a short while)
+    static constexpr __u64 MAX_PREDICTION_NS = 250000000;
+
+    // to be installed as an update listener of the DB (the shard of the
+    // sensor is locked by the caller: one writer per track)
+    void onUpdate(const RadarStateDB& stateDB, const DetectionData& newState);
+    // ... or with the time of the detection (e.g. replays)
+    void addDetection(const DetectionData& state, __u64 hostTimeNs);
+
+    // Every live track of a sensor, moved to 'hostTimeNs' (in the clock of
+    // CaptureLogWriter::hostTimeNs()): e.g. the time a video frame will be
+    // shown, so that what is drawn does not lag behind the obstacles.
+    // Lock-free; returns the number of objects written.
+    unsigned predictAt(unsigned sensorIdx, __u64 hostTimeNs,
+                       TrackedObject (&objects)[MAX_N_OBJS]) const;
+
+  private:
+    struct alignas(64) Track
+    {
+        std::atomic<__u32> sequence{0};
+        bool active = false;
+        bool appearing = false; // appearance status of the last detection
+        unsigned objIdx = 0;
+        __u64 lastNs = 0;
+        AxisFilter x;
+        AxisFilter y;
+    };
+
+    // one track per object id (3 bits) of each sensor
+    Track m_tracks[MAX_N_SENSORS][MAX_N_OBJS];
+};
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _BACKSENSE_OBJECT_TRACKER_H_
@@ -0,0 +1,282 @@
+/*
+ *   Fuses the detections of every sensor into one occupancy grid around
+ *   the vehicle.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "OccupancyGrid.h"
+#include "CaptureLog.h" // hostTimeNs()
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OCCUPANCY_X86 1
+#include <immintrin.h>
+#endif
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+static constexpr unsigned N_CELLS =
+    can::backsense::GRID_CELLS * can::backsense::GRID_CELLS;
+static_assert(N_CELLS <= 0x10000, "cell indexes are queued in 16 bits");
+static_assert(N_CELLS % 32 == 0, "the kernels have no remainder loop");
+
+static constexpr __u8 HIT = 0xFF;
+
+// :::: decay kernels
+
+// all saturating subtractions: a cell never wraps around to occupied
+
+#ifdef OCCUPANCY_X86
+
+// SSE2 is part of x86-64: no dispatch needed
+static void decaySse2(const __u8* in, __u8* out, size_t n, __u8 amount)
+{
+    const __m128i sub = _mm_set1_epi8(static_cast<char>(amount));
+    for (size_t i = 0; i < n; i += 16) {
+        const __m128i cells =
+            _mm_load_si128(reinterpret_cast<const __m128i*>(in + i));
+        _mm_store_si128(reinterpret_cast<__m128i*>(out + i),
+                        _mm_subs_epu8(cells, sub));
+    }
+}
+
+__attribute__((target("avx2"))) static void
+decayAvx2(const __u8* in, __u8* out, size_t n, __u8 amount)
+{
+    const __m256i sub = _mm256_set1_epi8(static_cast<char>(amount));
+    for (size_t i = 0; i < n; i += 32) {
+        const __m256i cells =
+            _mm256_load_si256(reinterpret_cast<const __m256i*>(in + i));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(out + i),
+                           _mm256_subs_epu8(cells, sub));
+    }
+}
+
+#else
+
+static void decayScalar(const __u8* in, __u8* out, size_t n, __u8 amount)
+{
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = in[i] > amount ? in[i] - amount : 0;
+    }
+}
+
+#endif
+
+static void (*selectDecay())(const __u8*, __u8*, size_t, __u8)
+{
+#ifdef OCCUPANCY_X86
+    return __builtin_cpu_supports("avx2") ? decayAvx2 : decaySse2;
+#else
+    return decayScalar;
+#endif
+}
+
+// :::: struct SensorMount
+
+using can::backsense::SensorMount;
+
+SensorMount SensorMount::parse(const std::string& spec)
+{
+    SensorMount mount;
+    std::istringstream in(spec);
+    char sep1 = 0, sep2 = 0, sep3 = 0;
+
+    if (!(in >> mount.sensorIdx >> sep1 >> mount.x >> sep2 >> mount.y >>
+          sep3 >> mount.yawDeg) ||
+        sep1 != ':' || sep2 != ',' || sep3 != ',' ||
+        mount.sensorIdx >= MAX_N_SENSORS || !(in >> std::ws).eof()) {
+        throw std::runtime_error("Invalid sensor mount \"" + spec +
+                                 "\", expected <sensor>:<x>,<y>,<yaw>.");
+    }
+    return mount;
+}
+
+void SensorMount::toVehicle(double sx, double sy, double& x,
+                            double& y) const
+{
+    const double yaw = yawDeg * M_PI / 180;
+    x = this->x + std::cos(yaw) * sx - std::sin(yaw) * sy;
+    y = this->y + std::sin(yaw) * sx + std::cos(yaw) * sy;
+}
+
+// :::: struct OccupancyCells
+
+using can::backsense::OccupancyCells;
+
+bool OccupancyCells::toCell(double x, double y, unsigned& row,
+                            unsigned& col)
+{
+    const double half = GRID_CELLS / 2;
+    const double r = std::floor(x * GRID_CELLS_PER_METRE + half);
+    const double c = std::floor(y * GRID_CELLS_PER_METRE + half);
+    if (r < 0 || r >= GRID_CELLS || c < 0 || c >= GRID_CELLS) {
+        return false;
+    }
+    row = static_cast<unsigned>(r);
+    col = static_cast<unsigned>(c);
+    return true;
+}
+
+double OccupancyCells::rowToX(unsigned row)
+{
+    return (row + 0.5 - GRID_CELLS / 2.0) / GRID_CELLS_PER_METRE;
+}
+
+double OccupancyCells::colToY(unsigned col)
+{
+    return (col + 0.5 - GRID_CELLS / 2.0) / GRID_CELLS_PER_METRE;
+}
+
+// :::: class OccupancyGrid
+
+using can::backsense::OccupancyGrid;
+
+constexpr __u8 OccupancyGrid::DEFAULT_DECAY;
+constexpr unsigned OccupancyGrid::MAX_PENDING_HITS;
+
+OccupancyGrid::OccupancyGrid(__u8 decayPerCycle)
+    : m_decay(decayPerCycle), m_decayCells(selectDecay())
+{
+    if (!decayPerCycle) {
+        throw std::runtime_error("The occupancy grid must decay.");
+    }
+    for (auto& buffer : m_buffers) {
+        std::memset(buffer.cells, 0, sizeof(buffer.cells));
+        buffer.hostTimeNs = 0;
+        buffer.cycle = 0;
+    }
+}
+
+void OccupancyGrid::setMount(const SensorMount& mount)
+{
+    assert(mount.sensorIdx < MAX_N_SENSORS);
+    const double yaw = mount.yawDeg * M_PI / 180;
+    auto& m = m_mounts[mount.sensorIdx];
+    m.mounted = true;
+    m.x = mount.x;
+    m.y = mount.y;
+    m.cosYaw = std::cos(yaw);
+    m.sinYaw = std::sin(yaw);
+}
+
+void OccupancyGrid::onUpdate(const RadarStateDB& /*stateDB*/,
+                             const DetectionData& newState)
+{
+    addDetection(newState);
+}
+
+void OccupancyGrid::addDetection(const DetectionData& state)
+{
+    if (state.getDetectionFlag()) {
+        // an empty slot
+        return;
+    }
+
+    const unsigned sensorIdx =
+        FrameHandler::getIndexPairFromId(state.getId()).first;
+    const auto& mount = m_mounts[sensorIdx];
+    if (!mount.mounted) {
+        return;
+    }
+
+    // the sensor's X axis is (cos, sin) in the vehicle frame, its Y axis
+    // (-sin, cos)
+    const double sx = state.getX().toDouble();
+    const double sy = state.getY().toDouble();
+    const double x = mount.x + mount.cosYaw * sx - mount.sinYaw * sy;
+    const double y = mount.y + mount.sinYaw * sx + mount.cosYaw * sy;
+
+    unsigned row, col;
+    if (!OccupancyCells::toCell(x, y, row, col)) {
+        return;
+    }
+
+    auto& queue = m_pending[sensorIdx];
+    const auto head = queue.head.load(std::memory_order_relaxed);
+    if (head - queue.tail.load(std::memory_order_acquire) >=
+        MAX_PENDING_HITS) {
+        queue.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    queue.cells[head % MAX_PENDING_HITS] =
+        static_cast<__u16>(row * GRID_CELLS + col);
+    queue.head.store(head + 1, std::memory_order_release);
+}
+
+void OccupancyGrid::fuse(__u64 hostTimeNs)
+{
+    const auto published = m_published.load(std::memory_order_relaxed);
+    const auto& front = m_buffers[published & 1];
+    auto& back = m_buffers[(published + 1) & 1];
+    // the last publish is the start marker of these writes, for readers
+    // still copying this buffer
+    std::atomic_thread_fence(std::memory_order_release);
+
+    m_decayCells(&front.cells[0][0], &back.cells[0][0], N_CELLS, m_decay);
+
+    __u8* cells = &back.cells[0][0];
+    for (auto& queue : m_pending) {
+        const auto head = queue.head.load(std::memory_order_acquire);
+        auto tail = queue.tail.load(std::memory_order_relaxed);
+        for (; tail != head; ++tail) {
+            cells[queue.cells[tail % MAX_PENDING_HITS]] = HIT;
+        }
+        queue.tail.store(tail, std::memory_order_release);
+    }
+
+    back.hostTimeNs = hostTimeNs;
+    back.cycle = published + 1;
+    m_published.store(published + 1, std::memory_order_release);
+}
+
+void OccupancyGrid::runFusion(OccupancyGrid& grid,
+                              std::chrono::milliseconds period,
+                              std::shared_future<void> futureSignal)
+{
+    while (futureSignal.wait_for(period) != std::future_status::ready) {
+        grid.fuse(CaptureLogWriter::hostTimeNs());
+    }
+}
+
+void OccupancyGrid::read(OccupancyCells& grid) const
+{
+    while (true) {
+        const auto before = m_published.load(std::memory_order_acquire);
+        std::memcpy(&grid, &m_buffers[before & 1], sizeof(grid));
+
+        // fuse() only writes this buffer again once it has published
+        // another cycle
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_published.load(std::memory_order_relaxed) == before) {
+            break;
+        }
+    }
+}
+
+__u64 OccupancyGrid::droppedHits() const
+{
+    __u64 dropped = 0;
+    for (const auto& queue : m_pending) {
+        dropped += queue.dropped.load(std::memory_order_relaxed);
+    }
+    return dropped;
+}
@@ -0,0 +1,158 @@
+/*
+ *   Fuses the detections of every sensor into one occupancy grid around
+ *   the vehicle.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BACKSENSE_OCCUPANCY_GRID_H_
+#define _BACKSENSE_OCCUPANCY_GRID_H_
+
+#include "BSFrameHandler.h"
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+
+namespace can {
+
+namespace backsense {
+
+// Where a sensor sits on the truck. The vehicle frame has its origin at
+// the centre of the truck, X forward and Y to the right (as the X and Y of
+// a sensor, seen from its own position).
+struct SensorMount
+{
+    unsigned sensorIdx = 0;
+    double x = 0;      // m
+    double y = 0;      // m
+    double yawDeg = 0; // the sensor's X axis, clockwise from the truck's
+
+    // "<sensor>:<x>,<y>,<yaw>", e.g. "1:-7.5,1.8,180" for a sensor at the
+    // rear, looking backwards
+    static SensorMount parse(const std::string& spec);
+
+    // a point seen by the sensor at (sx, sy), in the vehicle frame
+    void toVehicle(double sx, double sy, double& x, double& y) const;
+};
+
+// 64 m x 64 m around the truck, in half metre cells: twice the reach of a
+// sensor, and 16 KiB per grid (it stays in L1/L2)
+static constexpr unsigned GRID_CELLS = 128; // per side
+static constexpr unsigned GRID_CELLS_PER_METRE = 2;
+
+// One fused picture. cells[row][col]: row along X, col along Y, with the
+// vehicle origin at the corner shared by the four centre cells; 0 is free,
+// or unknown, and 255 was hit in the last cycle.
+struct alignas(64) OccupancyCells
+{
+    __u8 cells[GRID_CELLS][GRID_CELLS];
+    __u64 hostTimeNs; // of the cycle that made it
+    __u64 cycle;
+
+    // false when (x, y), in metres, is off the grid
+    static bool toCell(double x, double y, unsigned& row, unsigned& col);
+    // the centre of a cell, in metres
+    static double rowToX(unsigned row);
+    static double colToY(unsigned col);
+};
+
+// The reader thread of each sensor maps its detections to the vehicle
+// frame and queues the cells they hit, lock-free (one queue per sensor, so
+// the channels never wait for each other). Once per cycle, fuse() decays
+// the published grid into the other buffer, stamps the queued hits on it,
+// and publishes it: the cost is one pass over the grid plus the hits, not
+// a pass per sensor. Readers copy the published grid, and retry if a cycle
+// was published meanwhile (the seqlock of TrackHistory, with the two
+// buffers in place of the odd sequence: fuse() never writes the grid being
+// read until the next cycle).
+class OccupancyGrid
+{
+  public:
+    OccupancyGrid(const OccupancyGrid&) = delete;
+    OccupancyGrid& operator=(const OccupancyGrid&) = delete;
+
+    // a hit lasts 255 / decayPerCycle cycles
+    static constexpr __u8 DEFAULT_DECAY = 32;
+    // per sensor and cycle; more are dropped (and counted)
+    static constexpr unsigned MAX_PENDING_HITS = 256;
+
+    explicit OccupancyGrid(__u8 decayPerCycle = DEFAULT_DECAY);
+
+    // Sensors without a mount are ignored. To be set before the listener
+    // runs: the mounts are read without synchronization.
+    void setMount(const SensorMount& mount);
+
+    // to be installed as an update listener of the DB (the shard of the
+    // sensor is locked by the caller: one producer per queue)
+    void onUpdate(const RadarStateDB& stateDB, const DetectionData& newState);
+    void addDetection(const DetectionData& state);
+
+    // one cycle, from a single thread; 'hostTimeNs' in the clock of
+    // CaptureLogWriter::hostTimeNs()
+    void fuse(__u64 hostTimeNs);
+
+    // thread function: a cycle every 'period' until the signal is set
+    static void runFusion(OccupancyGrid& grid,
+                          std::chrono::milliseconds period,
+                          std::shared_future<void> futureSignal);
+
+    // the last published grid; never blocks fuse()
+    void read(OccupancyCells& grid) const;
+
+    __u64 droppedHits() const;
+
+  private:
+    struct Mount
+    {
+        bool mounted = false;
+        double x = 0;
+        double y = 0;
+        double cosYaw = 1;
+        double sinYaw = 0;
+    };
+
+    // single producer (the reader thread of the sensor), single consumer
+    // (fuse()): cell indexes, GRID_CELLS^2 fits in 16 bits
+    struct alignas(64) HitQueue
+    {
+        std::atomic<__u32> head{0}; // written by the producer
+        std::atomic<__u64> dropped{0};
+        alignas(64) std::atomic<__u32> tail{0}; // written by the consumer
+        __u16 cells[MAX_PENDING_HITS];
+    };
+
+    using DecayFunction = void (*)(const __u8* in, __u8* out, size_t n,
+                                   __u8 amount);
+
+    Mount m_mounts[MAX_N_SENSORS];
+    HitQueue m_pending[MAX_N_SENSORS];
+    OccupancyCells m_buffers[2];
+    // cycles published: m_buffers[m_published & 1] is the latest
+    std::atomic<__u64> m_published{0};
+    const __u8 m_decay;
+    const DecayFunction m_decayCells;
+};
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _BACKSENSE_OCCUPANCY_GRID_H_
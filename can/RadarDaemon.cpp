@@ -0,0 +1,404 @@
+/*
+ *   Owns the CAN channel and publishes the state of the BS-9000 sensors in
+ *   shared memory, so that several applications can use the radar at once.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "BSFrameHandler.h"
+#include "CaptureLog.h"
+#include "ChannelSupervisor.h"
+#include "FlightRecorder.h"
+#include "RadarStateBus.h"
+#include "RadarStream.h"
+#include "Telemetry.h"
+#include "Trace.h"
+
+#include <csignal>
+#include <cstring>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int waitForTerminationSignal(const sigset_t& signals)
+{
+    int sig = 0;
+    sigwait(&signals, &sig);
+    return sig;
+}
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg
+              << " [-c capture.log] [-s unix:<path> | -s udp:<group>:<port>]..."
+                 " [-C <channel>:<sensor>[,<sensor>...][@<cpu>]]..."
+                 " [-A <metres>:<seconds>] [-F <flight file>]"
+                 " [-S read|decode|update|sinks]"
+              << std::endl;
+}
+
+// Prints the obstacle alerts from a thread of its own: they are raised by
+// the reader threads, with their shard locked, which must never wait for
+// stderr (e.g. a pipe to a slow logger). An alert that finds the queue full,
+// or its lock taken, is dropped and counted instead.
+class AlertPrinter
+{
+  public:
+    AlertPrinter(const AlertPrinter&) = delete;
+    AlertPrinter& operator=(const AlertPrinter&) = delete;
+
+    AlertPrinter() : m_thread(&AlertPrinter::run, this) {}
+
+    ~AlertPrinter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopped = true;
+        }
+        m_wakeUp.notify_one();
+        m_thread.join();
+    }
+
+    // from a reader thread: never blocks, never allocates
+    void push(unsigned sensorIdx,
+              const can::backsense::ObstacleSummary& summary, bool raised)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || m_size == QUEUE_LEN) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_queue[(m_head + m_size++) % QUEUE_LEN] = {sensorIdx, summary, raised};
+        lock.unlock();
+        m_wakeUp.notify_one();
+    }
+
+  private:
+    struct Alert
+    {
+        unsigned sensorIdx;
+        can::backsense::ObstacleSummary summary;
+        bool raised;
+    };
+
+    static constexpr unsigned QUEUE_LEN = 64;
+
+    void run()
+    {
+        telemetry::registerThread("alerts");
+        std::array<Alert, QUEUE_LEN> alerts;
+        while (true) {
+            unsigned n = 0;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeUp.wait(lock, [this]() { return m_size || m_stopped; });
+                if (!m_size) {
+                    return;
+                }
+                for (; m_size; --m_size, m_head = (m_head + 1) % QUEUE_LEN) {
+                    alerts[n++] = m_queue[m_head];
+                }
+            }
+            for (unsigned i = 0; i < n; ++i) {
+                print(alerts[i]);
+            }
+            if (const auto dropped = m_dropped.exchange(0)) {
+                std::cerr << "#WARNING: " << dropped
+                          << " obstacle alert(s) not printed." << std::endl;
+            }
+        }
+    }
+
+    static void print(const Alert& alert)
+    {
+        if (!alert.raised) {
+            std::cerr << "#INFO: Sensor " << alert.sensorIdx << " all clear."
+                      << std::endl;
+            return;
+        }
+        std::cerr << "#WARNING: Sensor " << alert.sensorIdx
+                  << ": obstacle at " << alert.summary.nearestRadius << " m";
+        if (alert.summary.hasCollision()) {
+            std::cerr << ", collision in " << alert.summary.ttcMs << " ms";
+        }
+        std::cerr << "." << std::endl;
+    }
+
+  private:
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::array<Alert, QUEUE_LEN> m_queue;
+    unsigned m_head = 0;
+    unsigned m_size = 0;
+    bool m_stopped = false;
+    std::atomic<unsigned long> m_dropped{0};
+    std::thread m_thread;
+};
+
+// "-A 3:1.5": alert on obstacles closer than 3 m, or collisions in less than
+// 1.5 s; 'flight' (null without -F) keeps them too
+static void installObstacleAlert(can::backsense::RadarStateDB& stateDB,
+                                 const std::string& spec,
+                                 AlertPrinter& printer,
+                                 can::FlightRecorder* flight)
+{
+    std::istringstream in(spec);
+    double metres = 0, seconds = 0;
+    char sep = 0;
+    if (!(in >> metres >> sep >> seconds) || sep != ':' || metres < 0 ||
+        seconds < 0 || !(in >> std::ws).eof()) {
+        throw std::runtime_error("Bad obstacle alert \"" + spec +
+                                 "\", expected <metres>:<seconds>.");
+    }
+    const auto radius = can::backsense::Distance::fromSteps(
+        std::lround(metres * can::backsense::Distance::STEPS_PER_UNIT));
+
+    // straight from the reader thread that made the update, within
+    // microseconds of the frame; printed later
+    stateDB.addObstacleAlert(
+        radius, std::lround(seconds * 1000),
+        [flight, &printer](unsigned sensorIdx,
+                           const can::backsense::ObstacleSummary& summary,
+                           bool raised) {
+            if (flight) {
+                flight->onAlert(sensorIdx, summary, raised);
+            }
+            if (raised) {
+                telemetry::add(telemetry::Counter::OBSTACLE_ALERTS);
+            }
+            printer.push(sensorIdx, summary, raised);
+        });
+}
+
+static std::vector<can::ChannelConfig>
+makeChannelConfigs(const std::vector<std::string>& specs, unsigned nSensors)
+{
+    std::vector<can::ChannelConfig> configs;
+    for (const auto& spec : specs) {
+        configs.push_back(can::ChannelConfig::parse(spec));
+        for (unsigned i = 0; i + 1 < configs.size(); ++i) {
+            if (configs[i].channelIdx == configs.back().channelIdx) {
+                throw std::runtime_error(
+                    "CAN channel " + std::to_string(configs[i].channelIdx) +
+                    " is configured twice.");
+            }
+        }
+    }
+    if (configs.empty()) {
+        configs.push_back(can::ChannelConfig::singleChannel(nSensors));
+    }
+
+    // with several channels, every reader gets a core of its own unless
+    // told otherwise
+    if (configs.size() > 1) {
+        const unsigned nCores =
+            std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < configs.size(); ++i) {
+            if (configs[i].cpu < 0) {
+                configs[i].cpu = i % nCores;
+            }
+        }
+    }
+    return configs;
+}
+
+int main(int argc, char** argv)
+{
+    static constexpr unsigned N_SENSORS = 1;
+
+    std::string capturePath;
+    std::vector<std::string> streamEndpoints;
+    std::vector<std::string> channelSpecs;
+    std::vector<std::string> alertSpecs;
+    std::string flightPath;
+    std::string layoutSpec;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-c") && i + 1 < argc) {
+            capturePath = argv[++i];
+        } else if (!std::strcmp(argv[i], "-s") && i + 1 < argc) {
+            streamEndpoints.emplace_back(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-C") && i + 1 < argc) {
+            channelSpecs.emplace_back(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-A") && i + 1 < argc) {
+            alertSpecs.emplace_back(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-F") && i + 1 < argc) {
+            flightPath = argv[++i];
+        } else if (!std::strcmp(argv[i], "-S") && i + 1 < argc) {
+            layoutSpec = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // block the termination signals in every thread: they are handled
+    // synchronously by the main thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try {
+        auto configs = makeChannelConfigs(channelSpecs, N_SENSORS);
+        if (!layoutSpec.empty()) {
+            const auto layout = can::PipelineLayout::parse(layoutSpec);
+            for (auto& config : configs) {
+                config.layout = layout;
+            }
+        }
+
+        // one DB shard per channel
+        unsigned nSensors = 0;
+        std::vector<std::vector<unsigned>> shards;
+        for (const auto& config : configs) {
+            shards.push_back(config.sensors);
+            const auto last = *std::max_element(config.sensors.begin(),
+                                                config.sensors.end());
+            nSensors = std::max(nSensors, last + 1);
+        }
+
+        can::backsense::RadarStateDB stateDB(nSensors, shards);
+
+        // the last minutes of every update, alert and channel fault, kept
+        // through a crash of the daemon (the updates from a sink of each
+        // channel, see below)
+        std::unique_ptr<can::FlightRecorder> flight;
+        if (!flightPath.empty()) {
+            flight = std::make_unique<can::FlightRecorder>(flightPath);
+        }
+        std::unique_ptr<AlertPrinter> alertPrinter;
+        if (!alertSpecs.empty()) {
+            alertPrinter = std::make_unique<AlertPrinter>();
+        }
+        for (const auto& spec : alertSpecs) {
+            installObstacleAlert(stateDB, spec, *alertPrinter, flight.get());
+        }
+        can::backsense::RadarStateBusPublisher publisher;
+        auto telemetryExporter = telemetry::TelemetryExporter::fromEnvironment();
+        auto traceFlusher = tracing::TraceFlusher::fromEnvironment();
+
+        // called by the reader of each channel, which only holds the lock of
+        // its own shard
+        stateDB.addUpdateListener(
+            [&publisher](const can::backsense::RadarStateDB& db,
+                         const can::backsense::DetectionData& state) {
+                publisher.publishSensor(
+                    db, can::backsense::FrameHandler::getIndexPairFromId(
+                            state.getId())
+                            .first);
+            });
+
+        // per cycle binary stream for the other processes in the cab
+        std::unique_ptr<can::backsense::StreamPublisher> streamer;
+        if (!streamEndpoints.empty()) {
+            streamer = std::make_unique<can::backsense::StreamPublisher>(
+                streamEndpoints);
+            stateDB.addUpdateListener(
+                [&streamer](const can::backsense::RadarStateDB& db,
+                            const can::backsense::DetectionData& state) {
+                    streamer->onUpdate(db, state);
+                });
+        }
+
+        // the attached processes must learn when the state goes stale, even
+        // though no frame arrives to trigger a publication
+        auto publishState = [&publisher, &streamer, &stateDB](bool) {
+            can::backsense::RadarStateDB::FullLock lock(stateDB);
+            publisher.publish(stateDB);
+            if (streamer) {
+                for (unsigned i = 0; i < stateDB.getNumberOfSensors(); ++i) {
+                    streamer->publishCycle(stateDB, i);
+                }
+            }
+        };
+
+        // a capture log can't be shared between reader threads: with
+        // several channels, each one gets "<capture.log>.<channel>"
+        std::vector<std::unique_ptr<can::CaptureLogWriter>> captures;
+        std::vector<std::unique_ptr<can::ChannelSupervisor>> supervisors;
+        for (const auto& config : configs) {
+            can::CaptureLogWriter* capture = nullptr;
+            if (!capturePath.empty()) {
+                auto path = capturePath;
+                if (configs.size() > 1) {
+                    path += "." + std::to_string(config.channelIdx);
+                }
+                captures.push_back(
+                    std::make_unique<can::CaptureLogWriter>(path));
+                capture = captures.back().get();
+            }
+            supervisors.push_back(std::make_unique<can::ChannelSupervisor>(
+                config, stateDB, capture));
+            supervisors.back()->addStateListener(publishState);
+            if (flight) {
+                supervisors.back()->pipeline().addSink(
+                    "flight", [&flight, &stateDB](
+                                  const can::backsense::DetectionData& state) {
+                        flight->onUpdate(stateDB, state);
+                    });
+                supervisors.back()->addStateListener(
+                    [&flight, channelIdx = config.channelIdx](bool online) {
+                        flight->recordChannel(channelIdx, online);
+                    });
+            }
+        }
+        publishState(false); // stale until the channels are up
+
+        std::promise<void> exitSignal;
+        std::shared_future<void> futureSignal = exitSignal.get_future().share();
+        std::vector<std::thread> readingHandlers;
+        for (auto& supervisor : supervisors) {
+            readingHandlers.emplace_back(&can::ChannelSupervisor::run,
+                                         supervisor.get(), futureSignal);
+        }
+
+        std::cout << "#INFO: Radar daemon running, " << configs.size()
+                  << " CAN channel(s), stages "
+                  << configs.front().layout.toString() << "." << std::endl;
+        const int sig = waitForTerminationSignal(signals);
+        std::cout << "#INFO: Signal " << sig << " received, stopping."
+                  << std::endl;
+
+        // notify interruption threads
+        exitSignal.set_value();
+
+        for (auto& supervisor : supervisors) {
+            supervisor->interrupt();
+        }
+        for (auto& readingHandler : readingHandlers) {
+            readingHandler.join();
+        }
+
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ *   A single-threaded event loop for the consumers of the radar state: each
+ *   one waits for a cycle, an obstacle or a timer, instead of polling.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "RadarEventLoop.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <stdexcept>
+
+using can::backsense::RadarEventLoop;
+
+RadarEventLoop::RadarEventLoop(const RadarStateDB& stateDB)
+    : m_stateDB(stateDB)
+{
+    m_eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_eventFd < 0) {
+        throw std::runtime_error("Can't create the eventfd of the loop.");
+    }
+}
+
+RadarEventLoop::~RadarEventLoop()
+{
+    // registered, but never run
+    dropWaits();
+    close(m_eventFd);
+}
+
+void RadarEventLoop::wakeUp()
+{
+    // the news, then the look at 'm_asleep' (the loop does the opposite):
+    // at least one of the two sees the other
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_asleep.load(std::memory_order_relaxed)) {
+        const __u64 one = 1;
+        if (write(m_eventFd, &one, sizeof(one)) < 0) {
+            // the counter is saturated: the loop has a wake-up pending
+        }
+    }
+}
+
+void RadarEventLoop::onUpdate(const DetectionData& state)
+{
+    const auto indexes = FrameHandler::getIndexPairFromId(state.getId());
+    auto& feed = m_feeds[indexes.first];
+
+    const auto boundary = feed.cycleTracker.onObject(indexes.second);
+    if (const auto cycles = boundary.cycles()) {
+        feed.cycleSlots.store(boundary.completed ? CycleTracker::ALL_SLOTS
+                                                 : boundary.previousSlots,
+                              std::memory_order_relaxed);
+        feed.cycles.store(feed.cycles.load(std::memory_order_relaxed) +
+                              cycles,
+                          std::memory_order_relaxed);
+    }
+    feed.updates.store(feed.updates.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+    wakeUp();
+}
+
+void RadarEventLoop::onSnapshot()
+{
+    for (auto& feed : m_feeds) {
+        feed.cycleSlots.store(CycleTracker::ALL_SLOTS,
+                              std::memory_order_relaxed);
+        feed.cycles.store(feed.cycles.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+        feed.updates.store(feed.updates.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_release);
+    }
+    wakeUp();
+}
+
+void RadarEventLoop::nextCycle(unsigned sensorIdx, CycleHandler handler,
+                               Handler dropped)
+{
+    assert(sensorIdx < MAX_N_SENSORS);
+    m_cycleWaits.push_back(
+        {sensorIdx, m_feeds[sensorIdx].cycles.load(std::memory_order_relaxed),
+         std::move(handler), std::move(dropped)});
+}
+
+void RadarEventLoop::whenObstacle(unsigned sensorIdx,
+                                  ObstacleCondition condition,
+                                  ObstacleHandler handler, Handler dropped)
+{
+    assert(sensorIdx < MAX_N_SENSORS);
+    m_obstacleWaits.push_back({sensorIdx, std::move(condition),
+                               std::move(handler), std::move(dropped)});
+}
+
+void RadarEventLoop::whenCloserThan(unsigned sensorIdx, Distance radius,
+                                    ObstacleHandler handler, Handler dropped)
+{
+    whenObstacle(sensorIdx,
+                 [radius](const ObstacleSummary& summary) {
+                     return summary.hasObstacle() &&
+                            summary.nearestRadius < radius;
+                 },
+                 std::move(handler), std::move(dropped));
+}
+
+void RadarEventLoop::after(Clock::duration delay, Handler handler,
+                           Handler dropped)
+{
+    m_timers.push_back(
+        {Clock::now() + delay, std::move(handler), std::move(dropped)});
+}
+
+void RadarEventLoop::post(Handler handler)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_postedMutex);
+        m_posted.push_back(std::move(handler));
+    }
+    const __u64 one = 1;
+    if (write(m_eventFd, &one, sizeof(one)) < 0) {
+        // saturated: a wake-up is pending anyway
+    }
+}
+
+void RadarEventLoop::stop()
+{
+    post([this]() { m_stopped.store(true); });
+}
+
+bool RadarEventLoop::hasNews() const
+{
+    for (unsigned i = 0; i < MAX_N_SENSORS; ++i) {
+        if (m_feeds[i].updates.load(std::memory_order_acquire) !=
+            m_seenUpdates[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RadarEventLoop::runReady()
+{
+    // the sensors updated since the last time
+    __u32 newsMask = 0;
+    for (unsigned i = 0; i < MAX_N_SENSORS; ++i) {
+        const auto updates =
+            m_feeds[i].updates.load(std::memory_order_acquire);
+        if (updates != m_seenUpdates[i]) {
+            newsMask |= 1u << i;
+            m_seenUpdates[i] = updates;
+        }
+    }
+
+    // The due waits are taken out before their handlers run: a handler
+    // usually registers the next wait of its consumer.
+    std::vector<Handler> posted;
+    {
+        std::lock_guard<std::mutex> lock(m_postedMutex);
+        posted.swap(m_posted);
+    }
+
+    std::vector<CycleWait> cycles;
+    auto cycleEnd = std::stable_partition(
+        m_cycleWaits.begin(), m_cycleWaits.end(), [this](const CycleWait& w) {
+            return m_feeds[w.sensorIdx].cycles.load(
+                       std::memory_order_relaxed) == w.cycle;
+        });
+    std::move(cycleEnd, m_cycleWaits.end(), std::back_inserter(cycles));
+    m_cycleWaits.erase(cycleEnd, m_cycleWaits.end());
+
+    std::vector<std::pair<ObstacleSummary, ObstacleWait>> obstacles;
+    for (auto it = m_obstacleWaits.begin(); it != m_obstacleWaits.end();) {
+        if (!(newsMask & (1u << it->sensorIdx))) {
+            ++it;
+            continue;
+        }
+        const auto summary = m_stateDB.obstacleSummary(it->sensorIdx);
+        if (it->condition(summary)) {
+            obstacles.emplace_back(summary, std::move(*it));
+            it = m_obstacleWaits.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    const auto now = Clock::now();
+    std::vector<Timer> timers;
+    auto timerEnd = std::stable_partition(
+        m_timers.begin(), m_timers.end(),
+        [now](const Timer& timer) { return timer.due > now; });
+    std::move(timerEnd, m_timers.end(), std::back_inserter(timers));
+    m_timers.erase(timerEnd, m_timers.end());
+
+    for (auto& handler : posted) {
+        handler();
+    }
+    for (auto& wait : cycles) {
+        wait.handler(wait.sensorIdx,
+                     m_feeds[wait.sensorIdx].cycles.load(
+                         std::memory_order_relaxed));
+    }
+    for (auto& ready : obstacles) {
+        ready.second.handler(ready.second.sensorIdx, ready.first);
+    }
+    for (auto& timer : timers) {
+        timer.handler();
+    }
+
+    return !posted.empty() || !cycles.empty() || !obstacles.empty() ||
+           !timers.empty();
+}
+
+void RadarEventLoop::sleep()
+{
+    int timeoutMs = -1;
+    if (!m_timers.empty()) {
+        const auto next = std::min_element(
+            m_timers.begin(), m_timers.end(),
+            [](const Timer& a, const Timer& b) { return a.due < b.due; });
+        // rounded up: waking up early would spin until it's due
+        const auto wait = next->due - Clock::now() +
+                          std::chrono::milliseconds(1) -
+                          std::chrono::nanoseconds(1);
+        timeoutMs = std::max<long>(
+            0,
+            std::chrono::duration_cast<std::chrono::milliseconds>(wait)
+                .count());
+    }
+
+    m_asleep.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!hasNews()) {
+        pollfd pfd{m_eventFd, POLLIN, 0};
+        poll(&pfd, 1, timeoutMs);
+    }
+    m_asleep.store(false, std::memory_order_relaxed);
+
+    __u64 count;
+    if (read(m_eventFd, &count, sizeof(count)) < 0) {
+        // nothing was written: a timeout, or the news came first
+    }
+}
+
+void RadarEventLoop::run()
+{
+    m_stopped.store(false);
+    while (!m_stopped.load()) {
+        if (!runReady() && !m_stopped.load()) {
+            sleep();
+        }
+    }
+    dropWaits();
+}
+
+void RadarEventLoop::dropWaits()
+{
+    // taken out first: freeing a coroutine may free more of the waits' state
+    std::vector<Handler> dropped;
+    for (auto& wait : m_cycleWaits) {
+        dropped.push_back(std::move(wait.dropped));
+    }
+    for (auto& wait : m_obstacleWaits) {
+        dropped.push_back(std::move(wait.dropped));
+    }
+    for (auto& timer : m_timers) {
+        dropped.push_back(std::move(timer.dropped));
+    }
+    m_cycleWaits.clear();
+    m_obstacleWaits.clear();
+    m_timers.clear();
+
+    for (auto& handler : dropped) {
+        if (handler) {
+            handler();
+        }
+    }
+}
@@ -0,0 +1,316 @@
+/*
+ *   A single-threaded event loop for the consumers of the radar state: each
+ *   one waits for a cycle, an obstacle or a timer, instead of polling.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _RADAR_EVENT_LOOP_H_
+#define _RADAR_EVENT_LOOP_H_
+
+#include "BSFrameHandler.h"
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// with C++20 coroutines, the waits can also be co_await'ed (see below)
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define BS9000_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#endif
+
+namespace can {
+
+namespace backsense {
+
+#ifdef BS9000_COROUTINES
+class CycleAwaiter;
+class ObstacleAwaiter;
+class SleepAwaiter;
+#endif
+
+// Many lightweight consumers (alert rules, loggers, exporters, a GUI
+// refresh) share the thread that calls run(): each one registers a handler
+// for the next event it is interested in, and registers the following one
+// from that handler. Nothing runs between the events: the thread sleeps in
+// poll() until an update, a timer or a posted call wakes it up.
+//
+// The loop is fed by the threads that update the DB (an update listener or
+// an IngestPipeline sink calls onUpdate()), without ever waiting for it.
+class RadarEventLoop
+{
+  public:
+    RadarEventLoop(const RadarEventLoop&) = delete;
+    RadarEventLoop& operator=(const RadarEventLoop&) = delete;
+
+    using Clock = std::chrono::steady_clock;
+
+    explicit RadarEventLoop(const RadarStateDB& stateDB);
+    ~RadarEventLoop();
+
+    // From the thread that updated the sensor, with or without its shard
+    // locked: a few relaxed stores, plus a write to an eventfd if the loop
+    // is asleep. The cycles end as CycleTracker says.
+    void onUpdate(const DetectionData& state);
+    // the whole DB was replaced (e.g. RadarStateBusReader::refresh()): a
+    // cycle of every sensor
+    void onSnapshot();
+
+    // The waits, from the loop thread (or before run()). Each handler runs
+    // once, on the loop thread, and must not block; if the loop stops first,
+    // 'dropped' (if any) runs instead, e.g. to free a suspended coroutine.
+    using CycleHandler = std::function<void(unsigned sensorIdx, __u64 cycle)>;
+    using ObstacleCondition = std::function<bool(const ObstacleSummary&)>;
+    using ObstacleHandler =
+        std::function<void(unsigned sensorIdx, const ObstacleSummary&)>;
+    using Handler = std::function<void()>;
+
+    // after the next cycle of the sensor is complete
+    void nextCycle(unsigned sensorIdx, CycleHandler handler,
+                   Handler dropped = nullptr);
+    // at the first update of the sensor after which its obstacle summary
+    // meets the condition (checked on updates only: a consumer waiting
+    // again for the same condition is called back once per update while
+    // it holds, rather than spinning)
+    void whenObstacle(unsigned sensorIdx, ObstacleCondition condition,
+                      ObstacleHandler handler, Handler dropped = nullptr);
+    // ... an obstacle nearer than 'radius'
+    void whenCloserThan(unsigned sensorIdx, Distance radius,
+                        ObstacleHandler handler, Handler dropped = nullptr);
+    void after(Clock::duration delay, Handler handler,
+               Handler dropped = nullptr);
+
+    // from any thread: runs the handler on the loop thread
+    void post(Handler handler);
+
+    // runs the handlers on the calling thread until stop(); the waits still
+    // pending then are dropped (their coroutines destroyed, never resumed)
+    void run();
+    // from any thread, e.g. a handler
+    void stop();
+
+    const RadarStateDB& stateDB() const { return m_stateDB; }
+    // The slots of the sensor that held its last cycle as it completed: all
+    // of them, but for the first object of the next cycle when the sequence
+    // restarted. The DB may have moved on since, by the time a handler runs.
+    __u8 cycleSlots(unsigned sensorIdx) const
+    {
+        return m_feeds[sensorIdx].cycleSlots.load(std::memory_order_relaxed);
+    }
+
+#ifdef BS9000_COROUTINES
+    // "co_await loop.nextCycle(sensorIdx)", in a RadarTask: the same waits,
+    // resuming the coroutine on the loop thread
+    CycleAwaiter nextCycle(unsigned sensorIdx);
+    ObstacleAwaiter whenObstacle(unsigned sensorIdx,
+                                 ObstacleCondition condition);
+    ObstacleAwaiter whenCloserThan(unsigned sensorIdx, Distance radius);
+    SleepAwaiter sleepFor(Clock::duration delay);
+#endif
+
+  private:
+    // written by the thread that updates the sensor, read by the loop
+    struct alignas(64) SensorFeed
+    {
+        std::atomic<__u64> updates{0};
+        std::atomic<__u64> cycles{0};
+        std::atomic<__u8> cycleSlots{CycleTracker::ALL_SLOTS};
+        CycleTracker cycleTracker;
+    };
+
+    struct CycleWait
+    {
+        unsigned sensorIdx;
+        __u64 cycle; // fires once the sensor is past it
+        CycleHandler handler;
+        Handler dropped;
+    };
+
+    struct ObstacleWait
+    {
+        unsigned sensorIdx;
+        ObstacleCondition condition;
+        ObstacleHandler handler;
+        Handler dropped;
+    };
+
+    struct Timer
+    {
+        Clock::time_point due;
+        Handler handler;
+        Handler dropped;
+    };
+
+    void wakeUp();
+    // the feed moved since the last runReady()
+    bool hasNews() const;
+    // what is due now; returns false if nothing was
+    bool runReady();
+    void sleep();
+    // the pending waits, once the loop stopped
+    void dropWaits();
+
+  private:
+    const RadarStateDB& m_stateDB;
+    SensorFeed m_feeds[MAX_N_SENSORS];
+    int m_eventFd = -1;
+    std::atomic<bool> m_asleep{false};
+    std::atomic<bool> m_stopped{false};
+
+    std::mutex m_postedMutex;
+    std::vector<Handler> m_posted;
+
+    // only touched by the loop thread
+    __u64 m_seenUpdates[MAX_N_SENSORS] = {};
+    std::vector<CycleWait> m_cycleWaits;
+    std::vector<ObstacleWait> m_obstacleWaits;
+    std::vector<Timer> m_timers;
+};
+
+#ifdef BS9000_COROUTINES
+
+// A consumer written as a coroutine: it starts right away, runs on the
+// loop thread past its first co_await, and frees itself when it returns.
+struct RadarTask
+{
+    struct promise_type
+    {
+        RadarTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// the number of the cycle
+class CycleAwaiter
+{
+  public:
+    CycleAwaiter(RadarEventLoop& loop, unsigned sensorIdx)
+        : m_loop(loop), m_sensorIdx(sensorIdx)
+    {
+    }
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine)
+    {
+        m_loop.nextCycle(
+            m_sensorIdx,
+            [this, coroutine](unsigned, __u64 cycle) {
+                m_cycle = cycle;
+                coroutine.resume();
+            },
+            [coroutine]() { coroutine.destroy(); });
+    }
+    __u64 await_resume() const { return m_cycle; }
+
+  private:
+    RadarEventLoop& m_loop;
+    unsigned m_sensorIdx;
+    __u64 m_cycle = 0;
+};
+
+// the obstacle summary that met the condition
+class ObstacleAwaiter
+{
+  public:
+    ObstacleAwaiter(RadarEventLoop& loop, unsigned sensorIdx,
+                    RadarEventLoop::ObstacleCondition condition)
+        : m_loop(loop), m_sensorIdx(sensorIdx),
+          m_condition(std::move(condition))
+    {
+    }
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine)
+    {
+        m_loop.whenObstacle(
+            m_sensorIdx, std::move(m_condition),
+            [this, coroutine](unsigned, const ObstacleSummary& summary) {
+                m_summary = summary;
+                coroutine.resume();
+            },
+            [coroutine]() { coroutine.destroy(); });
+    }
+    ObstacleSummary await_resume() const { return m_summary; }
+
+  private:
+    RadarEventLoop& m_loop;
+    unsigned m_sensorIdx;
+    RadarEventLoop::ObstacleCondition m_condition;
+    ObstacleSummary m_summary;
+};
+
+class SleepAwaiter
+{
+  public:
+    SleepAwaiter(RadarEventLoop& loop, RadarEventLoop::Clock::duration delay)
+        : m_loop(loop), m_delay(delay)
+    {
+    }
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine)
+    {
+        m_loop.after(m_delay, [coroutine]() { coroutine.resume(); },
+                     [coroutine]() { coroutine.destroy(); });
+    }
+    void await_resume() const {}
+
+  private:
+    RadarEventLoop& m_loop;
+    RadarEventLoop::Clock::duration m_delay;
+};
+
+inline CycleAwaiter RadarEventLoop::nextCycle(unsigned sensorIdx)
+{
+    return {*this, sensorIdx};
+}
+
+inline ObstacleAwaiter RadarEventLoop::whenObstacle(unsigned sensorIdx,
+                                                    ObstacleCondition condition)
+{
+    return {*this, sensorIdx, std::move(condition)};
+}
+
+inline ObstacleAwaiter RadarEventLoop::whenCloserThan(unsigned sensorIdx,
+                                                      Distance radius)
+{
+    return {*this, sensorIdx, [radius](const ObstacleSummary& summary) {
+                return summary.hasObstacle() && summary.nearestRadius < radius;
+            }};
+}
+
+inline SleepAwaiter RadarEventLoop::sleepFor(Clock::duration delay)
+{
+    return {*this, delay};
+}
+
+#endif // BS9000_COROUTINES
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _RADAR_EVENT_LOOP_H_
@@ -0,0 +1,279 @@
+/*
+ *   Shares the radar state DB between processes through POSIX shared memory.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "RadarStateBus.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+static constexpr __u32 BUS_MAGIC = 0x42535342; // "BSSB"
+static constexpr __u32 BUS_VERSION = 2;
+
+// A writer keeps a sequence odd for a few microseconds. One that stays odd
+// longer belongs to a publisher that is stopped, or that crashed in the
+// middle of a write: the reader gives up on the sensor (it is then stale)
+// instead of spinning forever.
+static constexpr unsigned ODD_SPINS = 100;
+static constexpr unsigned MAX_ODD_YIELDS = 1000;
+
+using can::backsense::RadarStateBusPublisher;
+using can::backsense::RadarStateBusReader;
+
+// :::: class RadarStateBusPublisher
+
+RadarStateBusPublisher::RadarStateBusPublisher(const std::string& name)
+    : m_name(name)
+{
+    m_fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        throw std::runtime_error("Can't create shared memory \"" + name +
+                                 "\": " + std::strerror(errno));
+    }
+
+    // One publisher per segment: the lock is held as long as the fd is
+    // open, and goes away with a publisher that crashed.
+    if (flock(m_fd, LOCK_EX | LOCK_NB)) {
+        const auto error = errno;
+        close(m_fd);
+        if (error == EWOULDBLOCK) {
+            throw std::runtime_error("Another radar daemon is publishing at "
+                                     "\"" + name + "\".");
+        }
+        throw std::runtime_error("Can't lock shared memory \"" + name +
+                                 "\": " + std::strerror(error));
+    }
+
+    if (ftruncate(m_fd, sizeof(RadarStateSegment))) {
+        close(m_fd);
+        throw std::runtime_error("Can't resize shared memory \"" + name +
+                                 "\".");
+    }
+
+    void* map = mmap(nullptr, sizeof(RadarStateSegment),
+                     PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) {
+        close(m_fd);
+        throw std::runtime_error("Can't map shared memory \"" + name + "\".");
+    }
+
+    m_segment = static_cast<RadarStateSegment*>(map);
+
+    // Past the lock, the segment is new or abandoned: it may be left over
+    // by a publisher that crashed, possibly in the middle of a write, so it
+    // starts over from even sequences. The readers still attached to it
+    // carry on with the new publisher.
+    m_segment->magic = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    m_segment->nSensors.store(0);
+    m_segment->staleMask.store(0);
+    for (auto& slot : m_segment->sensors) {
+        slot.sequence.store(0);
+    }
+    m_segment->publisherPid.store(getpid());
+    m_segment->version = BUS_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    m_segment->magic = BUS_MAGIC;
+
+    std::cout << "#INFO: Publishing radar state at \"" << name << "\"."
+              << std::endl;
+}
+
+RadarStateBusPublisher::~RadarStateBusPublisher()
+{
+    // the segment is only given up by its publisher (e.g. not by a forked
+    // child)
+    if (m_segment->publisherPid.load() == getpid()) {
+        m_segment->publisherPid.store(0);
+        shm_unlink(m_name.c_str());
+    }
+    munmap(m_segment, sizeof(RadarStateSegment));
+    close(m_fd);
+}
+
+void RadarStateBusPublisher::publish(const RadarStateDB& stateDB)
+{
+    for (unsigned i = 0; i < stateDB.getNumberOfSensors(); ++i) {
+        publishSensor(stateDB, i);
+    }
+}
+
+void RadarStateBusPublisher::publishSensor(const RadarStateDB& stateDB,
+                                           unsigned sensorIdx)
+{
+    m_segment->nSensors.store(stateDB.getNumberOfSensors(),
+                              std::memory_order_relaxed);
+    m_segment->staleMask.store(stateDB.staleMask(), std::memory_order_relaxed);
+
+    auto& slot = m_segment->sensors[sensorIdx];
+    auto seq = slot.sequence.load(std::memory_order_relaxed);
+
+    slot.sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    stateDB.exportSensor(slot.rows, sensorIdx);
+
+    slot.sequence.store(seq + 2, std::memory_order_release);
+}
+
+// :::: class RadarStateBusReader
+
+RadarStateBusReader::RadarStateBusReader(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        throw std::runtime_error("No radar daemon is publishing at \"" +
+                                 name + "\".");
+    }
+
+    void* map =
+        mmap(nullptr, sizeof(RadarStateSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("Can't map shared memory \"" + name + "\".");
+    }
+
+    m_segment = static_cast<const RadarStateSegment*>(map);
+    if (m_segment->magic != BUS_MAGIC || m_segment->version != BUS_VERSION) {
+        munmap(map, sizeof(RadarStateSegment));
+        throw std::runtime_error("\"" + name + "\" is not a radar state bus.");
+    }
+
+    std::cout << "#INFO: Attached to radar state at \"" << name << "\"."
+              << std::endl;
+}
+
+RadarStateBusReader::~RadarStateBusReader()
+{
+    munmap(const_cast<RadarStateSegment*>(m_segment),
+           sizeof(RadarStateSegment));
+}
+
+bool RadarStateBusReader::read(RadarSnapshot& snapshot,
+                               __u64& lastSequence) const
+{
+    // every sequence only grows: their sum changes whenever any sensor was
+    // written (or is being written)
+    const unsigned nSensors = std::min<unsigned>(
+        m_segment->nSensors.load(std::memory_order_relaxed), MAX_N_SENSORS);
+    __u64 total = 0;
+    for (unsigned i = 0; i < nSensors; ++i) {
+        total += m_segment->sensors[i].sequence.load(std::memory_order_relaxed);
+    }
+    if (total == lastSequence) {
+        return false;
+    }
+
+    total = 0;
+    __u32 stuckMask = 0;
+    bool publisherGone = false;
+    for (unsigned i = 0; i < nSensors; ++i) {
+        const auto& slot = m_segment->sensors[i];
+        bool torn = false;
+        unsigned nOdd = 0;
+        while (true) {
+            auto before = slot.sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                // writer in progress
+                ++nOdd;
+                if (nOdd < ODD_SPINS) {
+                    continue;
+                }
+                if (nOdd % ODD_SPINS == 0) {
+                    publisherGone = publisherGone || !publisherAlive();
+                }
+                if (!publisherGone && nOdd < ODD_SPINS + MAX_ODD_YIELDS) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                // Give up: the rows copied so far, if any, are torn. The
+                // odd sequence goes into the total, so that this sensor is
+                // only read again once it moves.
+                if (torn) {
+                    std::fill(std::begin(snapshot.sensors[i].valid),
+                              std::end(snapshot.sensors[i].valid), 0);
+                }
+                stuckMask |= 1u << i;
+                total += before;
+                break;
+            }
+
+            std::memcpy(&snapshot.sensors[i], &slot.rows, sizeof(slot.rows));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto after = slot.sequence.load(std::memory_order_relaxed);
+            if (before == after) {
+                total += after;
+                break;
+            }
+            torn = true;
+        }
+    }
+
+    snapshot.nSensors = nSensors;
+    snapshot.stale = m_segment->staleMask.load(std::memory_order_relaxed) |
+                     stuckMask;
+    if (publisherGone) {
+        // nothing will be published anymore
+        snapshot.stale = (1u << nSensors) - 1;
+    }
+    lastSequence = total;
+    return true;
+}
+
+bool RadarStateBusReader::publisherAlive() const
+{
+    const auto pid = m_segment->publisherPid.load(std::memory_order_relaxed);
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+bool RadarStateBusReader::refresh(RadarStateDB& stateDB)
+{
+    if (!read(m_snapshot, m_lastSequence)) {
+        return false;
+    }
+    RadarStateDB::FullLock lock(stateDB);
+    stateDB.importSnapshot(m_snapshot);
+    return true;
+}
+
+void RadarStateBusReader::followBus(RadarStateBusReader& reader,
+                                    RadarStateDB& stateDB,
+                                    std::future<void> futureSignal)
+{
+    // the radar publishes a few cycles per second: 5ms is far below that,
+    // and reads are plain memory accesses
+    using namespace std::chrono_literals;
+    while (futureSignal.wait_for(5ms) != std::future_status::ready) {
+        reader.refresh(stateDB);
+    }
+}
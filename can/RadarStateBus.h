@@ -0,0 +1,118 @@
+/*
+ *   Shares the radar state DB between processes through POSIX shared memory.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _RADAR_STATE_BUS_H_
+#define _RADAR_STATE_BUS_H_
+
+#include "BSFrameHandler.h" // RadarSnapshot
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <future>
+#include <string>
+
+namespace can {
+
+namespace backsense {
+
+static constexpr const char* DEFAULT_BUS_NAME = "/bs9000_radar_state";
+
+// The segment is written by one process (the radar daemon) and mapped
+// read-only by any number of readers. Consistency is given by a seqlock per
+// sensor: its sequence is odd while its rows are being written, so a reader
+// retries whenever it sees an odd or changed sequence number. A sensor is
+// only written by the reader thread of its CAN channel (or with the whole
+// DB locked), so the channels never wait for each other here.
+struct alignas(64) SensorSlot
+{
+    std::atomic<__u64> sequence;
+    SensorSnapshot rows;
+};
+
+struct RadarStateSegment
+{
+    __u32 magic;
+    __u32 version;
+    std::atomic<__s32> publisherPid;
+    std::atomic<__u32> nSensors;
+    std::atomic<__u32> staleMask;
+    SensorSlot sensors[MAX_N_SENSORS];
+};
+
+class RadarStateBusPublisher
+{
+  public:
+    RadarStateBusPublisher(const RadarStateBusPublisher&) = delete;
+    RadarStateBusPublisher& operator=(const RadarStateBusPublisher&) = delete;
+
+    // throws if another publisher, still running, holds the segment
+    explicit RadarStateBusPublisher(const std::string& name = DEFAULT_BUS_NAME);
+    ~RadarStateBusPublisher();
+
+    // the whole DB must be locked by the caller
+    void publish(const RadarStateDB& stateDB);
+    // only the rows of one sensor, whose shard must be locked by the caller
+    void publishSensor(const RadarStateDB& stateDB, unsigned sensorIdx);
+
+  private:
+    std::string m_name;
+    int m_fd = -1; // open for the lifetime, with the publisher's lock
+    RadarStateSegment* m_segment = nullptr;
+};
+
+class RadarStateBusReader
+{
+  public:
+    RadarStateBusReader(const RadarStateBusReader&) = delete;
+    RadarStateBusReader& operator=(const RadarStateBusReader&) = delete;
+
+    explicit RadarStateBusReader(const std::string& name = DEFAULT_BUS_NAME);
+    ~RadarStateBusReader();
+
+    // copies a snapshot, consistent for every sensor; returns false if
+    // nothing was published since 'lastSequence' (which is updated otherwise).
+    // A sensor left in the middle of a write (e.g. by a crashed publisher)
+    // keeps its previous rows and is marked stale.
+    bool read(RadarSnapshot& snapshot, __u64& lastSequence) const;
+
+    // imports the latest snapshot into a local DB, if there is a new one
+    bool refresh(RadarStateDB& stateDB);
+
+    // keeps a local DB in sync with the bus until the signal is set: this is
+    // the replacement for CANUtils::readMsgs in processes attached to the bus
+    static void followBus(RadarStateBusReader& reader,
+                          RadarStateDB& stateDB,
+                          std::future<void> futureSignal);
+
+  private:
+    bool publisherAlive() const;
+
+  private:
+    const RadarStateSegment* m_segment = nullptr;
+    RadarSnapshot m_snapshot;
+    __u64 m_lastSequence = 0;
+};
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _RADAR_STATE_BUS_H_
@@ -0,0 +1,352 @@
+/*
+ *   Streams the radar state, one binary message per sensor cycle, over
+ *   Unix datagram sockets or UDP multicast.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "RadarStream.h"
+#include "CaptureLog.h" // hostTimeNs()
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+
+static constexpr __u32 STREAM_MAGIC = 0x42535354; // "BSST"
+static constexpr __u16 STREAM_VERSION = 2;
+
+static bool startsWith(const std::string& str, const std::string& prefix)
+{
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+static sockaddr_un parseUnixEndpoint(const std::string& endpoint)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    const std::string path = endpoint.substr(5);
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Invalid endpoint \"" + endpoint + "\".");
+    }
+    path.copy(addr.sun_path, path.size());
+    return addr;
+}
+
+static sockaddr_in parseUdpEndpoint(const std::string& endpoint)
+{
+    // udp:<group>:<port>
+    const auto sep = endpoint.rfind(':');
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    if (sep <= 4 ||
+        !inet_aton(endpoint.substr(4, sep - 4).c_str(), &addr.sin_addr) ||
+        !IN_MULTICAST(ntohl(addr.sin_addr.s_addr))) {
+        throw std::runtime_error("Invalid endpoint \"" + endpoint + "\".");
+    }
+    addr.sin_port = htons(std::stoi(endpoint.substr(sep + 1)));
+    return addr;
+}
+
+static int openSocket(int domain)
+{
+    int fd = socket(domain, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Can't create socket: ") +
+                                 std::strerror(errno));
+    }
+    return fd;
+}
+
+using can::backsense::StreamClient;
+using can::backsense::StreamPublisher;
+
+// :::: class StreamPublisher
+
+StreamPublisher::StreamPublisher(const std::vector<std::string>& endpoints)
+{
+    for (const auto& endpoint : endpoints) {
+        if (startsWith(endpoint, "unix:")) {
+            m_unixDest.push_back(parseUnixEndpoint(endpoint));
+        } else if (startsWith(endpoint, "udp:")) {
+            m_udpDest.push_back(parseUdpEndpoint(endpoint));
+        } else {
+            throw std::runtime_error("Invalid endpoint \"" + endpoint + "\".");
+        }
+    }
+
+    m_iov.iov_base = &m_msg;
+    m_iov.iov_len = sizeof(m_msg);
+
+    auto makeHeader = [this](void* addr, socklen_t addrLen) {
+        mmsghdr header{};
+        header.msg_hdr.msg_name = addr;
+        header.msg_hdr.msg_namelen = addrLen;
+        header.msg_hdr.msg_iov = &m_iov;
+        header.msg_hdr.msg_iovlen = 1;
+        return header;
+    };
+
+    if (!m_unixDest.empty()) {
+        m_unixFd = openSocket(AF_UNIX);
+        for (auto& dest : m_unixDest) {
+            m_unixHeaders.push_back(makeHeader(&dest, sizeof(dest)));
+        }
+    }
+
+    if (!m_udpDest.empty()) {
+        m_udpFd = openSocket(AF_INET);
+
+        // keep the traffic in this machine
+        in_addr loopback{htonl(INADDR_LOOPBACK)};
+        unsigned char loop = 1, ttl = 0;
+        setsockopt(m_udpFd, IPPROTO_IP, IP_MULTICAST_IF, &loopback,
+                   sizeof(loopback));
+        setsockopt(m_udpFd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                   sizeof(loop));
+        setsockopt(m_udpFd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+        for (auto& dest : m_udpDest) {
+            m_udpHeaders.push_back(makeHeader(&dest, sizeof(dest)));
+        }
+    }
+
+    m_msg.magic = STREAM_MAGIC;
+    m_msg.version = STREAM_VERSION;
+}
+
+StreamPublisher::~StreamPublisher()
+{
+    if (m_unixFd >= 0) {
+        close(m_unixFd);
+    }
+    if (m_udpFd >= 0) {
+        close(m_udpFd);
+    }
+}
+
+void StreamPublisher::onUpdate(const RadarStateDB& stateDB,
+                               const DetectionData& newState)
+{
+    const auto idxPair = FrameHandler::getIndexPairFromId(newState.getId());
+    const unsigned sensorIdx = idxPair.first;
+
+    const auto boundary = m_cycles[sensorIdx].onObject(idxPair.second);
+    if (boundary.restarted) {
+        // the DB already holds an object of the new cycle: its slot is
+        // left out
+        publishCycle(stateDB, sensorIdx, boundary.previousSlots);
+    }
+    if (boundary.completed) {
+        publishCycle(stateDB, sensorIdx);
+    }
+}
+
+void StreamPublisher::publishCycle(const RadarStateDB& stateDB,
+                                   unsigned sensorIdx)
+{
+    publishCycle(stateDB, sensorIdx, CycleTracker::ALL_SLOTS);
+}
+
+void StreamPublisher::publishCycle(const RadarStateDB& stateDB,
+                                   unsigned sensorIdx, __u8 slotMask)
+{
+    // the message buffer is shared by the reader threads of every channel
+    std::lock_guard<std::mutex> lock(m_sendMutex);
+    m_msg.sensorIdx = sensorIdx;
+    m_msg.validMask = 0;
+    m_msg.sequence = ++m_sequence;
+    m_msg.hostTimeNs = CaptureLogWriter::hostTimeNs();
+    m_msg.stale = stateDB.isSensorStale(sensorIdx);
+    // nothing of an earlier cycle in the empty slots
+    std::memset(m_msg.ids, 0, sizeof(m_msg.ids));
+    std::memset(m_msg.frames, 0, sizeof(m_msg.frames));
+
+    const auto& objs = stateDB.getSensorData(sensorIdx);
+    for (unsigned i = 0; i < MAX_N_OBJS; ++i) {
+        if (objs[i] && (slotMask & (1 << i))) {
+            m_msg.validMask |= 1 << i;
+            m_msg.ids[i] = objs[i]->getId();
+            const auto& raw = objs[i]->getRawData();
+            std::copy(raw.begin(), raw.end(), m_msg.frames[i]);
+        }
+    }
+
+    sendToAll(m_unixFd, m_unixHeaders);
+    sendToAll(m_udpFd, m_udpHeaders);
+}
+
+void StreamPublisher::sendToAll(int fd, std::vector<mmsghdr>& headers)
+{
+    // one syscall for every destination; a destination that is not
+    // listening (or is full) is skipped, since the reader thread must never
+    // block here
+    unsigned next = 0;
+    while (next < headers.size()) {
+        int sent = sendmmsg(fd, &headers[next], headers.size() - next,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ++next;
+        } else {
+            next += sent;
+        }
+    }
+}
+
+// :::: class StreamClient
+
+StreamClient::StreamClient(const std::string& endpoint)
+{
+    if (startsWith(endpoint, "unix:")) {
+        auto addr = parseUnixEndpoint(endpoint);
+        m_fd = openSocket(AF_UNIX);
+        unlink(addr.sun_path);
+        if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+            close(m_fd);
+            throw std::runtime_error("Can't bind to \"" + endpoint + "\".");
+        }
+        m_unixPath = addr.sun_path;
+    } else if (startsWith(endpoint, "udp:")) {
+        auto group = parseUdpEndpoint(endpoint);
+        m_fd = openSocket(AF_INET);
+
+        int reuse = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in addr = group;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        ip_mreq mreq{};
+        mreq.imr_multiaddr = group.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+            setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                       sizeof(mreq))) {
+            close(m_fd);
+            throw std::runtime_error("Can't join \"" + endpoint + "\".");
+        }
+    } else {
+        throw std::runtime_error("Invalid endpoint \"" + endpoint + "\".");
+    }
+
+    for (unsigned i = 0; i < BATCH; ++i) {
+        m_iovs[i].iov_base = &m_msgs[i];
+        m_iovs[i].iov_len = sizeof(StreamMessage);
+        m_headers[i] = mmsghdr{};
+        m_headers[i].msg_hdr.msg_iov = &m_iovs[i];
+        m_headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::memset(&m_snapshot, 0, sizeof(m_snapshot));
+    m_snapshot.nSensors = MAX_N_SENSORS;
+}
+
+StreamClient::~StreamClient()
+{
+    close(m_fd);
+    if (!m_unixPath.empty()) {
+        unlink(m_unixPath.c_str());
+    }
+}
+
+unsigned StreamClient::receive(int timeoutMs)
+{
+    pollfd pfd{m_fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) <= 0) {
+        return 0;
+    }
+
+    unsigned total = 0;
+    int n;
+    while ((n = recvmmsg(m_fd, m_headers.data(), BATCH, MSG_DONTWAIT,
+                         nullptr)) > 0) {
+        for (int i = 0; i < n; ++i) {
+            if (m_headers[i].msg_len == sizeof(StreamMessage) &&
+                m_msgs[i].magic == STREAM_MAGIC &&
+                m_msgs[i].version == STREAM_VERSION) {
+                apply(m_msgs[i]);
+                m_lastIdx = i;
+                ++total;
+            }
+        }
+        if (n < static_cast<int>(BATCH)) {
+            break;
+        }
+    }
+    return total;
+}
+
+void StreamClient::apply(const StreamMessage& msg)
+{
+    if (!m_first && msg.sequence > m_lastSequence + 1) {
+        m_lost += msg.sequence - m_lastSequence - 1;
+    }
+    m_first = false;
+    m_lastSequence = msg.sequence;
+    ++m_received;
+
+    if (msg.sensorIdx >= MAX_N_SENSORS) {
+        return;
+    }
+
+    if (msg.stale) {
+        m_snapshot.stale |= 1 << msg.sensorIdx;
+    } else {
+        m_snapshot.stale &= ~(1 << msg.sensorIdx);
+    }
+
+    auto& rows = m_snapshot.sensors[msg.sensorIdx];
+    for (unsigned i = 0; i < MAX_N_OBJS; ++i) {
+        const bool valid = msg.validMask & (1 << i);
+        rows.valid[i] = valid;
+        if (valid) {
+            rows.ids[i] = msg.ids[i];
+            std::memcpy(rows.frames[i], msg.frames[i], N_BYTES);
+        }
+    }
+    m_changed = true;
+}
+
+bool StreamClient::refresh(RadarStateDB& stateDB)
+{
+    if (!m_changed) {
+        return false;
+    }
+    RadarStateDB::FullLock lock(stateDB);
+    stateDB.importSnapshot(m_snapshot);
+    m_changed = false;
+    return true;
+}
+
+void StreamClient::followStream(StreamClient& client, RadarStateDB& stateDB,
+                                std::future<void> futureSignal)
+{
+    while (futureSignal.wait_for(std::chrono::seconds::zero()) !=
+           std::future_status::ready) {
+        // wake up at least every 100ms to check the exit signal
+        if (client.receive(100)) {
+            client.refresh(stateDB);
+        }
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ *   Streams the radar state, one binary message per sensor cycle, over
+ *   Unix datagram sockets or UDP multicast.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _RADAR_STREAM_H_
+#define _RADAR_STREAM_H_
+
+#include "BSFrameHandler.h"
+
+#include <linux/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <array>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace can {
+
+namespace backsense {
+
+#pragma pack(1)
+
+// one message per completed cycle of one sensor
+struct StreamMessage
+{
+    __u32 magic;
+    __u16 version;
+    __u8 sensorIdx;
+    __u8 validMask; // bit i set: object slot i holds a detection
+    __u64 sequence; // per publisher, +1 for every message
+    __u64 hostTimeNs; // steady clock of the publisher at cycle end
+    __u32 ids[MAX_N_OBJS]; // 0 in the slots without a detection
+    __u8 frames[MAX_N_OBJS][N_BYTES];
+    __u8 stale; // 1: the state of the sensor is stale (e.g. channel down)
+};
+
+#pragma pack()
+
+static_assert(sizeof(StreamMessage) == 25 + 12 * MAX_N_OBJS,
+              "unexpected message layout");
+
+// Endpoints are given as "unix:<socket path>" or "udp:<group>:<port>"
+// (a multicast group, delivered on the loopback interface).
+class StreamPublisher
+{
+  public:
+    StreamPublisher(const StreamPublisher&) = delete;
+    StreamPublisher& operator=(const StreamPublisher&) = delete;
+
+    explicit StreamPublisher(const std::vector<std::string>& endpoints);
+    ~StreamPublisher();
+
+    // to be installed as an update listener of the DB
+    void onUpdate(const RadarStateDB& stateDB, const DetectionData& newState);
+
+    // sends the cycle of one sensor to every endpoint; the shard of the
+    // sensor must be locked by the caller
+    void publishCycle(const RadarStateDB& stateDB, unsigned sensorIdx);
+
+    __u64 sentMessages() const { return m_sequence; }
+
+  private:
+    // ... leaving out the slots not in 'slotMask'
+    void publishCycle(const RadarStateDB& stateDB, unsigned sensorIdx,
+                      __u8 slotMask);
+    void sendToAll(int fd, std::vector<mmsghdr>& headers);
+
+  private:
+    int m_unixFd = -1;
+    int m_udpFd = -1;
+    std::vector<sockaddr_un> m_unixDest;
+    std::vector<sockaddr_in> m_udpDest;
+
+    // message and per destination headers are reused for every cycle
+    StreamMessage m_msg;
+    iovec m_iov;
+    std::vector<mmsghdr> m_unixHeaders;
+    std::vector<mmsghdr> m_udpHeaders;
+
+    std::array<CycleTracker, MAX_N_SENSORS> m_cycles;
+    std::mutex m_sendMutex;
+    __u64 m_sequence = 0;
+};
+
+class StreamClient
+{
+  public:
+    StreamClient(const StreamClient&) = delete;
+    StreamClient& operator=(const StreamClient&) = delete;
+
+    explicit StreamClient(const std::string& endpoint);
+    ~StreamClient();
+
+    // drains the pending messages, waiting up to 'timeoutMs' for the first
+    // one; returns the number of messages received
+    unsigned receive(int timeoutMs);
+
+    // imports the received state into a local DB, if it has changed
+    bool refresh(RadarStateDB& stateDB);
+
+    // keeps a local DB in sync with the stream until the signal is set
+    static void followStream(StreamClient& client, RadarStateDB& stateDB,
+                             std::future<void> futureSignal);
+
+    const StreamMessage& lastMessage() const { return m_msgs[m_lastIdx]; }
+    __u64 receivedMessages() const { return m_received; }
+    // messages missed, according to gaps in the sequence numbers
+    __u64 lostMessages() const { return m_lost; }
+
+  private:
+    void apply(const StreamMessage& msg);
+
+  private:
+    static constexpr unsigned BATCH = 16;
+
+    int m_fd = -1;
+    std::string m_unixPath;
+
+    std::array<StreamMessage, BATCH> m_msgs;
+    std::array<iovec, BATCH> m_iovs;
+    std::array<mmsghdr, BATCH> m_headers;
+    unsigned m_lastIdx = 0;
+
+    RadarSnapshot m_snapshot;
+    bool m_changed = false;
+    bool m_first = true;
+    __u64 m_lastSequence = 0;
+    __u64 m_received = 0;
+    __u64 m_lost = 0;
+};
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _RADAR_STREAM_H_
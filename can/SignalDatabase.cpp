@@ -0,0 +1,296 @@
+/*
+ *   Signal layouts loaded from DBC files, compiled into flat decode tables.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SignalDatabase.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using can::dbc::MessageLayout;
+using can::dbc::SignalDatabase;
+using can::dbc::SignalOp;
+
+static constexpr __u32 DBC_EXTENDED_FLAG = 0x80000000;
+
+namespace {
+
+// a minimal cursor over one DBC line
+class LineParser
+{
+  public:
+    LineParser(const std::string& line, const std::string& where)
+        : m_in(line)
+        , m_where(where)
+    {
+    }
+
+    std::string word()
+    {
+        std::string w;
+        if (!(m_in >> w)) {
+            fail("unexpected end of line");
+        }
+        return w;
+    }
+
+    template <typename T> T number()
+    {
+        T value;
+        if (!(m_in >> value)) {
+            fail("number expected");
+        }
+        return value;
+    }
+
+    void expect(char c)
+    {
+        char got;
+        if (!(m_in >> got) || got != c) {
+            fail(std::string("'") + c + "' expected");
+        }
+    }
+
+    bool peek(char c)
+    {
+        m_in >> std::ws;
+        return m_in.peek() == c;
+    }
+
+    std::string quoted()
+    {
+        expect('"');
+        std::string s;
+        std::getline(m_in, s, '"');
+        return s;
+    }
+
+    [[noreturn]] void fail(const std::string& what) const
+    {
+        throw std::runtime_error(m_where + ": " + what + ".");
+    }
+
+  private:
+    std::istringstream m_in;
+    std::string m_where;
+};
+
+} // namespace
+
+// Turns the DBC bit numbering into a shift in the 64 bit word:
+//  - Intel (@1): 'start' is the lsb, counted from bit 0 of byte 0 upwards,
+//    which is exactly its position in the little endian word;
+//  - Motorola (@0): 'start' is the msb, numbered as bit (start % 8) of byte
+//    (start / 8); in the big endian word, byte k holds bits 63-8k..56-8k.
+static SignalOp compileSignal(unsigned start, unsigned length, bool bigEndian,
+                              bool isSigned, double scale, double offset,
+                              LineParser& parser)
+{
+    if (length == 0 || length > 64) {
+        parser.fail("invalid signal length");
+    }
+
+    int lsb;
+    if (bigEndian) {
+        const int msb = (7 - static_cast<int>(start / 8)) * 8 + start % 8;
+        lsb = msb - static_cast<int>(length) + 1;
+    } else {
+        lsb = start;
+    }
+    if (lsb < 0 || lsb + length > 64) {
+        parser.fail("signal does not fit in 8 bytes");
+    }
+
+    SignalOp op;
+    op.mask = length == 64 ? ~0ull : (1ull << length) - 1;
+    op.signBit = isSigned ? 1ull << (length - 1) : 0;
+    op.scale = scale;
+    op.offset = offset;
+    op.shift = lsb;
+    op.bigEndian = bigEndian;
+    return op;
+}
+
+// :::: class MessageLayout
+
+int MessageLayout::signalIndex(const std::string& name) const
+{
+    for (size_t s = 0; s < m_signals.size(); ++s) {
+        if (m_signals[s].name == name) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+void MessageLayout::decodeBatch(const __u8* payloads, size_t stride,
+                                size_t n, double* out) const
+{
+    // The words are loaded once per block of payloads, then every signal
+    // runs over the block. The inner loops are branch free, with the op
+    // fields in locals, so that the compiler vectorizes them; signals of up
+    // to 32 bits (nearly all of them) use 32 bit lanes, which halves the
+    // work and allows the vector int to double conversion.
+    static constexpr size_t BLOCK = 256;
+    __u64 le[BLOCK], be[BLOCK];
+
+    for (size_t first = 0; first < n; first += BLOCK) {
+        const size_t count = std::min(BLOCK, n - first);
+        for (size_t i = 0; i < count; ++i) {
+            loadWords(payloads + (first + i) * stride, le[i], be[i]);
+        }
+        for (size_t s = 0; s < m_ops.size(); ++s) {
+            const auto& op = m_ops[s];
+            const __u64* words = op.bigEndian ? be : le;
+            double* column = out + s * n + first;
+
+            if (op.mask > 0xFFFFFFFF) {
+                for (size_t i = 0; i < count; ++i) {
+                    column[i] = apply(op, words[i]);
+                }
+                continue;
+            }
+
+            const unsigned shift = op.shift;
+            const __u32 mask = op.mask;
+            const __u32 signBit = op.signBit;
+            const double scale = op.scale;
+            const double offset = op.offset;
+            for (size_t i = 0; i < count; ++i) {
+                const __u32 raw = static_cast<__u32>(words[i] >> shift);
+                const __u32 field = raw & mask;
+                const __s32 value =
+                    static_cast<__s32>((field ^ signBit) - signBit);
+                column[i] = value * scale + offset;
+            }
+        }
+    }
+}
+
+// :::: class SignalDatabase
+
+SignalDatabase SignalDatabase::load(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Can't open DBC file \"" + path + "\".");
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return parse(text.str(), path);
+}
+
+SignalDatabase SignalDatabase::parse(const std::string& text,
+                                     const std::string& source)
+{
+    SignalDatabase db;
+    std::istringstream lines(text);
+    std::string line;
+    unsigned lineNumber = 0;
+    MessageLayout* current = nullptr;
+
+    while (std::getline(lines, line)) {
+        ++lineNumber;
+        const auto where = source + ":" + std::to_string(lineNumber);
+        LineParser parser(line, where);
+
+        std::istringstream first(line);
+        std::string keyword;
+        first >> keyword;
+
+        if (keyword == "BO_") {
+            // BO_ <id> <name>: <dlc> <transmitter>
+            parser.word();
+            MessageLayout msg;
+            const auto rawId = parser.number<__u32>();
+            msg.m_id = rawId & ~DBC_EXTENDED_FLAG;
+            msg.m_name = parser.word();
+            if (!msg.m_name.empty() && msg.m_name.back() == ':') {
+                msg.m_name.pop_back();
+            } else {
+                parser.expect(':');
+            }
+            msg.m_dlc = parser.number<unsigned>();
+            if (msg.m_dlc > MAX_PAYLOAD) {
+                parser.fail("only classic CAN payloads are supported");
+            }
+            db.m_messages.push_back(std::move(msg));
+            current = &db.m_messages.back();
+        } else if (keyword == "SG_") {
+            // SG_ <name> [M|m<n>] : <start>|<length>@<0|1><+|->
+            //     (<scale>,<offset>) [<min>|<max>] "<unit>" <receivers>
+            if (!current) {
+                parser.fail("signal outside of a message");
+            }
+            parser.word();
+            SignalInfo info;
+            info.name = parser.word();
+            if (!parser.peek(':')) {
+                parser.word(); // multiplexer indicator
+            }
+            parser.expect(':');
+            const auto start = parser.number<unsigned>();
+            parser.expect('|');
+            const auto length = parser.number<unsigned>();
+            parser.expect('@');
+            const auto byteOrder = parser.number<unsigned>();
+            const auto sign = parser.word().front();
+            parser.expect('(');
+            const auto scale = parser.number<double>();
+            parser.expect(',');
+            const auto offset = parser.number<double>();
+            parser.expect(')');
+            parser.expect('[');
+            info.minimum = parser.number<double>();
+            parser.expect('|');
+            info.maximum = parser.number<double>();
+            parser.expect(']');
+            info.unit = parser.quoted();
+
+            if (byteOrder > 1 || (sign != '+' && sign != '-')) {
+                parser.fail("invalid byte order or sign");
+            }
+            current->m_ops.push_back(compileSignal(start, length,
+                                                   byteOrder == 0, sign == '-',
+                                                   scale, offset, parser));
+            current->m_signals.push_back(std::move(info));
+        } else if (!keyword.empty() && line.front() != ' ' &&
+                   line.front() != '\t') {
+            // any other section ends the signal list of a message
+            current = nullptr;
+        }
+    }
+
+    db.index();
+    return db;
+}
+
+void SignalDatabase::index()
+{
+    for (size_t i = 0; i < m_messages.size(); ++i) {
+        const auto id = m_messages[i].id();
+        if (id < N_STD_IDS) {
+            m_stdIndex[id] = i;
+        } else {
+            m_extIndex[id] = i;
+        }
+    }
+}
@@ -0,0 +1,154 @@
+/*
+ *   Signal layouts loaded from DBC files, compiled into flat decode tables.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SIGNAL_DATABASE_H_
+#define _SIGNAL_DATABASE_H_
+
+#include <endian.h>
+#include <linux/types.h>
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace can {
+
+namespace dbc {
+
+static constexpr unsigned MAX_PAYLOAD = 8;
+
+// One signal, reduced to what the interpreter needs. The payload is read
+// once as a 64 bit word (little endian for Intel signals, big endian for
+// Motorola ones), so that any signal up to 64 bits, spanning any bytes, is
+// a shift and a mask away.
+struct SignalOp
+{
+    __u64 mask;      // (1 << length) - 1
+    __u64 signBit;   // 1 << (length - 1) for signed signals, 0 otherwise
+    double scale;
+    double offset;
+    __u8 shift;      // of the lsb, in the word
+    __u8 bigEndian;  // which word to read
+};
+
+struct SignalInfo
+{
+    std::string name;
+    std::string unit;
+    double minimum;
+    double maximum;
+};
+
+class MessageLayout
+{
+  public:
+    __u32 id() const { return m_id; }
+    const std::string& name() const { return m_name; }
+    unsigned dlc() const { return m_dlc; }
+
+    size_t signalCount() const { return m_ops.size(); }
+    const std::vector<SignalInfo>& signals() const { return m_signals; }
+    const std::vector<SignalOp>& ops() const { return m_ops; }
+    // -1 if the message has no such signal
+    int signalIndex(const std::string& name) const;
+
+    // every signal of one payload, in declaration order
+    void decode(const __u8* payload, double* out) const
+    {
+        __u64 le, be;
+        loadWords(payload, le, be);
+        for (size_t s = 0; s < m_ops.size(); ++s) {
+            out[s] = apply(m_ops[s], m_ops[s].bigEndian ? be : le);
+        }
+    }
+
+    // 'n' payloads, 'stride' bytes apart; 'out' gets one column per signal:
+    // out[s * n + i] is signal s of payload i
+    void decodeBatch(const __u8* payloads, size_t stride, size_t n,
+                     double* out) const;
+
+    static double apply(const SignalOp& op, __u64 word)
+    {
+        const __u64 raw = (word >> op.shift) & op.mask;
+        // sign extension, a no-op for unsigned signals (signBit 0)
+        const __s64 value = static_cast<__s64>((raw ^ op.signBit) - op.signBit);
+        return value * op.scale + op.offset;
+    }
+
+  private:
+    static void loadWords(const __u8* payload, __u64& le, __u64& be)
+    {
+        __u64 word;
+        std::memcpy(&word, payload, sizeof(word));
+        le = le64toh(word);
+        be = be64toh(word);
+    }
+
+    friend class SignalDatabase;
+
+  private:
+    __u32 m_id = 0;
+    std::string m_name;
+    unsigned m_dlc = 0;
+    std::vector<SignalInfo> m_signals;
+    std::vector<SignalOp> m_ops;
+};
+
+// The messages of a DBC file. Only what decoding needs is read: BO_ and
+// SG_ lines; comments, attributes and value tables are skipped, and
+// multiplexed signals are decoded as plain ones.
+class SignalDatabase
+{
+  public:
+    static SignalDatabase load(const std::string& path);
+    static SignalDatabase parse(const std::string& text,
+                                const std::string& source = "<text>");
+
+    const std::vector<MessageLayout>& messages() const { return m_messages; }
+
+    // null if the id is not described
+    const MessageLayout* find(__u32 id) const
+    {
+        if (id < N_STD_IDS) {
+            const int idx = m_stdIndex[id];
+            return idx < 0 ? nullptr : &m_messages[idx];
+        }
+        auto it = m_extIndex.find(id);
+        return it == m_extIndex.end() ? nullptr : &m_messages[it->second];
+    }
+
+  private:
+    SignalDatabase() : m_stdIndex(N_STD_IDS, -1) {}
+    void index();
+
+  private:
+    static constexpr unsigned N_STD_IDS = 2048;
+
+    std::vector<MessageLayout> m_messages;
+    std::vector<int> m_stdIndex;
+    std::unordered_map<__u32, size_t> m_extIndex;
+};
+
+} // namespace dbc
+
+} // namespace can
+
+#endif // _SIGNAL_DATABASE_H_
@@ -0,0 +1,101 @@
+/*
+ *   A bounded, lock-free ring buffer with a single producer and a single
+ *   consumer.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <linux/types.h>
+
+#include <atomic>
+
+namespace can {
+
+// The producer only advances 'head' and the consumer 'tail', each on a line
+// of its own; each side also keeps the last value it read of the other one,
+// so that it only touches the other line when the ring looks full (empty).
+// Nothing ever waits: a full ring refuses the item, an empty one returns
+// null. The items are copied in place, and never allocate.
+template <typename T, unsigned N> class SpscRing
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+  public:
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    SpscRing() = default;
+
+    static constexpr unsigned capacity() { return N; }
+
+    // producer only; returns false if the ring is full
+    bool tryPush(const T& item)
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head - m_cachedTail == N) {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head - m_cachedTail == N) {
+                return false;
+            }
+        }
+        m_items[head % N] = item;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only: the oldest item, or null if the ring is empty; it
+    // stays in place until pop()
+    T* front()
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_cachedHead) {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail == m_cachedHead) {
+                return nullptr;
+            }
+        }
+        return &m_items[tail % N];
+    }
+
+    void pop()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+    }
+
+    // from either side: exact for the calling side, a lower bound of what
+    // the other one has done meanwhile
+    __u64 size() const
+    {
+        const auto tail = m_tail.load(std::memory_order_acquire);
+        return m_head.load(std::memory_order_acquire) - tail;
+    }
+
+  private:
+    alignas(64) std::atomic<__u64> m_head{0};
+    __u64 m_cachedTail = 0; // the producer's
+    alignas(64) std::atomic<__u64> m_tail{0};
+    __u64 m_cachedHead = 0; // the consumer's
+    alignas(64) T m_items[N];
+};
+
+} // namespace can
+
+#endif // _SPSC_RING_H_
@@ -0,0 +1,142 @@
+/*
+ *   Loopback throughput and latency benchmark of the radar stream.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "BSFrameHandler.h"
+#include "CaptureLog.h"
+#include "RadarStream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace can::backsense;
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg
+              << " [-n cycles] [-r cycles_per_sec] <unix:path | udp:group:port>"
+              << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned nCycles = 100000;
+    unsigned rate = 0; // as fast as possible
+    std::string endpoint;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+            nCycles = std::stoul(argv[++i]);
+        } else if (!std::strcmp(argv[i], "-r") && i + 1 < argc) {
+            rate = std::stoul(argv[++i]);
+        } else {
+            endpoint = argv[i];
+        }
+    }
+    if (endpoint.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try {
+        StreamClient client(endpoint);
+        StreamPublisher publisher({endpoint});
+
+        RadarStateDB stateDB(MAX_N_SENSORS);
+        stateDB.addUpdateListener(
+            [&publisher](const RadarStateDB& db, const DetectionData& state) {
+                publisher.onUpdate(db, state);
+            });
+
+        std::atomic<bool> done{false};
+        std::vector<double> latenciesUs;
+        latenciesUs.reserve(nCycles);
+
+        std::thread receiver([&]() {
+            while (!done.load()) {
+                auto before = client.receivedMessages();
+                if (client.receive(10) &&
+                    client.receivedMessages() == before + 1) {
+                    // only single messages: a batch would only give the
+                    // latency of its last message
+                    auto now = can::CaptureLogWriter::hostTimeNs();
+                    latenciesUs.push_back(
+                        (now - client.lastMessage().hostTimeNs) / 1e3);
+                }
+            }
+            while (client.receive(0)) {
+                // drain what is left
+            }
+        });
+
+        FrameHandler frameHandler;
+        PARAM_STRUCT param{};
+        param.DataLength = N_BYTES;
+
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned cycle = 0; cycle < nCycles; ++cycle) {
+            for (unsigned obj = 0; obj < MAX_N_OBJS; ++obj) {
+                param.Ident = BASE_DETECTION_ID + obj;
+                param.RCV_data[0] = cycle;
+                auto state = frameHandler.processRcvFrame(param);
+                stateDB.updateState(std::move(*state));
+            }
+            if (rate) {
+                std::this_thread::sleep_until(
+                    start + std::chrono::microseconds(1000000ull *
+                                                      (cycle + 1) / rate));
+            }
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        done.store(true);
+        receiver.join();
+
+        std::cout << "Endpoint: " << endpoint << "\n"
+                  << "Sent: " << publisher.sentMessages() << " messages in "
+                  << elapsed.count() << " s ("
+                  << publisher.sentMessages() / elapsed.count() << " msg/s)\n"
+                  << "Received: " << client.receivedMessages()
+                  << ", lost: " << client.lostMessages() << "\n";
+
+        if (!latenciesUs.empty()) {
+            std::sort(latenciesUs.begin(), latenciesUs.end());
+            auto pct = [&](double p) {
+                return latenciesUs[(latenciesUs.size() - 1) * p];
+            };
+            std::cout << "Latency (us): p50 " << pct(0.5) << ", p99 "
+                      << pct(0.99) << ", max " << latenciesUs.back()
+                      << std::endl;
+        }
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,469 @@
+/*
+ *   Pipeline telemetry: per-thread counters exported in the Prometheus text
+ *   format.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Telemetry.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+namespace telemetry {
+
+struct Snapshot
+{
+    std::chrono::steady_clock::time_point time;
+    // the blocks may change hands: what they were when the counters were
+    // read
+    bool inUse[MAX_THREADS];
+    __u32 generations[MAX_THREADS];
+    char names[MAX_THREADS][32];
+    __u64 counters[MAX_THREADS][static_cast<unsigned>(Counter::N_COUNTERS)];
+    __u64 framesPerId[N_FRAME_IDS];
+};
+
+} // namespace telemetry
+
+using telemetry::Counter;
+using telemetry::Snapshot;
+using telemetry::TelemetryExporter;
+using telemetry::ThreadCounters;
+
+static constexpr unsigned N_COUNTERS =
+    static_cast<unsigned>(Counter::N_COUNTERS);
+
+static const char* COUNTER_NAMES[N_COUNTERS] = {
+    "bs9000_frames_read_total",       "bs9000_decode_rejects_total",
+    "bs9000_fifo_lost_messages_total", "bs9000_receive_overruns_total",
+    "bs9000_bus_state_changes_total", "bs9000_read_errors_total",
+    "bs9000_db_updates_total",        "bs9000_rendered_frames_total",
+    "bs9000_channel_recoveries_total", "bs9000_obstacle_alerts_total",
+    "bs9000_camera_frames_total",     "bs9000_recorded_frames_total",
+    "bs9000_recorder_drops_total"};
+
+// the last block is the shared "other" one
+static constexpr unsigned OTHER_BLOCK = telemetry::MAX_THREADS - 1;
+static ThreadCounters s_threads[telemetry::MAX_THREADS];
+static telemetry::BusGauges s_busGauges[telemetry::MAX_CHANNELS];
+static std::atomic<unsigned> s_nThreads{0};
+static telemetry::StageGauges s_stages[telemetry::MAX_STAGES];
+static std::atomic<unsigned> s_nStages{0};
+
+// held to claim or release a block (once per thread), and to take a
+// snapshot: never by the increments
+static std::mutex s_blocksMutex;
+
+static thread_local ThreadCounters* t_counters = nullptr;
+
+static ThreadCounters& otherBlock()
+{
+    auto& block = s_threads[OTHER_BLOCK];
+    if (!block.shared) {
+        block.shared = true;
+        std::snprintf(block.name, sizeof(block.name), "other");
+        block.inUse.store(true, std::memory_order_release);
+    }
+    return block;
+}
+
+static void releaseBlock(ThreadCounters& block)
+{
+    if (block.shared) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(s_blocksMutex);
+    auto& other = otherBlock();
+    for (unsigned c = 0; c < N_COUNTERS; ++c) {
+        other.counters[c].value.fetch_add(
+            block.counters[c].value.exchange(0, std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    }
+    for (unsigned id = 0; id < telemetry::N_FRAME_IDS; ++id) {
+        if (const auto n = block.framesPerId[id].exchange(
+                0, std::memory_order_relaxed)) {
+            other.framesPerId[id].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    block.inUse.store(false, std::memory_order_release);
+    block.claimed = false;
+}
+
+// gives the block of the thread back when it exits
+struct BlockOwner
+{
+    ThreadCounters* block = nullptr;
+    ~BlockOwner()
+    {
+        if (block) {
+            releaseBlock(*block);
+        }
+    }
+};
+
+static thread_local BlockOwner t_owner;
+
+static ThreadCounters& claimBlock(const char* name)
+{
+    std::lock_guard<std::mutex> lock(s_blocksMutex);
+    for (unsigned i = 0; i < OTHER_BLOCK; ++i) {
+        auto& block = s_threads[i];
+        if (!block.claimed) {
+            block.claimed = true;
+            ++block.generation;
+            std::snprintf(block.name, sizeof(block.name), "%s", name);
+            block.inUse.store(true, std::memory_order_release);
+            t_owner.block = &block;
+            return block;
+        }
+    }
+    return otherBlock();
+}
+
+void telemetry::registerThread(const char* name)
+{
+    if (!t_counters) {
+        t_counters = &claimBlock(name);
+    }
+}
+
+ThreadCounters& telemetry::threadCounters()
+{
+    if (!t_counters) {
+        auto name = "thread" + std::to_string(s_nThreads.fetch_add(1));
+        t_counters = &claimBlock(name.c_str());
+    }
+    return *t_counters;
+}
+
+telemetry::BusGauges& telemetry::busGauges(unsigned channelIdx)
+{
+    return s_busGauges[channelIdx % MAX_CHANNELS];
+}
+
+telemetry::StageGauges& telemetry::stageGauges(const char* name,
+                                               __u32 queueCapacity)
+{
+    auto idx = s_nStages.fetch_add(1);
+    if (idx >= MAX_STAGES) {
+        idx = MAX_STAGES - 1;
+        name = "overflow";
+    }
+
+    auto& gauges = s_stages[idx];
+    std::snprintf(gauges.name, sizeof(gauges.name), "%s", name);
+    gauges.queueCapacity = queueCapacity;
+    gauges.inUse.store(true, std::memory_order_release);
+    return gauges;
+}
+
+static void takeSnapshot(Snapshot& snapshot)
+{
+    // no block moves its counts to the other one meanwhile
+    std::lock_guard<std::mutex> lock(s_blocksMutex);
+    snapshot.time = std::chrono::steady_clock::now();
+    std::memset(snapshot.framesPerId, 0, sizeof(snapshot.framesPerId));
+    for (unsigned t = 0; t < telemetry::MAX_THREADS; ++t) {
+        const auto& block = s_threads[t];
+        const bool inUse = block.inUse.load(std::memory_order_acquire);
+        snapshot.inUse[t] = inUse;
+        snapshot.generations[t] = block.generation;
+        std::memcpy(snapshot.names[t], block.name, sizeof(block.name));
+        for (unsigned c = 0; c < N_COUNTERS; ++c) {
+            snapshot.counters[t][c] =
+                inUse ? block.counters[c].value.load(std::memory_order_relaxed)
+                      : 0;
+        }
+        if (inUse) {
+            for (unsigned id = 0; id < telemetry::N_FRAME_IDS; ++id) {
+                snapshot.framesPerId[id] +=
+                    block.framesPerId[id].load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+std::string telemetry::renderPrometheusText(const Snapshot* previous,
+                                            Snapshot* current)
+{
+    Snapshot local;
+    if (!current) {
+        current = &local;
+    }
+    takeSnapshot(*current);
+
+    double dt = 0;
+    if (previous) {
+        dt = std::chrono::duration<double>(current->time - previous->time)
+                 .count();
+    }
+
+    std::ostringstream out;
+
+    for (unsigned c = 0; c < N_COUNTERS; ++c) {
+        out << "# TYPE " << COUNTER_NAMES[c] << " counter\n";
+        for (unsigned t = 0; t < MAX_THREADS; ++t) {
+            if (current->inUse[t]) {
+                out << COUNTER_NAMES[c] << "{thread=\"" << current->names[t]
+                    << "\"} " << current->counters[t][c] << "\n";
+            }
+        }
+    }
+
+    out << "# TYPE bs9000_frames_by_id_total counter\n";
+    for (unsigned id = 0; id < N_FRAME_IDS; ++id) {
+        if (current->framesPerId[id]) {
+            out << "bs9000_frames_by_id_total{id=\"0x" << std::hex << id
+                << std::dec << "\"} " << current->framesPerId[id] << "\n";
+        }
+    }
+
+    if (dt > 0) {
+        out << "# TYPE bs9000_rate_per_second gauge\n";
+        for (unsigned c = 0; c < N_COUNTERS; ++c) {
+            for (unsigned t = 0; t < MAX_THREADS; ++t) {
+                // a block given to another thread since starts over
+                const bool sameThread = previous->inUse[t] &&
+                                        previous->generations[t] ==
+                                            current->generations[t];
+                const auto delta =
+                    current->counters[t][c] -
+                    (sameThread ? previous->counters[t][c] : 0);
+                if (current->inUse[t] && delta) {
+                    out << "bs9000_rate_per_second{counter=\""
+                        << COUNTER_NAMES[c] << "\",thread=\""
+                        << current->names[t] << "\"} " << delta / dt
+                        << "\n";
+                }
+            }
+        }
+        out << "# TYPE bs9000_frames_by_id_per_second gauge\n";
+        for (unsigned id = 0; id < N_FRAME_IDS; ++id) {
+            const auto delta =
+                current->framesPerId[id] - previous->framesPerId[id];
+            if (delta) {
+                out << "bs9000_frames_by_id_per_second{id=\"0x" << std::hex
+                    << id << std::dec << "\"} " << delta / dt << "\n";
+            }
+        }
+    }
+
+    // channel 0 is always there, the others once they are in use
+    auto renderGauge = [&out](const char* name, auto sample) {
+        out << "# TYPE " << name << " gauge\n";
+        for (unsigned ch = 0; ch < MAX_CHANNELS; ++ch) {
+            const auto& gauges = s_busGauges[ch];
+            if (ch == 0 || gauges.inUse.load()) {
+                out << name << "{channel=\"" << ch << "\"} " << sample(gauges)
+                    << "\n";
+            }
+        }
+    };
+    using telemetry::BusGauges;
+    renderGauge("bs9000_bus_state",
+                [](const BusGauges& g) { return g.busState.load(); });
+    renderGauge("bs9000_error_state",
+                [](const BusGauges& g) { return g.errorState.load(); });
+    renderGauge("bs9000_channel_online",
+                [](const BusGauges& g) { return g.channelOnline.load(); });
+    renderGauge("bs9000_last_blackout_seconds", [](const BusGauges& g) {
+        return g.lastBlackoutUs.load() / 1e6;
+    });
+
+    // the stages of the ingest pipelines: only the ones with a queue have
+    // queue metrics
+    auto renderStages = [&out](const char* name, const char* type,
+                               bool queued, auto sample) {
+        out << "# TYPE " << name << " " << type << "\n";
+        for (unsigned s = 0; s < MAX_STAGES; ++s) {
+            const auto& gauges = s_stages[s];
+            if (gauges.inUse.load(std::memory_order_acquire) &&
+                (!queued || gauges.queueCapacity)) {
+                out << name << "{stage=\"" << gauges.name << "\"} "
+                    << sample(gauges) << "\n";
+            }
+        }
+    };
+    using telemetry::StageGauges;
+    renderStages("bs9000_stage_queue_capacity", "gauge", true,
+                 [](const StageGauges& g) { return g.queueCapacity; });
+    // both sides count on their own: the depth may be off by a frame or
+    // two while they are at it
+    renderStages("bs9000_stage_queue_depth", "gauge", true,
+                 [](const StageGauges& g) {
+                     const auto processed = g.processed.load();
+                     const auto enqueued = g.enqueued.load();
+                     return enqueued > processed ? enqueued - processed : 0;
+                 });
+    renderStages("bs9000_stage_queue_high_water", "gauge", true,
+                 [](const StageGauges& g) { return g.highWater.load(); });
+    renderStages("bs9000_stage_queue_drops_total", "counter", true,
+                 [](const StageGauges& g) { return g.dropped.load(); });
+
+    out << "# TYPE bs9000_stage_latency_seconds histogram\n";
+    for (unsigned s = 0; s < MAX_STAGES; ++s) {
+        const auto& gauges = s_stages[s];
+        if (!gauges.inUse.load(std::memory_order_acquire)) {
+            continue;
+        }
+        __u64 cumulative = 0;
+        for (unsigned b = 0; b < N_LATENCY_BUCKETS; ++b) {
+            cumulative += gauges.latencyBuckets[b].load();
+            out << "bs9000_stage_latency_seconds_bucket{stage=\""
+                << gauges.name << "\",le=\"";
+            if (b < N_LATENCY_BUCKETS - 1) {
+                out << LATENCY_BOUNDS_NS[b] / 1e9;
+            } else {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << "bs9000_stage_latency_seconds_sum{stage=\"" << gauges.name
+            << "\"} " << gauges.latencyNsSum.load() / 1e9 << "\n"
+            << "bs9000_stage_latency_seconds_count{stage=\"" << gauges.name
+            << "\"} " << cumulative << "\n";
+    }
+
+    return out.str();
+}
+
+// :::: class TelemetryExporter
+
+TelemetryExporter::TelemetryExporter(const std::string& target,
+                                     std::chrono::milliseconds period)
+    : m_target(target)
+    , m_period(period)
+    , m_previous(new Snapshot)
+    , m_current(new Snapshot)
+{
+    takeSnapshot(*m_previous);
+
+    if (target.compare(0, 5, "unix:") == 0) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        const auto path = target.substr(5);
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Invalid telemetry target \"" + target +
+                                     "\".");
+        }
+        path.copy(addr.sun_path, path.size());
+        unlink(addr.sun_path);
+
+        m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_listenFd < 0 ||
+            bind(m_listenFd, reinterpret_cast<sockaddr*>(&addr),
+                 sizeof(addr)) ||
+            listen(m_listenFd, 4)) {
+            throw std::runtime_error("Can't listen on \"" + target + "\".");
+        }
+        m_thread = std::thread(&TelemetryExporter::socketLoop, this);
+    } else {
+        m_thread = std::thread(&TelemetryExporter::fileLoop, this);
+    }
+
+    std::cout << "#INFO: Exporting telemetry to \"" << target << "\"."
+              << std::endl;
+}
+
+TelemetryExporter::~TelemetryExporter()
+{
+    m_exitSignal.set_value();
+    m_thread.join();
+    if (m_listenFd >= 0) {
+        close(m_listenFd);
+        unlink(m_target.substr(5).c_str());
+    }
+}
+
+std::unique_ptr<TelemetryExporter> TelemetryExporter::fromEnvironment()
+{
+    const char* target = std::getenv("BS9000_TELEMETRY");
+    if (!target || !*target) {
+        return nullptr;
+    }
+    return std::make_unique<TelemetryExporter>(target,
+                                               std::chrono::seconds(1));
+}
+
+std::string TelemetryExporter::render()
+{
+    auto text = renderPrometheusText(m_previous.get(), m_current.get());
+    std::swap(m_previous, m_current);
+    return text;
+}
+
+void TelemetryExporter::fileLoop()
+{
+    registerThread("telemetry");
+    auto futureSignal = m_exitSignal.get_future();
+    const auto tmpPath = m_target + ".tmp";
+
+    while (futureSignal.wait_for(m_period) != std::future_status::ready) {
+        const auto text = render();
+        std::FILE* file = std::fopen(tmpPath.c_str(), "w");
+        if (!file) {
+            continue;
+        }
+        std::fwrite(text.data(), 1, text.size(), file);
+        std::fclose(file);
+        // readers never see a half written file
+        std::rename(tmpPath.c_str(), m_target.c_str());
+    }
+}
+
+void TelemetryExporter::socketLoop()
+{
+    registerThread("telemetry");
+    auto futureSignal = m_exitSignal.get_future();
+
+    // every connection gets the current metrics and is closed; rates are
+    // relative to the previous connection
+    while (futureSignal.wait_for(std::chrono::seconds::zero()) !=
+           std::future_status::ready) {
+        pollfd pfd{m_listenFd, POLLIN, 0};
+        if (poll(&pfd, 1, m_period.count()) <= 0) {
+            continue;
+        }
+        int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        const auto text = render();
+        size_t written = 0;
+        while (written < text.size()) {
+            auto n = send(fd, text.data() + written, text.size() - written,
+                          MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            written += n;
+        }
+        close(fd);
+    }
+}
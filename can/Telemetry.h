@@ -0,0 +1,209 @@
+/*
+ *   Pipeline telemetry: per-thread counters exported in the Prometheus text
+ *   format.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace telemetry {
+
+enum class Counter : unsigned {
+    FRAMES_READ,       // every event returned by CANL2_read_ac()
+    DECODE_REJECTS,    // frames which are not BS-9000 detections
+    FIFO_LOST_MSGS,    // PARAM_STRUCT::RCV_fifo_lost_msg
+    RECEIVE_OVERRUNS,  // PARAM_STRUCT::RecOverrun_flag
+    BUS_STATE_CHANGES, // transitions seen in the bus state
+    READ_ERRORS,       // negative returns of the driver
+    DB_UPDATES,        // RadarStateDB::updateState() calls
+    RENDERED_FRAMES,   // frames drawn by a consumer (GUI, AR windows)
+    CHANNEL_RECOVERIES, // CAN channel brought back after a fault
+    OBSTACLE_ALERTS,   // obstacle alerts raised (radar_daemon -A)
+    CAMERA_FRAMES,     // frames grabbed by the camera threads (ar_app1)
+    RECORDED_FRAMES,   // AR frames written by the recorder (--record)
+    RECORDER_DROPS,    // AR frames the recorder had no buffer for
+    N_COUNTERS
+};
+
+// standard CAN identifiers have 11 bits
+static constexpr unsigned N_FRAME_IDS = 2048;
+static constexpr unsigned MAX_THREADS = 16;
+static constexpr unsigned MAX_CHANNELS = 4;
+
+// Each thread owns one block and is its only writer: increments are a
+// relaxed load and store, with no read-modify-write on the hot path. Every
+// counter has its own cache line, so that the exporter reading them does
+// not bounce the lines the writer is using.
+//
+// A block goes back to the pool when its thread exits, its counts moving to
+// the shared "other" block. That one also counts for the threads beyond
+// MAX_THREADS - 1, with atomic increments.
+struct alignas(64) PaddedCounter
+{
+    std::atomic<__u64> value{0};
+};
+
+struct ThreadCounters
+{
+    std::atomic<bool> inUse{false};
+    bool shared = false; // the "other" block
+    bool claimed = false;
+    __u32 generation = 0; // +1 for every thread owning it
+    char name[32];
+    PaddedCounter counters[static_cast<unsigned>(Counter::N_COUNTERS)];
+    // only touched by the reader thread, packed: one line per 8 ids
+    std::atomic<__u64> framesPerId[N_FRAME_IDS];
+};
+
+// gauges of one CAN channel, written by its reader thread
+struct BusGauges
+{
+    std::atomic<bool> inUse{false};
+    std::atomic<__s32> busState{0};   // CANL2_GBS_*
+    std::atomic<__s32> errorState{0}; // PARAM_STRUCT::Error_state
+    std::atomic<__s32> channelOnline{0};
+    std::atomic<__u64> lastBlackoutUs{0}; // fault to the next data frame
+};
+
+static constexpr unsigned MAX_STAGES = 32;
+// upper bounds of the latency histogram of the stages; the last bucket is
+// unbounded
+static constexpr unsigned N_LATENCY_BUCKETS = 6;
+static constexpr __u64 LATENCY_BOUNDS_NS[N_LATENCY_BUCKETS - 1] = {
+    10000, 100000, 1000000, 10000000, 100000000};
+
+// A stage of an ingest pipeline (see IngestPipeline.h). The queue in front
+// of it is counted by its producer, the rest by the thread running the
+// stage: each side is the only writer of its own line. A stage fused into
+// the one before it has no queue.
+struct StageGauges
+{
+    std::atomic<bool> inUse{false};
+    char name[32];
+    __u32 queueCapacity = 0; // set before 'inUse'
+    alignas(64) std::atomic<__u64> enqueued{0};
+    std::atomic<__u64> dropped{0}; // the queue was full
+    std::atomic<__u64> highWater{0};
+    // from the read of the frame to the end of the stage
+    alignas(64) std::atomic<__u64> processed{0};
+    std::atomic<__u64> latencyNsSum{0};
+    std::atomic<__u64> latencyBuckets[N_LATENCY_BUCKETS];
+};
+
+// claims the gauges of a new stage, e.g. "ch0.decode" ('queueCapacity' 0 if
+// it has no queue); the last block is shared by any stage beyond MAX_STAGES
+StageGauges& stageGauges(const char* name, __u32 queueCapacity);
+
+inline void bump(std::atomic<__u64>& c, __u64 n = 1)
+{
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void recordLatency(StageGauges& gauges, __u64 latencyNs)
+{
+    unsigned bucket = 0;
+    while (bucket < N_LATENCY_BUCKETS - 1 &&
+           latencyNs > LATENCY_BOUNDS_NS[bucket]) {
+        ++bucket;
+    }
+    bump(gauges.latencyBuckets[bucket]);
+    bump(gauges.latencyNsSum, latencyNs);
+    bump(gauges.processed);
+}
+
+// names the calling thread in the exported metrics; threads which never
+// call it are registered as "thread<N>" on their first increment
+void registerThread(const char* name);
+
+ThreadCounters& threadCounters();
+BusGauges& busGauges(unsigned channelIdx = 0);
+
+inline void add(Counter counter, __u64 n = 1)
+{
+    auto& block = threadCounters();
+    auto& c = block.counters[static_cast<unsigned>(counter)].value;
+    if (block.shared) {
+        c.fetch_add(n, std::memory_order_relaxed);
+    } else {
+        bump(c, n);
+    }
+}
+
+inline void countFrameId(__u32 id)
+{
+    auto& block = threadCounters();
+    auto& c = block.framesPerId[id % N_FRAME_IDS];
+    if (block.shared) {
+        c.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        bump(c);
+    }
+}
+
+struct Snapshot;
+
+// renders all counters in the Prometheus text exposition format; with a
+// previous snapshot, per second rates since then are added as gauges
+std::string renderPrometheusText(const Snapshot* previous = nullptr,
+                                 Snapshot* current = nullptr);
+
+// Writes the metrics periodically to a file (atomically replaced, for a
+// textfile collector), or serves them on a Unix stream socket when the
+// target is "unix:<path>".
+class TelemetryExporter
+{
+  public:
+    TelemetryExporter(const TelemetryExporter&) = delete;
+    TelemetryExporter& operator=(const TelemetryExporter&) = delete;
+
+    TelemetryExporter(const std::string& target,
+                      std::chrono::milliseconds period);
+    ~TelemetryExporter();
+
+    // reads the target from the BS9000_TELEMETRY environment variable;
+    // returns null if it is not set
+    static std::unique_ptr<TelemetryExporter> fromEnvironment();
+
+  private:
+    void fileLoop();
+    void socketLoop();
+    std::string render();
+
+  private:
+    std::string m_target;
+    std::chrono::milliseconds m_period;
+    int m_listenFd = -1;
+    std::unique_ptr<Snapshot> m_previous;
+    std::unique_ptr<Snapshot> m_current;
+    std::promise<void> m_exitSignal;
+    std::thread m_thread;
+};
+
+} // namespace telemetry
+
+#endif // _TELEMETRY_H_
@@ -0,0 +1,235 @@
+/*
+ *   A shared time index of the streams of a recorded session (CAN traffic
+ *   and camera frames), and the clock to replay them together.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Timeline.h"
+#include "CANUtils.h"
+#include "CaptureLog.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static constexpr char INDEX_MAGIC[8] = {'B', 'S', 'T', 'I', 'M', 'E', 'L', 0};
+static constexpr __u32 INDEX_VERSION = 1;
+
+#pragma pack(1)
+
+// followed by checkpoints of 2 + nStreams __u64 each
+struct IndexFileHeader
+{
+    char magic[8];
+    __u32 version;
+    __u32 nStreams;
+};
+
+#pragma pack()
+
+std::string can::timelineCanLogPath(const std::string& dir)
+{
+    return dir + "/can.log";
+}
+
+std::string can::timelineCameraPrefix(const std::string& dir,
+                                      unsigned cameraIdx)
+{
+    return dir + "/cam" + std::to_string(cameraIdx);
+}
+
+std::string can::timelineCameraPath(const std::string& dir,
+                                    unsigned cameraIdx)
+{
+    return timelineCameraPrefix(dir, cameraIdx) + "_0000.avi";
+}
+
+std::string can::timelineTimestampsPath(const std::string& dir,
+                                        unsigned cameraIdx)
+{
+    return timelineCameraPrefix(dir, cameraIdx) + "_0000.ts";
+}
+
+// :::: class TimelineIndexWriter
+
+using can::TimelineIndexWriter;
+
+constexpr std::chrono::milliseconds TimelineIndexWriter::CHECKPOINT_PERIOD;
+
+TimelineIndexWriter::TimelineIndexWriter(
+    const std::string& dir, std::vector<std::function<__u64()>> positions)
+    : m_positions(std::move(positions)), m_record(2 + m_positions.size())
+{
+    const auto path = dir + "/timeline.idx";
+    m_file = std::fopen(path.c_str(), "wb");
+    if (!m_file) {
+        throw std::runtime_error("Can't create timeline index \"" + path +
+                                 "\".");
+    }
+
+    IndexFileHeader header{};
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.nStreams = m_positions.size();
+    std::fwrite(&header, sizeof(header), 1, m_file);
+}
+
+TimelineIndexWriter::~TimelineIndexWriter() { std::fclose(m_file); }
+
+void TimelineIndexWriter::checkpoint()
+{
+    m_record[0] = CaptureLogWriter::hostTimeNs();
+    m_record[1] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+    for (size_t i = 0; i < m_positions.size(); ++i) {
+        m_record[2 + i] = m_positions[i]();
+    }
+    std::fwrite(m_record.data(), sizeof(__u64), m_record.size(), m_file);
+    // a checkpoint is only useful once on disk
+    std::fflush(m_file);
+}
+
+void TimelineIndexWriter::run(TimelineIndexWriter& writer,
+                              std::shared_future<void> futureSignal)
+{
+    do {
+        writer.checkpoint();
+    } while (futureSignal.wait_for(CHECKPOINT_PERIOD) !=
+             std::future_status::ready);
+    writer.checkpoint();
+}
+
+// :::: class TimelineIndexReader
+
+using can::TimelineIndexReader;
+
+TimelineIndexReader::TimelineIndexReader(const std::string& dir)
+{
+    const auto path = dir + "/timeline.idx";
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Can't open timeline index \"" + path +
+                                 "\".");
+    }
+
+    IndexFileHeader header;
+    if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+        std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+        header.version != INDEX_VERSION) {
+        std::fclose(file);
+        throw std::runtime_error("\"" + path + "\" is not a timeline index.");
+    }
+    m_nStreams = header.nStreams;
+
+    // a checkpoint cut short by a crash is left out
+    std::vector<__u64> record(2 + m_nStreams);
+    while (std::fread(record.data(), sizeof(__u64), record.size(), file) ==
+           record.size()) {
+        m_checkpoints.push_back(
+            {record[0], record[1],
+             std::vector<__u64>(record.begin() + 2, record.end())});
+    }
+    std::fclose(file);
+
+    if (m_checkpoints.empty()) {
+        throw std::runtime_error("Timeline index \"" + path +
+                                 "\" is empty.");
+    }
+}
+
+const can::TimelineCheckpoint&
+TimelineIndexReader::seek(__u64 hostTimeNs) const
+{
+    auto next = std::upper_bound(
+        m_checkpoints.begin(), m_checkpoints.end(), hostTimeNs,
+        [](__u64 t, const TimelineCheckpoint& c) { return t < c.hostTimeNs; });
+    return next == m_checkpoints.begin() ? *next : *(next - 1);
+}
+
+std::vector<__u64> can::readTimestamps(const std::string& path)
+{
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Can't open timestamps \"" + path + "\".");
+    }
+    std::vector<__u64> timestamps;
+    __u64 t;
+    while (std::fread(&t, sizeof(t), 1, file) == 1) {
+        timestamps.push_back(t);
+    }
+    std::fclose(file);
+    return timestamps;
+}
+
+// :::: class ReplayClock
+
+using can::ReplayClock;
+
+ReplayClock::ReplayClock(__u64 fromNs, double speed)
+    : m_fromNs(fromNs), m_speed(speed),
+      m_startNs(CaptureLogWriter::hostTimeNs())
+{
+    if (!(speed > 0)) {
+        throw std::runtime_error("The replay speed must be positive.");
+    }
+}
+
+__u64 ReplayClock::dueNs(__u64 sessionNs) const
+{
+    if (sessionNs <= m_fromNs) {
+        return m_startNs;
+    }
+    return m_startNs + static_cast<__u64>((sessionNs - m_fromNs) / m_speed);
+}
+
+bool ReplayClock::waitUntil(__u64 sessionNs,
+                            const std::shared_future<void>& futureSignal) const
+{
+    // the host clock is the steady clock, in nanoseconds since its epoch
+    const std::chrono::steady_clock::time_point due(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::nanoseconds(dueNs(sessionNs))));
+    return futureSignal.wait_until(due) != std::future_status::ready;
+}
+
+size_t can::replayCaptureLog(const CaptureLogReader& log, size_t first,
+                             const ReplayClock& clock, FrameIngest& ingest,
+                             std::shared_future<void> futureSignal)
+{
+    size_t i = std::min(first, log.size());
+    // the checkpoint is a little early: up to the start of the replay
+    while (i < log.size() && log[i].hostTimeNs < clock.fromNs()) {
+        ++i;
+    }
+
+    size_t nReplayed = 0;
+    for (; i < log.size(); ++i) {
+        const auto& record = log[i];
+        if (!clock.waitUntil(record.hostTimeNs, futureSignal)) {
+            break;
+        }
+        PARAM_STRUCT param{};
+        toParam(record, param);
+        // a bus-off is only replayed as an event: there is no controller
+        // to reset
+        ingest.process(record.frameType, param);
+        ++nReplayed;
+    }
+    return nReplayed;
+}
@@ -0,0 +1,158 @@
+/*
+ *   A shared time index of the streams of a recorded session (CAN traffic
+ *   and camera frames), and the clock to replay them together.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TIMELINE_H_
+#define _TIMELINE_H_
+
+#include <linux/types.h>
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+namespace can {
+
+//
+// A session is a directory:
+//
+//   can.log          the capture log of the channel (CaptureLog.h)
+//   cam<i>_0000.avi  the frames of camera i...
+//   cam<i>_0000.ts   ... and the host time of each, a raw array of __u64
+//   timeline.idx     checkpoints of every stream
+//
+// Every stream is stamped with CaptureLogWriter::hostTimeNs(), the steady
+// clock of the host, when it is read from its device. A checkpoint holds,
+// for one instant, that clock, the wall clock (to tell when the session
+// was recorded, or to match another host's records) and the number of
+// records of each stream so far: stream 0 is the CAN log, stream i + 1
+// camera i.
+//
+// The counts of a checkpoint are lower bounds of the position of its
+// instant in each stream (a frame may still be queued for its file): a
+// seek starts from them and steps forward over the timestamps of the
+// stream.
+//
+
+std::string timelineCanLogPath(const std::string& dir);
+// for FrameRecorder, which adds "_0000.avi" and "_0000.ts"
+std::string timelineCameraPrefix(const std::string& dir, unsigned cameraIdx);
+std::string timelineCameraPath(const std::string& dir, unsigned cameraIdx);
+std::string timelineTimestampsPath(const std::string& dir,
+                                   unsigned cameraIdx);
+
+struct TimelineCheckpoint
+{
+    __u64 hostTimeNs;
+    __u64 wallTimeNs; // since the epoch
+    std::vector<__u64> positions;
+};
+
+class TimelineIndexWriter
+{
+  public:
+    TimelineIndexWriter(const TimelineIndexWriter&) = delete;
+    TimelineIndexWriter& operator=(const TimelineIndexWriter&) = delete;
+
+    static constexpr std::chrono::milliseconds CHECKPOINT_PERIOD{100};
+
+    // 'positions' tells how many records each stream has written, from any
+    // thread
+    TimelineIndexWriter(const std::string& dir,
+                        std::vector<std::function<__u64()>> positions);
+    ~TimelineIndexWriter();
+
+    void checkpoint();
+
+    // thread function: a checkpoint every CHECKPOINT_PERIOD until the
+    // signal is set, and a last one then
+    static void run(TimelineIndexWriter& writer,
+                    std::shared_future<void> futureSignal);
+
+  private:
+    std::FILE* m_file = nullptr;
+    std::vector<std::function<__u64()>> m_positions;
+    std::vector<__u64> m_record;
+};
+
+class TimelineIndexReader
+{
+  public:
+    explicit TimelineIndexReader(const std::string& dir);
+
+    unsigned getNumberOfStreams() const { return m_nStreams; }
+    const std::vector<TimelineCheckpoint>& checkpoints() const
+    {
+        return m_checkpoints;
+    }
+    __u64 startNs() const { return m_checkpoints.front().hostTimeNs; }
+    __u64 endNs() const { return m_checkpoints.back().hostTimeNs; }
+
+    // the last checkpoint at or before 'hostTimeNs' (the first one, before
+    // the session)
+    const TimelineCheckpoint& seek(__u64 hostTimeNs) const;
+
+  private:
+    unsigned m_nStreams = 0;
+    std::vector<TimelineCheckpoint> m_checkpoints;
+};
+
+// the host times of the frames of a camera stream
+std::vector<__u64> readTimestamps(const std::string& path);
+
+// From session time to host time: the session is played from 'fromNs' at
+// 'speed' times real time, starting now. Shared by the replay threads of
+// every stream, which keeps them in step.
+class ReplayClock
+{
+  public:
+    ReplayClock(__u64 fromNs, double speed);
+
+    __u64 fromNs() const { return m_fromNs; }
+    double speed() const { return m_speed; }
+
+    // when the record stamped 'sessionNs' is due, in the host clock
+    __u64 dueNs(__u64 sessionNs) const;
+    // false if the signal was set in the meantime
+    bool waitUntil(__u64 sessionNs,
+                   const std::shared_future<void>& futureSignal) const;
+
+  private:
+    const __u64 m_fromNs;
+    const double m_speed;
+    const __u64 m_startNs;
+};
+
+class FrameIngest;
+class CaptureLogReader;
+
+// Feeds the CAN log of a session through 'ingest' (as the reader thread
+// would), each record when due, from the position of the clock on; returns
+// the number of records replayed.
+size_t replayCaptureLog(const CaptureLogReader& log, size_t first,
+                        const ReplayClock& clock, FrameIngest& ingest,
+                        std::shared_future<void> futureSignal);
+
+} // namespace can
+
+#endif // _TIMELINE_H_
@@ -0,0 +1,215 @@
+/*
+ *   Scoped traces of the pipeline stages, per thread, exported as Chrome
+ *   trace events (chrome://tracing, ui.perfetto.dev).
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Trace.h"
+#include "Telemetry.h"
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+static const char* const EVENT_NAMES[] = {
+    "poll_wait", "can_read", "decode",  "db_update",
+    "capture",   "overlay",  "imshow", "wait_key"};
+
+static_assert(sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) ==
+                  static_cast<unsigned>(tracing::Event::N_EVENTS),
+              "an event without a name");
+
+using tracing::ThreadBuffer;
+
+static ThreadBuffer s_buffers[tracing::MAX_THREADS];
+// the spans of the threads that found no free buffer
+static std::atomic<__u64> s_overflowDropped{0};
+
+// hands the buffer of the thread back when it exits
+struct BufferOwner
+{
+    ThreadBuffer* buffer = nullptr;
+    bool overflow = false; // none was free: not tried again
+    ~BufferOwner()
+    {
+        if (buffer) {
+            buffer->state.store(ThreadBuffer::RELEASED,
+                                std::memory_order_release);
+        }
+    }
+};
+
+static thread_local BufferOwner t_owner;
+
+const char* tracing::eventName(Event event)
+{
+    return EVENT_NAMES[static_cast<unsigned>(event)];
+}
+
+static ThreadBuffer* claimBuffer()
+{
+    for (auto& buffer : s_buffers) {
+        __u8 expected = ThreadBuffer::FREE;
+        // acquire: the flusher is done with the spans of its last thread
+        if (buffer.state.compare_exchange_strong(expected,
+                                                 ThreadBuffer::CLAIMED,
+                                                 std::memory_order_acquire)) {
+            std::snprintf(buffer.name, sizeof(buffer.name), "%s",
+                          telemetry::threadCounters().name);
+            buffer.state.store(ThreadBuffer::IN_USE,
+                               std::memory_order_release);
+            return &buffer;
+        }
+    }
+    return nullptr;
+}
+
+ThreadBuffer* tracing::threadBuffer()
+{
+    if (!t_owner.buffer && !t_owner.overflow) {
+        t_owner.buffer = claimBuffer();
+        t_owner.overflow = !t_owner.buffer;
+    }
+    return t_owner.buffer;
+}
+
+void tracing::dropOverflowSpan()
+{
+    s_overflowDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+// :::: class TraceFlusher
+
+using tracing::TraceFlusher;
+
+constexpr std::chrono::milliseconds TraceFlusher::FLUSH_PERIOD;
+
+TraceFlusher::TraceFlusher(const std::string& path) : m_pid(getpid())
+{
+    m_file = std::fopen(path.c_str(), "w");
+    if (!m_file) {
+        throw std::runtime_error("Can't create trace \"" + path + "\".");
+    }
+    // the JSON array format: the closing bracket is optional
+    std::fputs("[\n", m_file);
+    m_thread = std::thread(&TraceFlusher::run, this);
+}
+
+TraceFlusher::~TraceFlusher()
+{
+    m_exitSignal.set_value();
+    m_thread.join();
+    std::fputs("{}]\n", m_file);
+    std::fclose(m_file);
+}
+
+std::unique_ptr<TraceFlusher> TraceFlusher::fromEnvironment()
+{
+    const char* path = std::getenv("BS9000_TRACE_FILE");
+    if (!path || !*path) {
+        return nullptr;
+    }
+#ifndef BS9000_TRACE
+    std::cerr << "#WARNING: BS9000_TRACE_FILE is set, but this build has no "
+                 "traces (make TRACE=1)."
+              << std::endl;
+    return nullptr;
+#else
+    return std::make_unique<TraceFlusher>(path);
+#endif
+}
+
+void TraceFlusher::run()
+{
+    telemetry::registerThread("trace_flusher");
+    auto futureSignal = m_exitSignal.get_future();
+    do {
+        flush();
+    } while (futureSignal.wait_for(FLUSH_PERIOD) !=
+             std::future_status::ready);
+    // what the other threads recorded until they were stopped
+    flush();
+}
+
+void TraceFlusher::flush()
+{
+    for (unsigned t = 0; t < MAX_THREADS; ++t) {
+        auto& buffer = s_buffers[t];
+        const auto state = buffer.state.load(std::memory_order_acquire);
+        if (state != ThreadBuffer::IN_USE && state != ThreadBuffer::RELEASED) {
+            continue;
+        }
+        if (!m_named[t]) {
+            std::fprintf(m_file,
+                         "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                         "\"tid\":%u,\"args\":{\"name\":\"%s\"}},\n",
+                         m_pid, t, buffer.name);
+            m_named[t] = true;
+        }
+
+        const auto tail = buffer.tail.load(std::memory_order_relaxed);
+        const auto head = buffer.head.load(std::memory_order_acquire);
+        for (auto i = tail; i != head; ++i) {
+            const auto& span = buffer.spans[i % BUFFER_SPANS];
+            // in microseconds, to the nanosecond
+            std::fprintf(m_file,
+                         "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,"
+                         "\"dur\":%u.%03u,\"pid\":%d,\"tid\":%u},\n",
+                         eventName(span.event),
+                         static_cast<unsigned long long>(span.startNs / 1000),
+                         static_cast<unsigned>(span.startNs % 1000),
+                         span.durationNs / 1000, span.durationNs % 1000,
+                         m_pid, t);
+        }
+        buffer.tail.store(head, std::memory_order_release);
+
+        // the spans lost since the last flush, as a counter track
+        const auto dropped = buffer.dropped.load(std::memory_order_relaxed);
+        if (dropped != m_dropped[t]) {
+            std::fprintf(m_file,
+                         "{\"name\":\"dropped_spans\",\"ph\":\"C\","
+                         "\"ts\":%llu,\"pid\":%d,\"tid\":%u,"
+                         "\"args\":{\"%s\":%llu}},\n",
+                         static_cast<unsigned long long>(nowNs() / 1000),
+                         m_pid, t, buffer.name,
+                         static_cast<unsigned long long>(dropped));
+            m_dropped[t] = dropped;
+        }
+
+        if (state == ThreadBuffer::RELEASED) {
+            // drained: the next thread to take it is named anew
+            m_named[t] = false;
+            buffer.state.store(ThreadBuffer::FREE, std::memory_order_release);
+        }
+    }
+
+    // the threads that found no free buffer, on a track of their own
+    const auto overflow = s_overflowDropped.load(std::memory_order_relaxed);
+    if (overflow != m_overflowDropped) {
+        std::fprintf(m_file,
+                     "{\"name\":\"dropped_spans\",\"ph\":\"C\","
+                     "\"ts\":%llu,\"pid\":%d,\"tid\":%u,"
+                     "\"args\":{\"overflow\":%llu}},\n",
+                     static_cast<unsigned long long>(nowNs() / 1000), m_pid,
+                     MAX_THREADS, static_cast<unsigned long long>(overflow));
+        m_overflowDropped = overflow;
+    }
+    std::fflush(m_file);
+}
@@ -0,0 +1,181 @@
+/*
+ *   Scoped traces of the pipeline stages, per thread, exported as Chrome
+ *   trace events (chrome://tracing, ui.perfetto.dev).
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+
+//
+// TRACE_SCOPE(DECODE); times the rest of the enclosing block as one span
+// of the calling thread. The spans are only recorded in a build with
+// BS9000_TRACE defined ("make TRACE=1"): otherwise the macro is empty, and
+// nothing of the tracing is left on the traced paths.
+//
+#ifdef BS9000_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(event)                                                     \
+    ::tracing::Scope TRACE_CONCAT(traceScope, __LINE__)(::tracing::Event::event)
+#else
+#define TRACE_SCOPE(event)                                                     \
+    do {                                                                       \
+    } while (false)
+#endif
+
+namespace tracing {
+
+enum class Event : __u16 {
+    POLL_WAIT,      // CAN reader: poll() until the next frames, or a timeout
+    CAN_READ,       // CAN reader: one CANL2_read_ac()
+    DECODE,         // CAN reader: a frame into a DetectionData
+    DB_UPDATE,      // CAN reader: the DB update (lock and listeners)
+    CAMERA_CAPTURE, // camera thread: one frame read and decoded
+    OVERLAY,        // render loop: the obstacles drawn over the frame
+    IMSHOW,         // render loop: cv::imshow()
+    WAIT_KEY,       // render loop: cv::waitKey()
+    N_EVENTS
+};
+
+const char* eventName(Event event);
+
+struct Span
+{
+    __u64 startNs; // steady clock
+    __u32 durationNs;
+    Event event;
+};
+
+// per thread; the flusher drains them every FLUSH_PERIOD
+static constexpr unsigned BUFFER_SPANS = 8192;
+static constexpr unsigned MAX_THREADS = 16;
+
+// One writer (its thread) and one reader (the flusher): the writer only
+// advances 'head' and the reader 'tail', so neither ever waits. When the
+// flusher falls behind, new spans are dropped and counted, rather than
+// overwriting the ones it may be reading. A thread that exits hands its
+// buffer back: the flusher drains it, then frees it for the next thread.
+struct ThreadBuffer
+{
+    enum State : __u8 {
+        FREE,
+        CLAIMED, // being named by its new thread
+        IN_USE,
+        RELEASED // its thread exited: the last spans are still to be flushed
+    };
+
+    std::atomic<__u8> state{FREE};
+    char name[32];
+    alignas(64) std::atomic<__u64> head{0};
+    alignas(64) std::atomic<__u64> tail{0};
+    std::atomic<__u64> dropped{0};
+    Span spans[BUFFER_SPANS];
+};
+
+// the buffer of the calling thread, named after its telemetry name; null
+// while MAX_THREADS other threads hold one
+ThreadBuffer* threadBuffer();
+// a span of a thread without a buffer: only counted
+void dropOverflowSpan();
+
+inline __u64 nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline void record(Event event, __u64 startNs, __u64 endNs)
+{
+    auto* buffer = threadBuffer();
+    if (!buffer) {
+        dropOverflowSpan();
+        return;
+    }
+    const auto head = buffer->head.load(std::memory_order_relaxed);
+    if (head - buffer->tail.load(std::memory_order_acquire) == BUFFER_SPANS) {
+        buffer->dropped.store(
+            buffer->dropped.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        return;
+    }
+    buffer->spans[head % BUFFER_SPANS] = {
+        startNs, static_cast<__u32>(endNs - startNs), event};
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+class Scope
+{
+  public:
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    explicit Scope(Event event) : m_event(event), m_startNs(nowNs()) {}
+    ~Scope() { record(m_event, m_startNs, nowNs()); }
+
+  private:
+    const Event m_event;
+    const __u64 m_startNs;
+};
+
+// Writes the spans of every thread to a JSON array of trace events, from
+// a thread of its own. The array is closed on destruction, but is loaded
+// as it is after a crash too.
+class TraceFlusher
+{
+  public:
+    TraceFlusher(const TraceFlusher&) = delete;
+    TraceFlusher& operator=(const TraceFlusher&) = delete;
+
+    static constexpr std::chrono::milliseconds FLUSH_PERIOD{100};
+
+    explicit TraceFlusher(const std::string& path);
+    ~TraceFlusher();
+
+    // reads the path from the BS9000_TRACE_FILE environment variable; returns
+    // null if it is not set (or, with a warning, if the build can't trace)
+    static std::unique_ptr<TraceFlusher> fromEnvironment();
+
+  private:
+    void run();
+    void flush();
+
+  private:
+    std::FILE* m_file = nullptr;
+    const int m_pid;
+    bool m_named[MAX_THREADS] = {}; // thread name written
+    __u64 m_dropped[MAX_THREADS] = {};
+    __u64 m_overflowDropped = 0;
+    std::promise<void> m_exitSignal;
+    std::thread m_thread;
+};
+
+} // namespace tracing
+
+#endif // _TRACE_H_
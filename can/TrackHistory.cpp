@@ -0,0 +1,154 @@
+/*
+ *   The recent positions of every object, for motion trails and closing
+ *   speed estimates.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TrackHistory.h"
+#include "CaptureLog.h" // hostTimeNs()
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using can::backsense::TrackHistory;
+using can::backsense::TrackVelocity;
+using std::experimental::nullopt;
+
+std::experimental::optional<TrackVelocity>
+can::backsense::estimateVelocity(const Trail& trail, unsigned window)
+{
+    const unsigned n = std::min(trail.nSamples, window);
+    if (n < 2) {
+        return nullopt;
+    }
+    const TrackSample* first = trail.end() - n;
+
+    // slope of each coordinate against time, in seconds relative to the
+    // last sample (small numbers, for precision)
+    const __u64 lastNs = trail.end()[-1].hostTimeNs;
+    auto timeOf = [lastNs](const TrackSample& sample) {
+        return -1e-9 * static_cast<double>(lastNs - sample.hostTimeNs);
+    };
+
+    double meanT = 0, meanX = 0, meanY = 0, meanR = 0;
+    for (const auto* s = first; s != trail.end(); ++s) {
+        meanT += timeOf(*s);
+        meanX += s->x.toDouble();
+        meanY += s->y.toDouble();
+        meanR += s->radius.toDouble();
+    }
+    meanT /= n;
+    meanX /= n;
+    meanY /= n;
+    meanR /= n;
+
+    double varT = 0, covX = 0, covY = 0, covR = 0;
+    for (const auto* s = first; s != trail.end(); ++s) {
+        const double dt = timeOf(*s) - meanT;
+        varT += dt * dt;
+        covX += dt * (s->x.toDouble() - meanX);
+        covY += dt * (s->y.toDouble() - meanY);
+        covR += dt * (s->radius.toDouble() - meanR);
+    }
+    if (varT <= 0) {
+        // every sample at the same time
+        return nullopt;
+    }
+
+    return TrackVelocity{covX / varT, covY / varT, -covR / varT};
+}
+
+// :::: class TrackHistory
+
+void TrackHistory::onUpdate(const RadarStateDB& /*stateDB*/,
+                            const DetectionData& newState)
+{
+    addSample(newState, CaptureLogWriter::hostTimeNs());
+}
+
+void TrackHistory::addSample(const DetectionData& state, __u64 hostTimeNs)
+{
+    const auto idxPair = FrameHandler::getIndexPairFromId(state.getId());
+    auto& track = m_tracks[idxPair.first][idxPair.second];
+
+    auto seq = track.sequence.load(std::memory_order_relaxed);
+    track.sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (track.nSamples) {
+        const auto& last = track.samples[(track.head + TRACK_LEN - 1) %
+                                         TRACK_LEN];
+        if (hostTimeNs - last.hostTimeNs > TRACK_TIMEOUT_NS) {
+            track.nSamples = 0;
+        }
+    }
+
+    if (state.getDetectionFlag()) {
+        // the slot is empty (the DB doesn't keep it either): the next
+        // object seen there starts a track of its own
+        track.nSamples = 0;
+    } else {
+        auto& sample = track.samples[track.head];
+        sample.hostTimeNs = hostTimeNs;
+        sample.x = state.getX();
+        sample.y = state.getY();
+        sample.radius = state.getPolarRadius();
+        sample.speed = state.getRelativeSpeed();
+        track.head = (track.head + 1) % TRACK_LEN;
+        track.nSamples = std::min(track.nSamples + 1, TRACK_LEN);
+    }
+
+    track.sequence.store(seq + 2, std::memory_order_release);
+}
+
+void TrackHistory::readTrail(unsigned sensorIdx, unsigned objIdx,
+                             Trail& trail) const
+{
+    assert(sensorIdx < MAX_N_SENSORS && objIdx < MAX_N_OBJS);
+    const auto& track = m_tracks[sensorIdx][objIdx];
+
+    // a raw copy of the ring, put in order once it is known to be
+    // consistent
+    TrackSample ring[TRACK_LEN];
+    __u32 nSamples;
+    __u32 head;
+    while (true) {
+        auto before = track.sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            // writer in progress
+            continue;
+        }
+
+        nSamples = track.nSamples;
+        head = track.head;
+        std::memcpy(ring, track.samples, sizeof(ring));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto after = track.sequence.load(std::memory_order_relaxed);
+        if (before == after) {
+            break;
+        }
+    }
+
+    trail.nSamples = nSamples;
+    const unsigned oldest = (head + TRACK_LEN - nSamples) % TRACK_LEN;
+    for (unsigned i = 0; i < nSamples; ++i) {
+        trail.samples[i] = ring[(oldest + i) % TRACK_LEN];
+    }
+}
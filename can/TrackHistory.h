@@ -0,0 +1,113 @@
+/*
+ *   The recent positions of every object, for motion trails and closing
+ *   speed estimates.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BACKSENSE_TRACK_HISTORY_H_
+#define _BACKSENSE_TRACK_HISTORY_H_
+
+#include "BSFrameHandler.h"
+
+#include <linux/types.h>
+
+#include <atomic>
+#include <experimental/optional>
+
+namespace can {
+
+namespace backsense {
+
+// samples kept per object: about 1.5 s of a sensor cycling at 20 Hz
+static constexpr unsigned TRACK_LEN = 32;
+// a longer silence ends the track (the slot is then a new object)
+static constexpr __u64 TRACK_TIMEOUT_NS = 500000000;
+
+struct TrackSample
+{
+    __u64 hostTimeNs;
+    Distance x;
+    Distance y;
+    Distance radius;
+    Speed speed; // RelativeSpeed, as sent by the sensor
+};
+
+// a copy of one track, oldest sample first: the polyline of its trail
+struct Trail
+{
+    unsigned nSamples = 0;
+    TrackSample samples[TRACK_LEN];
+
+    const TrackSample* begin() const { return samples; }
+    const TrackSample* end() const { return samples + nSamples; }
+};
+
+// least squares fit of the positions of a trail against time
+struct TrackVelocity
+{
+    double vx; // m/s
+    double vy; // m/s
+    // how fast the radius shrinks (m/s): positive when the object comes
+    // closer
+    double closingSpeed;
+};
+
+// needs two samples at different times; only the last 'window' samples
+// are used (a shorter window follows manoeuvres faster, but is noisier)
+std::experimental::optional<TrackVelocity>
+estimateVelocity(const Trail& trail, unsigned window = TRACK_LEN);
+
+// One ring of the last TRACK_LEN samples per (sensor, object) slot of the
+// DB, all allocated up front: the memory stays the same however long the
+// run. A track is only written by the reader thread of its sensor, with
+// its shard locked, and is read lock-free with a seqlock, as the segment of
+// the radar state bus.
+class TrackHistory
+{
+  public:
+    TrackHistory(const TrackHistory&) = delete;
+    TrackHistory& operator=(const TrackHistory&) = delete;
+
+    TrackHistory() = default;
+
+    // to be installed as an update listener of the DB: samples the object
+    // at the time of the call
+    void onUpdate(const RadarStateDB& stateDB, const DetectionData& newState);
+    // ... or at a given time (e.g. when replaying a capture log)
+    void addSample(const DetectionData& state, __u64 hostTimeNs);
+
+    // the trail of one slot; never blocks the writer
+    void readTrail(unsigned sensorIdx, unsigned objIdx, Trail& trail) const;
+
+  private:
+    struct alignas(64) Track
+    {
+        std::atomic<__u32> sequence{0};
+        __u32 nSamples = 0;
+        __u32 head = 0; // where the next sample goes
+        TrackSample samples[TRACK_LEN];
+    };
+
+    Track m_tracks[MAX_N_SENSORS][MAX_N_OBJS];
+};
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _BACKSENSE_TRACK_HISTORY_H_
@@ -0,0 +1,238 @@
+/*
+ *   Plays synthetic BS-9000 traffic on a CAN channel, a SocketCAN interface
+ *   (e.g. vcan0) or into a capture log.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CANproChannel.h"
+#include "CaptureLog.h"
+#include "TrafficGenerator.h"
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace can::backsense;
+
+static volatile std::sig_atomic_t s_stop = 0;
+
+static void printUsage(const char* prg)
+{
+    std::cerr << "Usage: " << prg
+              << " [-n sensors] [-p cycle ms | -B] [-s seed] [-x scenario]"
+                 " [-d seconds] [-f] [-c capture.log] [-C channel]"
+                 " [-v interface]"
+              << std::endl;
+}
+
+// a raw SocketCAN socket, bound to one interface (a virtual one, vcan0,
+// needs no hardware)
+class SocketCanSender
+{
+  public:
+    SocketCanSender(const SocketCanSender&) = delete;
+    SocketCanSender& operator=(const SocketCanSender&) = delete;
+
+    explicit SocketCanSender(const std::string& interface)
+    {
+        m_fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+        if (m_fd < 0) {
+            throw std::runtime_error("Can't open a SocketCAN socket.");
+        }
+        struct ifreq ifr;
+        std::memset(&ifr, 0, sizeof(ifr));
+        std::strncpy(ifr.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+        if (ioctl(m_fd, SIOCGIFINDEX, &ifr) < 0) {
+            close(m_fd);
+            throw std::runtime_error("No CAN interface \"" + interface +
+                                     "\".");
+        }
+        struct sockaddr_can addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.can_family = AF_CAN;
+        addr.can_ifindex = ifr.ifr_ifindex;
+        if (bind(m_fd, reinterpret_cast<struct sockaddr*>(&addr),
+                 sizeof(addr)) < 0) {
+            close(m_fd);
+            throw std::runtime_error("Can't bind to CAN interface \"" +
+                                     interface + "\".");
+        }
+    }
+
+    ~SocketCanSender() { close(m_fd); }
+
+    bool send(const PARAM_STRUCT& param)
+    {
+        struct can_frame frame;
+        std::memset(&frame, 0, sizeof(frame));
+        frame.can_id = param.Ident & CAN_SFF_MASK;
+        frame.can_dlc = param.DataLength;
+        std::memcpy(frame.data, param.RCV_data, sizeof(frame.data));
+        return write(m_fd, &frame, sizeof(frame)) == sizeof(frame);
+    }
+
+  private:
+    int m_fd = -1;
+};
+
+int main(int argc, char** argv)
+{
+    TrafficConfig config;
+    double durationS = std::numeric_limits<double>::infinity();
+    bool fast = false;
+    std::string capturePath;
+    int channelIdx = -1;
+    std::string interface;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            if (!std::strcmp(argv[i], "-n") && i + 1 < argc) {
+                config.nSensors = std::stoul(argv[++i]);
+            } else if (!std::strcmp(argv[i], "-p") && i + 1 < argc) {
+                config.cyclePeriod = std::chrono::microseconds(
+                    static_cast<long>(std::stod(argv[++i]) * 1000));
+            } else if (!std::strcmp(argv[i], "-B")) {
+                config.saturate = true;
+            } else if (!std::strcmp(argv[i], "-s") && i + 1 < argc) {
+                config.seed = std::stoul(argv[++i]);
+            } else if (!std::strcmp(argv[i], "-x") && i + 1 < argc) {
+                config.script = readScenario(argv[++i]);
+            } else if (!std::strcmp(argv[i], "-d") && i + 1 < argc) {
+                durationS = std::stod(argv[++i]);
+            } else if (!std::strcmp(argv[i], "-f")) {
+                fast = true;
+            } else if (!std::strcmp(argv[i], "-c") && i + 1 < argc) {
+                capturePath = argv[++i];
+            } else if (!std::strcmp(argv[i], "-C") && i + 1 < argc) {
+                channelIdx = std::stoi(argv[++i]);
+            } else if (!std::strcmp(argv[i], "-v") && i + 1 < argc) {
+                interface = argv[++i];
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        if (capturePath.empty() && channelIdx < 0 && interface.empty()) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (fast && (channelIdx >= 0 || !interface.empty())) {
+            std::cerr << "#ERROR: -f only writes capture logs: the bus takes "
+                         "the frames at its own pace."
+                      << std::endl;
+            return 1;
+        }
+        if (fast && !(durationS < std::numeric_limits<double>::infinity())) {
+            std::cerr << "#ERROR: -f needs a duration (-d)." << std::endl;
+            return 1;
+        }
+
+        TrafficGenerator generator(config);
+        std::unique_ptr<can::CaptureLogWriter> capture;
+        if (!capturePath.empty()) {
+            capture = std::make_unique<can::CaptureLogWriter>(capturePath);
+        }
+        std::unique_ptr<can::CANproChannel> channel;
+        if (channelIdx >= 0) {
+            channel = std::make_unique<can::CANproChannel>(
+                can::AcceptanceFilter(), channelIdx);
+        }
+        std::unique_ptr<SocketCanSender> socketCan;
+        if (!interface.empty()) {
+            socketCan = std::make_unique<SocketCanSender>(interface);
+        }
+
+        std::signal(SIGINT, [](int) { s_stop = 1; });
+        std::signal(SIGTERM, [](int) { s_stop = 1; });
+
+        const __u64 durationNs = durationS * 1e9;
+        const auto start = std::chrono::steady_clock::now();
+        // -f: the log reads as if recorded from a host time of 0
+        const __u64 startNs = fast ? 0 : can::CaptureLogWriter::hostTimeNs();
+        __u64 nFrames = 0;
+        __u64 nDropped = 0;
+        __u64 lastOffsetNs = 0;
+
+        while (!s_stop) {
+            const auto& frame = generator.next();
+            if (frame.offsetNs >= durationNs) {
+                break;
+            }
+            if (!fast) {
+                std::this_thread::sleep_until(
+                    start + std::chrono::nanoseconds(frame.offsetNs));
+            }
+            lastOffsetNs = frame.offsetNs;
+
+            const auto& param = frame.param;
+            if (capture) {
+                can::CaptureRecord record{};
+                record.hostTimeNs = startNs + frame.offsetNs;
+                record.canTime = param.Time;
+                record.ident = param.Ident;
+                record.frameType = CANL2_RA_DATAFRAME;
+                record.dataLength = param.DataLength;
+                std::memcpy(record.data, param.RCV_data, sizeof(record.data));
+                capture->append(record);
+            }
+            if (channel) {
+                __u8 data[N_BYTES];
+                std::memcpy(data, param.RCV_data, sizeof(data));
+                if (CANL2_send_data(channel->getHandle(), param.Ident,
+                                    0 /* standard id */, param.DataLength,
+                                    data) < 0) {
+                    ++nDropped; // e.g. the transmit FIFO is full
+                }
+            }
+            if (socketCan && !socketCan->send(param)) {
+                ++nDropped;
+            }
+            ++nFrames;
+        }
+
+        if (capture) {
+            capture->flush();
+        }
+        const double spanNs = lastOffsetNs + FRAME_TIME_NS;
+        std::cerr << "#INFO: " << nFrames << " frames of "
+                  << config.nSensors << " sensors, "
+                  << generator.cycleCount() << " cycles of "
+                  << generator.cyclePeriodNs() / 1000 << " us, " << nDropped
+                  << " not sent; bus load "
+                  << (nFrames ? 100.0 * nFrames * FRAME_TIME_NS / spanNs : 0)
+                  << "%." << std::endl;
+    } catch (std::exception& ex) {
+        std::cerr << "#ERROR: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ *   Synthetic BS-9000 traffic: the detection frames of N sensors, with
+ *   scripted or random-walk obstacles, on the timing of the real bus.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TrafficGenerator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace can::backsense;
+
+// the field of view of the sensor, as far as its frames can tell (see
+// BSDataConverter.h)
+static constexpr double MIN_X = 0.5;
+static constexpr double MAX_X = 30;
+static constexpr double MAX_ABS_Y = 5;
+// the random walk: a few m/s at most, changing smoothly
+static constexpr double MAX_SPEED = 5;
+static constexpr double ACCEL_SIGMA = 1.5; // m/s^2
+static constexpr double P_APPEAR_PER_S = 0.2;
+static constexpr double P_VANISH_PER_S = 0.05;
+
+static __u8 clampRaw(long value, __u8 min, __u8 max)
+{
+    return std::min<long>(std::max<long>(value, min), max);
+}
+
+std::array<__u8, N_BYTES>
+can::backsense::encodeDetection(const SimulatedObject& object,
+                                unsigned objIdx)
+{
+    static const double pi = std::atan(1.0) * 4.0;
+
+    std::array<__u8, N_BYTES> frame{};
+    const double radius = std::hypot(object.x, object.y);
+    const double angle = std::atan2(object.y, object.x) * 180 / pi;
+    // along the line of sight, in km/h
+    const double speed =
+        radius > 0 ? (object.x * object.vx + object.y * object.vy) / radius *
+                         3.6
+                   : 0;
+
+    frame[0] = clampRaw(std::lround(radius * Distance::STEPS_PER_UNIT), 0,
+                        0x79);
+    frame[1] = clampRaw(std::lround(angle) + 128, 0x44, 0xBC);
+    frame[2] = clampRaw(std::lround(object.x * Distance::STEPS_PER_UNIT), 0,
+                        0x78);
+    frame[3] =
+        clampRaw(std::lround(object.y * Distance::STEPS_PER_UNIT) + 128, 0x6C,
+                 0x94);
+    frame[4] =
+        clampRaw(std::lround(speed * Speed::STEPS_PER_UNIT) + 128, 0, 0xFF);
+    frame[5] = clampRaw(object.power, 0, 0x7F);
+    frame[6] = (objIdx % MAX_N_OBJS) << 5 | (object.appeared ? 1 : 0) << 4;
+    frame[7] = object.present ? 0 : 1; // the flag is set when there is none
+    return frame;
+}
+
+std::vector<ScriptedSegment> can::backsense::readScenario(
+    const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Can't read scenario \"" + path + "\".");
+    }
+    std::vector<ScriptedSegment> script;
+    std::string line;
+    for (unsigned lineNo = 1; std::getline(in, line); ++lineNo) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        ScriptedSegment segment;
+        if (!(fields >> segment.sensorIdx)) {
+            continue; // blank
+        }
+        if (!(fields >> segment.objIdx >> segment.t0 >> segment.x0 >>
+              segment.y0 >> segment.t1 >> segment.x1 >> segment.y1) ||
+            segment.sensorIdx >= MAX_N_SENSORS ||
+            segment.objIdx >= MAX_N_OBJS || !(segment.t1 > segment.t0)) {
+            throw std::runtime_error("Bad segment at \"" + path + "\":" +
+                                     std::to_string(lineNo) + ".");
+        }
+        script.push_back(segment);
+    }
+    return script;
+}
+
+// :::: class TrafficGenerator
+
+using can::backsense::TrafficGenerator;
+
+TrafficGenerator::TrafficGenerator(const TrafficConfig& config)
+    : m_config(config), m_rng(config.seed)
+{
+    if (!m_config.nSensors || m_config.nSensors > MAX_N_SENSORS) {
+        throw std::runtime_error("Can't simulate " +
+                                 std::to_string(m_config.nSensors) +
+                                 " sensors.");
+    }
+    const __u64 framesTimeNs =
+        m_config.nSensors * MAX_N_OBJS * FRAME_TIME_NS;
+    m_cyclePeriodNs =
+        m_config.saturate
+            ? framesTimeNs
+            : std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  m_config.cyclePeriod)
+                  .count();
+    if (m_cyclePeriodNs < framesTimeNs) {
+        throw std::runtime_error(
+            "The frames of a cycle take " +
+            std::to_string(framesTimeNs / 1000) +
+            " us on the bus: longer than the cycle period.");
+    }
+
+    m_objects.resize(m_config.nSensors);
+    std::uniform_real_distribution<> uniform(0, 1);
+    for (auto& objects : m_objects) {
+        for (auto& object : objects) {
+            object.present = uniform(m_rng) < 0.5;
+            object.appeared = object.present;
+            object.x = MIN_X + uniform(m_rng) * (MAX_X - MIN_X);
+            object.y = (uniform(m_rng) * 2 - 1) * MAX_ABS_Y;
+            object.vx = -uniform(m_rng) * MAX_SPEED;
+            object.power = 40 + uniform(m_rng) * 80;
+        }
+    }
+    std::memset(&m_frame, 0, sizeof(m_frame));
+    advance();
+}
+
+const TrafficFrame& TrafficGenerator::next()
+{
+    if (m_frameIdx == m_config.nSensors * MAX_N_OBJS) {
+        m_frameIdx = 0;
+        ++m_cycle;
+        advance();
+    }
+    const unsigned sensorIdx = m_frameIdx / MAX_N_OBJS;
+    const unsigned objIdx = m_frameIdx % MAX_N_OBJS;
+    const auto frame =
+        encodeDetection(m_objects[sensorIdx][objIdx], objIdx);
+
+    m_frame.offsetNs = m_cycle * m_cyclePeriodNs + m_frameIdx * FRAME_TIME_NS;
+    auto& param = m_frame.param;
+    param.Ident = BASE_DETECTION_ID + sensorIdx * SENSOR_ID_STRIDE + objIdx;
+    param.DataLength = N_BYTES;
+    std::copy(frame.begin(), frame.end(), param.RCV_data);
+    // the time stamp of the adapter, in microseconds
+    param.Time = m_frame.offsetNs / 1000;
+    ++m_frameIdx;
+    return m_frame;
+}
+
+void TrafficGenerator::advance()
+{
+    if (!m_config.script.empty()) {
+        const double t = m_cycle * m_cyclePeriodNs / 1e9;
+        for (unsigned i = 0; i < m_config.nSensors; ++i) {
+            for (unsigned j = 0; j < MAX_N_OBJS; ++j) {
+                followScript(i, j, t);
+            }
+        }
+    } else if (m_cycle) {
+        const double dt = m_cyclePeriodNs / 1e9;
+        for (auto& objects : m_objects) {
+            for (auto& object : objects) {
+                randomWalk(object, dt);
+            }
+        }
+    }
+}
+
+void TrafficGenerator::randomWalk(SimulatedObject& object, double dt)
+{
+    std::uniform_real_distribution<> uniform(0, 1);
+    std::normal_distribution<> accel(0, ACCEL_SIGMA * dt);
+
+    const bool wasPresent = object.present;
+    if (object.present) {
+        object.present = uniform(m_rng) >= P_VANISH_PER_S * dt;
+    } else if (uniform(m_rng) < P_APPEAR_PER_S * dt) {
+        // from the far end of the field, coming closer
+        object.present = true;
+        object.x = MAX_X - uniform(m_rng) * 5;
+        object.y = (uniform(m_rng) * 2 - 1) * MAX_ABS_Y;
+        object.vx = -uniform(m_rng) * MAX_SPEED;
+        object.vy = 0;
+        object.power = 40 + uniform(m_rng) * 80;
+    }
+    object.appeared = object.present && !wasPresent;
+    if (!object.present) {
+        return;
+    }
+
+    object.vx = std::min(std::max(object.vx + accel(m_rng), -MAX_SPEED),
+                         MAX_SPEED);
+    object.vy = std::min(std::max(object.vy + accel(m_rng), -MAX_SPEED),
+                         MAX_SPEED);
+    object.x += object.vx * dt;
+    object.y += object.vy * dt;
+    // bounces off the edges of the field
+    if (object.x < MIN_X || object.x > MAX_X) {
+        object.x = std::min(std::max(object.x, MIN_X), MAX_X);
+        object.vx = -object.vx;
+    }
+    if (std::abs(object.y) > MAX_ABS_Y) {
+        object.y = std::min(std::max(object.y, -MAX_ABS_Y), MAX_ABS_Y);
+        object.vy = -object.vy;
+    }
+    object.power = std::min(std::max(object.power + int(m_rng() % 5) - 2, 0),
+                            0x7F);
+}
+
+void TrafficGenerator::followScript(unsigned sensorIdx, unsigned objIdx,
+                                    double t)
+{
+    auto& object = m_objects[sensorIdx][objIdx];
+    const bool wasPresent = object.present;
+    object.present = false;
+    for (const auto& segment : m_config.script) {
+        if (segment.sensorIdx != sensorIdx || segment.objIdx != objIdx ||
+            t < segment.t0 || t >= segment.t1) {
+            continue;
+        }
+        const double duration = segment.t1 - segment.t0;
+        const double k = (t - segment.t0) / duration;
+        object.present = true;
+        object.x = segment.x0 + k * (segment.x1 - segment.x0);
+        object.y = segment.y0 + k * (segment.y1 - segment.y0);
+        object.vx = (segment.x1 - segment.x0) / duration;
+        object.vy = (segment.y1 - segment.y0) / duration;
+        object.power = 0x60;
+        break;
+    }
+    object.appeared = object.present && (!wasPresent || !m_cycle);
+}
@@ -0,0 +1,140 @@
+/*
+ *   Synthetic BS-9000 traffic: the detection frames of N sensors, with
+ *   scripted or random-walk obstacles, on the timing of the real bus.
+ *
+ *   Copyright (C) 2018  Joao Cosme <joaorcosme@gmail.com>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TRAFFIC_GENERATOR_H_
+#define _TRAFFIC_GENERATOR_H_
+
+#include "BSFrameHandler.h"
+#include "CANL2.h" // PARAM_STRUCT
+
+#include <linux/types.h>
+
+#include <array>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace can {
+
+namespace backsense {
+
+// 500 kbit/s (see CANproChannel); a data frame of 8 bytes with a standard
+// id is 108 bits, plus 3 of interframe space (stuff bits not counted)
+static constexpr __u32 BUS_BITRATE = 500000;
+static constexpr __u32 FRAME_BITS = 111;
+static constexpr __u64 FRAME_TIME_NS =
+    1000000000ull * FRAME_BITS / BUS_BITRATE;
+
+// what a sensor sees of one object: x away from the sensor and y across,
+// in metres, as in DetectionData
+struct SimulatedObject
+{
+    bool present = false;
+    bool appeared = false; // first cycle since it was last absent
+    double x = 0;
+    double y = 0;
+    double vx = 0; // m/s
+    double vy = 0;
+    int power = 0;
+};
+
+// the frame a sensor sends for an object (an absent one has its detection
+// flag set), clamped to the range of each signal
+std::array<__u8, N_BYTES> encodeDetection(const SimulatedObject& object,
+                                          unsigned objIdx);
+
+// A scripted object moves in a straight line from (x0, y0) at t0 to
+// (x1, y1) at t1, in seconds from the start; it is absent outside of its
+// segments. Read from lines of
+//   <sensor> <object> <t0> <x0> <y0> <t1> <x1> <y1>
+// where '#' starts a comment.
+struct ScriptedSegment
+{
+    unsigned sensorIdx;
+    unsigned objIdx;
+    double t0, x0, y0;
+    double t1, x1, y1;
+};
+std::vector<ScriptedSegment> readScenario(const std::string& path);
+
+struct TrafficConfig
+{
+    unsigned nSensors = 1;
+    // the sensors all send their 8 objects once per cycle
+    std::chrono::microseconds cyclePeriod{100000};
+    // the cycles back to back, as fast as the bus takes them
+    bool saturate = false;
+    // the whole scenario follows from it
+    __u32 seed = 9000;
+    // empty: the objects wander at random
+    std::vector<ScriptedSegment> script;
+};
+
+struct TrafficFrame
+{
+    __u64 offsetNs; // when it is due on the bus, from the start
+    PARAM_STRUCT param;
+};
+
+// Produces the frames in the order and at the times they are due: each
+// cycle, sensor after sensor, object after object, one frame time apart.
+// Nothing depends on the clock or on the global state: with the same
+// build, the same config gives the same frames, timed the same.
+class TrafficGenerator
+{
+  public:
+    TrafficGenerator(const TrafficGenerator&) = delete;
+    TrafficGenerator& operator=(const TrafficGenerator&) = delete;
+
+    explicit TrafficGenerator(const TrafficConfig& config);
+
+    const TrafficFrame& next();
+
+    // the time between the starts of two cycles
+    __u64 cyclePeriodNs() const { return m_cyclePeriodNs; }
+    __u64 cycleCount() const { return m_cycle; }
+    const SimulatedObject& object(unsigned sensorIdx, unsigned objIdx) const
+    {
+        return m_objects[sensorIdx][objIdx];
+    }
+
+  private:
+    // moves every object to where it is at the start of 'm_cycle'
+    void advance();
+    void randomWalk(SimulatedObject& object, double dt);
+    void followScript(unsigned sensorIdx, unsigned objIdx, double t);
+
+  private:
+    TrafficConfig m_config;
+    __u64 m_cyclePeriodNs;
+    std::mt19937 m_rng;
+    std::vector<std::array<SimulatedObject, MAX_N_OBJS>> m_objects;
+    __u64 m_cycle = 0;
+    unsigned m_frameIdx = 0; // within the cycle
+    TrafficFrame m_frame;
+};
+
+} // namespace backsense
+
+} // namespace can
+
+#endif // _TRAFFIC_GENERATOR_H_